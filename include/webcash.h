@@ -111,7 +111,9 @@ typedef enum wc_error {
         /** User interface startup failed */
         WC_ERROR_STARTUP_FAILED,
         /** Unknown error.  Should never happen! */
-        WC_ERROR_UNKNOWN
+        WC_ERROR_UNKNOWN,
+        /** Worker thread creation failed */
+        WC_ERROR_THREAD_FAILED
 } wc_error_t;
 
 /**
@@ -135,6 +137,144 @@ typedef time_t wc_time_t;
  */
 wc_error_t wc_init(void);
 
+/* Implementation details of this structure is private to the library. */
+typedef struct wc_arena *wc_arena_handle_t;
+
+/**
+ * @brief Create a memory arena.
+ *
+ * An arena hands out memory from large chunks by bumping a pointer, and
+ * releases all of it at once, avoiding per-allocation heap traffic and lock
+ * contention in the system allocator.  Once installed with wc_arena_use, the
+ * strings the library returns on the calling thread (secret serials, public
+ * hashes, formatted amounts and tokens, terms of service copies) are carved
+ * from the arena instead of the heap.
+ *
+ * Arena strings are write-protected bstrings: they can be read and passed to
+ * any API taking a bstring, but bstrlib refuses to modify or bdestroy them,
+ * so existing cleanup code is harmless.  Their memory remains valid until
+ * the arena is reset or destroyed, which first overwrites everything
+ * allocated with wc_memory_cleanse since secrets may be among it.
+ *
+ * An arena must only be used by one thread at a time.
+ *
+ * @param arena An out parameter to be filled in with the new arena.
+ * @param chunk_size The size of each chunk of memory the arena obtains from
+ * the heap, or zero for a default of 64 KiB.  Larger allocations are given
+ * a chunk of their own.
+ * @return wc_error_t WC_SUCCESS, WC_ERROR_INVALID_ARGUMENT, or
+ * WC_ERROR_OUT_OF_MEMORY.
+ */
+wc_error_t wc_arena_create(
+        wc_arena_handle_t *arena,
+        size_t chunk_size);
+
+/**
+ * @brief Allocate memory from an arena.
+ *
+ * @param arena The arena.
+ * @param size The number of bytes required.
+ * @return void* Suitably aligned memory, or NULL if out of memory.
+ */
+void* wc_arena_alloc(
+        wc_arena_handle_t arena,
+        size_t size);
+
+/**
+ * @brief Release, in bulk, everything allocated from an arena.
+ *
+ * All allocated memory is cleansed, and all but one chunk returned to the
+ * heap, leaving the arena ready for reuse.
+ *
+ * @param arena The arena.
+ * @return wc_error_t WC_SUCCESS or WC_ERROR_INVALID_ARGUMENT.
+ */
+wc_error_t wc_arena_reset(wc_arena_handle_t arena);
+
+/**
+ * @brief Release an arena and everything allocated from it.
+ *
+ * The arena must not be installed on any thread.
+ *
+ * @param arena The arena.
+ * @return wc_error_t WC_SUCCESS or WC_ERROR_INVALID_ARGUMENT.
+ */
+wc_error_t wc_arena_destroy(wc_arena_handle_t arena);
+
+/**
+ * @brief Select the allocator for strings returned by the library on the
+ * calling thread.
+ *
+ * @param arena The arena to allocate from, or NULL to use the heap.
+ * @param previous An optional out parameter to be filled in with the arena
+ * previously in use, so that it may be restored afterwards.
+ * @return wc_error_t WC_SUCCESS or WC_ERROR_OUT_OF_MEMORY.
+ */
+wc_error_t wc_arena_use(
+        wc_arena_handle_t arena,
+        wc_arena_handle_t *previous);
+
+/**
+ * @brief The operations for which the library keeps statistics.
+ */
+typedef enum wc_stats_op {
+        WC_STATS_MINING = 0, /* items are hashes computed */
+        WC_STATS_DERIVE, /* items are secrets derived */
+        WC_STATS_STORAGE, /* database callbacks; items are rows written */
+        WC_STATS_LOG, /* recovery log flushes; items are records made durable */
+        WC_STATS_SERVER, /* server requests; items are hashes checked */
+        WC_STATS_NUM_OPS
+} wc_stats_op_t;
+
+/* Bucket b > 0 of a latency histogram counts calls taking from 2^(b-1) up
+ * to 2^b microseconds, bucket 0 those under a microsecond, and the last
+ * bucket everything longer. */
+#define WC_STATS_BUCKETS 32
+
+typedef struct wc_stats_counter {
+        uint64_t calls;
+        uint64_t items;
+        uint64_t total_ns;
+        uint64_t max_ns;
+        uint64_t buckets[WC_STATS_BUCKETS];
+} wc_stats_counter_t;
+
+typedef struct wc_stats {
+        int enabled; /* zero if the library was built without statistics */
+        wc_stats_counter_t ops[WC_STATS_NUM_OPS];
+} wc_stats_t;
+
+/**
+ * @brief Read the library's performance counters.
+ *
+ * When the library is configured with --enable-stats (defining
+ * WEBCASH_STATS), each thread counts the calls, items processed, and
+ * latency of the mining and derivation kernels, the storage and recovery
+ * log callbacks, and the server callbacks.  Counters are kept per thread so
+ * that recording takes no locks; a snapshot sums them over all threads,
+ * including those which have since exited.  Operations in progress on other
+ * threads may or may not be included.
+ *
+ * Otherwise no instrumentation is compiled in, and the snapshot is all
+ * zeros with enabled unset.
+ *
+ * @param stats An out parameter to be filled in with the totals.
+ * @return wc_error_t WC_SUCCESS or WC_ERROR_INVALID_ARGUMENT.
+ */
+wc_error_t wc_stats_snapshot(wc_stats_t *stats);
+
+/**
+ * @brief Zero the library's performance counters.
+ *
+ * Other threads' counters are not touched; each thread discards its own
+ * when it next records, and until then they are left out of snapshots.  An
+ * operation completing concurrently with the reset may be counted on either
+ * side of it.
+ *
+ * @return wc_error_t WC_SUCCESS.
+ */
+wc_error_t wc_stats_reset(void);
+
 /**
  * @brief A webcash value / amount.
  */
@@ -226,6 +366,87 @@ wc_error_t wc_from_bstring(
  */
 bstring wc_to_bstring(wc_amount_t amount);
 
+/**
+ * @brief The maximum length of the decimal representation of a wc_amount_t,
+ * not including any terminating nul: "-92233720368.54775808".
+ */
+#define WC_AMOUNT_MAX_LEN 21
+
+/**
+ * @brief Parse a wc_amount_t from a (pointer, length) span.
+ *
+ * Accepts exactly the same syntax as wc_from_bstring, which is implemented
+ * in terms of it, but from input which need not be nul-terminated or held
+ * in a bstring.  Parsing does not depend on the C locale.
+ *
+ * @param amt A pointer to a wc_amount_t to receive the parsed value.
+ * @param noncanonical An optional pointer to an int to receive a flag
+ * indicating whether the parsed representation was found to be in canonical
+ * format (0) or not (1).  May be NULL if not needed.
+ * @param str The decimal representation to parse.
+ * @param len The length of the representation in bytes.
+ * @return wc_error_t WC_SUCCESS, WC_ERROR_INVALID_ARGUMENT, or
+ * WC_ERROR_OVERFLOW.
+ */
+wc_error_t wc_amount_parse(
+        wc_amount_t *amt,
+        int *noncanonical,
+        const char *str,
+        size_t len);
+
+/**
+ * @brief Parse an array of amounts.
+ *
+ * Calls wc_amount_parse on each of the n spans (strs[i], lens[i]).
+ *
+ * @param out An array of n wc_amount_t to receive the parsed values.
+ * @param errors An optional array of n wc_error_t to receive the result of
+ * parsing each amount.  May be NULL if not needed.
+ * @param strs An array of n pointers to decimal representations.
+ * @param lens An array of n lengths of the decimal representations.
+ * @param n The number of amounts to parse.
+ * @return wc_error_t WC_SUCCESS if every amount was parsed, or else the
+ * error of the first one which failed.
+ */
+wc_error_t wc_amounts_parse(
+        wc_amount_t out[],
+        wc_error_t errors[],
+        const char *const strs[],
+        const size_t lens[],
+        size_t n);
+
+/**
+ * @brief Format a wc_amount_t into a caller-provided buffer.
+ *
+ * Writes the same decimal representation as wc_to_bstring, followed by a
+ * terminating nul, without allocating memory or using printf.
+ *
+ * @param out A buffer of at least WC_AMOUNT_MAX_LEN + 1 bytes.
+ * @param amount The wc_amount_t to format.
+ * @return size_t The length of the representation, not including the nul.
+ */
+size_t wc_amount_format(
+        char out[WC_AMOUNT_MAX_LEN + 1],
+        wc_amount_t amount);
+
+/**
+ * @brief Format an array of amounts.
+ *
+ * Formats amounts[i] into the nul-terminated slot of WC_AMOUNT_MAX_LEN + 1
+ * bytes beginning at out + i * (WC_AMOUNT_MAX_LEN + 1).
+ *
+ * @param out A buffer of at least n * (WC_AMOUNT_MAX_LEN + 1) bytes.
+ * @param lens An optional array of n sizes to receive the length of each
+ * representation.  May be NULL if not needed.
+ * @param amounts An array of n wc_amount_t to format.
+ * @param n The number of amounts to format.
+ */
+void wc_amounts_format(
+        char out[],
+        size_t lens[],
+        const wc_amount_t amounts[],
+        size_t n);
+
 /**
  * @brief A webcash secret and the amount it protects.
  *
@@ -378,7 +599,8 @@ wc_error_t wc_secret_is_valid(const wc_secret_t *secret);
  *
  * This function destroys a wc_secret_t, freeing any memory it allocated.
  * After this function returns, the wc_secret_t is no longer valid and must be
- * reinitialized before being used again.
+ * reinitialized before being used again.  A write-protected serial, such as
+ * one allocated from a wc_arena_handle_t, is released with its arena instead.
  *
  * @param secret The wc_secret_t to destroy.
  * @return wc_error_t WC_SUCCESS or WC_ERROR_INVALID_ARGUMENT.
@@ -423,6 +645,131 @@ wc_error_t wc_secret_parse(
         int *noncanonical,
         bstring bstr);
 
+/**
+ * @brief A non-owning view of a webcash secret.
+ *
+ * @amount: The amount of webcash protected by the secret.
+ * @serial: A pointer to the first character of the secret, not necessarily
+ * nul-terminated.
+ * @len: The length of the secret in bytes.
+ *
+ * Unlike wc_secret_t, a wc_secret_view_t owns nothing: its serial points into
+ * a buffer owned by someone else, typically the input it was parsed from,
+ * and remains valid only as long as that buffer does.  It needs no
+ * destruction, and can be parsed and formatted without any heap allocation.
+ */
+typedef struct wc_secret_view {
+        wc_amount_t amount;
+        const char *serial;
+        size_t len;
+} wc_secret_view_t;
+
+/**
+ * @brief Parse a webcash claim code into a wc_secret_view_t, without
+ * allocating memory.
+ *
+ * Accepts the same "e{amount}:secret:{serial}" format as wc_secret_parse,
+ * but from a (pointer, length) span which need not be nul-terminated.  On
+ * success the serial of the returned view points into str.
+ *
+ * @param secret An output argument to be filled with the parsed view.
+ * @param noncanonical An output argument to be filled with a boolean
+ * indicating whether the claim code deviated from canonical format.  May be
+ * NULL if not needed.
+ * @param str The claim code to parse.
+ * @param len The length of the claim code in bytes.
+ * @return wc_error_t WC_SUCCESS, WC_ERROR_INVALID_ARGUMENT, or
+ * WC_ERROR_OVERFLOW.
+ */
+wc_error_t wc_secret_parse_view(
+        wc_secret_view_t *secret,
+        int *noncanonical,
+        const char *str,
+        size_t len);
+
+/**
+ * @brief Format a webcash claim code into a caller-provided buffer.
+ *
+ * Writes the "e{amount}:secret:{serial}" representation of the secret to
+ * out, followed by a terminating nul, without allocating memory.  The
+ * length of the claim code (not including the nul) is stored to len in any
+ * case, so calling with a size of zero queries the required buffer size.
+ *
+ * @param out A buffer of size bytes to receive the claim code.  May be NULL
+ * if size is zero.
+ * @param size The size of the output buffer.
+ * @param len An optional output argument to receive the length of the claim
+ * code.
+ * @param secret The secret to format.
+ * @return wc_error_t WC_SUCCESS, WC_ERROR_INVALID_ARGUMENT, or
+ * WC_ERROR_INSUFFICIENT_CAPACITY if out is too small to hold the claim code
+ * and terminating nul.
+ */
+wc_error_t wc_secret_format(
+        char out[],
+        size_t size,
+        size_t *len,
+        const wc_secret_view_t *secret);
+
+/**
+ * @brief A webcash secret with a 64-character hex serial, stored inline.
+ *
+ * @amount: The amount of webcash protected by the secret.
+ * @serial: The serial, hex-decoded to its 32 raw bytes.
+ *
+ * Nearly all webcash secrets, and all secrets generated by this library,
+ * are 64 lowercase hex characters.  Such a secret can be stored as plain
+ * data with no heap allocation, so that arrays of them are contiguous, can
+ * be copied with memcpy, and can be wiped with a single call to
+ * wc_memory_cleanse.  Secrets with any other serial cannot be represented
+ * and must use wc_secret_t.
+ */
+typedef struct wc_secret_compact {
+        wc_amount_t amount;
+        struct sha256 serial;
+} wc_secret_compact_t;
+
+/**
+ * @brief Convert a wc_secret_view_t to a wc_secret_compact_t.
+ *
+ * @param out An output argument to be filled with the compact secret.
+ * @param secret The secret to convert, which must have a serial of exactly
+ * 64 lowercase hex characters.
+ * @return wc_error_t WC_SUCCESS, or WC_ERROR_INVALID_ARGUMENT if the serial
+ * has any other form.
+ */
+wc_error_t wc_secret_compact_from_view(
+        wc_secret_compact_t *out,
+        const wc_secret_view_t *secret);
+
+/**
+ * @brief Convert a wc_secret_t to a wc_secret_compact_t.
+ *
+ * @param out An output argument to be filled with the compact secret.
+ * @param secret The secret to convert, which must have a serial of exactly
+ * 64 lowercase hex characters.
+ * @return wc_error_t WC_SUCCESS, or WC_ERROR_INVALID_ARGUMENT if the serial
+ * has any other form.
+ */
+wc_error_t wc_secret_compact_from_secret(
+        wc_secret_compact_t *out,
+        const wc_secret_t *secret);
+
+/**
+ * @brief Convert a wc_secret_compact_t to a wc_secret_t.
+ *
+ * The serial of the resulting wc_secret_t is newly allocated, and any
+ * serial it previously held is freed.
+ *
+ * @param out The wc_secret_t to be filled in.
+ * @param secret The compact secret to convert.
+ * @return wc_error_t WC_SUCCESS, WC_ERROR_INVALID_ARGUMENT, or
+ * WC_ERROR_OUT_OF_MEMORY.
+ */
+wc_error_t wc_secret_from_compact(
+        wc_secret_t *out,
+        const wc_secret_compact_t *secret);
+
 /**
  * @brief A webcash public hash and the amount allocated to it.
  *
@@ -458,6 +805,41 @@ typedef struct wc_public {
  */
 wc_public_t wc_public_from_secret(const wc_secret_t *secret);
 
+/**
+ * @brief Initialize an array of wc_public_t from an array of wc_secret_t.
+ *
+ * Equivalent to calling wc_public_from_secret on each element of in, but
+ * secrets with 64-byte serials (the hex-encoded secrets generated by this
+ * library) are hashed in parallel batches.  Secrets of any other length are
+ * hashed one at a time.
+ *
+ * @param out An array of at least n wc_public_t to be filled in.
+ * @param in An array of n wc_secret_t to hash.
+ * @param n The number of secrets.
+ * @return wc_error_t WC_SUCCESS or WC_ERROR_INVALID_ARGUMENT.
+ */
+wc_error_t wc_public_from_secrets(
+        wc_public_t out[],
+        const wc_secret_t in[],
+        size_t n);
+
+/**
+ * @brief Initialize an array of wc_public_t from an array of
+ * wc_secret_compact_t.
+ *
+ * Hashes the hex-encoded serial of each compact secret in parallel batches,
+ * with the same results as wc_public_from_secret on the equivalent
+ * wc_secret_t.
+ *
+ * @param out An array of at least n wc_public_t to be filled in.
+ * @param in An array of n compact secrets to hash.
+ * @param n The number of secrets.
+ */
+void wc_public_from_compact_secrets(
+        wc_public_t out[],
+        const wc_secret_compact_t in[],
+        size_t n);
+
 /**
  * @brief Check whether a wc_public_t is valid.
  *
@@ -505,6 +887,150 @@ wc_error_t wc_public_parse(
         int *noncanonical,
         bstring bstr);
 
+/**
+ * @brief The maximum length of an encoded wc_public_t, not including any
+ * terminating nul.
+ */
+#define WC_PUBLIC_MAX_LEN (1 + WC_AMOUNT_MAX_LEN + 8 + 64)
+
+/**
+ * @brief Parse a wc_public_t from a (pointer, length) span.
+ *
+ * Accepts the same "e{amount}:public:{hash}" format as wc_public_parse, but
+ * from input which need not be nul-terminated or held in a bstring.
+ *
+ * @param pub An output argument to be filled with the parsed wc_public_t.
+ * @param noncanonical An output argument to be filled with a boolean
+ * indicating whether the public hash deviated from canonical format.  May be
+ * NULL if not needed.
+ * @param str The public hash to parse.
+ * @param len The length of the public hash in bytes.
+ * @return wc_error_t WC_SUCCESS, WC_ERROR_INVALID_ARGUMENT, or
+ * WC_ERROR_OVERFLOW.
+ */
+wc_error_t wc_public_parse_view(
+        wc_public_t *pub,
+        int *noncanonical,
+        const char *str,
+        size_t len);
+
+/**
+ * @brief Format a wc_public_t into a caller-provided buffer.
+ *
+ * Writes the "e{amount}:public:{hash}" representation of pub to out,
+ * followed by a terminating nul, without allocating memory.  A buffer of
+ * WC_PUBLIC_MAX_LEN + 1 bytes is always sufficient.  The length of the
+ * encoding (not including the nul) is stored to len in any case.
+ *
+ * @param out A buffer of size bytes to receive the encoding.  May be NULL if
+ * size is zero.
+ * @param size The size of the output buffer.
+ * @param len An optional output argument to receive the encoded length.
+ * @param pub The wc_public_t to format.
+ * @return wc_error_t WC_SUCCESS, WC_ERROR_INVALID_ARGUMENT, or
+ * WC_ERROR_INSUFFICIENT_CAPACITY if out is too small to hold the encoding
+ * and terminating nul.
+ */
+wc_error_t wc_public_format(
+        char out[],
+        size_t size,
+        size_t *len,
+        const wc_public_t *pub);
+
+/**
+ * @brief The kind of a token parsed by wc_tokens_parse.
+ */
+typedef enum wc_token_type {
+        /** Neither a secret nor a public hash */
+        WC_TOKEN_INVALID = 0,
+        /** A webcash secret, "e{amount}:secret:{serial}" */
+        WC_TOKEN_SECRET,
+        /** A webcash public hash, "e{amount}:public:{hash}" */
+        WC_TOKEN_PUBLIC
+} wc_token_type_t;
+
+/**
+ * @brief One line of input parsed by wc_tokens_parse.
+ *
+ * @type: The kind of token found on the line.
+ * @error: The result of parsing the token.  The secret or pub field is only
+ * meaningful if this is WC_SUCCESS.
+ * @noncanonical: Whether the token deviated from canonical format.
+ * @offset: The offset of the token from the start of the buffer passed to
+ * wc_tokens_parse, after leading whitespace is skipped.
+ * @len: The length of the token, not including surrounding whitespace or
+ * the line terminator.
+ * @secret: The parsed secret, if type is WC_TOKEN_SECRET.  Its serial
+ * points into the input buffer.
+ * @pub: The parsed public hash, if type is WC_TOKEN_PUBLIC.
+ */
+typedef struct wc_token {
+        wc_token_type_t type;
+        wc_error_t error;
+        int noncanonical;
+        size_t offset;
+        size_t len;
+        wc_secret_view_t secret;
+        wc_public_t pub;
+} wc_token_t;
+
+/**
+ * @brief Parse a batch of newline-delimited secrets and public hashes.
+ *
+ * Parses lines of buf, one token per line, storing up to max records into
+ * tokens.  Lines may end in "\n" or "\r\n", spaces and tabs around a
+ * token are ignored, and blank lines are skipped without producing a
+ * record.  A line that fails to parse still produces a record, with its
+ * error field set, so that one bad token does not abort an import.  No
+ * memory is allocated: parsed secrets point into buf.
+ *
+ * Parsing stops after max records, or at a final line lacking a terminator
+ * unless final is set, since more of it may follow in the next chunk of a
+ * stream.  The number of bytes of buf consumed (always at a line boundary)
+ * is stored to consumed, and parsing resumes by calling again with
+ * buf + consumed.  Buffers can be split between threads at the positions
+ * returned by wc_tokens_boundary.
+ *
+ * @param tokens An array of max records to be filled in.
+ * @param max The maximum number of records to produce.
+ * @param count An output argument to receive the number of records
+ * produced.
+ * @param consumed An output argument to receive the number of bytes of buf
+ * consumed.
+ * @param buf The input to parse.
+ * @param len The length of the input in bytes.
+ * @param final Non-zero if buf extends to the end of the input, so that a
+ * last unterminated line should be parsed.
+ * @return wc_error_t WC_SUCCESS or WC_ERROR_INVALID_ARGUMENT.
+ */
+wc_error_t wc_tokens_parse(
+        wc_token_t tokens[],
+        size_t max,
+        size_t *count,
+        size_t *consumed,
+        const char *buf,
+        size_t len,
+        int final);
+
+/**
+ * @brief Find the start of the first line at or after a position.
+ *
+ * Returns pos if it is already the start of a line (pos is zero, or the
+ * preceding byte is a newline), and otherwise the offset just past the next
+ * newline, or len if there is none.  Splitting a buffer at these offsets
+ * yields independent chunks which can be passed to wc_tokens_parse on
+ * separate threads.
+ *
+ * @param buf The input buffer.
+ * @param len The length of the input in bytes.
+ * @param pos The position to begin searching from.
+ * @return size_t The offset of the start of the line.
+ */
+size_t wc_tokens_boundary(
+        const char *buf,
+        size_t len,
+        size_t pos);
+
 /**
  * @brief The strings "000" through "999", base64-encoded.
  *
@@ -554,6 +1080,322 @@ void wc_mining_8way(
         const unsigned char nonce2[4*8],
         const unsigned char final[4]);
 
+/**
+ * @brief Complete four different SHA-256 hashes in parallel.
+ *
+ * Identical to wc_mining_8way, but with a batch size of four.  This is the
+ * natural batch size for hosts with 128-bit vector units (SSE4, NEON).
+ *
+ * @param ctx The SHA-256 hash midstate.
+ * @param nonce1 The first 4-byte nonce value to append to the hash, which is used for all hashes.
+ * @param nonce2 An array of 4-byte nonce values to be appended next, one for each hash.
+ * @param hashes An array of 32-byte buffers to be filled with the resulting hash values.
+ */
+void wc_mining_4way(
+        unsigned char hashes[4*32],
+        const struct sha256_ctx* ctx,
+        const unsigned char nonce1[4],
+        const unsigned char nonce2[4*4],
+        const unsigned char final[4]);
+
+/**
+ * @brief Complete sixteen different SHA-256 hashes in parallel.
+ *
+ * Identical to wc_mining_8way, but with a batch size of sixteen.  This is
+ * the natural batch size for hosts with 512-bit vector units (AVX-512).
+ *
+ * @param ctx The SHA-256 hash midstate.
+ * @param nonce1 The first 4-byte nonce value to append to the hash, which is used for all hashes.
+ * @param nonce2 An array of 4-byte nonce values to be appended next, one for each hash.
+ * @param hashes An array of 32-byte buffers to be filled with the resulting hash values.
+ */
+void wc_mining_16way(
+        unsigned char hashes[16*32],
+        const struct sha256_ctx* ctx,
+        const unsigned char nonce1[4],
+        const unsigned char nonce2[4*16],
+        const unsigned char final[4]);
+
+/**
+ * @brief The mining batch size best suited to the host.
+ *
+ * Returns 4, 8, or 16, according to the vector width of the host CPU as
+ * detected by wc_init, indicating which of wc_mining_4way, wc_mining_8way,
+ * or wc_mining_16way mining software should prefer.  The mining engine
+ * (wc_mine_start) uses this batch size automatically.  Returns 8 if wc_init
+ * has not been called.
+ *
+ * @return size_t The preferred number of hashes per mining batch.
+ */
+size_t wc_mining_best_width(void);
+
+/**
+ * @brief The maximum number of lanes in a wc_mining_job_t block template.
+ */
+#define WC_MINING_JOB_LANES 16
+
+/**
+ * @brief The maximum number of nonce groups in a mining payload.
+ *
+ * Each nonce group is one 4-byte wc_mining_nonces entry, contributing three
+ * decimal digits (a factor of 1000) to the nonce space searchable from a
+ * single midstate.  Six groups allow 10^18 attempts per midstate.
+ */
+#define WC_MINING_MAX_NONCE_GROUPS 6
+
+/**
+ * @brief A prepared webcash mining job.
+ *
+ * @midstate: The SHA-256 midstate of the mining payload prefix.
+ * @ngroups: The number of nonce groups in the payload, including the final,
+ * per-lane group.
+ * @blocks: The final SHA-256 block of the payload, one per lane, with
+ * everything except the per-lane nonce group filled in.
+ * @digests: The hashes of the most recent wc_mining_job_search batch, one
+ * per lane.
+ *
+ * The wc_mining_Nway functions rebuild the final block of every lane on each
+ * call, even though only the nonce2 bytes change from one call to the next.
+ * A mining job holds a block template prepared once for a given midstate,
+ * leading nonce groups, and final value, so that each batch only has to
+ * write the last nonce group of each lane before hashing.
+ *
+ * The structure is plain data owned by the caller, so it may live on the
+ * stack or be embedded in other structures, and needs no destruction.
+ */
+typedef struct wc_mining_job {
+        uint32_t midstate[8];
+        unsigned ngroups;
+        unsigned char blocks[WC_MINING_JOB_LANES*64];
+        unsigned char digests[WC_MINING_JOB_LANES*32];
+} wc_mining_job_t;
+
+/**
+ * @brief Prepare a mining job with two nonce groups (nonce1 and nonce2).
+ *
+ * Equivalent to wc_mining_job_init_groups with ngroups set to 2, yielding
+ * the same hashes as the wc_mining_Nway functions.
+ *
+ * @param job The mining job to prepare.
+ * @param ctx The SHA-256 midstate of the mining payload prefix.
+ * @param nonce1 The first 4-byte nonce value, used for all hashes.
+ * @param final The final 4 bytes of the payload, usually wc_mining_final.
+ * @return wc_error_t WC_SUCCESS or WC_ERROR_INVALID_ARGUMENT.
+ */
+wc_error_t wc_mining_job_init(
+        wc_mining_job_t *job,
+        const struct sha256_ctx *ctx,
+        const unsigned char nonce1[4],
+        const unsigned char final[4]);
+
+/**
+ * @brief Prepare a mining job with any number of nonce groups.
+ *
+ * A mining payload of ngroups nonce groups has 1000^ngroups candidates per
+ * midstate: with three groups one midstate covers 10^9 attempts, instead of
+ * 10^6 for wc_mining_Nway.  Fills in the block template of every lane of the
+ * job with the leading ngroups-1 nonce groups, final, and the SHA-256
+ * padding and length fields.  The midstate must have consumed a multiple of
+ * 64 bytes, so that the nonces and final value make up the final block.
+ *
+ * @param job The mining job to prepare.
+ * @param ctx The SHA-256 midstate of the mining payload prefix.
+ * @param ngroups The number of nonce groups, from 1 to
+ * WC_MINING_MAX_NONCE_GROUPS.
+ * @param nonces The leading 4*(ngroups-1) nonce bytes, used for all hashes.
+ * May be NULL if ngroups is 1.
+ * @param final The final 4 bytes of the payload, usually wc_mining_final.
+ * @return wc_error_t WC_SUCCESS or WC_ERROR_INVALID_ARGUMENT.
+ */
+wc_error_t wc_mining_job_init_groups(
+        wc_mining_job_t *job,
+        const struct sha256_ctx *ctx,
+        unsigned ngroups,
+        const unsigned char nonces[],
+        const unsigned char final[4]);
+
+/**
+ * @brief Replace the first nonce group of a prepared mining job.
+ *
+ * Overwrites only the nonce1 bytes of each lane, leaving the rest of the
+ * block template as-is.  Has no effect on single-group jobs.
+ *
+ * @param job A mining job prepared by wc_mining_job_init.
+ * @param nonce1 The new first 4-byte nonce value.
+ */
+void wc_mining_job_set_nonce1(
+        wc_mining_job_t *job,
+        const unsigned char nonce1[4]);
+
+/**
+ * @brief Replace all leading nonce groups of a prepared mining job.
+ *
+ * Overwrites the leading 4*(ngroups-1) nonce bytes of each lane, leaving the
+ * rest of the block template as-is.
+ *
+ * @param job A mining job prepared by wc_mining_job_init_groups.
+ * @param nonces The new leading nonce bytes.
+ */
+void wc_mining_job_set_nonces(
+        wc_mining_job_t *job,
+        const unsigned char nonces[]);
+
+/**
+ * @brief Compute a batch of mining hashes from a prepared mining job.
+ *
+ * Writes the i'th 4-byte value of nonce2 into the last nonce group of lane i
+ * of the job's block template, and hashes the lanes in parallel.  For
+ * two-group jobs this produces the same hashes as the wc_mining_Nway
+ * functions would for the job's midstate, nonce1 and final value.  Batches
+ * larger than WC_MINING_JOB_LANES are processed WC_MINING_JOB_LANES hashes
+ * at a time.
+ *
+ * @param hashes A buffer of at least n*32 bytes to receive the hashes.
+ * @param job A mining job prepared by wc_mining_job_init.
+ * @param nonce2 An array of n 4-byte nonce values, one for each hash.
+ * @param n The number of hashes to compute.
+ */
+void wc_mining_job_hash(
+        unsigned char hashes[],
+        wc_mining_job_t *job,
+        const unsigned char nonce2[],
+        size_t n);
+
+/**
+ * @brief Compute a batch of mining hashes, returning only which ones meet a
+ * target difficulty.
+ *
+ * Like wc_mining_job_hash, but instead of handing back every digest this
+ * function tests each one for at least difficulty leading zero bits, and
+ * returns a bitmask with bit i set if lane i qualifies.  Since nearly every
+ * batch has no qualifying hashes, the caller usually has nothing further to
+ * do.  Otherwise the hash of a qualifying lane i can be read from
+ * job->digests + 32*i, which remains valid until the next call.
+ *
+ * @param job A mining job prepared by wc_mining_job_init.
+ * @param nonce2 An array of n 4-byte nonce values, one for each hash.
+ * @param n The number of hashes to compute, at most WC_MINING_JOB_LANES.
+ * Larger values are truncated to WC_MINING_JOB_LANES.
+ * @param difficulty The required number of leading zero bits.
+ * @return uint32_t A bitmask of the lanes whose hash meets the difficulty.
+ */
+uint32_t wc_mining_job_search(
+        wc_mining_job_t *job,
+        const unsigned char nonce2[],
+        size_t n,
+        unsigned difficulty);
+
+/**
+ * @brief A webcash mining solution found by the mining engine.
+ *
+ * @hash: The SHA-256 hash of the mining payload.
+ * @nonces: The 4-byte base64 nonce groups of the payload, each an entry of
+ * wc_mining_nonces.  Only the first 4*ngroups bytes are used.
+ * @ngroups: The number of nonce groups in the payload.
+ * @difficulty: The number of leading zero bits in the hash, which is at least
+ * the difficulty the engine was started with (and may be more).
+ *
+ * The full mining payload is the base64-encoded prefix from which the mining
+ * midstate was computed, followed by the nonce groups and wc_mining_final.
+ */
+typedef struct wc_mining_solution {
+        struct sha256 hash;
+        unsigned char nonces[4*WC_MINING_MAX_NONCE_GROUPS];
+        unsigned ngroups;
+        unsigned difficulty;
+} wc_mining_solution_t;
+
+/**
+ * @brief Called by the mining engine for each solution found.
+ *
+ * The callback is invoked from one of the engine's worker threads, but calls
+ * are serialized so that the callback never runs concurrently with itself.
+ * Returning a non-zero value requests that mining stop, and no further
+ * solutions will be reported.
+ */
+typedef int (*wc_mining_callback_t)(void *arg, const wc_mining_solution_t *solution);
+
+/* Implementation details of this structure is private to the library. */
+typedef struct wc_miner *wc_miner_handle_t;
+
+/**
+ * @brief Start mining in the background on multiple threads.
+ *
+ * Equivalent to wc_mine_start_groups with ngroups set to 2, searching the
+ * nonce1 x nonce2 space of wc_mining_nonces (10^6 candidate payloads).
+ */
+wc_error_t wc_mine_start(
+        wc_miner_handle_t *miner,
+        const struct sha256_ctx *ctx,
+        unsigned difficulty,
+        unsigned nthreads,
+        wc_mining_callback_t callback,
+        void *arg);
+
+/**
+ * @brief Start mining in the background on multiple threads, with a
+ * configurable number of nonce groups.
+ *
+ * The mining engine searches all 1000^ngroups payloads made of ngroups
+ * wc_mining_nonces entries following the passed-in midstate, in batches of
+ * wc_mining_best_width hashes.  The values of the leading ngroups-1 nonce
+ * groups are divided evenly between nthreads worker threads.  Each hash
+ * with at least difficulty leading zero bits is reported through callback.
+ *
+ * The midstate must have consumed a multiple of 64 bytes (i.e. it must end on
+ * a SHA-256 block boundary), so that the nonces and wc_mining_final make up
+ * the final block.
+ *
+ * Mining continues until the nonce space is exhausted, the callback returns
+ * a non-zero value, or wc_mine_stop is called.  Either wc_mine_wait or
+ * wc_mine_stop must eventually be called to release the returned handle.
+ *
+ * @param miner An out parameter to be filled in with the mining engine
+ * handle.  Only modified if the function returns WC_SUCCESS.
+ * @param ctx The SHA-256 midstate of the mining payload prefix.
+ * @param ngroups The number of nonce groups, from 1 to
+ * WC_MINING_MAX_NONCE_GROUPS.
+ * @param difficulty The minimum number of leading zero bits of a solution.
+ * @param nthreads The number of worker threads to use, from 1 to 1000.
+ * @param callback The callback to receive solutions.
+ * @param arg An opaque pointer passed through to the callback.
+ * @return wc_error_t WC_SUCCESS, WC_ERROR_INVALID_ARGUMENT,
+ * WC_ERROR_OUT_OF_MEMORY, or WC_ERROR_THREAD_FAILED.
+ */
+wc_error_t wc_mine_start_groups(
+        wc_miner_handle_t *miner,
+        const struct sha256_ctx *ctx,
+        unsigned ngroups,
+        unsigned difficulty,
+        unsigned nthreads,
+        wc_mining_callback_t callback,
+        void *arg);
+
+/**
+ * @brief Wait for the mining engine to finish, and release it.
+ *
+ * Blocks until every worker thread has exited, either because the nonce
+ * space was exhausted or because the callback requested a stop, then frees
+ * all resources associated with the engine.
+ *
+ * @param miner The mining engine to wait on.
+ * @return wc_error_t WC_SUCCESS or WC_ERROR_INVALID_ARGUMENT.
+ */
+wc_error_t wc_mine_wait(wc_miner_handle_t miner);
+
+/**
+ * @brief Cancel mining, and release the mining engine.
+ *
+ * Requests that all worker threads stop, waits for them to exit, then frees
+ * all resources associated with the engine.  No solutions are reported
+ * after this function returns.  Must not be called from within the mining
+ * callback; return a non-zero value from the callback instead.
+ *
+ * @param miner The mining engine to stop.
+ * @return wc_error_t WC_SUCCESS or WC_ERROR_INVALID_ARGUMENT.
+ */
+wc_error_t wc_mine_stop(wc_miner_handle_t miner);
+
 /**
  * @brief Derive a webcash secret from a master / root secret and chaincode +
  * depth.
@@ -601,12 +1443,205 @@ wc_error_t wc_derive_serial(
  * @param start The depth of the first secret to derive.
  * @param count The number of secrets to derive.
  */
-void wc_derive_serials(
+void wc_derive_serials(
+        char out[],
+        const struct sha256 *root,
+        uint64_t chaincode,
+        uint64_t start,
+        size_t count);
+
+/**
+ * @brief Derive multiple webcash secrets using multiple threads.
+ *
+ * Produces exactly the same output as wc_derive_serials, but divides the
+ * depth range into contiguous slices which are derived concurrently by up to
+ * nthreads threads (including the calling thread), each writing into its own
+ * disjoint region of out.  Slices are multiples of 8 secrets, so each worker
+ * keeps the full batch width of wc_derive_serials.  Returns once all secrets
+ * have been derived.
+ *
+ * If worker threads cannot be created, the remaining secrets are derived on
+ * the calling thread instead, so this function only fails on invalid
+ * arguments.
+ *
+ * @param out A buffer to be filled with the generated secrets, of length at least count * 64 bytes.
+ * @param root The master secret to derive from.
+ * @param chaincode The chaincode to use.
+ * @param start The depth of the first secret to derive.
+ * @param count The number of secrets to derive.
+ * @param nthreads The maximum number of threads to use, at least 1.
+ * @return wc_error_t WC_SUCCESS or WC_ERROR_INVALID_ARGUMENT.
+ */
+wc_error_t wc_derive_serials_mt(
+        char out[],
+        const struct sha256 *root,
+        uint64_t chaincode,
+        uint64_t start,
+        size_t count,
+        unsigned nthreads);
+
+/**
+ * @brief Derive multiple webcash secrets as raw hash values.
+ *
+ * Identical to wc_derive_serials, except that each secret is stored as its
+ * raw 32-byte hash value rather than hex-encoded.  This halves the size of
+ * the output, and skips the encoding step for callers which only hash or
+ * compare the secrets.  The hex-encoded serial of out[i] is what
+ * wc_hex_encode produces from its 32 bytes.
+ *
+ * @param out An array of at least count hashes to be filled with the generated secrets.
+ * @param root The master secret to derive from.
+ * @param chaincode The chaincode to use.
+ * @param start The depth of the first secret to derive.
+ * @param count The number of secrets to derive.
+ */
+void wc_derive_serials_raw(
+        struct sha256 out[],
+        const struct sha256 *root,
+        uint64_t chaincode,
+        uint64_t start,
+        size_t count);
+
+/**
+ * @brief Derive the public hashes of multiple webcash secrets.
+ *
+ * Computes the public hash of each secret that wc_derive_serials would
+ * generate for the same arguments, i.e. what wc_public_from_secret would
+ * return for each of them, without materializing the secrets as bstrings.
+ * Both the derivation and the public hashing are performed in parallel
+ * batches.  This is the inner loop of a wallet recovery scan, which only
+ * needs to know which public hashes the server has seen.
+ *
+ * @param out An array of at least count hashes to be filled with the public hashes.
+ * @param root The master secret to derive from.
+ * @param chaincode The chaincode to use.
+ * @param start The depth of the first secret to derive.
+ * @param count The number of secrets to derive.
+ */
+void wc_derive_publics(
+        struct sha256 out[],
+        const struct sha256 *root,
+        uint64_t chaincode,
+        uint64_t start,
+        size_t count);
+
+/*****************************************************************************
+ * Compute backend interface (mining and bulk derivation offload)
+ *****************************************************************************/
+
+/* Implementation details of this structure is specific to the backend. */
+typedef struct wc_device *wc_device_handle_t;
+
+/**
+ * @brief Kernels which a compute backend, such as a GPU, may take over.
+ *
+ * Each callback works on a whole range at once, so that a device with
+ * thousands of lanes can be kept busy.  A callback which fails, or is NULL,
+ * leaves the range to the library's CPU code, so a backend may implement
+ * only what it accelerates.  Callbacks can be invoked from several threads
+ * at once.
+ */
+typedef struct wc_backend_callbacks {
+        /* Search count rows of the mining nonce space, starting at row
+         * first, for hashes with at least difficulty leading zero bits.  A
+         * row is one assignment of wc_mining_nonces entries to the leading
+         * ngroups-1 nonce groups (row r giving group g, counted from the
+         * last leading group, the value (r / 1000^g) % 1000), combined with
+         * all 1000 values of the last group, for 1000 hashes per row.  The
+         * nonces and wc_mining_final form the final block after the
+         * midstate ctx.  Solutions are passed to found, and the search
+         * stops early if it returns non-zero.  The engine holds them until
+         * the call returns: if it fails, they are discarded, and the whole
+         * range is searched again on the CPU, so that each is reported to
+         * the user exactly once. */
+        wc_error_t (*mine)(wc_device_handle_t dev, const struct sha256_ctx *ctx, unsigned ngroups, uint64_t first, uint64_t count, unsigned difficulty, wc_mining_callback_t found, void *arg); /* optional */
+
+        /* Fill out[] with what wc_derive_serials_raw and wc_derive_publics
+         * compute for the same root, chaincode and depth range. */
+        wc_error_t (*derive_serials)(wc_device_handle_t dev, struct sha256 *out, const struct sha256 *root, uint64_t chaincode, uint64_t start, size_t count); /* optional */
+        wc_error_t (*derive_publics)(wc_device_handle_t dev, struct sha256 *out, const struct sha256 *root, uint64_t chaincode, uint64_t start, size_t count); /* optional */
+} wc_backend_callbacks_t;
+
+/**
+ * @brief The built-in backend, using libsha2 on the host CPU.
+ *
+ * This is the default.  The device handle is unused.  Its callbacks are
+ * also a reference for backend implementers to test against.
+ */
+extern const wc_backend_callbacks_t wc_backend_cpu_callbacks;
+
+/**
+ * @brief Parameters for offloading work to a compute backend.
+ *
+ * Zero-initialized fields select the defaults given below.
+ */
+typedef struct wc_backend_params {
+        uint64_t mining_rows; /* rows of 1000 hashes per mine call; default 1 */
+        size_t min_derive; /* smallest derivation offloaded; smaller ones stay on the CPU; default 4096 */
+} wc_backend_params_t;
+
+/**
+ * @brief Select the compute backend for mining and bulk derivation.
+ *
+ * Once set, mining engines started afterwards hand ranges of
+ * params->mining_rows rows to the mine callback, each worker thread taking
+ * every nthreads'th range, and the derivation functions pass batches of at
+ * least params->min_derive secrets to the derive callbacks.  Results are
+ * the same as with the CPU.
+ *
+ * Like wc_init, this must not be called while other threads are using the
+ * library, and the device must remain valid until another backend is
+ * selected.
+ *
+ * @param callbacks The backend, or NULL for wc_backend_cpu_callbacks.
+ * @param dev The device handle passed to the callbacks.
+ * @param params Optional parameters; may be NULL for the defaults.
+ * @return wc_error_t WC_SUCCESS.
+ */
+wc_error_t wc_backend_use(
+        const wc_backend_callbacks_t *callbacks,
+        wc_device_handle_t dev,
+        const wc_backend_params_t *params);
+
+/**
+ * @brief Hex-encode a buffer, using lowercase digits.
+ *
+ * Writes exactly 2 * n characters to out, without a terminating nul.  The
+ * output buffer may be the same as the input buffer, in which case the
+ * encoding is done in place (the buffer must then be 2 * n bytes long).
+ * Otherwise the buffers must not overlap.
+ *
+ * @param out A buffer of at least 2 * n bytes to receive the hex digits.
+ * @param in The bytes to encode.
+ * @param n The number of bytes to encode.
+ */
+void wc_hex_encode(
         char out[],
-        const struct sha256 *root,
-        uint64_t chaincode,
-        uint64_t start,
-        size_t count);
+        const unsigned char in[],
+        size_t n);
+
+/**
+ * @brief Validate and decode a hex string.
+ *
+ * Decodes 2 * n hex digits from in to n bytes in out, in a single pass
+ * which also checks that every character is a hex digit and notes whether
+ * any are uppercase (which is accepted, but not canonical).  Uses SSE2
+ * where available.
+ *
+ * @param out A buffer of at least n bytes to receive the decoded bytes.
+ * The contents are unspecified if the input is not valid hex.
+ * @param noncanonical An optional output argument to receive a flag
+ * indicating whether any uppercase digits were found.  May be NULL.
+ * @param in The 2 * n hex digits to decode.
+ * @param n The number of bytes to decode.
+ * @return wc_error_t WC_SUCCESS, or WC_ERROR_INVALID_ARGUMENT if the input
+ * contains a non-hex character.
+ */
+wc_error_t wc_hex_decode(
+        unsigned char out[],
+        int *noncanonical,
+        const char in[],
+        size_t n);
 
 /**
  * @brief The terms of service.
@@ -677,6 +1712,21 @@ typedef struct wc_terms {
 #endif
 } wc_terms_t;
 
+/**
+ * @brief Hash a terms of service document.
+ *
+ * The SHA-256 hash of the terms' UTF-8 text identifies a particular version
+ * of the terms.  It is stored alongside accepted terms, and sent to the
+ * server as an entity tag so that unchanged terms need not be refetched.
+ *
+ * @param out The hash to be filled in.
+ * @param terms The terms of service.
+ * @return wc_error_t WC_SUCCESS or WC_ERROR_INVALID_ARGUMENT.
+ */
+wc_error_t wc_terms_hash(
+        struct sha256 *out,
+        bstring terms);
+
 /*****************************************************************************
  * Storage interface (database and recovery log)
  *****************************************************************************/
@@ -741,6 +1791,45 @@ typedef struct wc_db_terms {
 #endif
 } wc_db_terms_t;
 
+/**
+ * @brief A wallet secret as recorded in the database.
+ *
+ * The serial of the secret view is not copied by the caller of the storage
+ * callbacks and need only remain valid for the duration of the call.  The
+ * hash is the public hash of the secret, by which the output is matched
+ * against server replies and later marked as spent.  Secrets generated by
+ * the wallet's own deterministic derivation have derived set to a non-zero
+ * value and record the chaincode and depth from which they were derived;
+ * for secrets received from elsewhere those fields are ignored.
+ */
+typedef struct wc_db_secret {
+        wc_secret_view_t secret;
+        struct sha256 hash;
+        int derived;
+        uint64_t chaincode;
+        uint64_t depth;
+} wc_db_secret_t;
+
+/**
+ * @brief A per-row visitor for the each_secret storage callback.
+ *
+ * Called once for each secret recorded in the database, with spent set to a
+ * non-zero value if the output has been marked as spent.  The serial of the
+ * secret is only valid for the duration of the call.  Returning a non-zero
+ * value stops the iteration.
+ */
+typedef int (*wc_db_secrets_visitor_t)(void *arg, const wc_db_secret_t *secret, int spent);
+
+/**
+ * @brief A per-row visitor for the each_terms storage callback.
+ *
+ * Called once for each accepted version of the terms of service, in the
+ * order of acceptance.  The text is owned by the storage backend and is only
+ * valid for the duration of the call; it must be copied if it is needed
+ * afterwards.  Returning a non-zero value stops the iteration.
+ */
+typedef int (*wc_db_terms_visitor_t)(void *arg, wc_time_t when, bstring text);
+
 /**
  * @brief Callbacks for interacting with data storage for the wallet,
  * including both a read-write database and an append-only recovery log.
@@ -757,8 +1846,44 @@ typedef struct wc_storage_callbacks {
         wc_error_t (*all_terms)(wc_db_handle_t db, wc_db_terms_t *terms, size_t *count);
         wc_error_t (*terms_accepted)(wc_db_handle_t db, bstring terms, wc_time_t *when);
         wc_error_t (*accept_terms)(wc_db_handle_t db, bstring terms, wc_time_t now);
+        wc_error_t (*count_terms)(wc_db_handle_t db, size_t *count); /* optional */
+        wc_error_t (*each_terms)(wc_db_handle_t db, wc_db_terms_visitor_t visit, void *arg); /* optional */
+        /* The most recently accepted terms and their wc_terms_hash, or
+         * *terms set to NULL if none have been accepted. */
+        wc_error_t (*latest_terms)(wc_db_handle_t db, bstring *terms, struct sha256 *hash, wc_time_t *when); /* optional */
+
+        /* Transactions */
+        wc_error_t (*begin)(wc_db_handle_t db); /* optional */
+        wc_error_t (*commit)(wc_db_handle_t db); /* optional */
+        wc_error_t (*rollback)(wc_db_handle_t db); /* optional */
+
+        /* Wallet outputs */
+        wc_error_t (*add_secrets)(wc_db_handle_t db, const wc_db_secret_t *secrets, size_t count);
+        wc_error_t (*spend_outputs)(wc_db_handle_t db, const struct sha256 *hashes, size_t count);
+        wc_error_t (*each_secret)(wc_db_handle_t db, wc_db_secrets_visitor_t visit, void *arg); /* optional */
+
+        /* Recovery log */
+        wc_error_t (*log_write)(wc_log_handle_t log, const void *data, size_t len); /* optional */
+        wc_error_t (*log_sync)(wc_log_handle_t log); /* optional */
 } wc_storage_callbacks_t;
 
+/**
+ * @brief The default storage implementation, backed by SQLite.
+ *
+ * The dburl passed to wc_storage_open is a nul-terminated filesystem path to
+ * the SQLite database, which is created if it does not exist, and the logurl
+ * is a nul-terminated path to the recovery log file, which is likewise
+ * created if necessary and opened for appending only.  Both are plain
+ * (const char*) values cast to wc_db_url_t and wc_log_url_t respectively.
+ *
+ * The database is opened in write-ahead-log mode with synchronous=NORMAL, and
+ * its frequently used queries are prepared once per connection and reused.
+ * An exclusive POSIX advisory lock is held on the recovery log for as long as
+ * it is open, so opening the same wallet from two processes at once fails
+ * with WC_ERROR_LOG_OPEN_FAILED.
+ */
+extern const wc_storage_callbacks_t wc_storage_sqlite_callbacks;
+
 /* Implementation details of this structure is private to the library. */
 typedef struct wc_storage *wc_storage_handle_t;
 
@@ -831,6 +1956,59 @@ wc_error_t wc_storage_enumerate_terms(
         wc_terms_t *terms,
         size_t *count);
 
+/**
+ * @brief Returns the number of versions of the terms of service that have
+ * been accepted by the user.
+ *
+ * Uses the count_terms storage callback if provided, which need not touch
+ * the text of the terms, and otherwise falls back to asking all_terms for
+ * its required capacity.
+ *
+ * @param storage The wallet storage interface.
+ * @param count An out parameter to be filled in with the number of accepted
+ * terms.  Only valid if the function returns WC_SUCCESS.
+ * @return wc_error_t WC_SUCCESS, WC_ERROR_INVALID_ARGUMENT,
+ * WC_ERROR_DB_CLOSED, or an error code from the storage backend.
+ */
+wc_error_t wc_storage_count_terms(
+        wc_storage_handle_t storage,
+        size_t *count);
+
+/**
+ * @brief A per-row visitor for wc_storage_foreach_terms.
+ *
+ * The when parameter is the time of acceptance, in UTC, and text is the
+ * accepted document.  Both are only valid for the duration of the call.
+ * Returning a non-zero value stops the iteration.
+ */
+typedef int (*wc_terms_visitor_t)(void *arg, const struct tm *when, bstring text);
+
+/**
+ * @brief Calls visit once for each version of the terms of service accepted
+ * by the user, in the order of acceptance.
+ *
+ * Unlike wc_storage_enumerate_terms this requires no caller-sized array and
+ * makes no copies of the terms, so a wallet with any number of accepted
+ * terms is walked in constant memory when the storage backend provides the
+ * each_terms callback.  Backends which do not are served from a temporary
+ * copy of all_terms.
+ *
+ * With wc_storage_sqlite_callbacks the visitor may use the same storage
+ * handle, including for a nested wc_storage_foreach_terms.
+ *
+ * @param storage The wallet storage interface.
+ * @param visit The function to call for each row.
+ * @param arg An opaque pointer passed through to visit.
+ * @return wc_error_t WC_SUCCESS if every row was visited or visit requested
+ * an early stop, WC_ERROR_INVALID_ARGUMENT, WC_ERROR_DB_CLOSED,
+ * WC_ERROR_DB_CORRUPT if a stored time is out of range, or an error code
+ * from the storage backend.
+ */
+wc_error_t wc_storage_foreach_terms(
+        wc_storage_handle_t storage,
+        wc_terms_visitor_t visit,
+        void *arg);
+
 /**
  * @brief Returns whether the user has accepted any version of the Webcash
  * terms of service.
@@ -903,6 +2081,291 @@ wc_error_t wc_storage_accept_terms(
         bstring terms,
         struct tm *now);
 
+/**
+ * @brief Retrieve the most recently accepted terms of service.
+ *
+ * Returns the terms the user last accepted, along with their wc_terms_hash,
+ * in a single lookup.  This lets the wallet check whether the server's terms
+ * are still the ones accepted by comparing hashes, without a full-text
+ * search of every accepted version.
+ *
+ * If the storage callbacks do not provide latest_terms, or no terms have
+ * been accepted, WC_SUCCESS is returned with *terms set to NULL.
+ *
+ * @param storage The wallet storage interface.
+ * @param terms An out parameter to be filled in with a copy of the terms,
+ * owned by the caller.
+ * @param hash An out parameter to be filled in with the hash of the terms.
+ * @param when An optional out parameter to be filled in with the time of
+ * acceptance.
+ * @return wc_error_t WC_SUCCESS, WC_ERROR_INVALID_ARGUMENT,
+ * WC_ERROR_DB_CLOSED, or an error code from the storage callbacks.
+ */
+wc_error_t wc_storage_latest_terms(
+        wc_storage_handle_t storage,
+        bstring *terms,
+        struct sha256 *hash,
+        struct tm *when);
+
+/**
+ * @brief Begin a storage transaction.
+ *
+ * All storage writes made until the matching wc_storage_commit or
+ * wc_storage_rollback are applied atomically, and with a single flush to
+ * disk on commit rather than one per write.  Transactions do not nest.  If
+ * the storage backend does not provide the begin, commit and rollback
+ * callbacks, writes are applied immediately and the transaction calls only
+ * track their pairing.
+ *
+ * @param storage The wallet storage interface.
+ * @return wc_error_t WC_SUCCESS, WC_ERROR_INVALID_ARGUMENT if a
+ * transaction is already open, WC_ERROR_DB_CLOSED, or an error code from
+ * the storage backend.
+ */
+wc_error_t wc_storage_begin(wc_storage_handle_t storage);
+
+/**
+ * @brief Commit the open storage transaction.
+ *
+ * If the commit fails the transaction is rolled back, and in either case no
+ * transaction is open when this function returns.
+ *
+ * @param storage The wallet storage interface.
+ * @return wc_error_t WC_SUCCESS, WC_ERROR_INVALID_ARGUMENT if no
+ * transaction is open, WC_ERROR_DB_CLOSED, or an error code from the
+ * storage backend.
+ */
+wc_error_t wc_storage_commit(wc_storage_handle_t storage);
+
+/**
+ * @brief Discard all writes made since wc_storage_begin.
+ *
+ * @param storage The wallet storage interface.
+ * @return wc_error_t WC_SUCCESS, WC_ERROR_INVALID_ARGUMENT if no
+ * transaction is open, WC_ERROR_DB_CLOSED, or an error code from the
+ * storage backend.
+ */
+wc_error_t wc_storage_rollback(wc_storage_handle_t storage);
+
+/**
+ * @brief Record a batch of secrets in the wallet database.
+ *
+ * If no transaction is open, the whole batch is written in a transaction of
+ * its own, so that either every secret is recorded or none are.  Otherwise
+ * the writes become part of the caller's transaction.
+ *
+ * @param storage The wallet storage interface.
+ * @param secrets The secrets to record.
+ * @param count The number of secrets.
+ * @return wc_error_t WC_SUCCESS, WC_ERROR_INVALID_ARGUMENT (including when
+ * a secret with the same public hash is already recorded),
+ * WC_ERROR_DB_CLOSED, or an error code from the storage backend.
+ */
+wc_error_t wc_storage_add_secrets(
+        wc_storage_handle_t storage,
+        const wc_db_secret_t secrets[],
+        size_t count);
+
+/**
+ * @brief Mark a batch of wallet outputs as spent, by public hash.
+ *
+ * Hashes which do not match any recorded secret are ignored.  Transaction
+ * handling is as for wc_storage_add_secrets.
+ *
+ * @param storage The wallet storage interface.
+ * @param hashes The public hashes of the spent outputs.
+ * @param count The number of hashes.
+ * @return wc_error_t WC_SUCCESS, WC_ERROR_INVALID_ARGUMENT,
+ * WC_ERROR_DB_CLOSED, or an error code from the storage backend.
+ */
+wc_error_t wc_storage_spend_outputs(
+        wc_storage_handle_t storage,
+        const struct sha256 hashes[],
+        size_t count);
+
+/**
+ * @brief Record the effect of a replace operation on the wallet: the inputs
+ * are marked as spent and the outputs recorded, in a single transaction.
+ *
+ * @param storage The wallet storage interface.
+ * @param inputs The public hashes of the spent inputs.
+ * @param ninputs The number of inputs.
+ * @param outputs The newly created secrets.
+ * @param noutputs The number of outputs.
+ * @return wc_error_t as for wc_storage_add_secrets.
+ */
+wc_error_t wc_storage_replace(
+        wc_storage_handle_t storage,
+        const struct sha256 inputs[],
+        size_t ninputs,
+        const wc_db_secret_t outputs[],
+        size_t noutputs);
+
+/**
+ * @brief When records appended to the recovery log are made durable.
+ */
+typedef enum wc_log_sync {
+        /** wc_storage_log_append returns once its record is on disk.
+         * Concurrent appenders share a single write and sync. */
+        WC_LOG_SYNC_RECORD = 0,
+        /** Records are written and synced by a background thread at a fixed
+         * interval, and wc_storage_log_append returns immediately. */
+        WC_LOG_SYNC_INTERVAL,
+        /** Records are buffered until wc_storage_log_flush is called, or the
+         * buffer fills. */
+        WC_LOG_SYNC_BATCH
+} wc_log_sync_t;
+
+/**
+ * @brief Select the durability policy of the recovery log.
+ *
+ * Any records already appended are first flushed under the previous policy.
+ * The default, for newly opened storage, is WC_LOG_SYNC_RECORD.  This
+ * function must not be called concurrently with itself or with
+ * wc_storage_close on the same storage handle, but may race freely with
+ * appends.
+ *
+ * @param storage The wallet storage interface.
+ * @param policy The new durability policy.
+ * @param interval_ms For WC_LOG_SYNC_INTERVAL, the maximum time in
+ * milliseconds for which an appended record may remain unsynced.  Ignored
+ * for the other policies.
+ * @return wc_error_t WC_SUCCESS, WC_ERROR_INVALID_ARGUMENT,
+ * WC_ERROR_THREAD_FAILED, or an error code from flushing the log.
+ */
+wc_error_t wc_storage_log_configure(
+        wc_storage_handle_t storage,
+        wc_log_sync_t policy,
+        unsigned interval_ms);
+
+/**
+ * @brief The size of each record slot in the recovery log, and the maximum
+ * length of a record's payload.
+ *
+ * Records are stored in fixed-size slots so that the n-th record of a block
+ * can be located without parsing those before it.  A slot is large enough to
+ * hold any webcash secret in its string form.
+ */
+#define WC_LOG_RECORD_SIZE 128
+#define WC_LOG_RECORD_MAX (WC_LOG_RECORD_SIZE - 2)
+
+/**
+ * @brief Append a record to the recovery log.
+ *
+ * The record is framed into a fixed-size slot of the library's log buffer,
+ * and written out in checksummed blocks with
+ * the storage backend's log_write callback followed by log_sync, if
+ * provided, as dictated by the durability policy.  Records appended from
+ * different threads are written in the order in which their calls acquired
+ * the buffer, and never interleaved.
+ *
+ * A failure to write or sync the log is sticky: once it happens, every
+ * subsequent append and flush returns the same error.
+ *
+ * @param storage The wallet storage interface.
+ * @param record The bytes to append.
+ * @param len The length of the record, at most WC_LOG_RECORD_MAX.
+ * @return wc_error_t WC_SUCCESS, WC_ERROR_INVALID_ARGUMENT if the backend
+ * has no log_write callback, WC_ERROR_OVERFLOW if the record is too long,
+ * WC_ERROR_OUT_OF_MEMORY, or an error code from the storage backend.
+ */
+wc_error_t wc_storage_log_append(
+        wc_storage_handle_t storage,
+        const void *record,
+        size_t len);
+
+/**
+ * @brief Write and sync every record appended to the recovery log so far,
+ * regardless of the durability policy.
+ *
+ * @param storage The wallet storage interface.
+ * @return wc_error_t WC_SUCCESS, WC_ERROR_INVALID_ARGUMENT, or an error
+ * code from the storage backend.
+ */
+wc_error_t wc_storage_log_flush(wc_storage_handle_t storage);
+
+/* Implementation details of this structure is private to the library. */
+typedef struct wc_log_reader *wc_log_reader_handle_t;
+
+/**
+ * @brief Open a recovery log for reading, by memory-mapping the file.
+ *
+ * Only the index of the log is read up front: when the log was last closed
+ * cleanly this is just the footers written at each close, and otherwise the
+ * header of each block.  Record data is not touched until it is accessed,
+ * and each block's checksum is verified on first access to one of its
+ * records.  A partially written block at the end of the file, as left by a
+ * crash, is ignored.
+ *
+ * The file is mapped read-only, so the log may be read while a wallet has it
+ * open for appending, but records appended after this call are not seen.
+ * Reader handles are not safe for concurrent use from multiple threads.
+ *
+ * @param reader An out parameter to be filled in with the reader.  Only
+ * modified if the function returns WC_SUCCESS.
+ * @param path The path of the log file.
+ * @return wc_error_t WC_SUCCESS, WC_ERROR_INVALID_ARGUMENT,
+ * WC_ERROR_LOG_OPEN_FAILED, or WC_ERROR_OUT_OF_MEMORY.
+ */
+wc_error_t wc_log_reader_open(
+        wc_log_reader_handle_t *reader,
+        const char *path);
+
+/**
+ * @brief Open a recovery log for reading from a buffer in memory.
+ *
+ * As wc_log_reader_open, but for a log already in memory, such as one read
+ * through a storage backend that is not file-based.  The buffer must remain
+ * valid and unmodified until the reader is closed.
+ *
+ * @param reader An out parameter to be filled in with the reader.
+ * @param data The contents of the log.
+ * @param len The length of the log in bytes.
+ * @return wc_error_t WC_SUCCESS, WC_ERROR_INVALID_ARGUMENT, or
+ * WC_ERROR_OUT_OF_MEMORY.
+ */
+wc_error_t wc_log_reader_open_memory(
+        wc_log_reader_handle_t *reader,
+        const void *data,
+        size_t len);
+
+/**
+ * @brief Returns the number of records in the log.
+ *
+ * @param reader The log reader.
+ * @param count An out parameter to be filled in with the number of records.
+ * @return wc_error_t WC_SUCCESS or WC_ERROR_INVALID_ARGUMENT.
+ */
+wc_error_t wc_log_reader_count(
+        wc_log_reader_handle_t reader,
+        uint64_t *count);
+
+/**
+ * @brief Fetch a record from the log by index, without copying it.
+ *
+ * @param reader The log reader.
+ * @param index The zero-based index of the record, in order of appending.
+ * @param record An out parameter to be filled in with a pointer to the
+ * record's payload, which remains valid until the reader is closed.
+ * @param len An out parameter to be filled in with the payload length.
+ * @return wc_error_t WC_SUCCESS, WC_ERROR_INVALID_ARGUMENT if index is out
+ * of range, or WC_ERROR_DB_CORRUPT if the block holding the record fails
+ * its checksum.
+ */
+wc_error_t wc_log_reader_get(
+        wc_log_reader_handle_t reader,
+        uint64_t index,
+        const void **record,
+        size_t *len);
+
+/**
+ * @brief Unmap the log and free the reader.
+ *
+ * @param reader The log reader.
+ * @return wc_error_t WC_SUCCESS or WC_ERROR_INVALID_ARGUMENT.
+ */
+wc_error_t wc_log_reader_close(wc_log_reader_handle_t reader);
+
 /*****************************************************************************
  * Server connection interface
  *****************************************************************************/
@@ -911,6 +2374,25 @@ wc_error_t wc_storage_accept_terms(
 typedef struct wc_conn *wc_conn_handle_t;
 typedef struct wc_server_url *wc_server_url_t;
 
+/**
+ * @brief The server's view of an output, as returned by a health check.
+ */
+typedef struct wc_health {
+        int known; /* non-zero if the server has a record of the output */
+        int spent; /* non-zero if known and spent */
+        wc_amount_t amount; /* if known and not spent; otherwise zero */
+} wc_health_t;
+
+/**
+ * @brief Completion notification for asynchronous server callbacks.
+ *
+ * An asynchronous callback which returns WC_SUCCESS must call this exactly
+ * once, from any thread, after the request's outputs have been filled in,
+ * passing back the token it was given along with the request's result.  It
+ * must not be called if the asynchronous callback itself returns an error.
+ */
+typedef void (*wc_server_done_t)(void *token, wc_error_t error);
+
 typedef struct wc_server_callbacks {
         /* Initialization */
         wc_conn_handle_t (*connect)(wc_server_url_t url);
@@ -918,6 +2400,27 @@ typedef struct wc_server_callbacks {
 
         /* Terms of Service */
         wc_error_t (*get_terms)(wc_conn_handle_t conn, bstring *terms);
+
+        /* Output status, for count public hashes in one request */
+        wc_error_t (*health_check)(wc_conn_handle_t conn, const struct sha256 *hashes, size_t count, wc_health_t *result); /* optional */
+
+        /* Asynchronous variants of the above, which start the request and
+         * return without waiting for the reply.  Many requests may be in
+         * flight on one connection at once. */
+        wc_error_t (*get_terms_async)(wc_conn_handle_t conn, bstring *terms, wc_server_done_t done, void *token); /* optional */
+        wc_error_t (*health_check_async)(wc_conn_handle_t conn, const struct sha256 *hashes, size_t count, wc_health_t *result, wc_server_done_t done, void *token); /* optional */
+
+        /* Liveness probe of an idle connection, used by the connection pool
+         * to detect connections the server has dropped. */
+        wc_error_t (*ping)(wc_conn_handle_t conn); /* optional */
+
+        /* Conditional terms fetch: if the server's terms have the
+         * wc_terms_hash etag, as with an HTTP If-None-Match request, leave
+         * *terms NULL rather than sending them again. */
+        wc_error_t (*get_terms_if_changed)(wc_conn_handle_t conn, const struct sha256 *etag, bstring *terms); /* optional */
+
+        /* New members are only ever appended, so that positional
+         * initializers and compiled clients remain valid. */
 } wc_server_callbacks_t;
 
 /* Implementation details of this structure is private to the library. */
@@ -945,11 +2448,98 @@ wc_error_t wc_server_connect(
         const wc_server_callbacks_t *callbacks,
         wc_server_url_t url);
 
+/**
+ * @brief Parameters for wc_server_connect_pool.
+ *
+ * Zero-initialized fields select the defaults given below.
+ */
+typedef struct wc_server_params {
+        size_t connections; /* maximum number of pooled connections; default 1 */
+        unsigned ping_interval_ms; /* idle time after which a connection is pinged before reuse; default 30000 */
+        unsigned batch_window_ms; /* time to collect health checks into one request; default 0, disabled */
+        size_t batch_max; /* public hashes per coalesced health check request; default 500 */
+} wc_server_params_t;
+
+/**
+ * @brief Open a pool of connections to the webcash server.
+ *
+ * Like wc_server_connect, but the server object manages up to
+ * params->connections connections opened with the connect callback, which
+ * are shared between threads using the server object concurrently.  The
+ * first connection is opened immediately, and the rest only as concurrent
+ * demand requires, after which they are kept open for reuse until the
+ * server object is closed.
+ *
+ * A connection which fails a request with WC_ERROR_NOT_CONNECTED or
+ * WC_ERROR_CONNECT_FAILED, or which has been idle for longer than the ping
+ * interval and fails the optional ping callback, is closed and reopened
+ * before its next use.  The url must therefore remain valid for as long as
+ * the server object is open.
+ *
+ * If params->batch_window_ms is set, wc_server_health_check calls from
+ * concurrent threads are coalesced: the hashes submitted within the window,
+ * up to params->batch_max of them, are checked with a single server request
+ * and the results handed back to each caller.  This trades up to one window
+ * of added latency for far fewer requests under load.  Calls with more than
+ * batch_max hashes, and asynchronous health checks, are sent on their own.
+ *
+ * wc_server_connect is equivalent to this with a single connection and no
+ * coalescing.
+ *
+ * @param server The server object to be filled in.
+ * @param callbacks The callbacks to be used for interacting with the server.
+ * @param url The URL of the server to connect to.
+ * @param params The pool parameters, or NULL for the defaults.
+ * @return wc_error_t WC_SUCCESS if the server object was successfully
+ * initialized, or an error code otherwise.
+ */
+wc_error_t wc_server_connect_pool(
+        wc_server_handle_t *server,
+        const wc_server_callbacks_t *callbacks,
+        wc_server_url_t url,
+        const wc_server_params_t *params);
+
+/**
+ * @brief Borrow a connection from the server object's pool.
+ *
+ * Blocks until a connection is free, opening or reopening one if needed.
+ * The connection is for the caller's exclusive use with the server
+ * callbacks until it is returned with wc_server_checkin.
+ *
+ * @param server The server object.
+ * @param conn An out parameter to be filled in with the connection.
+ * @return wc_error_t WC_SUCCESS, WC_ERROR_INVALID_ARGUMENT,
+ * WC_ERROR_CONNECT_FAILED, or WC_ERROR_NOT_CONNECTED if the server object
+ * is being closed.
+ */
+wc_error_t wc_server_checkout(
+        wc_server_handle_t server,
+        wc_conn_handle_t *conn);
+
+/**
+ * @brief Return a connection borrowed with wc_server_checkout.
+ *
+ * @param server The server object.
+ * @param conn The connection.
+ * @param status The result of the last request made on the connection.
+ * WC_ERROR_NOT_CONNECTED or WC_ERROR_CONNECT_FAILED cause the connection to
+ * be reopened before it is used again.
+ * @return wc_error_t WC_SUCCESS, or WC_ERROR_INVALID_ARGUMENT if conn is not
+ * checked out from this server object.
+ */
+wc_error_t wc_server_checkin(
+        wc_server_handle_t server,
+        wc_conn_handle_t conn,
+        wc_error_t status);
+
 /**
  * @brief Close a connection to the webcash server.
  *
  * Tears down any open connections to the server, and frees any resources
- * associated with the server object.
+ * associated with the server object.  Waits for connections checked out by
+ * other threads to be returned and for asynchronous requests to complete.
+ * Calls blocked waiting for a connection fail with WC_ERROR_NOT_CONNECTED.
+ * The server object must not be used once this function has returned.
  *
  * @param server The server object to be closed.
  * @return wc_error_t WC_SUCCESS or WC_ERROR_INVALID_ARGUMENT.
@@ -973,6 +2563,115 @@ wc_error_t wc_server_get_terms(
         wc_server_handle_t server,
         bstring *terms);
 
+/**
+ * @brief Fetch the terms of service, unless they are already known.
+ *
+ * Asks the server for its terms of service only if their wc_terms_hash
+ * differs from etag.  Uses the get_terms_if_changed server callback, which
+ * can answer with a small "not modified" reply, if provided, or otherwise
+ * fetches the terms in full and compares hashes locally.
+ *
+ * @param server The server connection.
+ * @param terms An out parameter to be filled in with the terms of service if
+ * they have changed, or NULL if not.
+ * @param changed An out parameter to be filled in with a non-zero value if
+ * the terms have changed.
+ * @param etag The hash of the terms already known to the caller.
+ * @return wc_error_t WC_SUCCESS, WC_ERROR_INVALID_ARGUMENT,
+ * WC_ERROR_NOT_CONNECTED, or an error code from the server callbacks.
+ */
+wc_error_t wc_server_get_terms_if_changed(
+        wc_server_handle_t server,
+        bstring *terms,
+        int *changed,
+        const struct sha256 *etag);
+
+/**
+ * @brief Ask the server for the status of a batch of outputs.
+ *
+ * @param server The server connection.
+ * @param result An array of count results to be filled in.
+ * @param hashes The public hashes of the outputs to check.
+ * @param count The number of hashes.
+ * @return wc_error_t WC_SUCCESS, WC_ERROR_NOT_CONNECTED,
+ * WC_ERROR_INVALID_ARGUMENT if the server callbacks do not support health
+ * checks, or an error code from the server callbacks.
+ */
+wc_error_t wc_server_health_check(
+        wc_server_handle_t server,
+        wc_health_t result[],
+        const struct sha256 hashes[],
+        size_t count);
+
+/**
+ * @brief Identifies a request started with one of the wc_server_*_async
+ * APIs.  Never zero for a valid request.
+ */
+typedef uint64_t wc_request_id_t;
+
+/**
+ * @brief Start fetching the current terms of service, without waiting.
+ *
+ * The terms out parameter is filled in once the request completes, and must
+ * remain valid until then.  If the server callbacks have no get_terms_async
+ * the request is performed synchronously with get_terms before returning,
+ * so that callers can use the asynchronous interface regardless.
+ *
+ * Every request that is started must eventually be retired with
+ * wc_server_wait.
+ *
+ * @param server The server connection.
+ * @param id An out parameter to be filled in with the request identifier.
+ * @param terms An out parameter to be filled in with the terms of service.
+ * @return wc_error_t WC_SUCCESS if the request was started,
+ * WC_ERROR_INVALID_ARGUMENT, WC_ERROR_NOT_CONNECTED,
+ * WC_ERROR_OUT_OF_MEMORY, or an error code from the server callbacks.
+ */
+wc_error_t wc_server_get_terms_async(
+        wc_server_handle_t server,
+        wc_request_id_t *id,
+        bstring *terms);
+
+/**
+ * @brief Start a health check of a batch of outputs, without waiting.
+ *
+ * As wc_server_get_terms_async, for wc_server_health_check.  The hashes and
+ * result arrays must remain valid until the request completes.
+ */
+wc_error_t wc_server_health_check_async(
+        wc_server_handle_t server,
+        wc_request_id_t *id,
+        wc_health_t result[],
+        const struct sha256 hashes[],
+        size_t count);
+
+/**
+ * @brief Check whether an asynchronous request has completed.
+ *
+ * @param server The server connection.
+ * @param id The request identifier.
+ * @param done An out parameter to be filled in with a non-zero value if the
+ * request has completed, in which case wc_server_wait will not block.
+ * @return wc_error_t WC_SUCCESS, or WC_ERROR_INVALID_ARGUMENT if id does
+ * not identify an outstanding request.
+ */
+wc_error_t wc_server_poll(
+        wc_server_handle_t server,
+        wc_request_id_t id,
+        int *done);
+
+/**
+ * @brief Wait for an asynchronous request to complete, and retire it.
+ *
+ * @param server The server connection.
+ * @param id The request identifier, which is no longer valid afterwards.
+ * @return wc_error_t The result of the request, or
+ * WC_ERROR_INVALID_ARGUMENT if id does not identify an outstanding request.
+ */
+wc_error_t wc_server_wait(
+        wc_server_handle_t server,
+        wc_request_id_t id);
+
 /*****************************************************************************
  * User interface callbacks
  *****************************************************************************/
@@ -1065,11 +2764,22 @@ typedef struct wc_wallet *wc_wallet_handle_t;
  * interfaces.  The caller should not use these interfaces after passing them
  * to this function, nor should the caller attempt to free them.
  *
+ * Every wallet API except wc_wallet_release may be called concurrently from
+ * multiple threads on the same wallet context.  Access to the storage
+ * interface is serialized, except that wc_wallet_lookup_outputs calls run in
+ * parallel with each other.  Fetching the terms of service and prompting the
+ * user happen on one thread at a time, and once the terms are accepted they
+ * are served from a cache shared by all readers.  The server connection
+ * object is thread-safe in its own right.  The user interface callbacks are
+ * never invoked from more than one thread at once.
+ *
  * @param wallet An out parameter to be filled in with the wallet context.
  * @param storage The wallet storage interface.
  * @param server The server connection object.
  * @param ui The user interface object.
- * @return wc_error_t WC_SUCCESS or WC_ERROR_OUT_OF_MEMORY.
+ * @return wc_error_t WC_SUCCESS, WC_ERROR_OUT_OF_MEMORY, or an error code
+ * from loading the index of wallet outputs from storage, in which case the
+ * caller retains ownership of the interfaces.
  */
 wc_error_t wc_wallet_configure(
         wc_wallet_handle_t *wallet,
@@ -1088,6 +2798,99 @@ wc_error_t wc_wallet_configure(
  */
 wc_error_t wc_wallet_release(wc_wallet_handle_t wallet);
 
+/**
+ * @brief What the wallet knows of an output, as returned by
+ * wc_wallet_lookup_outputs.
+ */
+typedef struct wc_output_info {
+        int found; /* non-zero if the output belongs to the wallet */
+        int spent; /* non-zero if the output has been spent */
+        wc_amount_t amount;
+        int derived; /* non-zero if chaincode and depth are valid */
+        uint64_t chaincode;
+        uint64_t depth;
+} wc_output_info_t;
+
+/**
+ * @brief Look up a batch of public hashes among the wallet's outputs.
+ *
+ * The lookup is served from an in-memory hash table of every secret in the
+ * wallet, keyed by public hash.  The table is loaded from storage by
+ * wc_wallet_configure, using the each_secret storage callback, and is kept
+ * up to date by wc_storage_add_secrets, wc_storage_spend_outputs and
+ * wc_storage_replace, so no storage access is needed here.  (Should a
+ * transaction be rolled back, the table is reloaded on the next lookup.)
+ *
+ * @param wallet The wallet context.
+ * @param info The array of n results to be filled in.
+ * @param hashes The n public hashes to look up.
+ * @param n The number of hashes.
+ * @return wc_error_t WC_SUCCESS, WC_ERROR_INVALID_ARGUMENT (also if the
+ * storage has no each_secret callback to load the table with), or an error
+ * code from reloading the table.
+ */
+wc_error_t wc_wallet_lookup_outputs(
+        wc_wallet_handle_t wallet,
+        wc_output_info_t info[],
+        const struct sha256 hashes[],
+        size_t n);
+
+/**
+ * @brief The maximum number of chaincodes scanned by wc_wallet_recover.
+ */
+#define WC_RECOVER_MAX_CHAINCODES 8
+
+/**
+ * @brief Parameters for wc_wallet_recover.
+ *
+ * Zero-initialized fields select the defaults given below.
+ */
+typedef struct wc_recover_params {
+        unsigned nchaincodes; /* chaincodes 0..nchaincodes-1 are scanned; default 4 */
+        size_t batch; /* public hashes per health check request; default 500 */
+        size_t gap_limit; /* consecutive unused depths ending a scan; default 100 */
+} wc_recover_params_t;
+
+/**
+ * @brief The outcome of wc_wallet_recover.
+ */
+typedef struct wc_recover_result {
+        uint64_t recovered; /* outputs found that the wallet did not have */
+        uint64_t unspent; /* of which, not yet spent */
+        wc_amount_t balance; /* total amount of the recovered unspent outputs */
+        uint64_t next_depth[WC_RECOVER_MAX_CHAINCODES]; /* depth past the last used output */
+} wc_recover_result_t;
+
+/**
+ * @brief Recover a wallet's outputs from its master secret by querying the
+ * server.
+ *
+ * For each chaincode, public hashes are derived from root in batches from
+ * depth zero and checked with the server's health_check callback, until
+ * gap_limit consecutive depths after the last one known to the server have
+ * been found unused.  The next batch is derived on a second thread while the
+ * previous request is in flight, so that derivation is overlapped with the
+ * network round trip.
+ *
+ * Every output the server knows of and the wallet does not is recorded in
+ * storage, with the serial re-derived and spent outputs marked as spent, in
+ * one transaction per batch.
+ *
+ * @param wallet The wallet context.
+ * @param result An optional out parameter to receive a summary of the
+ * recovery.  Filled in even on failure, with progress up to that point.
+ * @param root The wallet's master secret.
+ * @param params The recovery parameters, or NULL for the defaults.
+ * @return wc_error_t WC_SUCCESS, WC_ERROR_INVALID_ARGUMENT,
+ * WC_ERROR_OUT_OF_MEMORY, WC_ERROR_NOT_CONNECTED, or an error code from the
+ * server or storage callbacks.
+ */
+wc_error_t wc_wallet_recover(
+        wc_wallet_handle_t wallet,
+        wc_recover_result_t *result,
+        const struct sha256 *root,
+        const wc_recover_params_t *params);
+
 /**
  * @brief Ensure the user has accepted the Webcash terms of service.
  *
@@ -1095,6 +2898,11 @@ wc_error_t wc_wallet_release(wc_wallet_handle_t wallet);
  * user has accepted this version of the terms, and if not, shows the terms to
  * the user and records their response.
  *
+ * When the storage interface can report the most recently accepted terms,
+ * the server is only asked whether its terms differ from those (by hash),
+ * so the common case of unchanged terms costs a conditional request and a
+ * single indexed lookup rather than a full fetch and full-text search.
+ *
  * A return value of WC_SUCCESS indicates successful execution of this API,
  * not acceptance of the terms of service.  For that you must check the output
  * parameters.  accepted will be set to 1 if the user previously accepted the
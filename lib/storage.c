@@ -0,0 +1,727 @@
+/* Copyright (c) 2022-2023 Mark Friedenbach
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/* Reference implementation of wc_storage_callbacks_t, using the bundled
+ * SQLite as the wallet database and a plain append-only file as the recovery
+ * log.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include "webcash.h"
+
+#include "sqlite3.h"
+
+#include <errno.h>
+#include <fcntl.h> /* for open, fcntl */
+#include <limits.h> /* for INT_MAX */
+#include <string.h> /* for memset */
+#include <unistd.h> /* for close, write, fsync */
+
+/*****************************************************************************
+ * Recovery log
+ *****************************************************************************/
+
+struct wc_log {
+        int fd;
+};
+
+static wc_log_handle_t wc_sqlite_log_open(wc_log_url_t logurl) {
+        const char *path = (const char*)logurl;
+        struct wc_log *log = NULL;
+        struct flock lock;
+        if (!path) {
+                return NULL;
+        }
+        log = malloc(sizeof(struct wc_log));
+        if (!log) {
+                return NULL;
+        }
+        log->fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+        if (log->fd < 0) {
+                free(log);
+                return NULL;
+        }
+        /* Only one process may append to the recovery log at a time.  The
+         * lock is released automatically when the descriptor is closed. */
+        memset(&lock, 0, sizeof(lock));
+        lock.l_type = F_WRLCK;
+        lock.l_whence = SEEK_SET;
+        lock.l_start = 0;
+        lock.l_len = 0; /* the whole file */
+        if (fcntl(log->fd, F_SETLK, &lock) < 0) {
+                close(log->fd);
+                free(log);
+                return NULL;
+        }
+        return log;
+}
+
+static void wc_sqlite_log_close(wc_log_handle_t log) {
+        if (!log) {
+                return;
+        }
+        close(log->fd);
+        free(log);
+}
+
+static wc_error_t wc_sqlite_log_write(wc_log_handle_t log, const void *data, size_t len) {
+        const unsigned char *p = (const unsigned char*)data;
+        ssize_t n = 0;
+        if (!log || (!data && len)) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        while (len) {
+                n = write(log->fd, p, len);
+                if (n < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        return errno == ENOSPC || errno == EFBIG ? WC_ERROR_OVERFLOW : WC_ERROR_UNKNOWN;
+                }
+                p += n;
+                len -= (size_t)n;
+        }
+        return WC_SUCCESS;
+}
+
+static wc_error_t wc_sqlite_log_sync(wc_log_handle_t log) {
+        if (!log) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        while (fsync(log->fd) < 0) {
+                if (errno != EINTR) {
+                        return WC_ERROR_UNKNOWN;
+                }
+        }
+        return WC_SUCCESS;
+}
+
+/*****************************************************************************
+ * Database
+ *****************************************************************************/
+
+/* Executed on every connection, before the schema is created.  WAL mode lets
+ * readers proceed concurrently with the single writer, and together with
+ * synchronous=NORMAL means a transaction commit costs an append to the WAL
+ * rather than an fsync of the main database.  Durability of the last few
+ * transactions across power loss is instead provided by the recovery log. */
+static const char wc_sqlite_pragmas[] =
+        "PRAGMA journal_mode = WAL;"
+        "PRAGMA synchronous = NORMAL;"
+        "PRAGMA foreign_keys = ON;"
+        "PRAGMA temp_store = MEMORY;"
+        "PRAGMA cache_size = -8192;" /* KiB */
+        "PRAGMA wal_autocheckpoint = 1000;";
+
+#define WC_SQLITE_BUSY_TIMEOUT 5000 /* milliseconds */
+
+/* The terms table records each version of the terms of service the user has
+ * accepted, along with its wc_terms_hash so that the wallet can check the
+ * latest version against the server's by hash alone.  It is indexed by
+ * (accepted, id), so that the latest accepted terms are a single lookup.
+ *
+ * The secrets table records every secret the wallet knows of, whether from
+ * its own deterministic derivation (with chaincode and depth set) or received
+ * from elsewhere (chaincode and depth NULL).  It is indexed by public hash for
+ * matching server replies against wallet outputs, and by (chaincode, depth)
+ * for locating the next unused derivation index. */
+static const char wc_sqlite_schema[] =
+        "CREATE TABLE IF NOT EXISTS terms ("
+                "id INTEGER PRIMARY KEY,"
+                "body TEXT NOT NULL UNIQUE,"
+                "accepted INTEGER NOT NULL,"
+                "hash BLOB"
+        ");"
+        "CREATE INDEX IF NOT EXISTS terms_by_accepted "
+                "ON terms (accepted, id);"
+        "CREATE TABLE IF NOT EXISTS secrets ("
+                "id INTEGER PRIMARY KEY,"
+                "amount INTEGER NOT NULL,"
+                "serial TEXT NOT NULL,"
+                "public_hash BLOB NOT NULL,"
+                "chaincode INTEGER,"
+                "depth INTEGER,"
+                "spent INTEGER NOT NULL DEFAULT 0"
+        ");"
+        "CREATE UNIQUE INDEX IF NOT EXISTS secrets_by_public_hash "
+                "ON secrets (public_hash);"
+        "CREATE UNIQUE INDEX IF NOT EXISTS secrets_by_chaincode_depth "
+                "ON secrets (chaincode, depth) WHERE chaincode IS NOT NULL;"
+        "PRAGMA user_version = 2;";
+
+/* Upgrades a version 1 database, whose terms have no stored hash.  Rows
+ * without one have it computed on read instead.  The terms index is created
+ * by the schema, which is applied to every database after any upgrade. */
+static const char wc_sqlite_upgrade_v1[] =
+        "ALTER TABLE terms ADD COLUMN hash BLOB;";
+
+/* Statements which are run repeatedly are prepared once, on first use, and
+ * kept for the lifetime of the connection.  The exceptions are the walks
+ * which call out to a visitor, which prepare their own each time. */
+enum wc_sqlite_stmt {
+        WC_SQLITE_ANY_TERMS = 0,
+        WC_SQLITE_COUNT_TERMS,
+        WC_SQLITE_ALL_TERMS,
+        WC_SQLITE_TERMS_ACCEPTED,
+        WC_SQLITE_ACCEPT_TERMS,
+        WC_SQLITE_LATEST_TERMS,
+        WC_SQLITE_BEGIN,
+        WC_SQLITE_COMMIT,
+        WC_SQLITE_ROLLBACK,
+        WC_SQLITE_ADD_SECRET,
+        WC_SQLITE_SPEND_OUTPUT,
+        WC_SQLITE_ALL_SECRETS,
+        WC_SQLITE_NUM_STMTS
+};
+
+static const char *const wc_sqlite_sql[WC_SQLITE_NUM_STMTS] = {
+        "SELECT EXISTS (SELECT 1 FROM terms)",
+        "SELECT COUNT(*) FROM terms",
+        "SELECT accepted, body FROM terms ORDER BY id",
+        "SELECT accepted FROM terms WHERE body = ?1",
+        "INSERT INTO terms (body, accepted, hash) VALUES (?1, ?2, ?3) "
+                "ON CONFLICT (body) DO UPDATE SET accepted = excluded.accepted, "
+                "hash = excluded.hash",
+        "SELECT accepted, body, hash FROM terms ORDER BY accepted DESC, id DESC LIMIT 1",
+        /* Take the write lock up front, so that a busy database is reported
+         * at the start of a transaction rather than partway through. */
+        "BEGIN IMMEDIATE",
+        "COMMIT",
+        "ROLLBACK",
+        "INSERT INTO secrets (amount, serial, public_hash, chaincode, depth) "
+                "VALUES (?1, ?2, ?3, ?4, ?5)",
+        "UPDATE secrets SET spent = 1 WHERE public_hash = ?1",
+        "SELECT amount, serial, public_hash, chaincode, depth, spent FROM secrets",
+};
+
+struct wc_db {
+        sqlite3 *conn;
+        sqlite3_stmt *stmts[WC_SQLITE_NUM_STMTS];
+};
+
+static wc_error_t wc_sqlite_error(int rc) {
+        switch (rc & 0xff) { /* primary result code */
+        case SQLITE_OK:
+        case SQLITE_ROW:
+        case SQLITE_DONE:
+                return WC_SUCCESS;
+        case SQLITE_NOMEM:
+                return WC_ERROR_OUT_OF_MEMORY;
+        case SQLITE_TOOBIG:
+        case SQLITE_RANGE:
+                return WC_ERROR_OVERFLOW;
+        case SQLITE_CORRUPT:
+        case SQLITE_NOTADB:
+        case SQLITE_SCHEMA:
+                return WC_ERROR_DB_CORRUPT;
+        case SQLITE_CANTOPEN:
+                return WC_ERROR_DB_OPEN_FAILED;
+        case SQLITE_CONSTRAINT:
+        case SQLITE_MISMATCH:
+                return WC_ERROR_INVALID_ARGUMENT;
+        default:
+                return WC_ERROR_UNKNOWN;
+        }
+}
+
+/* Returns the cached statement, reset and with bindings cleared, preparing it
+ * if this is its first use.  Returns NULL on failure, with the SQLite result
+ * code in *rc. */
+static sqlite3_stmt* wc_sqlite_stmt(
+        struct wc_db *db,
+        enum wc_sqlite_stmt which,
+        int *rc
+) {
+        sqlite3_stmt *stmt = db->stmts[which];
+        if (stmt) {
+                sqlite3_reset(stmt);
+                sqlite3_clear_bindings(stmt);
+                *rc = SQLITE_OK;
+                return stmt;
+        }
+        *rc = sqlite3_prepare_v3(db->conn, wc_sqlite_sql[which], -1,
+                                 SQLITE_PREPARE_PERSISTENT, &stmt, NULL);
+        if (*rc != SQLITE_OK) {
+                return NULL;
+        }
+        db->stmts[which] = stmt;
+        return stmt;
+}
+
+/* Returns a new statement for a walk which calls out to a visitor, to be
+ * finalized by the caller.  A cached statement cannot be used, since the
+ * visitor may reset it by using the same connection, walks included.
+ * Returns NULL on failure, with the SQLite result code in *rc. */
+static sqlite3_stmt* wc_sqlite_walk_stmt(
+        struct wc_db *db,
+        enum wc_sqlite_stmt which,
+        int *rc
+) {
+        sqlite3_stmt *stmt = NULL;
+        *rc = sqlite3_prepare_v3(db->conn, wc_sqlite_sql[which], -1, 0, &stmt, NULL);
+        return *rc == SQLITE_OK ? stmt : NULL;
+}
+
+static void wc_sqlite_db_close(wc_db_handle_t db) {
+        size_t i = 0;
+        if (!db) {
+                return;
+        }
+        for (i = 0; i < WC_SQLITE_NUM_STMTS; ++i) {
+                sqlite3_finalize(db->stmts[i]);
+                db->stmts[i] = NULL;
+        }
+        sqlite3_close(db->conn);
+        free(db);
+}
+
+/* Reads the schema version of an existing database, or 0 if it is new. */
+static int wc_sqlite_user_version(sqlite3 *conn, int *version) {
+        sqlite3_stmt *stmt = NULL;
+        int rc = sqlite3_prepare_v2(conn, "PRAGMA user_version", -1, &stmt, NULL);
+        if (rc != SQLITE_OK) {
+                return rc;
+        }
+        rc = sqlite3_step(stmt);
+        if (rc == SQLITE_ROW) {
+                *version = sqlite3_column_int(stmt, 0);
+                rc = SQLITE_OK;
+        }
+        sqlite3_finalize(stmt);
+        return rc;
+}
+
+static wc_db_handle_t wc_sqlite_db_open(wc_db_url_t dburl) {
+        const char *path = (const char*)dburl;
+        struct wc_db *db = NULL;
+        int rc = SQLITE_OK;
+        int version = 0;
+        if (!path) {
+                return NULL;
+        }
+        db = malloc(sizeof(struct wc_db));
+        if (!db) {
+                return NULL;
+        }
+        memset(db, 0, sizeof(struct wc_db));
+        rc = sqlite3_open_v2(path, &db->conn,
+                             SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
+        if (rc == SQLITE_OK) {
+                rc = sqlite3_busy_timeout(db->conn, WC_SQLITE_BUSY_TIMEOUT);
+        }
+        if (rc == SQLITE_OK) {
+                rc = sqlite3_exec(db->conn, wc_sqlite_pragmas, NULL, NULL, NULL);
+        }
+        if (rc == SQLITE_OK) {
+                rc = wc_sqlite_user_version(db->conn, &version);
+        }
+        if (rc == SQLITE_OK && version == 1) {
+                rc = sqlite3_exec(db->conn, wc_sqlite_upgrade_v1, NULL, NULL, NULL);
+        }
+        if (rc == SQLITE_OK) {
+                rc = sqlite3_exec(db->conn, wc_sqlite_schema, NULL, NULL, NULL);
+        }
+        if (rc != SQLITE_OK) {
+                /* sqlite3_open_v2 allocates a handle even on failure. */
+                wc_sqlite_db_close(db);
+                return NULL;
+        }
+        return db;
+}
+
+static wc_error_t wc_sqlite_any_terms(wc_db_handle_t db, int *any) {
+        sqlite3_stmt *stmt = NULL;
+        int rc = SQLITE_OK;
+        if (!db || !any) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        stmt = wc_sqlite_stmt(db, WC_SQLITE_ANY_TERMS, &rc);
+        if (!stmt) {
+                return wc_sqlite_error(rc);
+        }
+        rc = sqlite3_step(stmt);
+        if (rc != SQLITE_ROW) {
+                sqlite3_reset(stmt);
+                return rc == SQLITE_DONE ? WC_ERROR_DB_CORRUPT : wc_sqlite_error(rc);
+        }
+        *any = !!sqlite3_column_int(stmt, 0);
+        sqlite3_reset(stmt);
+        return WC_SUCCESS;
+}
+
+static wc_error_t wc_sqlite_count_terms(wc_db_handle_t db, size_t *count) {
+        sqlite3_stmt *stmt = NULL;
+        sqlite3_int64 n = 0;
+        int rc = SQLITE_OK;
+        if (!db || !count) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        stmt = wc_sqlite_stmt(db, WC_SQLITE_COUNT_TERMS, &rc);
+        if (!stmt) {
+                return wc_sqlite_error(rc);
+        }
+        rc = sqlite3_step(stmt);
+        if (rc != SQLITE_ROW) {
+                sqlite3_reset(stmt);
+                return rc == SQLITE_DONE ? WC_ERROR_DB_CORRUPT : wc_sqlite_error(rc);
+        }
+        n = sqlite3_column_int64(stmt, 0);
+        sqlite3_reset(stmt);
+        if (n < 0 || (sqlite3_uint64)n > (size_t)-1) {
+                return WC_ERROR_DB_CORRUPT;
+        }
+        *count = (size_t)n;
+        return WC_SUCCESS;
+}
+
+static wc_error_t wc_sqlite_all_terms(
+        wc_db_handle_t db,
+        wc_db_terms_t *terms,
+        size_t *count
+) {
+        wc_error_t e = WC_SUCCESS;
+        sqlite3_stmt *stmt = NULL;
+        size_t n = 0, i = 0, j = 0;
+        int rc = SQLITE_OK;
+        if (!db || !count) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        /* Check capacity first, so that nothing is allocated if the caller
+         * needs to retry with a larger array. */
+        e = wc_sqlite_count_terms(db, &n);
+        if (e != WC_SUCCESS) {
+                return e;
+        }
+        if (!terms || *count < n) {
+                *count = n;
+                return WC_ERROR_INSUFFICIENT_CAPACITY;
+        }
+        stmt = wc_sqlite_stmt(db, WC_SQLITE_ALL_TERMS, &rc);
+        if (!stmt) {
+                return wc_sqlite_error(rc);
+        }
+        while (i < *count && (rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+                terms[i].when = (wc_time_t)sqlite3_column_int64(stmt, 0);
+                terms[i].text = blk2bstr(sqlite3_column_text(stmt, 1),
+                                         sqlite3_column_bytes(stmt, 1));
+                if (!terms[i].text) {
+                        rc = SQLITE_NOMEM;
+                        break;
+                }
+                ++i;
+        }
+        sqlite3_reset(stmt);
+        if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+                for (j = 0; j < i; ++j) {
+                        bdestroy(terms[j].text);
+                        terms[j].text = NULL;
+                }
+                return wc_sqlite_error(rc);
+        }
+        *count = i;
+        return WC_SUCCESS;
+}
+
+static wc_error_t wc_sqlite_each_terms(
+        wc_db_handle_t db,
+        wc_db_terms_visitor_t visit,
+        void *arg
+) {
+        sqlite3_stmt *stmt = NULL;
+        struct tagbstring text;
+        int rc = SQLITE_OK;
+        if (!db || !visit) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        stmt = wc_sqlite_walk_stmt(db, WC_SQLITE_ALL_TERMS, &rc);
+        if (!stmt) {
+                return wc_sqlite_error(rc);
+        }
+        /* Each row is handed out as a view of SQLite's own column buffer,
+         * which remains valid until the next step. */
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+                const unsigned char *body = sqlite3_column_text(stmt, 1);
+                int len = sqlite3_column_bytes(stmt, 1);
+                if (!body) {
+                        rc = SQLITE_NOMEM;
+                        break;
+                }
+                btfromblk(text, body, len);
+                if (visit(arg, (wc_time_t)sqlite3_column_int64(stmt, 0), &text)) {
+                        rc = SQLITE_DONE;
+                        break;
+                }
+        }
+        sqlite3_finalize(stmt);
+        return wc_sqlite_error(rc);
+}
+
+static wc_error_t wc_sqlite_terms_accepted(
+        wc_db_handle_t db,
+        bstring terms,
+        wc_time_t *when
+) {
+        sqlite3_stmt *stmt = NULL;
+        int rc = SQLITE_OK;
+        if (!db || !terms || terms->slen < 0 || !when) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        stmt = wc_sqlite_stmt(db, WC_SQLITE_TERMS_ACCEPTED, &rc);
+        if (!stmt) {
+                return wc_sqlite_error(rc);
+        }
+        rc = sqlite3_bind_text(stmt, 1, (const char*)terms->data, terms->slen, SQLITE_STATIC);
+        if (rc != SQLITE_OK) {
+                return wc_sqlite_error(rc);
+        }
+        rc = sqlite3_step(stmt);
+        if (rc == SQLITE_ROW) {
+                *when = (wc_time_t)sqlite3_column_int64(stmt, 0);
+        } else if (rc == SQLITE_DONE) {
+                *when = 0;
+        }
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+        return wc_sqlite_error(rc);
+}
+
+static wc_error_t wc_sqlite_accept_terms(
+        wc_db_handle_t db,
+        bstring terms,
+        wc_time_t now
+) {
+        sqlite3_stmt *stmt = NULL;
+        struct sha256 hash;
+        int rc = SQLITE_OK;
+        if (!db || !terms || terms->slen < 0) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        stmt = wc_sqlite_stmt(db, WC_SQLITE_ACCEPT_TERMS, &rc);
+        if (!stmt) {
+                return wc_sqlite_error(rc);
+        }
+        wc_terms_hash(&hash, terms);
+        rc = sqlite3_bind_text(stmt, 1, (const char*)terms->data, terms->slen, SQLITE_STATIC);
+        if (rc == SQLITE_OK) {
+                rc = sqlite3_bind_int64(stmt, 2, (sqlite3_int64)now);
+        }
+        if (rc == SQLITE_OK) {
+                rc = sqlite3_bind_blob(stmt, 3, hash.u8, sizeof(hash.u8), SQLITE_STATIC);
+        }
+        if (rc == SQLITE_OK) {
+                rc = sqlite3_step(stmt);
+        }
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+        return wc_sqlite_error(rc);
+}
+
+static wc_error_t wc_sqlite_latest_terms(
+        wc_db_handle_t db,
+        bstring *terms,
+        struct sha256 *hash,
+        wc_time_t *when
+) {
+        sqlite3_stmt *stmt = NULL;
+        const void *stored = NULL;
+        int rc = SQLITE_OK;
+        if (!db || !terms || !hash || !when) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        *terms = NULL;
+        stmt = wc_sqlite_stmt(db, WC_SQLITE_LATEST_TERMS, &rc);
+        if (!stmt) {
+                return wc_sqlite_error(rc);
+        }
+        rc = sqlite3_step(stmt);
+        if (rc == SQLITE_ROW) {
+                *when = (wc_time_t)sqlite3_column_int64(stmt, 0);
+                *terms = blk2bstr(sqlite3_column_text(stmt, 1),
+                                  sqlite3_column_bytes(stmt, 1));
+                stored = sqlite3_column_blob(stmt, 2);
+                if (!*terms) {
+                        rc = SQLITE_NOMEM;
+                } else if (stored && sqlite3_column_bytes(stmt, 2) == sizeof(hash->u8)) {
+                        memcpy(hash->u8, stored, sizeof(hash->u8));
+                } else {
+                        /* Accepted before hashes were stored. */
+                        wc_terms_hash(hash, *terms);
+                }
+        }
+        sqlite3_reset(stmt);
+        return wc_sqlite_error(rc);
+}
+
+/* Steps a cached statement which takes no parameters and returns no rows. */
+static wc_error_t wc_sqlite_exec(wc_db_handle_t db, enum wc_sqlite_stmt which) {
+        sqlite3_stmt *stmt = NULL;
+        int rc = SQLITE_OK;
+        if (!db) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        stmt = wc_sqlite_stmt(db, which, &rc);
+        if (!stmt) {
+                return wc_sqlite_error(rc);
+        }
+        rc = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        return wc_sqlite_error(rc);
+}
+
+static wc_error_t wc_sqlite_begin(wc_db_handle_t db) {
+        return wc_sqlite_exec(db, WC_SQLITE_BEGIN);
+}
+
+static wc_error_t wc_sqlite_commit(wc_db_handle_t db) {
+        return wc_sqlite_exec(db, WC_SQLITE_COMMIT);
+}
+
+static wc_error_t wc_sqlite_rollback(wc_db_handle_t db) {
+        /* Nothing to do if SQLite already rolled back on error. */
+        if (db && sqlite3_get_autocommit(db->conn)) {
+                return WC_SUCCESS;
+        }
+        return wc_sqlite_exec(db, WC_SQLITE_ROLLBACK);
+}
+
+static wc_error_t wc_sqlite_add_secrets(
+        wc_db_handle_t db,
+        const wc_db_secret_t *secrets,
+        size_t count
+) {
+        sqlite3_stmt *stmt = NULL;
+        size_t i = 0;
+        int rc = SQLITE_OK;
+        if (!db || (!secrets && count)) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        stmt = wc_sqlite_stmt(db, WC_SQLITE_ADD_SECRET, &rc);
+        if (!stmt) {
+                return wc_sqlite_error(rc);
+        }
+        for (i = 0; i < count && rc == SQLITE_OK; ++i) {
+                const wc_db_secret_t *s = &secrets[i];
+                if (!s->secret.serial || s->secret.len > INT_MAX) {
+                        rc = SQLITE_RANGE;
+                        break;
+                }
+                rc = sqlite3_bind_int64(stmt, 1, (sqlite3_int64)s->secret.amount);
+                if (rc == SQLITE_OK) {
+                        rc = sqlite3_bind_text(stmt, 2, s->secret.serial, (int)s->secret.len, SQLITE_STATIC);
+                }
+                if (rc == SQLITE_OK) {
+                        rc = sqlite3_bind_blob(stmt, 3, s->hash.u8, sizeof(s->hash.u8), SQLITE_STATIC);
+                }
+                if (rc == SQLITE_OK) {
+                        rc = s->derived ? sqlite3_bind_int64(stmt, 4, (sqlite3_int64)s->chaincode)
+                                        : sqlite3_bind_null(stmt, 4);
+                }
+                if (rc == SQLITE_OK) {
+                        rc = s->derived ? sqlite3_bind_int64(stmt, 5, (sqlite3_int64)s->depth)
+                                        : sqlite3_bind_null(stmt, 5);
+                }
+                if (rc == SQLITE_OK) {
+                        rc = sqlite3_step(stmt);
+                        rc = (rc == SQLITE_DONE) ? SQLITE_OK : rc;
+                }
+                sqlite3_reset(stmt);
+        }
+        sqlite3_clear_bindings(stmt);
+        return wc_sqlite_error(rc);
+}
+
+static wc_error_t wc_sqlite_spend_outputs(
+        wc_db_handle_t db,
+        const struct sha256 *hashes,
+        size_t count
+) {
+        sqlite3_stmt *stmt = NULL;
+        size_t i = 0;
+        int rc = SQLITE_OK;
+        if (!db || (!hashes && count)) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        stmt = wc_sqlite_stmt(db, WC_SQLITE_SPEND_OUTPUT, &rc);
+        if (!stmt) {
+                return wc_sqlite_error(rc);
+        }
+        for (i = 0; i < count && rc == SQLITE_OK; ++i) {
+                rc = sqlite3_bind_blob(stmt, 1, hashes[i].u8, sizeof(hashes[i].u8), SQLITE_STATIC);
+                if (rc == SQLITE_OK) {
+                        rc = sqlite3_step(stmt);
+                        rc = (rc == SQLITE_DONE) ? SQLITE_OK : rc;
+                }
+                sqlite3_reset(stmt);
+        }
+        sqlite3_clear_bindings(stmt);
+        return wc_sqlite_error(rc);
+}
+
+static wc_error_t wc_sqlite_each_secret(
+        wc_db_handle_t db,
+        wc_db_secrets_visitor_t visit,
+        void *arg
+) {
+        sqlite3_stmt *stmt = NULL;
+        wc_db_secret_t secret;
+        int rc = SQLITE_OK;
+        if (!db || !visit) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        stmt = wc_sqlite_walk_stmt(db, WC_SQLITE_ALL_SECRETS, &rc);
+        if (!stmt) {
+                return wc_sqlite_error(rc);
+        }
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+                const void *hash = sqlite3_column_blob(stmt, 2);
+                if (sqlite3_column_bytes(stmt, 2) != sizeof(secret.hash.u8) || !hash) {
+                        rc = SQLITE_CORRUPT;
+                        break;
+                }
+                memset(&secret, 0, sizeof(secret));
+                secret.secret.amount = (wc_amount_t)sqlite3_column_int64(stmt, 0);
+                secret.secret.serial = (const char*)sqlite3_column_text(stmt, 1);
+                secret.secret.len = (size_t)sqlite3_column_bytes(stmt, 1);
+                memcpy(secret.hash.u8, hash, sizeof(secret.hash.u8));
+                secret.derived = sqlite3_column_type(stmt, 3) != SQLITE_NULL;
+                if (secret.derived) {
+                        secret.chaincode = (uint64_t)sqlite3_column_int64(stmt, 3);
+                        secret.depth = (uint64_t)sqlite3_column_int64(stmt, 4);
+                }
+                if (visit(arg, &secret, sqlite3_column_int(stmt, 5))) {
+                        rc = SQLITE_DONE;
+                        break;
+                }
+        }
+        sqlite3_finalize(stmt);
+        return wc_sqlite_error(rc);
+}
+
+const wc_storage_callbacks_t wc_storage_sqlite_callbacks = {
+        wc_sqlite_log_open,
+        wc_sqlite_log_close,
+        wc_sqlite_db_open,
+        wc_sqlite_db_close,
+        wc_sqlite_any_terms,
+        wc_sqlite_all_terms,
+        wc_sqlite_terms_accepted,
+        wc_sqlite_accept_terms,
+        wc_sqlite_count_terms,
+        wc_sqlite_each_terms,
+        wc_sqlite_latest_terms,
+        wc_sqlite_begin,
+        wc_sqlite_commit,
+        wc_sqlite_rollback,
+        wc_sqlite_add_secrets,
+        wc_sqlite_spend_outputs,
+        wc_sqlite_each_secret,
+        wc_sqlite_log_write,
+        wc_sqlite_log_sync
+};
+
+/* End of File
+ */
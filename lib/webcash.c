@@ -12,12 +12,41 @@
 
 #include <sha2/sha256.h>
 
-#include <ctype.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* Two hex digits for each byte value, so that encoding takes one table
+ * lookup per byte instead of one per nibble. */
+static const char hexpairs[512] =
+        "000102030405060708090a0b0c0d0e0f"
+        "101112131415161718191a1b1c1d1e1f"
+        "202122232425262728292a2b2c2d2e2f"
+        "303132333435363738393a3b3c3d3e3f"
+        "404142434445464748494a4b4c4d4e4f"
+        "505152535455565758595a5b5c5d5e5f"
+        "606162636465666768696a6b6c6d6e6f"
+        "707172737475767778797a7b7c7d7e7f"
+        "808182838485868788898a8b8c8d8e8f"
+        "909192939495969798999a9b9c9d9e9f"
+        "a0a1a2a3a4a5a6a7a8a9aaabacadaeaf"
+        "b0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+        "c0c1c2c3c4c5c6c7c8c9cacbcccdcecf"
+        "d0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+        "e0e1e2e3e4e5e6e7e8e9eaebecedeeef"
+        "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
 
-static unsigned char hexdigits[] = "0123456789abcdef";
 static unsigned char hexdigit_to_int(char c) {
         if (c >= '0' && c <= '9') {
                 return c - '0';
@@ -31,12 +60,43 @@ static unsigned char hexdigit_to_int(char c) {
         return 0xff;
 }
 
+/* The number of mining hashes to compute per batch.  8 is the historical
+ * default of wc_mining_8way, and what is used if wc_init is never called. */
+static size_t wc_mining_width = 8;
+
+/* The compute backend selected with wc_backend_use.  NULL means the CPU,
+ * which runs the library's own code directly rather than through
+ * wc_backend_cpu_callbacks. */
+static const wc_backend_callbacks_t *wc_backend = NULL;
+static wc_device_handle_t wc_backend_dev = NULL;
+static uint64_t wc_backend_rows = 1;
+static size_t wc_backend_min_derive = 4096;
+
+static size_t wc_detect_mining_width(void) {
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) {
+                return 16;
+        }
+        if (__builtin_cpu_supports("avx2")) {
+                return 8;
+        }
+        return 4; /* SSE4 or scalar */
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+        return 4; /* 128-bit NEON registers */
+#else
+        return 8;
+#endif
+}
+
 static struct sha256_ctx webcashwalletv1_midstate = SHA256_INIT;
 wc_error_t wc_init(void) {
         const char *webcashwalletv1_tag_str = "webcashwalletv1";
         struct sha256 webcashwalletv1_tag;
         /* Setup libsha2 */
         sha256_auto_detect();
+        /* Size mining batches to the vector width of the host. */
+        wc_mining_width = wc_detect_mining_width();
         /* Initialize the midstate for the webcashwalletv1 chain derivation tag. */
         sha256_init(&webcashwalletv1_midstate);
         sha256_update(&webcashwalletv1_midstate, (const unsigned char*)webcashwalletv1_tag_str, strlen(webcashwalletv1_tag_str));
@@ -47,6 +107,359 @@ wc_error_t wc_init(void) {
         return WC_SUCCESS;
 }
 
+#define WC_ARENA_DEFAULT_CHUNK_SIZE (64 * 1024)
+#define WC_ARENA_ALIGN 16
+
+/* Arena memory is a list of chunks, most recent first, each followed
+ * directly by its data.  Allocation bumps the offset into the head chunk. */
+struct wc_arena_chunk {
+        struct wc_arena_chunk *next;
+        size_t size; /* bytes of data */
+        size_t used;
+};
+
+struct wc_arena {
+        struct wc_arena_chunk *chunks;
+        size_t chunk_size;
+};
+
+#define WC_ARENA_ROUND(n) (((n) + (WC_ARENA_ALIGN - 1)) & ~(size_t)(WC_ARENA_ALIGN - 1))
+#define WC_ARENA_HEADER WC_ARENA_ROUND(sizeof(struct wc_arena_chunk))
+#define WC_ARENA_DATA(chunk) ((unsigned char*)(chunk) + WC_ARENA_HEADER)
+
+/* The arena, if any, each thread's returned strings are allocated from. */
+static pthread_key_t wc_arena_key;
+static pthread_once_t wc_arena_once = PTHREAD_ONCE_INIT;
+static int wc_arena_key_ok = 0;
+
+static void wc_arena_key_init(void) {
+        wc_arena_key_ok = (pthread_key_create(&wc_arena_key, NULL) == 0);
+}
+
+static struct wc_arena_chunk* wc_arena_chunk_new(size_t size) {
+        struct wc_arena_chunk *chunk = NULL;
+        if (size > SIZE_MAX - WC_ARENA_HEADER) {
+                return NULL;
+        }
+        chunk = malloc(WC_ARENA_HEADER + size);
+        if (!chunk) {
+                return NULL;
+        }
+        chunk->next = NULL;
+        chunk->size = size;
+        chunk->used = 0;
+        return chunk;
+}
+
+wc_error_t wc_arena_create(
+        wc_arena_handle_t *arena,
+        size_t chunk_size
+) {
+        struct wc_arena *a = NULL;
+        if (!arena) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        if (!chunk_size) {
+                chunk_size = WC_ARENA_DEFAULT_CHUNK_SIZE;
+        }
+        a = malloc(sizeof(struct wc_arena));
+        if (!a) {
+                return WC_ERROR_OUT_OF_MEMORY;
+        }
+        a->chunk_size = WC_ARENA_ROUND(chunk_size);
+        a->chunks = wc_arena_chunk_new(a->chunk_size);
+        if (!a->chunks) {
+                free(a);
+                return WC_ERROR_OUT_OF_MEMORY;
+        }
+        *arena = a;
+        return WC_SUCCESS;
+}
+
+void* wc_arena_alloc(
+        wc_arena_handle_t a,
+        size_t size
+) {
+        struct wc_arena_chunk *chunk = NULL;
+        void *p = NULL;
+        if (!a || size > SIZE_MAX - WC_ARENA_ALIGN) {
+                return NULL;
+        }
+        size = WC_ARENA_ROUND(size ? size : 1);
+        chunk = a->chunks;
+        if (!chunk || chunk->size - chunk->used < size) {
+                chunk = wc_arena_chunk_new(size > a->chunk_size ? size : a->chunk_size);
+                if (!chunk) {
+                        return NULL;
+                }
+                chunk->next = a->chunks;
+                a->chunks = chunk;
+        }
+        p = WC_ARENA_DATA(chunk) + chunk->used;
+        chunk->used += size;
+        return p;
+}
+
+wc_error_t wc_arena_reset(wc_arena_handle_t a) {
+        struct wc_arena_chunk *chunk = NULL, *keep = NULL;
+        if (!a) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        /* Keep a chunk of the default size, if there is one, for reuse. */
+        while (a->chunks) {
+                chunk = a->chunks;
+                a->chunks = chunk->next;
+                wc_memory_cleanse(WC_ARENA_DATA(chunk), chunk->used);
+                if (!keep && chunk->size == a->chunk_size) {
+                        keep = chunk;
+                } else {
+                        free(chunk);
+                }
+        }
+        if (keep) {
+                keep->next = NULL;
+                keep->used = 0;
+        }
+        a->chunks = keep;
+        return WC_SUCCESS;
+}
+
+wc_error_t wc_arena_destroy(wc_arena_handle_t a) {
+        if (!a) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        wc_arena_reset(a);
+        free(a->chunks);
+        free(a);
+        return WC_SUCCESS;
+}
+
+wc_error_t wc_arena_use(
+        wc_arena_handle_t arena,
+        wc_arena_handle_t *previous
+) {
+        pthread_once(&wc_arena_once, wc_arena_key_init);
+        if (!wc_arena_key_ok) {
+                return WC_ERROR_OUT_OF_MEMORY;
+        }
+        if (previous) {
+                *previous = (wc_arena_handle_t)pthread_getspecific(wc_arena_key);
+        }
+        if (pthread_setspecific(wc_arena_key, arena) != 0) {
+                return WC_ERROR_OUT_OF_MEMORY;
+        }
+        return WC_SUCCESS;
+}
+
+/* Allocate an empty string with room for len bytes plus a terminator, from
+ * the calling thread's arena if it has one and otherwise the heap.  The
+ * caller fills in data and slen.  Arena strings are marked write-protected,
+ * which makes bstrlib refuse to resize or free them. */
+static bstring wc_bstr_alloc(size_t len) {
+        wc_arena_handle_t arena = NULL;
+        bstring b = NULL;
+        if (len >= INT_MAX) {
+                return NULL;
+        }
+        pthread_once(&wc_arena_once, wc_arena_key_init);
+        if (wc_arena_key_ok) {
+                arena = (wc_arena_handle_t)pthread_getspecific(wc_arena_key);
+        }
+        if (!arena) {
+                return bfromcstralloc((int)len + 1, "");
+        }
+        b = wc_arena_alloc(arena, sizeof(struct tagbstring) + len + 1);
+        if (!b) {
+                return NULL;
+        }
+        b->mlen = -1;
+        b->slen = 0;
+        b->data = (unsigned char*)(b + 1);
+        b->data[0] = '\0';
+        return b;
+}
+
+/* As blk2bstr, but allocated by wc_bstr_alloc. */
+static bstring wc_bstr_from_blk(const void *blk, size_t len) {
+        bstring b = wc_bstr_alloc(len);
+        if (!b) {
+                return NULL;
+        }
+        if (len) {
+                memcpy(b->data, blk, len);
+        }
+        b->data[len] = '\0';
+        b->slen = (int)len;
+        return b;
+}
+
+/* Instrumentation.  Each thread accumulates its own counters, found through
+ * a thread-specific key, so that recording never contends on a lock; the
+ * registry lock is only taken when a thread first records, when it exits
+ * (folding its counters into wc_stats_retired), and by snapshots.  Only the
+ * owning thread ever writes its counters: a reset just advances
+ * wc_stats_epoch, and each thread zeroes its own counters when it next
+ * records and finds them from an earlier epoch.  Until then they are left
+ * out of snapshots.  Without WEBCASH_STATS the recording macros expand to
+ * nothing. */
+#ifdef WEBCASH_STATS
+struct wc_stats_thread {
+        struct wc_stats_thread *next;
+        struct wc_stats_thread **prev;
+        unsigned long epoch; /* value of wc_stats_epoch the ops are from */
+        wc_stats_counter_t ops[WC_STATS_NUM_OPS];
+};
+
+static pthread_mutex_t wc_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct wc_stats_thread *wc_stats_threads = NULL;
+static wc_stats_counter_t wc_stats_retired[WC_STATS_NUM_OPS];
+static unsigned long wc_stats_epoch = 0;
+static pthread_key_t wc_stats_key;
+static pthread_once_t wc_stats_once = PTHREAD_ONCE_INIT;
+static int wc_stats_key_ok = 0;
+
+static void wc_stats_merge(wc_stats_counter_t *into, const wc_stats_counter_t *from) {
+        size_t i = 0;
+        into->calls += from->calls;
+        into->items += from->items;
+        into->total_ns += from->total_ns;
+        if (from->max_ns > into->max_ns) {
+                into->max_ns = from->max_ns;
+        }
+        for (i = 0; i < WC_STATS_BUCKETS; ++i) {
+                into->buckets[i] += from->buckets[i];
+        }
+}
+
+static void wc_stats_thread_exit(void *arg) {
+        struct wc_stats_thread *t = (struct wc_stats_thread*)arg;
+        size_t i = 0;
+        pthread_mutex_lock(&wc_stats_lock);
+        for (i = 0; i < WC_STATS_NUM_OPS && t->epoch == wc_stats_epoch; ++i) {
+                wc_stats_merge(&wc_stats_retired[i], &t->ops[i]);
+        }
+        *t->prev = t->next;
+        if (t->next) {
+                t->next->prev = t->prev;
+        }
+        pthread_mutex_unlock(&wc_stats_lock);
+        free(t);
+}
+
+static void wc_stats_key_init(void) {
+        wc_stats_key_ok = (pthread_key_create(&wc_stats_key, wc_stats_thread_exit) == 0);
+}
+
+static struct wc_stats_thread* wc_stats_self(void) {
+        struct wc_stats_thread *t = NULL;
+        pthread_once(&wc_stats_once, wc_stats_key_init);
+        if (!wc_stats_key_ok) {
+                return NULL;
+        }
+        t = (struct wc_stats_thread*)pthread_getspecific(wc_stats_key);
+        if (t) {
+                return t;
+        }
+        t = calloc(1, sizeof(struct wc_stats_thread));
+        if (!t) {
+                return NULL;
+        }
+        if (pthread_setspecific(wc_stats_key, t) != 0) {
+                free(t);
+                return NULL;
+        }
+        pthread_mutex_lock(&wc_stats_lock);
+        t->epoch = wc_stats_epoch;
+        t->next = wc_stats_threads;
+        t->prev = &wc_stats_threads;
+        if (t->next) {
+                t->next->prev = &t->next;
+        }
+        wc_stats_threads = t;
+        pthread_mutex_unlock(&wc_stats_lock);
+        return t;
+}
+
+static uint64_t wc_stats_now(void) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+static void wc_stats_record(wc_stats_op_t op, uint64_t start, uint64_t items) {
+        struct wc_stats_thread *t = wc_stats_self();
+        wc_stats_counter_t *c = NULL;
+        uint64_t ns = wc_stats_now() - start, us = 0;
+        size_t b = 0;
+        if (!t) {
+                return;
+        }
+        /* The epoch is read without the lock.  A reset which races with
+         * this record may let it count towards the earlier epoch. */
+        if (t->epoch != wc_stats_epoch) {
+                memset(t->ops, 0, sizeof(t->ops));
+                t->epoch = wc_stats_epoch;
+        }
+        c = &t->ops[op];
+        ++c->calls;
+        c->items += items;
+        c->total_ns += ns;
+        if (ns > c->max_ns) {
+                c->max_ns = ns;
+        }
+        /* Bucket b > 0 holds latencies of [2^(b-1), 2^b) microseconds. */
+        for (us = ns / 1000; us && b < WC_STATS_BUCKETS - 1; us >>= 1) {
+                ++b;
+        }
+        ++c->buckets[b];
+}
+
+#define WC_STATS_DECL(t) uint64_t t = 0;
+#define WC_STATS_START(t) ((t) = wc_stats_now())
+#define WC_STATS_END(op, t, n) wc_stats_record((op), (t), (uint64_t)(n))
+#else
+#define WC_STATS_DECL(t)
+#define WC_STATS_START(t) ((void)0)
+#define WC_STATS_END(op, t, n) ((void)0)
+#endif
+
+wc_error_t wc_stats_snapshot(wc_stats_t *out) {
+#ifdef WEBCASH_STATS
+        const struct wc_stats_thread *t = NULL;
+        size_t i = 0;
+#endif
+        if (!out) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        memset(out, 0, sizeof(wc_stats_t));
+#ifdef WEBCASH_STATS
+        out->enabled = 1;
+        pthread_mutex_lock(&wc_stats_lock);
+        for (i = 0; i < WC_STATS_NUM_OPS; ++i) {
+                wc_stats_merge(&out->ops[i], &wc_stats_retired[i]);
+        }
+        /* Other threads' counters are read while they may be updating them,
+         * so a snapshot can be off by the operations in progress. */
+        for (t = wc_stats_threads; t; t = t->next) {
+                for (i = 0; i < WC_STATS_NUM_OPS && t->epoch == wc_stats_epoch; ++i) {
+                        wc_stats_merge(&out->ops[i], &t->ops[i]);
+                }
+        }
+        pthread_mutex_unlock(&wc_stats_lock);
+#endif
+        return WC_SUCCESS;
+}
+
+wc_error_t wc_stats_reset(void) {
+#ifdef WEBCASH_STATS
+        pthread_mutex_lock(&wc_stats_lock);
+        memset(wc_stats_retired, 0, sizeof(wc_stats_retired));
+        ++wc_stats_epoch;
+        pthread_mutex_unlock(&wc_stats_lock);
+#endif
+        return WC_SUCCESS;
+}
+
 wc_amount_t wc_zero(void) {
         return WC_ZERO;
 }
@@ -66,29 +479,52 @@ wc_error_t wc_from_bstring(
         int *noncanonical,
         bstring str
 ) {
-        const unsigned char* pos = NULL;
-        const unsigned char* end = NULL;
+        /* Sanity: must provide output parameter. */
+        if (!amt) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        /* Sanity: no invalid bstrings allowed. */
+        if (!str || str->slen < 0 || (str->mlen >= 0 && str->mlen < str->slen) || !str->data) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        return wc_amount_parse(amt, noncanonical, (const char*)str->data, str->slen);
+}
+
+/* Digit classification without the locale dependence of isdigit. */
+#define WC_IS_DIGIT(c) ((unsigned char)((c) - '0') < 10)
+
+wc_error_t wc_amount_parse(
+        wc_amount_t *amt,
+        int *noncanonical,
+        const char *str,
+        size_t len
+) {
+        static const uint64_t pow10[9] = {
+                UINT64_C(1), UINT64_C(10), UINT64_C(100), UINT64_C(1000),
+                UINT64_C(10000), UINT64_C(100000), UINT64_C(1000000),
+                UINT64_C(10000000), UINT64_C(100000000)
+        };
+        const char* pos = NULL;
+        const char* end = NULL;
+        const char* digits = NULL;
         uint64_t u64 = UINT64_C(0);
         int is_noncanonical = 0;
         int is_negative = 0;
         int is_fractional = 0;
+        int is_overflow = 0;
         int j = 0;
 
         /* Sanity: must provide output parameter. */
         if (!amt) {
                 return WC_ERROR_INVALID_ARGUMENT;
         }
-        /* Sanity: no invalid bstrings allowed. */
-        if (!str || str->slen < 0 || (str->mlen >= 0 && str->mlen < str->slen) || !str->data) {
-                return WC_ERROR_INVALID_ARGUMENT;
-        }
         /* Sanity: no empty strings allowed. */
-        if (str->slen == 0) {
+        if (!str || len == 0) {
                 return WC_ERROR_INVALID_ARGUMENT;
         }
 
-        pos = &str->data[0];
-        end = &str->data[str->slen];
+        pos = str;
+        end = str + len;
 
         is_negative = (*pos == '-');
         if (is_negative) {
@@ -103,24 +539,28 @@ wc_error_t wc_from_bstring(
          * point, and the canonical representation of zero is a single zero
          * digit.  But only one zero, and in all other cases no leading zeros
          * are allowed. */
-        if (!isdigit(*pos)) {
+        if (!WC_IS_DIGIT(*pos)) {
                 return WC_ERROR_INVALID_ARGUMENT;
         }
         if (pos[0] == '0' && (pos + 1) != end && pos[1] != '.') {
                 is_noncanonical = 1;
         }
 
-        /* Parse the integral part. */
-        for (; pos != end && isdigit(*pos); ++pos) {
-                /* Overflow checked arithmetic. */
-                if (u64 > (UINT64_MAX / 10)) {
-                        return WC_ERROR_OVERFLOW;
-                }
-                u64 *= UINT64_C(10);
-                if (u64 > (UINT64_MAX - (*pos - '0'))) {
-                        return WC_ERROR_OVERFLOW;
+        /* Parse the integral part.  Leading zeros contribute nothing, and
+         * with them skipped, at most 11 integral digits can be followed by
+         * the 8 fractional digits without exceeding 2^63.  Knowing that up
+         * front keeps overflow checks out of the digit loops, since 19
+         * decimal digits always fit in a uint64_t.  Excess digits are only
+         * flagged, so that malformed input is still reported as such. */
+        while (pos != end && *pos == '0') {
+                ++pos;
+        }
+        for (digits = pos; pos != end && WC_IS_DIGIT(*pos); ++pos) {
+                if (pos - digits >= 11) {
+                        is_overflow = 1;
+                        continue;
                 }
-                u64 += (*pos - '0');
+                u64 = u64 * 10 + (unsigned char)(*pos - '0');
         }
 
         /* The fractional portion is optional. */
@@ -143,21 +583,11 @@ wc_error_t wc_from_bstring(
                 /* Read up to eight digits. */
                 for (; j < 8 && pos != end; ++j, ++pos) {
                         /* Must be a decimal digit. */
-                        if (!isdigit(*pos)) {
+                        if (!WC_IS_DIGIT(*pos)) {
                                 return WC_ERROR_INVALID_ARGUMENT;
                         }
-                        if (*pos != '0') {
-                                is_fractional = 1;
-                        }
-                        /* Overflow checked arithmetic. */
-                        if (u64 > (UINT64_MAX / 10)) {
-                                return WC_ERROR_OVERFLOW;
-                        }
-                        u64 *= UINT64_C(10);
-                        if (u64 > (UINT64_MAX - (*pos - '0'))) {
-                                return WC_ERROR_OVERFLOW;
-                        }
-                        u64 += (*pos - '0');
+                        is_fractional |= (*pos != '0');
+                        u64 = u64 * 10 + (unsigned char)(*pos - '0');
                 }
                 /* We ought to now be at the end of the input.  There could be
                  * some trailing zeros in a non-canonical input, however. */
@@ -175,15 +605,12 @@ wc_error_t wc_from_bstring(
         }
 
         /* Scale by any elided fractional digits. */
-        while (j++ < 8) {
-                /* Overflow checked arithmetic. */
-                if (u64 > (UINT64_MAX / 10)) {
-                        return WC_ERROR_OVERFLOW;
-                }
-                u64 *= UINT64_C(10);
-        }
+        u64 *= pow10[8 - j];
 
         /* Check for signed overflow */
+        if (is_overflow) {
+                return WC_ERROR_OVERFLOW;
+        }
         if (is_negative && u64 > ((uint64_t)INT64_MAX + 1)) {
                 return WC_ERROR_OVERFLOW;
         }
@@ -200,36 +627,91 @@ wc_error_t wc_from_bstring(
         if (noncanonical) {
                 *noncanonical = is_noncanonical;
         }
-        *amt = is_negative ? -u64 : u64;
+        *amt = is_negative ? (wc_amount_t)-u64 : (wc_amount_t)u64;
         return WC_SUCCESS;
 }
 
+wc_error_t wc_amounts_parse(
+        wc_amount_t out[],
+        wc_error_t errors[],
+        const char *const strs[],
+        const size_t lens[],
+        size_t n
+) {
+        wc_error_t ret = WC_SUCCESS, err = WC_SUCCESS;
+        size_t i = 0;
+        if ((!out || !strs || !lens) && n) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        for (; i < n; ++i) {
+                err = wc_amount_parse(&out[i], NULL, strs[i], lens[i]);
+                if (errors) {
+                        errors[i] = err;
+                }
+                if (ret == WC_SUCCESS) {
+                        ret = err;
+                }
+        }
+        return ret;
+}
+
 bstring wc_to_bstring(wc_amount_t amount) {
-        int64_t quot = 0;
-        int64_t rem = 0;
-        int is_negative = 0;
-        bstring str = NULL;
-        if (amount < 0) {
-                /* We handle this as a special case because otherwise the
-                 * negation below would overflow. */
-                if (amount == INT64_MIN) {
-                        return cstr2bstr("-92233720368.54775808");
+        char buf[WC_AMOUNT_MAX_LEN + 1];
+        size_t len = wc_amount_format(buf, amount);
+        return wc_bstr_from_blk(buf, len);
+}
+
+size_t wc_amount_format(
+        char out[WC_AMOUNT_MAX_LEN + 1],
+        wc_amount_t amount
+) {
+        /* Digits are generated from the least significant end into a scratch
+         * buffer, so neither printf nor any trailing zero trimming is
+         * needed. */
+        char tmp[WC_AMOUNT_MAX_LEN];
+        char *p = tmp + sizeof(tmp);
+        uint64_t u64 = amount < 0 ? -(uint64_t)amount : (uint64_t)amount;
+        uint64_t rem = u64 % WC_AMOUNT_SCALE;
+        size_t n = 0;
+        int j = 0;
+        if (rem != 0) {
+                /* Skip trailing fractional zeros, then emit the rest of the
+                 * eight fractional digits. */
+                for (j = 8; rem % 10 == 0; --j) {
+                        rem /= 10;
                 }
-                /* Otherwise we remember it is negative and calculate its
-                 * absolute value. */
-                is_negative = 1;
-                amount = -amount;
+                for (; j > 0; --j, rem /= 10) {
+                        *--p = (char)('0' + rem % 10);
+                }
+                *--p = '.';
         }
-        quot = amount / WC_AMOUNT_SCALE;
-        rem = amount % WC_AMOUNT_SCALE;
-        if (rem == 0) {
-                return bformat("%s%" PRId64, is_negative ? "-" : "", quot);
+        u64 /= WC_AMOUNT_SCALE;
+        do {
+                *--p = (char)('0' + u64 % 10);
+                u64 /= 10;
+        } while (u64);
+        if (amount < 0) {
+                *--p = '-';
         }
-        str = bformat("%s%" PRId64 ".%08" PRId64, is_negative ? "-" : "", quot, rem);
-        while (str->slen > 0 && str->data[str->slen - 1] == '0') {
-                btrunc(str, str->slen - 1);
+        n = (size_t)(tmp + sizeof(tmp) - p);
+        memcpy(out, p, n);
+        out[n] = '\0';
+        return n;
+}
+
+void wc_amounts_format(
+        char out[],
+        size_t lens[],
+        const wc_amount_t amounts[],
+        size_t n
+) {
+        size_t i = 0, len = 0;
+        for (; i < n; ++i) {
+                len = wc_amount_format(out + i*(WC_AMOUNT_MAX_LEN + 1), amounts[i]);
+                if (lens) {
+                        lens[i] = len;
+                }
         }
-        return str;
 }
 
 /* The amount of memory to allocate for wc_secret_t.secret when default
@@ -265,7 +747,7 @@ wc_error_t wc_secret_from_cstring(
         if (serial == NULL) {
                 return WC_ERROR_INVALID_ARGUMENT;
         }
-        bstr = bfromcstr(serial);
+        bstr = wc_bstr_from_blk(serial, strlen(serial));
         if (bstr == NULL) {
                 return WC_ERROR_OUT_OF_MEMORY;
         }
@@ -305,7 +787,7 @@ wc_error_t wc_secret_from_bstring_copy(
         if (serial == NULL || serial->slen < 0 || serial->data == NULL) {
                 return WC_ERROR_INVALID_ARGUMENT;
         }
-        bstr = bstrcpy(serial);
+        bstr = wc_bstr_from_blk(serial->data, (size_t)serial->slen);
         if (bstr == NULL) {
                 return WC_ERROR_OUT_OF_MEMORY;
         }
@@ -343,6 +825,13 @@ wc_error_t wc_secret_destroy(wc_secret_t *secret) {
         if (!secret) {
                 return WC_ERROR_INVALID_ARGUMENT;
         }
+        /* Write-protected serials, such as those allocated from an arena,
+         * are not ours to free: the arena cleanses them on release. */
+        if (secret->serial && secret->serial->mlen <= 0 && secret->serial->data) {
+                secret->amount = WC_ZERO;
+                secret->serial = NULL;
+                return WC_SUCCESS;
+        }
         if (bdestroy(secret->serial) != BSTR_OK) {
                 return WC_ERROR_INVALID_ARGUMENT;
         }
@@ -355,7 +844,9 @@ wc_error_t wc_secret_to_string(
         bstring *bstr,
         const wc_secret_t *secret
 ) {
-        bstring amt = NULL;
+        wc_secret_view_t view = {0};
+        bstring ret = NULL;
+        size_t len = 0;
         if (!bstr) {
                 return WC_ERROR_INVALID_ARGUMENT;
         }
@@ -365,19 +856,57 @@ wc_error_t wc_secret_to_string(
         if (secret->serial == NULL || secret->serial->slen < 0 || secret->serial->data == NULL) {
                 return WC_ERROR_INVALID_ARGUMENT;
         }
-        amt = wc_to_bstring(secret->amount);
-        if (amt == NULL) {
+        view.amount = secret->amount;
+        view.serial = (const char*)secret->serial->data;
+        view.len = secret->serial->slen;
+        /* Measure, then format directly into a single allocation. */
+        wc_secret_format(NULL, 0, &len, &view);
+        if (len >= INT_MAX) {
                 return WC_ERROR_OUT_OF_MEMORY;
         }
+        ret = wc_bstr_alloc(len);
+        if (ret == NULL) {
+                return WC_ERROR_OUT_OF_MEMORY;
+        }
+        wc_secret_format((char*)ret->data, len + 1, &len, &view);
+        ret->slen = (int)len;
         if (*bstr) {
                 /* prevent memory leaks */
                 bdestroy(*bstr);
         }
-        *bstr = bformat("e%s:secret:%s", amt->data, secret->serial->data);
-        bdestroy(amt); /* cleanup */
-        if (*bstr == NULL) {
-                return WC_ERROR_OUT_OF_MEMORY;
+        *bstr = ret;
+        return WC_SUCCESS;
+}
+
+wc_error_t wc_secret_format(
+        char out[],
+        size_t size,
+        size_t *len,
+        const wc_secret_view_t *secret
+) {
+        char amt[WC_AMOUNT_MAX_LEN + 1];
+        size_t amtlen = 0, n = 0;
+        if (!secret || (!secret->serial && secret->len)) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        if (!out && size) {
+                return WC_ERROR_INVALID_ARGUMENT;
         }
+        amtlen = wc_amount_format(amt, secret->amount);
+        n = 1 + amtlen + 8 + secret->len; /* "e" amount ":secret:" serial */
+        if (len) {
+                *len = n;
+        }
+        if (n >= size) {
+                return WC_ERROR_INSUFFICIENT_CAPACITY;
+        }
+        out[0] = 'e';
+        memcpy(out + 1, amt, amtlen);
+        memcpy(out + 1 + amtlen, ":secret:", 8);
+        if (secret->len) {
+                memcpy(out + 1 + amtlen + 8, secret->serial, secret->len);
+        }
+        out[n] = '\0';
         return WC_SUCCESS;
 }
 
@@ -386,8 +915,7 @@ wc_error_t wc_secret_parse(
         int *noncanonical,
         bstring bstr
 ) {
-        struct tagbstring sep = bsStatic(":");
-        int pos[3] = {0}; /* { amount, "secret", serial } */
+        wc_secret_view_t view = {0};
         int is_noncanonical = 0;
         wc_error_t err = WC_SUCCESS;
         wc_secret_t ret = {0};
@@ -398,35 +926,97 @@ wc_error_t wc_secret_parse(
         if (bstr == NULL || bstr->slen <= 0 || bstr->data == NULL) {
                 return WC_ERROR_INVALID_ARGUMENT;
         }
-        /* Split the string into amount, "secret", and serial fields. */
-        pos[0] = bstr->data[0] == 'e' ? 1 : 0; /* skip 'e' if present */
-        pos[1] = binchr(bstr, pos[0], &sep);
-        if (pos[1] == BSTR_ERR) {
+        err = wc_secret_parse_view(&view, &is_noncanonical, (const char*)bstr->data, bstr->slen);
+        if (err != WC_SUCCESS) {
+                return err;
+        }
+        ret.amount = view.amount;
+        ret.serial = wc_bstr_from_blk(view.serial, view.len);
+        if (ret.serial == NULL) {
+                return WC_ERROR_OUT_OF_MEMORY;
+        }
+        /* Write to output parameters. */
+        wc_secret_destroy(secret); /* avoid leaking memory */
+        *secret = ret;
+        if (noncanonical) {
+                *noncanonical = is_noncanonical;
+        }
+        return WC_SUCCESS;
+}
+
+/* Split a token of the form "e{amount}:{type}:{value}" into its fields,
+ * checking the type and parsing the amount.  On success, the value field is
+ * returned through value and valuelen.  If hash is given, the value must be
+ * a hex encoded hash, which is decoded into it.  The hash is checked before
+ * the amount is parsed, so that a malformed hash takes precedence over an
+ * out-of-range amount. */
+static wc_error_t wc_token_split(
+        wc_amount_t *amount,
+        int *noncanonical,
+        const char **value,
+        size_t *valuelen,
+        const char *str,
+        size_t len,
+        const char *type,
+        size_t typelen,
+        struct sha256 *hash
+) {
+        struct tagbstring tstr = {0};
+        const char *start = NULL, *end = NULL, *sep1 = NULL, *sep2 = NULL;
+        int is_noncanonical = 0, upper = 0;
+        wc_error_t err = WC_SUCCESS;
+        /* Amounts and values are measured with int-sized bstrings. */
+        if (!str || len == 0 || len > INT_MAX) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        end = str + len;
+        start = str[0] == 'e' ? str + 1 : str; /* skip 'e' if present */
+        sep1 = memchr(start, ':', end - start);
+        if (!sep1) {
                 return WC_ERROR_INVALID_ARGUMENT;
         }
-        pos[2] = binchr(bstr, pos[1] + 1, &sep);
-        if (pos[2] == BSTR_ERR) {
+        sep2 = memchr(sep1 + 1, ':', end - sep1 - 1);
+        if (!sep2) {
                 return WC_ERROR_INVALID_ARGUMENT;
         }
-        /* Check that the middle field is the ASCII text "secret". */
-        btfromblk(sep, &bstr->data[pos[1] + 1], pos[2] - pos[1] - 1);
-        if (biseqcstr(&sep, "secret") != 1) {
+        /* Check the middle field. */
+        if ((size_t)(sep2 - sep1 - 1) != typelen || memcmp(sep1 + 1, type, typelen) != 0) {
                 return WC_ERROR_INVALID_ARGUMENT;
         }
-        /* Parse the amount and serial fields. */
-        btfromblk(sep, &bstr->data[pos[0]], pos[1] - pos[0]);
-        err = wc_from_bstring(&ret.amount, &is_noncanonical, &sep);
+        /* Check and decode the hash field, if any. */
+        if (hash && (end - sep2 - 1 != 64 || wc_hex_decode(hash->u8, &upper, sep2 + 1, 32) != WC_SUCCESS)) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        /* Parse the amount field. */
+        btfromblk(tstr, start, (int)(sep1 - start));
+        err = wc_from_bstring(amount, &is_noncanonical, &tstr);
         if (err != WC_SUCCESS) {
                 return err;
         }
-        /* Canonical form includes the 'e'. */
-        is_noncanonical = is_noncanonical || pos[0] == 0;
-        ret.serial = bmidstr(bstr, pos[2] + 1, bstr->slen - pos[2] - 1);
-        if (ret.serial == NULL) {
-                return WC_ERROR_OUT_OF_MEMORY;
+        /* Canonical form includes the 'e', and lower case hex. */
+        *noncanonical = is_noncanonical || start == str || upper;
+        *value = sep2 + 1;
+        *valuelen = end - sep2 - 1;
+        return WC_SUCCESS;
+}
+
+wc_error_t wc_secret_parse_view(
+        wc_secret_view_t *secret,
+        int *noncanonical,
+        const char *str,
+        size_t len
+) {
+        wc_secret_view_t ret = {0};
+        int is_noncanonical = 0;
+        wc_error_t err = WC_SUCCESS;
+        if (!secret) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        err = wc_token_split(&ret.amount, &is_noncanonical, &ret.serial, &ret.len, str, len, "secret", 6, NULL);
+        if (err != WC_SUCCESS) {
+                return err;
         }
         /* Write to output parameters. */
-        wc_secret_destroy(secret); /* avoid leaking memory */
         *secret = ret;
         if (noncanonical) {
                 *noncanonical = is_noncanonical;
@@ -434,6 +1024,100 @@ wc_error_t wc_secret_parse(
         return WC_SUCCESS;
 }
 
+wc_error_t wc_secret_compact_from_view(
+        wc_secret_compact_t *out,
+        const wc_secret_view_t *secret
+) {
+        struct sha256 serial;
+        int upper = 0;
+        if (!out || !secret) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        if (!secret->serial || secret->len != 64) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        /* Only lowercase hex survives the round trip through raw bytes. */
+        if (wc_hex_decode(serial.u8, &upper, secret->serial, 32) != WC_SUCCESS || upper) {
+                wc_memory_cleanse(&serial, sizeof(serial));
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        out->amount = secret->amount;
+        out->serial = serial;
+        wc_memory_cleanse(&serial, sizeof(serial));
+        return WC_SUCCESS;
+}
+
+wc_error_t wc_secret_compact_from_secret(
+        wc_secret_compact_t *out,
+        const wc_secret_t *secret
+) {
+        wc_secret_view_t view = {0};
+        if (!out || !secret) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        if (secret->serial == NULL || secret->serial->slen < 0 || secret->serial->data == NULL) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        view.amount = secret->amount;
+        view.serial = (const char*)secret->serial->data;
+        view.len = secret->serial->slen;
+        return wc_secret_compact_from_view(out, &view);
+}
+
+wc_error_t wc_secret_from_compact(
+        wc_secret_t *out,
+        const wc_secret_compact_t *secret
+) {
+        bstring serial = NULL;
+        if (!out || !secret) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        serial = wc_bstr_alloc(64);
+        if (serial == NULL) {
+                return WC_ERROR_OUT_OF_MEMORY;
+        }
+        wc_hex_encode((char*)serial->data, secret->serial.u8, 32);
+        serial->data[64] = '\0';
+        serial->slen = 64;
+        wc_secret_destroy(out); /* avoid leaking memory */
+        out->amount = secret->amount;
+        out->serial = serial;
+        return WC_SUCCESS;
+}
+
+extern void WriteBE64(unsigned char* ptr, uint64_t x); /* provided by libsha2 */
+
+/* Compute the SHA-256 of each of n 64-byte messages, n at most 8.  That is
+ * one block of message followed by one block of padding.  The message
+ * blocks share the same initial midstate across lanes, and so are
+ * compressed in a single multi-lane call.  The padding block starts from a
+ * different state in each lane, so it is compressed one lane at a time, but
+ * still without the buffering overhead of sha256_update/sha256_done. */
+static void wc_sha256_64bytes(
+        struct sha256 out[],
+        const unsigned char blocks[],
+        size_t n
+) {
+        static const uint32_t init[8] = {
+                0x6a09e667ul, 0xbb67ae85ul, 0x3c6ef372ul, 0xa54ff53aul,
+                0x510e527ful, 0x9b05688cul, 0x1f83d9abul, 0x5be0cd19ul
+        };
+        unsigned char padding[64] = {0};
+        uint32_t s[8] = {0};
+        const unsigned char *p = NULL;
+        size_t i = 0, j = 0;
+        padding[0] = 0x80;
+        WriteBE64(padding + 56, 64 << 3);
+        sha256_midstate(out, init, blocks, n);
+        for (; i < n; ++i) {
+                for (j = 0, p = out[i].u8; j < 8; ++j, p += 4) {
+                        s[j] = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16)
+                             | ((uint32_t)p[2] <<  8) | ((uint32_t)p[3] <<  0);
+                }
+                sha256_midstate(&out[i], s, padding, 1);
+        }
+}
+
 wc_public_t wc_public_from_secret(const wc_secret_t *secret) {
         wc_public_t pub = {0};
         struct sha256_ctx ctx = SHA256_INIT;
@@ -449,6 +1133,72 @@ wc_public_t wc_public_from_secret(const wc_secret_t *secret) {
         return pub;
 }
 
+wc_error_t wc_public_from_secrets(
+        wc_public_t out[],
+        const wc_secret_t in[],
+        size_t n
+) {
+        struct sha256 hashes[8];
+        unsigned char blocks[8*64];
+        size_t idx[8] = {0};
+        size_t i = 0, k = 0, m = 0;
+        bstring serial = NULL;
+        if (!out || !in) {
+                return n ? WC_ERROR_INVALID_ARGUMENT : WC_SUCCESS;
+        }
+        /* Serials of exactly 64 bytes (the hex-encoded secrets generated by
+         * this library) are gathered into batches of 8 and hashed in
+         * parallel.  Everything else is hashed one at a time. */
+        for (; i < n; ++i) {
+                serial = in[i].serial;
+                if (serial == NULL || serial->data == NULL || serial->slen != 64) {
+                        out[i] = wc_public_from_secret(&in[i]);
+                        continue;
+                }
+                memcpy(blocks + 64*m, serial->data, 64);
+                idx[m++] = i;
+                if (m == 8) {
+                        wc_sha256_64bytes(hashes, blocks, m);
+                        for (k = 0; k < m; ++k) {
+                                out[idx[k]].amount = in[idx[k]].amount;
+                                out[idx[k]].hash = hashes[k];
+                        }
+                        m = 0;
+                }
+        }
+        if (m) {
+                wc_sha256_64bytes(hashes, blocks, m);
+                for (k = 0; k < m; ++k) {
+                        out[idx[k]].amount = in[idx[k]].amount;
+                        out[idx[k]].hash = hashes[k];
+                }
+        }
+        wc_memory_cleanse(blocks, sizeof(blocks));
+        return WC_SUCCESS;
+}
+
+void wc_public_from_compact_secrets(
+        wc_public_t out[],
+        const wc_secret_compact_t in[],
+        size_t n
+) {
+        struct sha256 hashes[8];
+        unsigned char blocks[8*64];
+        size_t i = 0, m = 0;
+        for (; n > 0; n -= m, in += m, out += m) {
+                m = n < 8 ? n : 8;
+                for (i = 0; i < m; ++i) {
+                        wc_hex_encode((char*)blocks + 64*i, in[i].serial.u8, 32);
+                }
+                wc_sha256_64bytes(hashes, blocks, m);
+                for (i = 0; i < m; ++i) {
+                        out[i].amount = in[i].amount;
+                        out[i].hash = hashes[i];
+                }
+        }
+        wc_memory_cleanse(blocks, sizeof(blocks));
+}
+
 wc_error_t wc_public_is_valid(const wc_public_t *pub) {
         if (!pub) {
                 return WC_ERROR_INVALID_ARGUMENT;
@@ -463,39 +1213,55 @@ wc_error_t wc_public_to_string(
         bstring *bstr,
         const wc_public_t *pub
 ) {
-        bstring amt = NULL;
+        char buf[WC_PUBLIC_MAX_LEN + 1];
+        bstring ret = NULL;
+        size_t len = 0;
         if (!bstr) {
                 return WC_ERROR_INVALID_ARGUMENT;
         }
         if (!pub) {
                 return WC_ERROR_INVALID_ARGUMENT;
         }
-        amt = wc_to_bstring(pub->amount);
-        if (amt == NULL) {
+        wc_public_format(buf, sizeof(buf), &len, pub);
+        ret = wc_bstr_from_blk(buf, len);
+        if (ret == NULL) {
                 return WC_ERROR_OUT_OF_MEMORY;
         }
         if (*bstr) {
                 /* prevent memory leaks */
                 bdestroy(*bstr);
         }
-        *bstr = bformat("e%s:public:"
-                        "%02x%02x%02x%02x%02x%02x%02x%02x"
-                        "%02x%02x%02x%02x%02x%02x%02x%02x"
-                        "%02x%02x%02x%02x%02x%02x%02x%02x"
-                        "%02x%02x%02x%02x%02x%02x%02x%02x",
-                        amt->data,
-                        pub->hash.u8[0],  pub->hash.u8[1],  pub->hash.u8[2],  pub->hash.u8[3],
-                        pub->hash.u8[4],  pub->hash.u8[5],  pub->hash.u8[6],  pub->hash.u8[7],
-                        pub->hash.u8[8],  pub->hash.u8[9],  pub->hash.u8[10], pub->hash.u8[11],
-                        pub->hash.u8[12], pub->hash.u8[13], pub->hash.u8[14], pub->hash.u8[15],
-                        pub->hash.u8[16], pub->hash.u8[17], pub->hash.u8[18], pub->hash.u8[19],
-                        pub->hash.u8[20], pub->hash.u8[21], pub->hash.u8[22], pub->hash.u8[23],
-                        pub->hash.u8[24], pub->hash.u8[25], pub->hash.u8[26], pub->hash.u8[27],
-                        pub->hash.u8[28], pub->hash.u8[29], pub->hash.u8[30], pub->hash.u8[31]);
-        bdestroy(amt); /* cleanup */
-        if (*bstr == NULL) {
-                return WC_ERROR_OUT_OF_MEMORY;
+        *bstr = ret;
+        return WC_SUCCESS;
+}
+
+wc_error_t wc_public_format(
+        char out[],
+        size_t size,
+        size_t *len,
+        const wc_public_t *pub
+) {
+        char amt[WC_AMOUNT_MAX_LEN + 1];
+        size_t amtlen = 0, n = 0;
+        if (!pub) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        if (!out && size) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        amtlen = wc_amount_format(amt, pub->amount);
+        n = 1 + amtlen + 8 + 64; /* "e" amount ":public:" hash */
+        if (len) {
+                *len = n;
         }
+        if (n >= size) {
+                return WC_ERROR_INSUFFICIENT_CAPACITY;
+        }
+        out[0] = 'e';
+        memcpy(out + 1, amt, amtlen);
+        memcpy(out + 1 + amtlen, ":public:", 8);
+        wc_hex_encode(out + 1 + amtlen + 8, pub->hash.u8, 32);
+        out[n] = '\0';
         return WC_SUCCESS;
 }
 
@@ -504,12 +1270,6 @@ wc_error_t wc_public_parse(
         int *noncanonical,
         bstring bstr
 ) {
-        struct tagbstring sep = bsStatic(":");
-        int pos[3] = {0}; /* { amount, "public", hash } */
-        int is_noncanonical = 0;
-        wc_error_t err = WC_SUCCESS;
-        wc_public_t ret = {0};
-        int j = 0, c = 0;
         /* Argument validation. */
         if (!pub) {
                 return WC_ERROR_INVALID_ARGUMENT;
@@ -517,47 +1277,28 @@ wc_error_t wc_public_parse(
         if (bstr == NULL || bstr->slen <= 0 || bstr->data == NULL) {
                 return WC_ERROR_INVALID_ARGUMENT;
         }
-        /* Split the string into amount, "public", and hash fields. */
-        pos[0] = bstr->data[0] == 'e' ? 1 : 0; /* skip 'e' if present */
-        pos[1] = binchr(bstr, pos[0], &sep);
-        if (pos[1] == BSTR_ERR) {
-                return WC_ERROR_INVALID_ARGUMENT;
-        }
-        pos[2] = binchr(bstr, pos[1] + 1, &sep);
-        if (pos[2] == BSTR_ERR) {
-                return WC_ERROR_INVALID_ARGUMENT;
-        }
-        if (bstr->slen - pos[2] != 1/*:*/ + 64/*hash*/) {
-                return WC_ERROR_INVALID_ARGUMENT;
-        }
-        for (j = 0; j < 64; ++j) {
-                c = bstr->data[pos[2] + 1 + j];
-                if (hexdigit_to_int(c) > 15) {
-                        return WC_ERROR_INVALID_ARGUMENT;
-                }
-                if (c >= 'A' && c <= 'F') {
-                        is_noncanonical = 1;
-                }
-        }
-        /* Check that the middle field is the ASCII text "public". */
-        btfromblk(sep, &bstr->data[pos[1] + 1], pos[2] - pos[1] - 1);
-        if (biseqcstr(&sep, "public") != 1) {
+        return wc_public_parse_view(pub, noncanonical, (const char*)bstr->data, bstr->slen);
+}
+
+wc_error_t wc_public_parse_view(
+        wc_public_t *pub,
+        int *noncanonical,
+        const char *str,
+        size_t len
+) {
+        const char *hex = NULL;
+        size_t hexlen = 0;
+        int is_noncanonical = 0;
+        wc_error_t err = WC_SUCCESS;
+        wc_public_t ret = {0};
+        /* Argument validation. */
+        if (!pub) {
                 return WC_ERROR_INVALID_ARGUMENT;
         }
-        /* Parse the amount and hash fields. */
-        btfromblk(sep, &bstr->data[pos[0]], pos[1] - pos[0]);
-        c = 0;
-        err = wc_from_bstring(&ret.amount, &c, &sep);
-        is_noncanonical = is_noncanonical || c;
+        err = wc_token_split(&ret.amount, &is_noncanonical, &hex, &hexlen, str, len, "public", 6, &ret.hash);
         if (err != WC_SUCCESS) {
                 return err;
         }
-        /* Canonical form includes the 'e'. */
-        is_noncanonical = is_noncanonical || pos[0] == 0;
-        for (j = 0; j < 32; ++j) {
-                ret.hash.u8[j] = hexdigit_to_int(bstr->data[pos[2] + 1 + 2*j]) << 4
-                               | hexdigit_to_int(bstr->data[pos[2] + 1 + 2*j + 1]);
-        }
         /* Write to output parameters. */
         *pub = ret;
         if (noncanonical) {
@@ -566,6 +1307,92 @@ wc_error_t wc_public_parse(
         return WC_SUCCESS;
 }
 
+static void wc_token_parse(
+        wc_token_t *token,
+        const char *str,
+        size_t len
+) {
+        const char *sep = memchr(str, ':', len);
+        token->type = WC_TOKEN_INVALID;
+        token->error = WC_ERROR_INVALID_ARGUMENT;
+        token->noncanonical = 0;
+        /* The field following the amount determines the type. */
+        if (sep && (size_t)(str + len - sep) > 8 && sep[7] == ':') {
+                if (memcmp(sep + 1, "secret", 6) == 0) {
+                        token->type = WC_TOKEN_SECRET;
+                        token->error = wc_secret_parse_view(&token->secret, &token->noncanonical, str, len);
+                } else if (memcmp(sep + 1, "public", 6) == 0) {
+                        token->type = WC_TOKEN_PUBLIC;
+                        token->error = wc_public_parse_view(&token->pub, &token->noncanonical, str, len);
+                }
+        }
+}
+
+wc_error_t wc_tokens_parse(
+        wc_token_t tokens[],
+        size_t max,
+        size_t *count,
+        size_t *consumed,
+        const char *buf,
+        size_t len,
+        int final
+) {
+        const char *pos = buf, *end = buf + len, *eol = NULL, *next = NULL;
+        const char *first = NULL, *last = NULL;
+        size_t n = 0;
+        if (!count || !consumed || (!tokens && max) || (!buf && len)) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        for (; n < max && pos != end; pos = next) {
+                eol = memchr(pos, '\n', end - pos);
+                if (!eol) {
+                        if (!final) {
+                                break;
+                        }
+                        eol = end;
+                        next = end;
+                } else {
+                        next = eol + 1;
+                }
+                /* Trim surrounding whitespace, including a CR from a CRLF
+                 * line terminator. */
+                first = pos;
+                while (first != eol && (*first == ' ' || *first == '\t')) {
+                        ++first;
+                }
+                last = eol;
+                while (last != first && (last[-1] == ' ' || last[-1] == '\t' || last[-1] == '\r')) {
+                        --last;
+                }
+                if (first == last) {
+                        continue; /* blank line */
+                }
+                tokens[n].offset = first - buf;
+                tokens[n].len = last - first;
+                wc_token_parse(&tokens[n], first, last - first);
+                ++n;
+        }
+        *count = n;
+        *consumed = pos - buf;
+        return WC_SUCCESS;
+}
+
+size_t wc_tokens_boundary(
+        const char *buf,
+        size_t len,
+        size_t pos
+) {
+        const char *eol = NULL;
+        if (pos >= len) {
+                return len;
+        }
+        if (pos == 0 || buf[pos - 1] == '\n') {
+                return pos;
+        }
+        eol = memchr(buf + pos, '\n', len - pos);
+        return eol ? (size_t)(eol - buf) + 1 : len;
+}
+
 unsigned char wc_mining_nonces[4*1000] = {
         "MDAwMDAxMDAyMDAzMDA0MDA1MDA2MDA3MDA4MDA5MDEwMDExMDEyMDEzMDE0MDE1MDE2MDE3MDE4MDE5"
         "MDIwMDIxMDIyMDIzMDI0MDI1MDI2MDI3MDI4MDI5MDMwMDMxMDMyMDMzMDM0MDM1MDM2MDM3MDM4MDM5"
@@ -620,24 +1447,545 @@ unsigned char wc_mining_nonces[4*1000] = {
 };
 unsigned char wc_mining_final[4] = { 'f', 'Q', '=', '=' };
 
-extern void WriteBE64(unsigned char* ptr, uint64_t x); /* provided by libsha2 */
-void wc_mining_8way(
-        unsigned char hashes[8*32],
+static void wc_mining_nway(
+        unsigned char hashes[],
         const struct sha256_ctx* ctx,
         const unsigned char nonce1[4],
-        const unsigned char nonce2[4*8],
-        const unsigned char final[4]
+        const unsigned char nonce2[],
+        const unsigned char final[4],
+        size_t n
 ) {
-	unsigned char blocks[8*64] = {0};
-	int i = 0;
-	for (; i < 8; ++i) {
+	unsigned char blocks[16*64] = {0};
+	size_t i = 0;
+	for (; i < n; ++i) {
 		memcpy(blocks + 64*i + 0, nonce1, 4);
 		memcpy(blocks + 64*i + 4, nonce2 + 4*i, 4);
 		memcpy(blocks + 64*i + 8, final, 4);
 		blocks[i*64 + 12] = 0x80; /* padding byte */
 		WriteBE64(blocks + 64*i + 56, (ctx->bytes + 12) << 3);
 	}
-	sha256_midstate((struct sha256*)hashes, ctx->s, blocks, 8);
+	sha256_midstate((struct sha256*)hashes, ctx->s, blocks, n);
+}
+
+void wc_mining_4way(
+        unsigned char hashes[4*32],
+        const struct sha256_ctx* ctx,
+        const unsigned char nonce1[4],
+        const unsigned char nonce2[4*4],
+        const unsigned char final[4]
+) {
+        wc_mining_nway(hashes, ctx, nonce1, nonce2, final, 4);
+}
+
+void wc_mining_8way(
+        unsigned char hashes[8*32],
+        const struct sha256_ctx* ctx,
+        const unsigned char nonce1[4],
+        const unsigned char nonce2[4*8],
+        const unsigned char final[4]
+) {
+        wc_mining_nway(hashes, ctx, nonce1, nonce2, final, 8);
+}
+
+void wc_mining_16way(
+        unsigned char hashes[16*32],
+        const struct sha256_ctx* ctx,
+        const unsigned char nonce1[4],
+        const unsigned char nonce2[4*16],
+        const unsigned char final[4]
+) {
+        wc_mining_nway(hashes, ctx, nonce1, nonce2, final, 16);
+}
+
+size_t wc_mining_best_width(void) {
+        return wc_mining_width;
+}
+
+static unsigned wc_leading_zero_bits(const unsigned char hash[32]) {
+        unsigned bits = 0;
+        unsigned char c = 0;
+        int i = 0;
+        for (; i < 32 && hash[i] == 0; ++i) {
+                bits += 8;
+        }
+        if (i < 32) {
+                for (c = hash[i]; !(c & 0x80); c <<= 1) {
+                        ++bits;
+                }
+        }
+        return bits;
+}
+
+wc_error_t wc_mining_job_init(
+        wc_mining_job_t *job,
+        const struct sha256_ctx *ctx,
+        const unsigned char nonce1[4],
+        const unsigned char final[4]
+) {
+        if (!nonce1) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        return wc_mining_job_init_groups(job, ctx, 2, nonce1, final);
+}
+
+wc_error_t wc_mining_job_init_groups(
+        wc_mining_job_t *job,
+        const struct sha256_ctx *ctx,
+        unsigned ngroups,
+        const unsigned char nonces[],
+        const unsigned char final[4]
+) {
+        size_t len = 0;
+        int i = 0;
+        if (!job || !ctx || !final) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        if (ngroups < 1 || ngroups > WC_MINING_MAX_NONCE_GROUPS) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        if (ngroups > 1 && !nonces) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        /* The nonces and padding must make up the final block. */
+        if (ctx->bytes % 64 != 0) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        /* Each lane is laid out as the fixed nonce groups, the per-lane
+         * nonce group, final, and padding.  With at most six groups that is
+         * 29 bytes, leaving room for the 8-byte length field. */
+        len = 4*ngroups + 4;
+        memcpy(job->midstate, ctx->s, sizeof(job->midstate));
+        job->ngroups = ngroups;
+        memset(job->blocks, 0, sizeof(job->blocks));
+        for (; i < WC_MINING_JOB_LANES; ++i) {
+                if (ngroups > 1) {
+                        memcpy(job->blocks + 64*i, nonces, 4*(ngroups - 1));
+                }
+                memcpy(job->blocks + 64*i + len - 4, final, 4);
+                job->blocks[i*64 + len] = 0x80; /* padding byte */
+                WriteBE64(job->blocks + 64*i + 56, (ctx->bytes + len) << 3);
+        }
+        return WC_SUCCESS;
+}
+
+void wc_mining_job_set_nonce1(
+        wc_mining_job_t *job,
+        const unsigned char nonce1[4]
+) {
+        int i = 0;
+        if (job->ngroups < 2) {
+                return;
+        }
+        for (; i < WC_MINING_JOB_LANES; ++i) {
+                memcpy(job->blocks + 64*i, nonce1, 4);
+        }
+}
+
+void wc_mining_job_set_nonces(
+        wc_mining_job_t *job,
+        const unsigned char nonces[]
+) {
+        int i = 0;
+        if (job->ngroups < 2) {
+                return;
+        }
+        for (; i < WC_MINING_JOB_LANES; ++i) {
+                memcpy(job->blocks + 64*i, nonces, 4*(job->ngroups - 1));
+        }
+}
+
+void wc_mining_job_hash(
+        unsigned char hashes[],
+        wc_mining_job_t *job,
+        const unsigned char nonce2[],
+        size_t n
+) {
+        size_t i = 0, m = 0;
+        size_t off = 4*(job->ngroups - 1); /* offset of per-lane nonce */
+        for (; n > 0; n -= m) {
+                m = n < WC_MINING_JOB_LANES ? n : WC_MINING_JOB_LANES;
+                for (i = 0; i < m; ++i) {
+                        memcpy(job->blocks + 64*i + off, nonce2 + 4*i, 4);
+                }
+                sha256_midstate((struct sha256*)hashes, job->midstate, job->blocks, m);
+                nonce2 += 4*m;
+                hashes += 32*m;
+        }
+}
+
+uint32_t wc_mining_job_search(
+        wc_mining_job_t *job,
+        const unsigned char nonce2[],
+        size_t n,
+        unsigned difficulty
+) {
+        const unsigned char *p = NULL;
+        uint64_t limit = 0, v = 0;
+        uint32_t mask = 0;
+        size_t i = 0;
+        if (n > WC_MINING_JOB_LANES) {
+                n = WC_MINING_JOB_LANES;
+        }
+        wc_mining_job_hash(job->digests, job, nonce2, n);
+        if (difficulty == 0) {
+                return (UINT32_C(1) << n) - 1;
+        }
+        /* A hash has at least d leading zero bits exactly when its first
+         * eight bytes, read as a big-endian integer, are less than 2^(64-d).
+         * That makes the common case a single branch-free comparison per
+         * lane.  Difficulties above 64 bits additionally need the rest of
+         * the hash examined, but only for lanes that pass the first test. */
+        limit = difficulty < 64 ? UINT64_C(1) << (64 - difficulty) : 1;
+        for (; i < n; ++i) {
+                p = job->digests + 32*i;
+                v = ((uint64_t)p[0] << 56) | ((uint64_t)p[1] << 48)
+                  | ((uint64_t)p[2] << 40) | ((uint64_t)p[3] << 32)
+                  | ((uint64_t)p[4] << 24) | ((uint64_t)p[5] << 16)
+                  | ((uint64_t)p[6] <<  8) | ((uint64_t)p[7] <<  0);
+                mask |= (uint32_t)(v < limit) << i;
+        }
+        if (difficulty > 64) {
+                for (i = 0; i < n; ++i) {
+                        if ((mask >> i) & 1 && wc_leading_zero_bits(job->digests + 32*i) < difficulty) {
+                                mask &= ~(UINT32_C(1) << i);
+                        }
+                }
+        }
+        return mask;
+}
+
+struct wc_miner_thread {
+        struct wc_miner *miner;
+        pthread_t thread;
+        unsigned index;
+};
+
+struct wc_miner {
+        struct sha256_ctx ctx;
+        unsigned ngroups;
+        uint64_t nrows; /* 1000^(ngroups-1) values of the fixed groups */
+        unsigned difficulty;
+        int width; /* hashes per batch */
+        const wc_backend_callbacks_t *backend; /* NULL for the CPU */
+        wc_device_handle_t dev;
+        uint64_t rows; /* rows per range handed to the backend */
+        wc_mining_callback_t callback;
+        void *arg;
+        pthread_mutex_t lock; /* guards stop, and serializes callbacks */
+        int stop;
+        unsigned nthreads;
+        struct wc_miner_thread *threads;
+};
+
+static int wc_miner_should_stop(struct wc_miner *m) {
+        int stop = 0;
+        pthread_mutex_lock(&m->lock);
+        stop = m->stop;
+        pthread_mutex_unlock(&m->lock);
+        return stop;
+}
+
+/* Search rows [first, first+count) of the nonce space on the CPU, using a
+ * job prepared for ngroups groups.  Returns non-zero if found asks to stop.
+ *
+ * Each row is one assignment of values to the leading ngroups-1 nonce
+ * groups, searched against all values of the last nonce group.  The 1000
+ * values of the last group are conveniently contiguous in wc_mining_nonces,
+ * so a batch is just a window into that array.  The final batch may be
+ * short if the mining width does not divide 1000.  The block template is
+ * built once, and afterwards only the nonce bytes are rewritten.  Timing is
+ * recorded once per call rather than per batch, keeping the clock out of
+ * the hashing loop. */
+static int wc_mine_rows(
+        wc_mining_job_t *job,
+        unsigned ngroups,
+        uint64_t first,
+        uint64_t count,
+        unsigned difficulty,
+        int width,
+        wc_mining_callback_t found,
+        void *arg
+) {
+        wc_mining_solution_t sol;
+        unsigned char nonces[4*WC_MINING_MAX_NONCE_GROUPS] = {0};
+        size_t off = 4*(ngroups - 1); /* offset of per-lane nonce */
+        uint64_t row = 0, r = 0, hashes = 0;
+        uint32_t mask = 0;
+        int g = 0, j = 0, k = 0, n = 0, stop = 0;
+        WC_STATS_DECL(t0)
+        WC_STATS_START(t0);
+        for (row = first; row < first + count && !stop; ++row) {
+                /* Decode the row index into base-1000 digits, the first
+                 * nonce group being the most significant. */
+                for (r = row, g = (int)ngroups - 2; g >= 0; --g, r /= 1000) {
+                        memcpy(nonces + 4*g, &wc_mining_nonces[4*(r % 1000)], 4);
+                }
+                wc_mining_job_set_nonces(job, nonces);
+                for (j = 0; j < 1000 && !stop; j += n) {
+                        n = 1000 - j < width ? 1000 - j : width;
+                        mask = wc_mining_job_search(job, &wc_mining_nonces[4*j], n, difficulty);
+                        hashes += (uint64_t)n;
+                        for (k = 0; mask && !stop; ++k, mask >>= 1) {
+                                if (!(mask & 1)) {
+                                        continue;
+                                }
+                                memcpy(sol.hash.u8, job->digests + 32*k, 32);
+                                memset(sol.nonces, 0, sizeof(sol.nonces));
+                                memcpy(sol.nonces, nonces, off);
+                                memcpy(sol.nonces + off, &wc_mining_nonces[4*(j + k)], 4);
+                                sol.ngroups = ngroups;
+                                sol.difficulty = wc_leading_zero_bits(sol.hash.u8);
+                                stop = found(arg, &sol);
+                        }
+                }
+        }
+        WC_STATS_END(WC_STATS_MINING, t0, hashes);
+        (void)hashes;
+        return stop;
+}
+
+/* Pass a solution on to the user's callback, one at a time, and report
+ * whether mining should stop. */
+static int wc_miner_found(void *arg, const wc_mining_solution_t *sol) {
+        struct wc_miner *m = (struct wc_miner*)arg;
+        int stop = 0;
+        pthread_mutex_lock(&m->lock);
+        if (!m->stop && m->callback(m->arg, sol)) {
+                m->stop = 1;
+        }
+        stop = m->stop;
+        pthread_mutex_unlock(&m->lock);
+        return stop;
+}
+
+/* Solutions reported by the backend during one mine call.  They are only
+ * passed on once the call succeeds, since a range which fails is searched
+ * again on the CPU, which would report them a second time. */
+struct wc_miner_held {
+        struct wc_miner *miner;
+        wc_mining_solution_t *sols;
+        size_t count;
+        size_t cap;
+        int failed; /* out of memory */
+};
+
+static int wc_miner_hold(void *arg, const wc_mining_solution_t *sol) {
+        struct wc_miner_held *h = (struct wc_miner_held*)arg;
+        wc_mining_solution_t *sols = NULL;
+        size_t cap = 0;
+        if (h->count == h->cap) {
+                cap = h->cap ? 2 * h->cap : 16;
+                sols = realloc(h->sols, cap * sizeof(wc_mining_solution_t));
+                if (!sols) {
+                        /* Abandon the range to the CPU. */
+                        h->failed = 1;
+                        return 1;
+                }
+                h->sols = sols;
+                h->cap = cap;
+        }
+        h->sols[h->count++] = *sol;
+        return wc_miner_should_stop(h->miner);
+}
+
+static void* wc_miner_thread_main(void *ptr) {
+        struct wc_miner_thread *t = (struct wc_miner_thread*)ptr;
+        struct wc_miner *m = t->miner;
+        struct wc_miner_held held;
+        wc_mining_job_t job;
+        unsigned char nonces[4*WC_MINING_MAX_NONCE_GROUPS] = {0};
+        uint64_t range = 0, first = 0, count = 0, row = 0;
+        wc_error_t e = WC_SUCCESS;
+        size_t i = 0;
+        int stop = 0;
+        WC_STATS_DECL(t0)
+        memset(&held, 0, sizeof(held));
+        held.miner = m;
+        /* The nonce space is cut into ranges of m->rows rows, and each
+         * worker takes every nthreads'th range.  With the CPU a range is a
+         * single row. */
+        wc_mining_job_init_groups(&job, &m->ctx, m->ngroups, nonces, wc_mining_final);
+        for (range = t->index; range < (m->nrows + m->rows - 1) / m->rows; range += m->nthreads) {
+                first = range * m->rows;
+                count = m->nrows - first < m->rows ? m->nrows - first : m->rows;
+                if (m->backend) {
+                        if (wc_miner_should_stop(m)) {
+                                break;
+                        }
+                        held.count = 0;
+                        held.failed = 0;
+                        WC_STATS_START(t0);
+                        e = m->backend->mine(m->dev, &m->ctx, m->ngroups, first, count, m->difficulty, wc_miner_hold, &held);
+                        if (e == WC_SUCCESS && !held.failed) {
+                                /* The CPU backend records its own rows. */
+                                if (m->backend != &wc_backend_cpu_callbacks) {
+                                        WC_STATS_END(WC_STATS_MINING, t0, 1000 * count);
+                                }
+                                for (i = 0; i < held.count && !stop; ++i) {
+                                        stop = wc_miner_found(m, &held.sols[i]);
+                                }
+                                if (stop) {
+                                        break;
+                                }
+                                continue;
+                        }
+                        /* Search what the device could not on the CPU,
+                         * dropping what it reported. */
+                }
+                /* Checking for cancellation once per row (every 1000
+                 * hashes) keeps lock traffic out of the inner loop. */
+                for (row = first; row < first + count && !stop; ++row) {
+                        stop = wc_miner_should_stop(m)
+                            || wc_mine_rows(&job, m->ngroups, row, 1, m->difficulty, m->width, wc_miner_found, m);
+                }
+                if (stop) {
+                        break;
+                }
+        }
+        free(held.sols);
+        return NULL;
+}
+
+static void wc_miner_destroy(struct wc_miner *m, unsigned nstarted) {
+        unsigned i = 0;
+        for (; i < nstarted; ++i) {
+                pthread_join(m->threads[i].thread, NULL);
+        }
+        pthread_mutex_destroy(&m->lock);
+        free(m->threads);
+        free(m);
+}
+
+wc_error_t wc_mine_start(
+        wc_miner_handle_t *miner,
+        const struct sha256_ctx *ctx,
+        unsigned difficulty,
+        unsigned nthreads,
+        wc_mining_callback_t callback,
+        void *arg
+) {
+        return wc_mine_start_groups(miner, ctx, 2, difficulty, nthreads, callback, arg);
+}
+
+wc_error_t wc_mine_start_groups(
+        wc_miner_handle_t *miner,
+        const struct sha256_ctx *ctx,
+        unsigned ngroups,
+        unsigned difficulty,
+        unsigned nthreads,
+        wc_mining_callback_t callback,
+        void *arg
+) {
+        struct wc_miner *m = NULL;
+        uint64_t nrows = 1;
+        unsigned i = 0;
+        if (!miner || !ctx || !callback) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        if (ngroups < 1 || ngroups > WC_MINING_MAX_NONCE_GROUPS) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        for (i = 1; i < ngroups; ++i) {
+                nrows *= 1000;
+        }
+        /* The nonces and padding must make up the final block. */
+        if (ctx->bytes % 64 != 0) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        /* Workers beyond the number of rows would sit idle, but the
+         * limit is kept independent of ngroups for simplicity. */
+        if (nthreads < 1 || nthreads > 1000) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        if (difficulty > 256) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        /* Allocate the mining engine structure. */
+        m = malloc(sizeof(struct wc_miner));
+        if (!m) {
+                return WC_ERROR_OUT_OF_MEMORY;
+        }
+        m->threads = malloc(nthreads * sizeof(struct wc_miner_thread));
+        if (!m->threads) {
+                free(m);
+                return WC_ERROR_OUT_OF_MEMORY;
+        }
+        if (pthread_mutex_init(&m->lock, NULL) != 0) {
+                free(m->threads);
+                free(m);
+                return WC_ERROR_OUT_OF_MEMORY;
+        }
+        /* Initialize the mining engine structure. */
+        m->ctx = *ctx;
+        m->ngroups = ngroups;
+        m->nrows = nrows;
+        m->difficulty = difficulty;
+        m->width = (int)wc_mining_width;
+        m->backend = wc_backend && wc_backend->mine ? wc_backend : NULL;
+        m->dev = wc_backend_dev;
+        m->rows = m->backend ? wc_backend_rows : 1;
+        m->callback = callback;
+        m->arg = arg;
+        m->stop = 0;
+        m->nthreads = nthreads;
+        /* Launch the workers. */
+        for (i = 0; i < nthreads; ++i) {
+                m->threads[i].miner = m;
+                m->threads[i].index = i;
+                if (pthread_create(&m->threads[i].thread, NULL, wc_miner_thread_main, &m->threads[i]) != 0) {
+                        pthread_mutex_lock(&m->lock);
+                        m->stop = 1;
+                        pthread_mutex_unlock(&m->lock);
+                        wc_miner_destroy(m, i);
+                        return WC_ERROR_THREAD_FAILED;
+                }
+        }
+        /* Return the mining engine structure. */
+        *miner = m;
+        return WC_SUCCESS;
+}
+
+wc_error_t wc_mine_wait(wc_miner_handle_t m) {
+        if (!m) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        wc_miner_destroy(m, m->nthreads);
+        return WC_SUCCESS;
+}
+
+wc_error_t wc_mine_stop(wc_miner_handle_t m) {
+        if (!m) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        pthread_mutex_lock(&m->lock);
+        m->stop = 1;
+        pthread_mutex_unlock(&m->lock);
+        wc_miner_destroy(m, m->nthreads);
+        return WC_SUCCESS;
+}
+
+/* The mine callback of wc_backend_cpu_callbacks. */
+static wc_error_t wc_backend_cpu_mine(
+        wc_device_handle_t dev,
+        const struct sha256_ctx *ctx,
+        unsigned ngroups,
+        uint64_t first,
+        uint64_t count,
+        unsigned difficulty,
+        wc_mining_callback_t found,
+        void *arg
+) {
+        wc_mining_job_t job;
+        unsigned char nonces[4*WC_MINING_MAX_NONCE_GROUPS] = {0};
+        (void)dev;
+        if (!ctx || !found || difficulty > 256) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        if (wc_mining_job_init_groups(&job, ctx, ngroups, nonces, wc_mining_final) != WC_SUCCESS) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        wc_mine_rows(&job, ngroups, first, count, difficulty, (int)wc_mining_width, found, arg);
+        return WC_SUCCESS;
 }
 
 wc_error_t wc_derive_serial(
@@ -658,7 +2006,7 @@ wc_error_t wc_derive_serial(
                 /* prevent memory leaks */
                 bdestroy(*bstr);
         }
-        *bstr = blk2bstr(buf, 64);
+        *bstr = wc_bstr_from_blk(buf, 64);
         wc_memory_cleanse(buf, 64);
         if (*bstr == NULL) {
                 return WC_ERROR_OUT_OF_MEMORY;
@@ -666,19 +2014,134 @@ wc_error_t wc_derive_serial(
         return WC_SUCCESS;
 }
 
-void wc_derive_serials(
+#if defined(__SSE2__)
+/* Encode 16 bytes as 32 lowercase hex digits.  All of in is read before out
+ * is written, so the two may overlap as wc_hex_encode allows. */
+static void wc_hex_encode_sse2(
+        char out[32],
+        const unsigned char in[16]
+) {
+        const __m128i nibble = _mm_set1_epi8(0x0f);
+        __m128i v, hi, lo;
+        v = _mm_loadu_si128((const __m128i*)in);
+        hi = _mm_and_si128(_mm_srli_epi16(v, 4), nibble);
+        lo = _mm_and_si128(v, nibble);
+        /* Digits above 9 become 'a'-'f', which follow '9' in ASCII after a
+         * gap of 39 characters. */
+        hi = _mm_add_epi8(_mm_add_epi8(hi, _mm_set1_epi8('0')),
+                          _mm_and_si128(_mm_cmpgt_epi8(hi, _mm_set1_epi8(9)), _mm_set1_epi8(39)));
+        lo = _mm_add_epi8(_mm_add_epi8(lo, _mm_set1_epi8('0')),
+                          _mm_and_si128(_mm_cmpgt_epi8(lo, _mm_set1_epi8(9)), _mm_set1_epi8(39)));
+        _mm_storeu_si128((__m128i*)out, _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128((__m128i*)(out + 16), _mm_unpackhi_epi8(hi, lo));
+}
+#endif
+
+void wc_hex_encode(
         char out[],
+        const unsigned char in[],
+        size_t n
+) {
+        size_t m = 0; /* bytes left to the vector path */
+#if defined(__SSE2__)
+        m = n - n % 16;
+#endif
+        /* Working from the end allows out to alias in, since each output
+         * pair lies at or beyond the input byte it encodes.  The vector
+         * path keeps to this order a block at a time. */
+        for (; n > m; --n) {
+                memcpy(out + 2*(n - 1), hexpairs + 2*in[n - 1], 2);
+        }
+#if defined(__SSE2__)
+        for (; n > 0; n -= 16) {
+                wc_hex_encode_sse2(out + 2*(n - 16), in + n - 16);
+        }
+#endif
+}
+
+#if defined(__SSE2__)
+/* Decode 32 hex digits to 16 bytes.  Returns non-zero if any character is
+ * not a hex digit, and sets *upper if any are uppercase. */
+static int wc_hex_decode_sse2(
+        unsigned char out[16],
+        int *upper,
+        const char in[32]
+) {
+        const __m128i zero = _mm_setzero_si128();
+        __m128i v[2], lower, digit, alpha, caps, val, pairs[2];
+        int bad = 0, i = 0;
+        for (; i < 2; ++i) {
+                v[i] = _mm_loadu_si128((const __m128i*)(in + 16*i));
+                /* Signed comparisons also reject bytes >= 0x80. */
+                digit = _mm_and_si128(_mm_cmpgt_epi8(v[i], _mm_set1_epi8('0' - 1)),
+                                      _mm_cmplt_epi8(v[i], _mm_set1_epi8('9' + 1)));
+                lower = _mm_or_si128(v[i], _mm_set1_epi8(0x20));
+                alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                                      _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+                caps = _mm_and_si128(alpha, _mm_cmpeq_epi8(_mm_and_si128(v[i], _mm_set1_epi8(0x20)), zero));
+                bad |= ~_mm_movemask_epi8(_mm_or_si128(digit, alpha)) & 0xffff;
+                *upper |= _mm_movemask_epi8(caps) != 0;
+                /* Nibble values: c - '0' for digits, (c | 0x20) - 'a' + 10
+                 * for letters. */
+                val = _mm_or_si128(_mm_and_si128(digit, _mm_sub_epi8(v[i], _mm_set1_epi8('0'))),
+                                   _mm_and_si128(alpha, _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10))));
+                /* Each 16-bit lane holds the high nibble in its low byte and
+                 * the low nibble in its high byte (little-endian). */
+                pairs[i] = _mm_or_si128(_mm_and_si128(_mm_slli_epi16(val, 4), _mm_set1_epi16(0x00f0)),
+                                        _mm_srli_epi16(val, 8));
+        }
+        _mm_storeu_si128((__m128i*)out, _mm_packus_epi16(pairs[0], pairs[1]));
+        return bad;
+}
+#endif
+
+wc_error_t wc_hex_decode(
+        unsigned char out[],
+        int *noncanonical,
+        const char in[],
+        size_t n
+) {
+        unsigned char hi = 0, lo = 0;
+        int upper = 0;
+        size_t i = 0;
+#if defined(__SSE2__)
+        for (; i + 16 <= n; i += 16) {
+                if (wc_hex_decode_sse2(out + i, &upper, in + 2*i)) {
+                        return WC_ERROR_INVALID_ARGUMENT;
+                }
+        }
+#endif
+        for (; i < n; ++i) {
+                hi = hexdigit_to_int(in[2*i]);
+                lo = hexdigit_to_int(in[2*i + 1]);
+                if ((hi | lo) > 15) {
+                        return WC_ERROR_INVALID_ARGUMENT;
+                }
+                upper |= (in[2*i] >= 'A' && in[2*i] <= 'F')
+                       | (in[2*i + 1] >= 'A' && in[2*i + 1] <= 'F');
+                out[i] = (unsigned char)(hi << 4 | lo);
+        }
+        if (noncanonical) {
+                *noncanonical = upper;
+        }
+        return WC_SUCCESS;
+}
+
+static void wc_derive_serials_impl(
+        unsigned char *out,
         const struct sha256 *root,
         uint64_t chaincode,
         uint64_t depth,
-        size_t count
+        size_t count,
+        int hex
 ) {
         unsigned char blocks[8*64] = {0};
-        size_t n = 0, m = 0;
-        int i = 0;
+        size_t n = 0, m = 0, total = count;
+        WC_STATS_DECL(t0)
         if (count == 0) {
                 return;
         }
+        WC_STATS_START(t0);
         for (n = 0; n < (count < 8 ? count : 8); ++n) {
                 memcpy(   blocks + 64*n +  0, root->u8, 32);
                 WriteBE64(blocks + 64*n + 32, chaincode);
@@ -708,11 +2171,10 @@ void wc_derive_serials(
         case 1:         WriteBE64(blocks + 64*0 + 40, depth + 0);
                         m = (count - 1) % 8 + 1; /* count % 8, but with 0 mod 8 becoming 8 */
                         sha256_midstate((struct sha256*)out, webcashwalletv1_midstate.s, blocks, m);
-                        for (i = m*32 - 1; i >= 0; --i) {
-                                out[2*i + 1] = hexdigits[(out[i] >> 0) & 0x0f];
-                                out[2*i + 0] = hexdigits[(out[i] >> 4) & 0x0f];
+                        if (hex) {
+                                wc_hex_encode((char*)out, out, m*32);
                         }
-                        out += m*64;
+                        out += hex ? m*64 : m*32;
                         depth += m;
                         count -= m;
                 } while (count > 0);
@@ -720,20 +2182,685 @@ void wc_derive_serials(
         while (n) {
                 wc_memory_cleanse(blocks + 64*(--n), 48);
         }
+        WC_STATS_END(WC_STATS_DERIVE, t0, total);
+        (void)total;
 }
 
-struct wc_storage {
-        const struct wc_storage_callbacks* cb;
-        wc_db_handle_t db; /* the main wallet database */
-        wc_log_handle_t log; /* append-only recovery log */
-};
-
-wc_error_t wc_storage_open(
-        wc_storage_handle_t *storage,
-        const wc_storage_callbacks_t *callbacks,
-        wc_log_url_t logurl,
-        wc_db_url_t dburl
-) {
+/* Hand a derivation to the selected backend, if it is large enough to be
+ * worth the transfer.  Returns non-zero if the backend produced the output,
+ * or zero if it is left to the CPU. */
+static int wc_backend_derive(
+        struct sha256 *out,
+        const struct sha256 *root,
+        uint64_t chaincode,
+        uint64_t depth,
+        size_t count,
+        int publics
+) {
+        wc_error_t e = WC_ERROR_INVALID_ARGUMENT;
+        WC_STATS_DECL(t0)
+        if (!wc_backend || count < wc_backend_min_derive) {
+                return 0;
+        }
+        WC_STATS_START(t0);
+        if (publics && wc_backend->derive_publics) {
+                e = wc_backend->derive_publics(wc_backend_dev, out, root, chaincode, depth, count);
+        } else if (!publics && wc_backend->derive_serials) {
+                e = wc_backend->derive_serials(wc_backend_dev, out, root, chaincode, depth, count);
+        }
+        if (e != WC_SUCCESS) {
+                return 0;
+        }
+        WC_STATS_END(WC_STATS_DERIVE, t0, count);
+        return 1;
+}
+
+/* As wc_backend_derive, for hex-encoded serials.  The device writes into a
+ * buffer of its own, as the hex buffer need not be aligned for struct
+ * sha256. */
+static int wc_backend_derive_hex(
+        char *out,
+        const struct sha256 *root,
+        uint64_t chaincode,
+        uint64_t depth,
+        size_t count
+) {
+        struct sha256 *raw = NULL;
+        int done = 0;
+        if (!wc_backend || !wc_backend->derive_serials || count < wc_backend_min_derive) {
+                return 0;
+        }
+        raw = malloc(count * sizeof(struct sha256));
+        if (!raw) {
+                return 0;
+        }
+        done = wc_backend_derive(raw, root, chaincode, depth, count, 0);
+        if (done) {
+                wc_hex_encode(out, raw[0].u8, count*32);
+        }
+        wc_memory_cleanse(raw, count * sizeof(struct sha256));
+        free(raw);
+        return done;
+}
+
+void wc_derive_serials(
+        char out[],
+        const struct sha256 *root,
+        uint64_t chaincode,
+        uint64_t depth,
+        size_t count
+) {
+        if (wc_backend_derive_hex(out, root, chaincode, depth, count)) {
+                return;
+        }
+        wc_derive_serials_impl((unsigned char*)out, root, chaincode, depth, count, 1);
+}
+
+void wc_derive_serials_raw(
+        struct sha256 out[],
+        const struct sha256 *root,
+        uint64_t chaincode,
+        uint64_t depth,
+        size_t count
+) {
+        if (wc_backend_derive(out, root, chaincode, depth, count, 0)) {
+                return;
+        }
+        wc_derive_serials_impl((unsigned char*)out, root, chaincode, depth, count, 0);
+}
+
+static void wc_derive_publics_cpu(
+        struct sha256 out[],
+        const struct sha256 *root,
+        uint64_t chaincode,
+        uint64_t depth,
+        size_t count
+) {
+        struct sha256 secrets[8];
+        unsigned char blocks[8*64];
+        size_t n = 0, i = 0;
+        /* A public hash is the SHA-256 of the 64-character hex serial. */
+        for (; count > 0; count -= n) {
+                n = count < 8 ? count : 8;
+                wc_derive_serials_impl(secrets[0].u8, root, chaincode, depth, n, 0);
+                for (i = 0; i < n; ++i) {
+                        wc_hex_encode((char*)blocks + 64*i, secrets[i].u8, 32);
+                }
+                wc_sha256_64bytes(out, blocks, n);
+                out += n;
+                depth += n;
+        }
+        wc_memory_cleanse(secrets, sizeof(secrets));
+        wc_memory_cleanse(blocks, sizeof(blocks));
+}
+
+void wc_derive_publics(
+        struct sha256 out[],
+        const struct sha256 *root,
+        uint64_t chaincode,
+        uint64_t depth,
+        size_t count
+) {
+        if (wc_backend_derive(out, root, chaincode, depth, count, 1)) {
+                return;
+        }
+        wc_derive_publics_cpu(out, root, chaincode, depth, count);
+}
+
+struct wc_derive_slice {
+        pthread_t thread;
+        char *out;
+        const struct sha256 *root;
+        uint64_t chaincode;
+        uint64_t start;
+        size_t count;
+};
+
+static void* wc_derive_slice_main(void *ptr) {
+        struct wc_derive_slice *s = (struct wc_derive_slice*)ptr;
+        wc_derive_serials(s->out, s->root, s->chaincode, s->start, s->count);
+        return NULL;
+}
+
+wc_error_t wc_derive_serials_mt(
+        char out[],
+        const struct sha256 *root,
+        uint64_t chaincode,
+        uint64_t start,
+        size_t count,
+        unsigned nthreads
+) {
+        struct wc_derive_slice *slices = NULL;
+        size_t batches = 0, per = 0, off = 0;
+        unsigned i = 0, nstarted = 0;
+        if ((!out && count) || !root || nthreads < 1) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        /* An offloaded derivation is parallel already. */
+        if (wc_backend_derive_hex(out, root, chaincode, start, count)) {
+                return WC_SUCCESS;
+        }
+        /* Slices are whole batches of 8 secrets, so there is no point in
+         * having more threads than batches. */
+        batches = (count + 7) / 8;
+        if (nthreads > batches) {
+                nthreads = (unsigned)batches;
+        }
+        if (nthreads <= 1) {
+                wc_derive_serials(out, root, chaincode, start, count);
+                return WC_SUCCESS;
+        }
+        slices = malloc(nthreads * sizeof(struct wc_derive_slice));
+        if (!slices) {
+                wc_derive_serials(out, root, chaincode, start, count);
+                return WC_SUCCESS;
+        }
+        per = 8 * ((batches + nthreads - 1) / nthreads);
+        for (i = 0; i < nthreads && off < count; ++i) {
+                slices[i].out = out + 64*off;
+                slices[i].root = root;
+                slices[i].chaincode = chaincode;
+                slices[i].start = start + off;
+                slices[i].count = count - off < per ? count - off : per;
+                off += slices[i].count;
+        }
+        nthreads = i;
+        /* The calling thread derives the first slice itself.  If a worker
+         * cannot be started, its slice and all following ones are derived
+         * here as well. */
+        for (i = 1; i < nthreads; ++i) {
+                if (pthread_create(&slices[i].thread, NULL, wc_derive_slice_main, &slices[i]) != 0) {
+                        break;
+                }
+        }
+        nstarted = i;
+        wc_derive_slice_main(&slices[0]);
+        for (; i < nthreads; ++i) {
+                wc_derive_slice_main(&slices[i]);
+        }
+        for (i = 1; i < nstarted; ++i) {
+                pthread_join(slices[i].thread, NULL);
+        }
+        free(slices);
+        return WC_SUCCESS;
+}
+
+static wc_error_t wc_backend_cpu_derive_serials(
+        wc_device_handle_t dev,
+        struct sha256 *out,
+        const struct sha256 *root,
+        uint64_t chaincode,
+        uint64_t start,
+        size_t count
+) {
+        (void)dev;
+        if ((!out && count) || !root) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        wc_derive_serials_impl((unsigned char*)out, root, chaincode, start, count, 0);
+        return WC_SUCCESS;
+}
+
+static wc_error_t wc_backend_cpu_derive_publics(
+        wc_device_handle_t dev,
+        struct sha256 *out,
+        const struct sha256 *root,
+        uint64_t chaincode,
+        uint64_t start,
+        size_t count
+) {
+        (void)dev;
+        if ((!out && count) || !root) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        wc_derive_publics_cpu(out, root, chaincode, start, count);
+        return WC_SUCCESS;
+}
+
+const wc_backend_callbacks_t wc_backend_cpu_callbacks = {
+        wc_backend_cpu_mine,
+        wc_backend_cpu_derive_serials,
+        wc_backend_cpu_derive_publics
+};
+
+wc_error_t wc_backend_use(
+        const wc_backend_callbacks_t *callbacks,
+        wc_device_handle_t dev,
+        const wc_backend_params_t *params
+) {
+        /* The CPU is run directly, without going through callbacks. */
+        wc_backend = callbacks == &wc_backend_cpu_callbacks ? NULL : callbacks;
+        wc_backend_dev = dev;
+        wc_backend_rows = params && params->mining_rows ? params->mining_rows : 1;
+        wc_backend_min_derive = params && params->min_derive ? params->min_derive : 4096;
+        return WC_SUCCESS;
+}
+
+/* Appended records which have not been written by the time the buffer
+ * reaches this size are flushed by the appender, whatever the policy. */
+#define WC_LOG_BUFFER_LIMIT (1 << 20)
+
+/* Recovery log file format.  All integers are little-endian.
+ *
+ * The log is a sequence of blocks, one per group commit:
+ *
+ *     "WCLB"  u32 count  u8 check[24]  count x u8 record[WC_LOG_RECORD_SIZE]
+ *
+ * where check is the first 24 bytes of SHA-256(count || records), and each
+ * record is a u16 payload length followed by the payload and zero padding.
+ * Each time the log is closed cleanly, a footer indexing the blocks written
+ * since it was opened (the segment) is appended:
+ *
+ *     "WCLF"  u32 n  u8 check[24]  n x (u64 offset, u64 count)
+ *     u64 seglen  u32 n  "WCLE"
+ *
+ * where offsets are relative to the start of the segment, seglen is the
+ * number of bytes of blocks in the segment, and check covers n and the
+ * entries.  A reader can therefore walk from the end of the file back
+ * through the chain of footers without touching any record data, and falls
+ * back on hopping from block header to block header if the last segment was
+ * not closed cleanly. */
+#define WC_LOG_HEADER_SIZE 32
+#define WC_LOG_TRAILER_SIZE 16
+#define WC_LOG_ENTRY_SIZE 16
+
+static void wc_le32_write(unsigned char *p, uint32_t x) {
+        p[0] = (unsigned char)x;
+        p[1] = (unsigned char)(x >> 8);
+        p[2] = (unsigned char)(x >> 16);
+        p[3] = (unsigned char)(x >> 24);
+}
+
+static void wc_le64_write(unsigned char *p, uint64_t x) {
+        wc_le32_write(p, (uint32_t)x);
+        wc_le32_write(p + 4, (uint32_t)(x >> 32));
+}
+
+static uint32_t wc_le32_read(const unsigned char *p) {
+        return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t wc_le64_read(const unsigned char *p) {
+        return (uint64_t)wc_le32_read(p) | ((uint64_t)wc_le32_read(p + 4) << 32);
+}
+
+/* Fill in a block or footer header for the n items in body. */
+static void wc_log_header(
+        unsigned char out[WC_LOG_HEADER_SIZE],
+        const char magic[4],
+        uint32_t n,
+        const unsigned char *body,
+        size_t len
+) {
+        struct sha256_ctx ctx = SHA256_INIT;
+        struct sha256 hash;
+        memcpy(out, magic, 4);
+        wc_le32_write(out + 4, n);
+        sha256_update(&ctx, out + 4, 4);
+        sha256_update(&ctx, body, len);
+        sha256_done(&hash, &ctx);
+        memcpy(out + 8, hash.u8, WC_LOG_HEADER_SIZE - 8);
+}
+
+static int wc_log_header_check(
+        const unsigned char header[WC_LOG_HEADER_SIZE],
+        const unsigned char *body,
+        size_t len
+) {
+        unsigned char expected[WC_LOG_HEADER_SIZE];
+        wc_log_header(expected, (const char*)header, wc_le32_read(header + 4), body, len);
+        return !memcmp(expected, header, WC_LOG_HEADER_SIZE);
+}
+
+/* Buffered writer for the recovery log, with group commit.  Records are
+ * appended to buf under the lock.  Whichever thread next needs the log to be
+ * durable becomes the leader: it swaps buf with spare, releases the lock,
+ * and writes and syncs everything that had been appended, on behalf of every
+ * thread waiting.  Appends arriving meanwhile accumulate in the new buf for
+ * the next leader, so at most one write and one sync are in flight, and each
+ * covers as many records as arrived during the previous one. */
+struct wc_log_writer {
+        pthread_mutex_t lock; /* guards everything below */
+        pthread_cond_t done; /* signalled when a leader finishes */
+        pthread_cond_t wake; /* wakes the interval flusher */
+        wc_log_sync_t policy;
+        unsigned interval_ms;
+        unsigned char *buf; /* appended, not yet being written */
+        size_t len, cap;
+        unsigned char *spare; /* being written by the leader */
+        size_t sparecap;
+        uint64_t appended; /* total records appended */
+        uint64_t durable; /* total records written and synced */
+        uint64_t written; /* bytes of blocks written this segment */
+        unsigned char *index; /* footer entries for this segment */
+        size_t nindex, indexcap;
+        int noindex; /* index allocation failed; write no footer */
+        int flushing; /* a leader is writing spare */
+        wc_error_t error; /* sticky write or sync failure */
+        int running; /* the interval flusher is running */
+        int stop; /* asks the interval flusher to exit */
+        pthread_t thread;
+};
+
+/* Open-addressing hash table of wallet outputs, keyed by public hash.  The
+ * keys are SHA-256 outputs and so already uniformly distributed: the first
+ * eight bytes are used directly as the hash, with linear probing.  Entries
+ * are never removed (spending only sets a flag), and the table is kept at
+ * most half full. */
+struct wc_output_entry {
+        struct sha256 hash;
+        wc_amount_t amount;
+        uint64_t chaincode;
+        uint64_t depth;
+        unsigned char used;
+        unsigned char derived;
+        unsigned char spent;
+};
+
+struct wc_output_index {
+        struct wc_output_entry *slots;
+        size_t mask; /* capacity - 1, capacity a power of 2 */
+        size_t count;
+};
+
+static size_t wc_output_slot(const struct wc_output_index *idx, const struct sha256 *hash) {
+        uint64_t h = 0;
+        memcpy(&h, hash->u8, sizeof(h));
+        return (size_t)h & idx->mask;
+}
+
+static struct wc_output_entry* wc_output_find(
+        const struct wc_output_index *idx,
+        const struct sha256 *hash
+) {
+        size_t i = 0;
+        if (!idx->slots) {
+                return NULL;
+        }
+        for (i = wc_output_slot(idx, hash); idx->slots[i].used; i = (i + 1) & idx->mask) {
+                if (!memcmp(idx->slots[i].hash.u8, hash->u8, sizeof(hash->u8))) {
+                        return &idx->slots[i];
+                }
+        }
+        return NULL;
+}
+
+/* Returns the entry for hash, inserting an unused-in-all-but-key entry if
+ * absent, or NULL on allocation failure. */
+static struct wc_output_entry* wc_output_insert(
+        struct wc_output_index *idx,
+        const struct sha256 *hash
+) {
+        struct wc_output_entry *slots = NULL, *old = idx->slots;
+        size_t cap = 0, oldcap = old ? idx->mask + 1 : 0, i = 0, j = 0;
+        if (2 * (idx->count + 1) > oldcap) {
+                cap = oldcap ? 2 * oldcap : 64;
+                slots = calloc(cap, sizeof(struct wc_output_entry));
+                if (!slots) {
+                        return NULL;
+                }
+                idx->slots = slots;
+                idx->mask = cap - 1;
+                for (i = 0; i < oldcap; ++i) {
+                        if (old[i].used) {
+                                for (j = wc_output_slot(idx, &old[i].hash); slots[j].used; j = (j + 1) & idx->mask) {
+                                }
+                                slots[j] = old[i];
+                        }
+                }
+                free(old);
+        }
+        for (i = wc_output_slot(idx, hash); idx->slots[i].used; i = (i + 1) & idx->mask) {
+                if (!memcmp(idx->slots[i].hash.u8, hash->u8, sizeof(hash->u8))) {
+                        return &idx->slots[i];
+                }
+        }
+        memset(&idx->slots[i], 0, sizeof(struct wc_output_entry));
+        idx->slots[i].hash = *hash;
+        idx->slots[i].used = 1;
+        ++idx->count;
+        return &idx->slots[i];
+}
+
+static int wc_output_put(struct wc_output_index *idx, const wc_db_secret_t *secret, int spent) {
+        struct wc_output_entry *e = wc_output_insert(idx, &secret->hash);
+        if (!e) {
+                return 0;
+        }
+        e->amount = secret->secret.amount;
+        e->derived = !!secret->derived;
+        e->chaincode = secret->derived ? secret->chaincode : 0;
+        e->depth = secret->derived ? secret->depth : 0;
+        e->spent = !!spent;
+        return 1;
+}
+
+static void wc_output_clear(struct wc_output_index *idx) {
+        free(idx->slots);
+        idx->slots = NULL;
+        idx->mask = 0;
+        idx->count = 0;
+}
+
+struct wc_storage {
+        const struct wc_storage_callbacks* cb;
+        wc_db_handle_t db; /* the main wallet database */
+        wc_log_handle_t log; /* append-only recovery log */
+        int txn; /* non-zero while a transaction is open */
+        struct wc_log_writer lw;
+        struct wc_output_index outputs;
+        int indexed; /* outputs mirrors the database */
+};
+
+static int wc_storage_index_visit(void *arg, const wc_db_secret_t *secret, int spent) {
+        struct wc_storage *w = (struct wc_storage*)arg;
+        if (!wc_output_put(&w->outputs, secret, spent)) {
+                w->indexed = -1; /* out of memory */
+                return 1;
+        }
+        return 0;
+}
+
+/* (Re)load the output index from the database, if it is not current.  A
+ * database which cannot enumerate its secrets has no index, and an empty
+ * one would wrongly report its outputs as absent. */
+static wc_error_t wc_storage_index_load(struct wc_storage *w) {
+        wc_error_t e = WC_SUCCESS;
+        WC_STATS_DECL(t0)
+        if (w->indexed) {
+                return WC_SUCCESS;
+        }
+        if (!w->db) {
+                return WC_ERROR_DB_CLOSED;
+        }
+        if (!w->cb || !w->cb->each_secret) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        wc_output_clear(&w->outputs);
+        WC_STATS_START(t0);
+        e = w->cb->each_secret(w->db, wc_storage_index_visit, w);
+        WC_STATS_END(WC_STATS_STORAGE, t0, 1);
+        if (e == WC_SUCCESS && w->indexed < 0) {
+                e = WC_ERROR_OUT_OF_MEMORY;
+        }
+        if (e != WC_SUCCESS) {
+                wc_output_clear(&w->outputs);
+                w->indexed = 0;
+                return e;
+        }
+        w->indexed = 1;
+        return WC_SUCCESS;
+}
+
+/* Called and returns with w->lw.lock held.  Waits until everything up to
+ * target has been made durable, leading the write itself if no other thread
+ * is already doing so. */
+static wc_error_t wc_log_writer_sync(struct wc_storage *w, uint64_t target) {
+        struct wc_log_writer *lw = &w->lw;
+        wc_error_t e = WC_SUCCESS;
+        unsigned char *data = NULL, *index = NULL;
+        unsigned char header[WC_LOG_HEADER_SIZE];
+        size_t len = 0, cap = 0;
+        uint64_t upto = 0;
+        WC_STATS_DECL(t0)
+        while (lw->error == WC_SUCCESS && lw->durable < target) {
+                if (lw->flushing) {
+                        pthread_cond_wait(&lw->done, &lw->lock);
+                        continue;
+                }
+                /* Take everything appended so far, by every thread. */
+                data = lw->buf;
+                len = lw->len;
+                cap = lw->cap;
+                upto = lw->appended;
+                lw->buf = lw->spare;
+                lw->cap = lw->sparecap;
+                lw->len = 0;
+                lw->flushing = 1;
+                pthread_mutex_unlock(&lw->lock);
+                WC_STATS_START(t0);
+                e = WC_SUCCESS;
+                if (len) {
+                        wc_log_header(header, "WCLB", (uint32_t)(len / WC_LOG_RECORD_SIZE), data, len);
+                        e = w->cb->log_write(w->log, header, sizeof(header));
+                        if (e == WC_SUCCESS) {
+                                e = w->cb->log_write(w->log, data, len);
+                        }
+                }
+                if (e == WC_SUCCESS && w->cb->log_sync) {
+                        e = w->cb->log_sync(w->log);
+                }
+                WC_STATS_END(WC_STATS_LOG, t0, len / WC_LOG_RECORD_SIZE);
+                pthread_mutex_lock(&lw->lock);
+                lw->spare = data;
+                lw->sparecap = cap;
+                lw->flushing = 0;
+                if (e == WC_SUCCESS && len) {
+                        if (!lw->noindex && lw->nindex == lw->indexcap) {
+                                cap = lw->indexcap ? 2 * lw->indexcap : 64;
+                                index = realloc(lw->index, cap * WC_LOG_ENTRY_SIZE);
+                                if (index) {
+                                        lw->index = index;
+                                        lw->indexcap = cap;
+                                } else {
+                                        lw->noindex = 1;
+                                }
+                        }
+                        if (!lw->noindex) {
+                                index = lw->index + lw->nindex++ * WC_LOG_ENTRY_SIZE;
+                                wc_le64_write(index, lw->written);
+                                wc_le64_write(index + 8, len / WC_LOG_RECORD_SIZE);
+                        }
+                        lw->written += sizeof(header) + len;
+                }
+                if (e == WC_SUCCESS) {
+                        lw->durable = upto;
+                } else {
+                        lw->error = e;
+                }
+                pthread_cond_broadcast(&lw->done);
+        }
+        return lw->error;
+}
+
+static void* wc_log_writer_main(void *arg) {
+        struct wc_storage *w = (struct wc_storage*)arg;
+        struct wc_log_writer *lw = &w->lw;
+        struct timespec deadline;
+        pthread_mutex_lock(&lw->lock);
+        while (!lw->stop) {
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_sec += lw->interval_ms / 1000;
+                deadline.tv_nsec += (long)(lw->interval_ms % 1000) * 1000000L;
+                if (deadline.tv_nsec >= 1000000000L) {
+                        deadline.tv_sec += 1;
+                        deadline.tv_nsec -= 1000000000L;
+                }
+                pthread_cond_timedwait(&lw->wake, &lw->lock, &deadline);
+                if (lw->appended > lw->durable) {
+                        wc_log_writer_sync(w, lw->appended);
+                }
+        }
+        pthread_mutex_unlock(&lw->lock);
+        return NULL;
+}
+
+/* Stops the interval flusher, if running.  Called without the lock held. */
+static void wc_log_writer_stop(struct wc_storage *w) {
+        struct wc_log_writer *lw = &w->lw;
+        int running = 0;
+        pthread_mutex_lock(&lw->lock);
+        running = lw->running;
+        lw->stop = 1;
+        lw->running = 0;
+        pthread_cond_signal(&lw->wake);
+        pthread_mutex_unlock(&lw->lock);
+        if (running) {
+                pthread_join(lw->thread, NULL);
+        }
+}
+
+static wc_error_t wc_log_writer_init(struct wc_log_writer *lw) {
+        memset(lw, 0, sizeof(*lw));
+        if (pthread_mutex_init(&lw->lock, NULL) != 0) {
+                return WC_ERROR_OUT_OF_MEMORY;
+        }
+        if (pthread_cond_init(&lw->done, NULL) != 0) {
+                pthread_mutex_destroy(&lw->lock);
+                return WC_ERROR_OUT_OF_MEMORY;
+        }
+        if (pthread_cond_init(&lw->wake, NULL) != 0) {
+                pthread_cond_destroy(&lw->done);
+                pthread_mutex_destroy(&lw->lock);
+                return WC_ERROR_OUT_OF_MEMORY;
+        }
+        lw->policy = WC_LOG_SYNC_RECORD;
+        lw->error = WC_SUCCESS;
+        return WC_SUCCESS;
+}
+
+static void wc_log_writer_destroy(struct wc_log_writer *lw) {
+        pthread_cond_destroy(&lw->wake);
+        pthread_cond_destroy(&lw->done);
+        pthread_mutex_destroy(&lw->lock);
+        free(lw->buf);
+        free(lw->spare);
+        free(lw->index);
+        lw->buf = lw->spare = lw->index = NULL;
+}
+
+/* Writes the footer indexing this segment.  Called with the lock held once
+ * everything appended has been made durable. */
+static void wc_log_writer_footer(struct wc_storage *w) {
+        struct wc_log_writer *lw = &w->lw;
+        unsigned char header[WC_LOG_HEADER_SIZE];
+        unsigned char trailer[WC_LOG_TRAILER_SIZE];
+        wc_error_t e = WC_SUCCESS;
+        if (lw->error != WC_SUCCESS || lw->noindex || !lw->nindex || lw->nindex > UINT32_MAX) {
+                return;
+        }
+        wc_log_header(header, "WCLF", (uint32_t)lw->nindex, lw->index, lw->nindex * WC_LOG_ENTRY_SIZE);
+        wc_le64_write(trailer, lw->written);
+        wc_le32_write(trailer + 8, (uint32_t)lw->nindex);
+        memcpy(trailer + 12, "WCLE", 4);
+        e = w->cb->log_write(w->log, header, sizeof(header));
+        if (e == WC_SUCCESS) {
+                e = w->cb->log_write(w->log, lw->index, lw->nindex * WC_LOG_ENTRY_SIZE);
+        }
+        if (e == WC_SUCCESS) {
+                e = w->cb->log_write(w->log, trailer, sizeof(trailer));
+        }
+        if (e == WC_SUCCESS && w->cb->log_sync) {
+                w->cb->log_sync(w->log);
+        }
+}
+
+wc_error_t wc_storage_open(
+        wc_storage_handle_t *storage,
+        const wc_storage_callbacks_t *callbacks,
+        wc_log_url_t logurl,
+        wc_db_url_t dburl
+) {
         wc_storage_handle_t w = NULL;
         /* Must have a way of returning the allocated wallet to the caller. */
         if (!storage) {
@@ -751,8 +2878,16 @@ wc_error_t wc_storage_open(
         }
         /* Initialize the wallet storage structure. */
         w->cb = callbacks;
+        w->txn = 0;
+        memset(&w->outputs, 0, sizeof(w->outputs));
+        w->indexed = 0;
+        if (wc_log_writer_init(&w->lw) != WC_SUCCESS) {
+                free(w);
+                return WC_ERROR_OUT_OF_MEMORY;
+        }
         w->log = callbacks->log_open(logurl);
         if (!w->log) {
+                wc_log_writer_destroy(&w->lw);
                 free(w);
                 return WC_ERROR_LOG_OPEN_FAILED;
         }
@@ -761,6 +2896,7 @@ wc_error_t wc_storage_open(
                 if (callbacks->log_close) {
                         callbacks->log_close(w->log);
                 }
+                wc_log_writer_destroy(&w->lw);
                 free(w);
                 return WC_ERROR_DB_OPEN_FAILED;
         }
@@ -774,22 +2910,51 @@ wc_error_t wc_storage_close(wc_storage_handle_t w) {
                 return WC_ERROR_INVALID_ARGUMENT;
         }
         if (w->db) {
+                /* Uncommitted writes are discarded. */
+                if (w->txn && w->cb && w->cb->rollback) {
+                        w->cb->rollback(w->db);
+                }
+                w->txn = 0;
                 if  (w->cb && w->cb->db_close) {
                         w->cb->db_close(w->db);
                 }
                 w->db = NULL;
         }
         if (w->log) {
+                /* Anything still buffered is written out before closing. */
+                wc_log_writer_stop(w);
+                if (w->cb && w->cb->log_write) {
+                        pthread_mutex_lock(&w->lw.lock);
+                        if (wc_log_writer_sync(w, w->lw.appended) == WC_SUCCESS) {
+                                wc_log_writer_footer(w);
+                        }
+                        pthread_mutex_unlock(&w->lw.lock);
+                }
                 if (w->cb && w->cb->log_close) {
                         w->cb->log_close(w->log);
                 }
                 w->log = NULL;
         }
         w->cb = NULL;
+        wc_output_clear(&w->outputs);
+        wc_log_writer_destroy(&w->lw);
         free(w);
         return WC_SUCCESS;
 }
 
+wc_error_t wc_terms_hash(
+        struct sha256 *out,
+        bstring terms
+) {
+        struct sha256_ctx ctx = SHA256_INIT;
+        if (!out || !terms || terms->slen < 0) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        sha256_update(&ctx, terms->data, (size_t)terms->slen);
+        sha256_done(out, &ctx);
+        return WC_SUCCESS;
+}
+
 wc_error_t wc_storage_enumerate_terms(
         wc_storage_handle_t w,
         wc_terms_t *terms,
@@ -814,172 +2979,1641 @@ wc_error_t wc_storage_enumerate_terms(
         if (e != WC_SUCCESS) {
                 return e;
         }
-        for (i = *count; i > 0;) {
-                --i; /* zero-based indexing */
-                terms[i].text = dbterms[i].text;
-                if (!gmtime_r(&dbterms[i].when, &terms[i].when)) {
-                        for (j = 0; j < i; ++j) {
-                                bdestroy(dbterms[j].text);
-                        }
-                        for (; j < *count; ++j) {
-                                bdestroy(terms[j].text);
-                        }
-                        return WC_ERROR_DB_CORRUPT;
-                }
-        }
+        for (i = *count; i > 0;) {
+                --i; /* zero-based indexing */
+                terms[i].text = dbterms[i].text;
+                if (!gmtime_r(&dbterms[i].when, &terms[i].when)) {
+                        for (j = 0; j < i; ++j) {
+                                bdestroy(dbterms[j].text);
+                        }
+                        for (; j < *count; ++j) {
+                                bdestroy(terms[j].text);
+                        }
+                        return WC_ERROR_DB_CORRUPT;
+                }
+        }
+        return WC_SUCCESS;
+}
+
+wc_error_t wc_storage_count_terms(
+        wc_storage_handle_t w,
+        size_t *count
+) {
+        wc_error_t e = WC_SUCCESS;
+        size_t n = 0;
+        if (!w || !count) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        if (!w->db) {
+                return WC_ERROR_DB_CLOSED;
+        }
+        if (!w->cb) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        if (w->cb->count_terms) {
+                return w->cb->count_terms(w->db, count);
+        }
+        if (!w->cb->all_terms) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        /* A NULL array always reports the required capacity. */
+        e = w->cb->all_terms(w->db, NULL, &n);
+        if (e != WC_SUCCESS && e != WC_ERROR_INSUFFICIENT_CAPACITY) {
+                return e;
+        }
+        *count = n;
+        return WC_SUCCESS;
+}
+
+/* Convert a stored wc_time_t to calendar time in UTC. */
+static wc_error_t wc_time_to_tm(wc_time_t t, struct tm *out) {
+        if (t + WC_TIME_EPOCH < t) {
+                return WC_ERROR_OVERFLOW;
+        }
+        t += WC_TIME_EPOCH;
+        if (!gmtime_r(&t, out)) {
+                return WC_ERROR_DB_CORRUPT;
+        }
+        return WC_SUCCESS;
+}
+
+struct wc_foreach_terms {
+        wc_terms_visitor_t visit;
+        void *arg;
+        wc_error_t error;
+};
+
+static int wc_foreach_terms_visit(void *arg, wc_time_t when, bstring text) {
+        struct wc_foreach_terms *f = (struct wc_foreach_terms*)arg;
+        struct tm tm;
+        f->error = wc_time_to_tm(when, &tm);
+        if (f->error != WC_SUCCESS) {
+                return 1; /* stop */
+        }
+        return f->visit(f->arg, &tm, text);
+}
+
+wc_error_t wc_storage_foreach_terms(
+        wc_storage_handle_t w,
+        wc_terms_visitor_t visit,
+        void *arg
+) {
+        wc_error_t e = WC_SUCCESS;
+        struct wc_foreach_terms f;
+        wc_db_terms_t *terms = NULL;
+        size_t count = 0, i = 0;
+        if (!w || !visit) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        if (!w->db) {
+                return WC_ERROR_DB_CLOSED;
+        }
+        if (!w->cb) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        f.visit = visit;
+        f.arg = arg;
+        f.error = WC_SUCCESS;
+        if (w->cb->each_terms) {
+                e = w->cb->each_terms(w->db, wc_foreach_terms_visit, &f);
+                return e != WC_SUCCESS ? e : f.error;
+        }
+        /* Fall back on a temporary copy of the whole set, retrying in the
+         * unlikely event that terms are accepted between the two calls. */
+        if (!w->cb->all_terms) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        do {
+                free(terms);
+                terms = NULL;
+                e = w->cb->all_terms(w->db, NULL, &count);
+                if (e != WC_SUCCESS && e != WC_ERROR_INSUFFICIENT_CAPACITY) {
+                        return e;
+                }
+                if (!count) {
+                        return WC_SUCCESS;
+                }
+                terms = calloc(count, sizeof(wc_db_terms_t));
+                if (!terms) {
+                        return WC_ERROR_OUT_OF_MEMORY;
+                }
+                e = w->cb->all_terms(w->db, terms, &count);
+        } while (e == WC_ERROR_INSUFFICIENT_CAPACITY);
+        if (e == WC_SUCCESS) {
+                for (i = 0; i < count; ++i) {
+                        if (wc_foreach_terms_visit(&f, terms[i].when, terms[i].text)) {
+                                break;
+                        }
+                }
+                for (i = 0; i < count; ++i) {
+                        bdestroy(terms[i].text);
+                }
+                e = f.error;
+        }
+        free(terms);
+        return e;
+}
+
+wc_error_t wc_storage_have_accepted_terms(
+        wc_storage_handle_t w,
+        int *accepted
+) {
+        if (!w || !accepted) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        if (!w->db) {
+                return WC_ERROR_DB_CLOSED;
+        }
+        if (!w->cb || !w->cb->any_terms) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        return w->cb->any_terms(w->db, accepted);
+}
+
+wc_error_t wc_storage_are_terms_accepted(
+        wc_storage_handle_t w,
+        int *accepted,
+        struct tm *when,
+        bstring terms
+) {
+        wc_error_t e = WC_SUCCESS;
+        time_t t = 0;
+        int found = 0;
+        WC_STATS_DECL(t0)
+        if (!w || !terms || !(accepted || when)) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        if (!w->db) {
+                return WC_ERROR_DB_CLOSED;
+        }
+        if (!w->cb || !w->cb->terms_accepted) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        WC_STATS_START(t0);
+        e = w->cb->terms_accepted(w->db, terms, &t);
+        WC_STATS_END(WC_STATS_STORAGE, t0, 1);
+        if (e != WC_SUCCESS) {
+                return e;
+        }
+        found = (t != 0);
+        if (when && found) {
+                e = wc_time_to_tm(t, when);
+                if (e != WC_SUCCESS) {
+                        return e;
+                }
+        }
+        if (accepted) {
+                *accepted = found;
+        }
+        return WC_SUCCESS;
+}
+
+wc_error_t wc_storage_accept_terms(
+        wc_storage_handle_t w,
+        bstring terms,
+        struct tm *now
+) {
+        wc_error_t e = WC_SUCCESS;
+        time_t t = 0;
+        WC_STATS_DECL(t0)
+        if (!w || !terms) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        if (!w->db) {
+                return WC_ERROR_DB_CLOSED;
+        }
+        if (!w->cb || !w->cb->accept_terms) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        if (now) {
+                t = mktime(now);
+                if (t == (time_t)-1 || t < WC_TIME_EPOCH) {
+                        return WC_ERROR_INVALID_ARGUMENT;
+                }
+        } else {
+                t = time(NULL);
+                if (t == (time_t)-1 || t < WC_TIME_EPOCH) {
+                        /* The only reason time() might fail is integer overflow. */
+                        return WC_ERROR_OVERFLOW;
+                }
+        }
+        t -= WC_TIME_EPOCH;
+        WC_STATS_START(t0);
+        e = w->cb->accept_terms(w->db, terms, t);
+        WC_STATS_END(WC_STATS_STORAGE, t0, 1);
+        return e;
+}
+
+wc_error_t wc_storage_latest_terms(
+        wc_storage_handle_t w,
+        bstring *terms,
+        struct sha256 *hash,
+        struct tm *when
+) {
+        wc_error_t e = WC_SUCCESS;
+        wc_time_t t = 0;
+        WC_STATS_DECL(t0)
+        if (!w || !terms || !hash) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        *terms = NULL;
+        if (!w->db) {
+                return WC_ERROR_DB_CLOSED;
+        }
+        if (!w->cb || !w->cb->latest_terms) {
+                return WC_SUCCESS;
+        }
+        WC_STATS_START(t0);
+        e = w->cb->latest_terms(w->db, terms, hash, &t);
+        WC_STATS_END(WC_STATS_STORAGE, t0, 1);
+        if (e == WC_SUCCESS && *terms && when) {
+                e = wc_time_to_tm(t, when);
+        }
+        if (e != WC_SUCCESS && *terms) {
+                bdestroy(*terms);
+                *terms = NULL;
+        }
+        return e;
+}
+
+wc_error_t wc_storage_begin(wc_storage_handle_t w) {
+        wc_error_t e = WC_SUCCESS;
+        if (!w || !w->cb || w->txn) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        if (!w->db) {
+                return WC_ERROR_DB_CLOSED;
+        }
+        if (w->cb->begin) {
+                e = w->cb->begin(w->db);
+                if (e != WC_SUCCESS) {
+                        return e;
+                }
+        }
+        w->txn = 1;
+        return WC_SUCCESS;
+}
+
+wc_error_t wc_storage_commit(wc_storage_handle_t w) {
+        wc_error_t e = WC_SUCCESS;
+        WC_STATS_DECL(t0)
+        if (!w || !w->cb || !w->txn) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        if (!w->db) {
+                return WC_ERROR_DB_CLOSED;
+        }
+        w->txn = 0;
+        if (w->cb->commit) {
+                WC_STATS_START(t0);
+                e = w->cb->commit(w->db);
+                WC_STATS_END(WC_STATS_STORAGE, t0, 1);
+                if (e != WC_SUCCESS) {
+                        if (w->indexed) {
+                                wc_output_clear(&w->outputs);
+                                w->indexed = 0;
+                        }
+                        if (w->cb->rollback) {
+                                w->cb->rollback(w->db);
+                        }
+                }
+        }
+        return e;
+}
+
+wc_error_t wc_storage_rollback(wc_storage_handle_t w) {
+        if (!w || !w->cb || !w->txn) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        if (!w->db) {
+                return WC_ERROR_DB_CLOSED;
+        }
+        w->txn = 0;
+        /* The output index may hold writes which were just discarded. */
+        if (w->indexed) {
+                wc_output_clear(&w->outputs);
+                w->indexed = 0;
+        }
+        if (w->cb->rollback) {
+                return w->cb->rollback(w->db);
+        }
+        return WC_SUCCESS;
+}
+
+/* Writes made outside of an explicit transaction are wrapped in one of their
+ * own.  Sets *owned if this call opened it, in which case the matching
+ * wc_storage_batch_end commits or rolls back according to e. */
+static wc_error_t wc_storage_batch_begin(wc_storage_handle_t w, int *owned) {
+        wc_error_t e = WC_SUCCESS;
+        *owned = 0;
+        if (!w->txn) {
+                e = wc_storage_begin(w);
+                *owned = (e == WC_SUCCESS);
+        }
+        return e;
+}
+
+static wc_error_t wc_storage_batch_end(wc_storage_handle_t w, int owned, wc_error_t e) {
+        if (!owned) {
+                return e;
+        }
+        if (e != WC_SUCCESS) {
+                wc_storage_rollback(w);
+                return e;
+        }
+        return wc_storage_commit(w);
+}
+
+wc_error_t wc_storage_add_secrets(
+        wc_storage_handle_t w,
+        const wc_db_secret_t secrets[],
+        size_t count
+) {
+        wc_error_t e = WC_SUCCESS;
+        size_t i = 0;
+        int owned = 0;
+        WC_STATS_DECL(t0)
+        if (!w || (!secrets && count)) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        if (!w->db) {
+                return WC_ERROR_DB_CLOSED;
+        }
+        if (!count) {
+                return WC_SUCCESS;
+        }
+        if (!w->cb || !w->cb->add_secrets) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        e = wc_storage_batch_begin(w, &owned);
+        if (e != WC_SUCCESS) {
+                return e;
+        }
+        WC_STATS_START(t0);
+        e = w->cb->add_secrets(w->db, secrets, count);
+        WC_STATS_END(WC_STATS_STORAGE, t0, count);
+        if (e == WC_SUCCESS && w->indexed) {
+                for (i = 0; i < count; ++i) {
+                        if (!wc_output_put(&w->outputs, &secrets[i], 0)) {
+                                /* Rebuilt from the database on next use. */
+                                wc_output_clear(&w->outputs);
+                                w->indexed = 0;
+                                break;
+                        }
+                }
+        }
+        return wc_storage_batch_end(w, owned, e);
+}
+
+wc_error_t wc_storage_spend_outputs(
+        wc_storage_handle_t w,
+        const struct sha256 hashes[],
+        size_t count
+) {
+        wc_error_t e = WC_SUCCESS;
+        size_t i = 0;
+        int owned = 0;
+        WC_STATS_DECL(t0)
+        if (!w || (!hashes && count)) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        if (!w->db) {
+                return WC_ERROR_DB_CLOSED;
+        }
+        if (!count) {
+                return WC_SUCCESS;
+        }
+        if (!w->cb || !w->cb->spend_outputs) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        e = wc_storage_batch_begin(w, &owned);
+        if (e != WC_SUCCESS) {
+                return e;
+        }
+        WC_STATS_START(t0);
+        e = w->cb->spend_outputs(w->db, hashes, count);
+        WC_STATS_END(WC_STATS_STORAGE, t0, count);
+        if (e == WC_SUCCESS && w->indexed) {
+                for (i = 0; i < count; ++i) {
+                        struct wc_output_entry *out = wc_output_find(&w->outputs, &hashes[i]);
+                        if (out) {
+                                out->spent = 1;
+                        }
+                }
+        }
+        return wc_storage_batch_end(w, owned, e);
+}
+
+wc_error_t wc_storage_replace(
+        wc_storage_handle_t w,
+        const struct sha256 inputs[],
+        size_t ninputs,
+        const wc_db_secret_t outputs[],
+        size_t noutputs
+) {
+        wc_error_t e = WC_SUCCESS;
+        int owned = 0;
+        if (!w || (!inputs && ninputs) || (!outputs && noutputs)) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        if (!w->db) {
+                return WC_ERROR_DB_CLOSED;
+        }
+        e = wc_storage_batch_begin(w, &owned);
+        if (e != WC_SUCCESS) {
+                return e;
+        }
+        e = wc_storage_spend_outputs(w, inputs, ninputs);
+        if (e == WC_SUCCESS) {
+                e = wc_storage_add_secrets(w, outputs, noutputs);
+        }
+        return wc_storage_batch_end(w, owned, e);
+}
+
+wc_error_t wc_storage_log_configure(
+        wc_storage_handle_t w,
+        wc_log_sync_t policy,
+        unsigned interval_ms
+) {
+        wc_error_t e = WC_SUCCESS;
+        if (!w || !w->cb || !w->log) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        if (policy != WC_LOG_SYNC_RECORD && policy != WC_LOG_SYNC_INTERVAL && policy != WC_LOG_SYNC_BATCH) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        if (policy == WC_LOG_SYNC_INTERVAL && interval_ms == 0) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        wc_log_writer_stop(w);
+        pthread_mutex_lock(&w->lw.lock);
+        if (w->cb->log_write) {
+                e = wc_log_writer_sync(w, w->lw.appended);
+        }
+        w->lw.policy = policy;
+        w->lw.interval_ms = interval_ms;
+        w->lw.stop = 0;
+        if (e == WC_SUCCESS && policy == WC_LOG_SYNC_INTERVAL) {
+                if (pthread_create(&w->lw.thread, NULL, wc_log_writer_main, w) != 0) {
+                        /* Fall back on the safest policy. */
+                        w->lw.policy = WC_LOG_SYNC_RECORD;
+                        e = WC_ERROR_THREAD_FAILED;
+                } else {
+                        w->lw.running = 1;
+                }
+        }
+        pthread_mutex_unlock(&w->lw.lock);
+        return e;
+}
+
+wc_error_t wc_storage_log_append(
+        wc_storage_handle_t w,
+        const void *record,
+        size_t len
+) {
+        struct wc_log_writer *lw = NULL;
+        wc_error_t e = WC_SUCCESS;
+        unsigned char *buf = NULL, *slot = NULL;
+        size_t cap = 0;
+        if (!w || (!record && len)) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        if (!w->log || !w->cb || !w->cb->log_write) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        if (len > WC_LOG_RECORD_MAX) {
+                return WC_ERROR_OVERFLOW;
+        }
+        lw = &w->lw;
+        pthread_mutex_lock(&lw->lock);
+        e = lw->error;
+        if (e == WC_SUCCESS && lw->cap - lw->len < WC_LOG_RECORD_SIZE) {
+                cap = lw->cap ? 2 * lw->cap : 32 * WC_LOG_RECORD_SIZE;
+                buf = realloc(lw->buf, cap);
+                if (!buf) {
+                        e = WC_ERROR_OUT_OF_MEMORY;
+                } else {
+                        lw->buf = buf;
+                        lw->cap = cap;
+                }
+        }
+        if (e == WC_SUCCESS) {
+                slot = lw->buf + lw->len;
+                slot[0] = (unsigned char)len;
+                slot[1] = (unsigned char)(len >> 8);
+                if (len) {
+                        memcpy(slot + 2, record, len);
+                }
+                memset(slot + 2 + len, 0, WC_LOG_RECORD_MAX - len);
+                lw->len += WC_LOG_RECORD_SIZE;
+                lw->appended += 1;
+                if (lw->policy == WC_LOG_SYNC_RECORD || lw->len >= WC_LOG_BUFFER_LIMIT) {
+                        e = wc_log_writer_sync(w, lw->appended);
+                }
+        }
+        pthread_mutex_unlock(&lw->lock);
+        return e;
+}
+
+wc_error_t wc_storage_log_flush(wc_storage_handle_t w) {
+        wc_error_t e = WC_SUCCESS;
+        if (!w || !w->log || !w->cb || !w->cb->log_write) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        pthread_mutex_lock(&w->lw.lock);
+        e = wc_log_writer_sync(w, w->lw.appended);
+        pthread_mutex_unlock(&w->lw.lock);
+        return e;
+}
+
+struct wc_log_block {
+        uint64_t offset; /* of the block header */
+        uint64_t first; /* index of the block's first record */
+        uint32_t count;
+        int checked; /* 0 if not yet verified, 1 if valid, -1 if corrupt */
+};
+
+struct wc_log_reader {
+        const unsigned char *data;
+        size_t size;
+        void *map; /* non-NULL if data was mapped from a file */
+        struct wc_log_block *blocks;
+        size_t nblocks, cap;
+        uint64_t nrecords;
+};
+
+static int wc_log_reader_push(struct wc_log_reader *r, uint64_t offset, uint32_t count) {
+        struct wc_log_block *blocks = NULL;
+        size_t cap = 0;
+        if (r->nblocks == r->cap) {
+                cap = r->cap ? 2 * r->cap : 64;
+                blocks = realloc(r->blocks, cap * sizeof(struct wc_log_block));
+                if (!blocks) {
+                        return 0;
+                }
+                r->blocks = blocks;
+                r->cap = cap;
+        }
+        r->blocks[r->nblocks].offset = offset;
+        r->blocks[r->nblocks].first = r->nrecords;
+        r->blocks[r->nblocks].count = count;
+        r->blocks[r->nblocks].checked = 0;
+        ++r->nblocks;
+        r->nrecords += count;
+        return 1;
+}
+
+/* If a valid footer ends at pos, returns non-zero and the bounds of the
+ * segment it indexes.  Block headers are checked against the index, but
+ * record data is not read. */
+static int wc_log_footer_at(
+        const struct wc_log_reader *r,
+        uint64_t pos,
+        uint64_t *segstart,
+        uint64_t *footer,
+        uint32_t *n
+) {
+        const unsigned char *p = NULL, *entry = NULL;
+        uint64_t seglen = 0, size = 0, offset = 0, count = 0;
+        uint32_t i = 0;
+        if (pos < WC_LOG_HEADER_SIZE + WC_LOG_TRAILER_SIZE) {
+                return 0;
+        }
+        p = r->data + pos - WC_LOG_TRAILER_SIZE;
+        if (memcmp(p + 12, "WCLE", 4)) {
+                return 0;
+        }
+        seglen = wc_le64_read(p);
+        *n = wc_le32_read(p + 8);
+        size = WC_LOG_HEADER_SIZE + (uint64_t)*n * WC_LOG_ENTRY_SIZE + WC_LOG_TRAILER_SIZE;
+        if (size > pos || seglen > pos - size) {
+                return 0;
+        }
+        *footer = pos - size;
+        *segstart = *footer - seglen;
+        p = r->data + *footer;
+        if (memcmp(p, "WCLF", 4) || wc_le32_read(p + 4) != *n) {
+                return 0;
+        }
+        if (!wc_log_header_check(p, p + WC_LOG_HEADER_SIZE, (size_t)*n * WC_LOG_ENTRY_SIZE)) {
+                return 0;
+        }
+        for (i = 0; i < *n; ++i) {
+                entry = p + WC_LOG_HEADER_SIZE + (size_t)i * WC_LOG_ENTRY_SIZE;
+                offset = wc_le64_read(entry);
+                count = wc_le64_read(entry + 8);
+                if (offset > seglen || seglen - offset < WC_LOG_HEADER_SIZE ||
+                    count > (seglen - offset - WC_LOG_HEADER_SIZE) / WC_LOG_RECORD_SIZE) {
+                        return 0;
+                }
+                entry = r->data + *segstart + offset;
+                if (memcmp(entry, "WCLB", 4) || wc_le32_read(entry + 4) != count) {
+                        return 0;
+                }
+        }
+        return 1;
+}
+
+/* Build the block index.  The chain of footers is followed back from the
+ * end of the file for as long as it is intact, and whatever precedes it is
+ * scanned block header by block header. */
+static wc_error_t wc_log_reader_index(struct wc_log_reader *r) {
+        uint64_t *segs = NULL, *tmp = NULL;
+        size_t nsegs = 0, segcap = 0, i = 0;
+        uint64_t end = r->size, pos = 0, segstart = 0, footer = 0, len = 0;
+        const unsigned char *p = NULL;
+        uint32_t n = 0, j = 0;
+        while (end > 0 && wc_log_footer_at(r, end, &segstart, &footer, &n)) {
+                if (nsegs == segcap) {
+                        segcap = segcap ? 2 * segcap : 16;
+                        tmp = realloc(segs, segcap * 2 * sizeof(uint64_t));
+                        if (!tmp) {
+                                free(segs);
+                                return WC_ERROR_OUT_OF_MEMORY;
+                        }
+                        segs = tmp;
+                }
+                segs[2 * nsegs] = segstart;
+                segs[2 * nsegs + 1] = footer;
+                ++nsegs;
+                end = segstart;
+        }
+        /* Anything before the intact chain was not closed cleanly.  A torn
+         * block ends the scan, but does not hide the segments after it. */
+        while (pos < end && end - pos >= WC_LOG_HEADER_SIZE) {
+                p = r->data + pos;
+                n = wc_le32_read(p + 4);
+                if (!memcmp(p, "WCLB", 4)) {
+                        len = WC_LOG_HEADER_SIZE + (uint64_t)n * WC_LOG_RECORD_SIZE;
+                        if (len > end - pos) {
+                                break;
+                        }
+                        if (!wc_log_reader_push(r, pos, n)) {
+                                free(segs);
+                                return WC_ERROR_OUT_OF_MEMORY;
+                        }
+                } else if (!memcmp(p, "WCLF", 4)) {
+                        len = WC_LOG_HEADER_SIZE + (uint64_t)n * WC_LOG_ENTRY_SIZE + WC_LOG_TRAILER_SIZE;
+                        if (len > end - pos) {
+                                break;
+                        }
+                } else {
+                        break;
+                }
+                pos += len;
+        }
+        for (i = nsegs; i > 0;) {
+                --i;
+                segstart = segs[2 * i];
+                p = r->data + segs[2 * i + 1];
+                n = wc_le32_read(p + 4);
+                for (j = 0; j < n; ++j) {
+                        const unsigned char *entry = p + WC_LOG_HEADER_SIZE + (size_t)j * WC_LOG_ENTRY_SIZE;
+                        if (!wc_log_reader_push(r, segstart + wc_le64_read(entry), (uint32_t)wc_le64_read(entry + 8))) {
+                                free(segs);
+                                return WC_ERROR_OUT_OF_MEMORY;
+                        }
+                }
+        }
+        free(segs);
+        return WC_SUCCESS;
+}
+
+wc_error_t wc_log_reader_open_memory(
+        wc_log_reader_handle_t *reader,
+        const void *data,
+        size_t len
+) {
+        struct wc_log_reader *r = NULL;
+        wc_error_t e = WC_SUCCESS;
+        if (!reader || (!data && len)) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        r = malloc(sizeof(struct wc_log_reader));
+        if (!r) {
+                return WC_ERROR_OUT_OF_MEMORY;
+        }
+        memset(r, 0, sizeof(struct wc_log_reader));
+        r->data = (const unsigned char*)data;
+        r->size = len;
+        e = wc_log_reader_index(r);
+        if (e != WC_SUCCESS) {
+                free(r->blocks);
+                free(r);
+                return e;
+        }
+        *reader = r;
+        return WC_SUCCESS;
+}
+
+wc_error_t wc_log_reader_open(
+        wc_log_reader_handle_t *reader,
+        const char *path
+) {
+        wc_error_t e = WC_SUCCESS;
+        struct stat st;
+        void *map = NULL;
+        size_t size = 0;
+        int fd = -1;
+        if (!reader || !path) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        fd = open(path, O_RDONLY);
+        if (fd < 0) {
+                return WC_ERROR_LOG_OPEN_FAILED;
+        }
+        if (fstat(fd, &st) < 0 || st.st_size < 0 || (uintmax_t)st.st_size > SIZE_MAX) {
+                close(fd);
+                return WC_ERROR_LOG_OPEN_FAILED;
+        }
+        size = (size_t)st.st_size;
+        if (size) {
+                map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (map == MAP_FAILED) {
+                        close(fd);
+                        return WC_ERROR_LOG_OPEN_FAILED;
+                }
+        }
+        /* The mapping holds its own reference to the file. */
+        close(fd);
+        e = wc_log_reader_open_memory(reader, map, size);
+        if (e != WC_SUCCESS) {
+                if (map) {
+                        munmap(map, size);
+                }
+                return e;
+        }
+        (*reader)->map = map;
+        return WC_SUCCESS;
+}
+
+wc_error_t wc_log_reader_count(
+        wc_log_reader_handle_t r,
+        uint64_t *count
+) {
+        if (!r || !count) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        *count = r->nrecords;
+        return WC_SUCCESS;
+}
+
+wc_error_t wc_log_reader_get(
+        wc_log_reader_handle_t r,
+        uint64_t index,
+        const void **record,
+        size_t *len
+) {
+        struct wc_log_block *b = NULL;
+        const unsigned char *p = NULL;
+        size_t lo = 0, hi = 0, mid = 0;
+        size_t n = 0;
+        if (!r || !record || !len || index >= r->nrecords) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        /* Find the last block whose first record is at or before index. */
+        lo = 0;
+        hi = r->nblocks;
+        while (hi - lo > 1) {
+                mid = lo + (hi - lo) / 2;
+                if (r->blocks[mid].first <= index) {
+                        lo = mid;
+                } else {
+                        hi = mid;
+                }
+        }
+        b = &r->blocks[lo];
+        p = r->data + b->offset;
+        if (!b->checked) {
+                b->checked = wc_log_header_check(p, p + WC_LOG_HEADER_SIZE, (size_t)b->count * WC_LOG_RECORD_SIZE) ? 1 : -1;
+        }
+        if (b->checked < 0) {
+                return WC_ERROR_DB_CORRUPT;
+        }
+        p += WC_LOG_HEADER_SIZE + (size_t)(index - b->first) * WC_LOG_RECORD_SIZE;
+        n = (size_t)p[0] | ((size_t)p[1] << 8);
+        if (n > WC_LOG_RECORD_MAX) {
+                return WC_ERROR_DB_CORRUPT;
+        }
+        *record = p + 2;
+        *len = n;
+        return WC_SUCCESS;
+}
+
+wc_error_t wc_log_reader_close(wc_log_reader_handle_t r) {
+        if (!r) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        if (r->map) {
+                munmap(r->map, r->size);
+        }
+        free(r->blocks);
+        free(r);
+        return WC_SUCCESS;
+}
+
+/* An asynchronous request in flight.  The request structure itself is the
+ * token handed to the server callbacks, and remains allocated until it is
+ * retired by wc_server_wait (or the server is disconnected), so that a late
+ * completion never touches freed memory. */
+struct wc_request {
+        struct wc_server *server;
+        struct wc_request *next;
+        wc_request_id_t id;
+        size_t slot; /* the pooled connection carrying the request */
+        int done;
+        wc_error_t error;
+#ifdef WEBCASH_STATS
+        uint64_t started; /* for the round-trip time of the request */
+        size_t items;
+#endif
+};
+
+/* One pooled connection.  A connection which is checked out (busy) is owned
+ * by its borrower, but conn is only ever written with the server lock held
+ * so that wc_server_checkin can look it up.  Asynchronous requests only hold
+ * the connection while starting, but pin it against being torn down until
+ * they complete, so that many of them can share one connection. */
+struct wc_server_slot {
+        wc_conn_handle_t conn;
+        uint64_t last_used; /* milliseconds, from wc_monotonic_ms */
+        size_t inflight;
+        int busy;
+        int broken;
+};
+
+#define WC_SERVER_DEFAULT_PING_INTERVAL_MS 30000
+#define WC_SERVER_DEFAULT_BATCH_MAX 500
+
+/* Health checks from concurrent callers being coalesced into one server
+ * request.  The first caller to find no open batch becomes its leader: it
+ * waits out the collection window (or until the batch fills), sends the
+ * request, and fans the results back out to the callers which joined. */
+struct wc_health_batch {
+        struct sha256 *hashes;
+        wc_health_t *result;
+        size_t count;
+        size_t cap;
+        size_t refs; /* callers yet to collect their results */
+        int done;
+        wc_error_t error;
+};
+
+struct wc_server {
+        const struct wc_server_callbacks *cb;
+        wc_server_url_t url;
+        unsigned ping_interval_ms;
+        size_t batch_max;
+        unsigned batch_window_ms;
+        /* Everything below is guarded by lock.  The done condition is
+         * signalled whenever a request completes or a connection is
+         * returned to the pool. */
+        pthread_mutex_t lock;
+        pthread_cond_t done;
+        struct wc_server_slot *slots;
+        size_t nslots;
+        int closing;
+        struct wc_request *requests;
+        wc_request_id_t next_id;
+        size_t pending;
+        size_t waiters; /* threads blocked on done holding no slot */
+        struct wc_health_batch *batch; /* open for joining, if any */
+};
+
+static uint64_t wc_monotonic_ms(void) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (uint64_t)now.tv_sec * 1000u + (uint64_t)now.tv_nsec / 1000000u;
+}
+
+/* Return a connection to the pool.  Connections which failed with a
+ * connection-level error are marked broken, to be torn down and reopened by
+ * the next borrower rather than here, since this may be called from within
+ * a completion callback.  Must be called with the server lock held. */
+static void wc_server_settle_locked(
+        wc_server_handle_t c,
+        size_t i,
+        wc_error_t status
+) {
+        struct wc_server_slot *slot = &c->slots[i];
+        if (status == WC_ERROR_NOT_CONNECTED || status == WC_ERROR_CONNECT_FAILED) {
+                slot->broken = 1;
+        }
+        slot->last_used = wc_monotonic_ms();
+        pthread_cond_broadcast(&c->done);
+}
+
+static void wc_server_release_locked(
+        wc_server_handle_t c,
+        size_t i,
+        wc_error_t status
+) {
+        c->slots[i].busy = 0;
+        wc_server_settle_locked(c, i, status);
+}
+
+static void wc_server_release(
+        wc_server_handle_t c,
+        size_t i,
+        wc_error_t status
+) {
+        pthread_mutex_lock(&c->lock);
+        wc_server_release_locked(c, i, status);
+        pthread_mutex_unlock(&c->lock);
+}
+
+/* Wait on the done condition without holding a slot.  Such waiters are
+ * counted, so that wc_server_disconnect can wake them and wait for them to
+ * leave before freeing the lock they sleep on.  Must be called with the
+ * server lock held.  Callers waiting on a slot or a batch must check closing
+ * on return, since neither frees up once it is set; requests still complete,
+ * so those waiting on a request need not. */
+static void wc_server_wait_locked(wc_server_handle_t c) {
+        ++c->waiters;
+        pthread_cond_wait(&c->done, &c->lock);
+        if (--c->waiters == 0 && c->closing) {
+                pthread_cond_broadcast(&c->done);
+        }
+}
+
+/* Check out a connection from the pool, blocking until one is available.
+ * An idle open connection is preferred, then an unopened slot.  Connections
+ * which are broken, or which have been idle long enough that the server may
+ * have dropped them and fail a ping, are reopened before being handed out. */
+static wc_error_t wc_server_acquire(
+        wc_server_handle_t c,
+        size_t *out
+) {
+        struct wc_server_slot *slot = NULL;
+        wc_conn_handle_t conn = NULL;
+        size_t i = 0, spare = 0;
+        int stale = 0;
+        pthread_mutex_lock(&c->lock);
+        for (;;) {
+                if (c->closing) {
+                        pthread_mutex_unlock(&c->lock);
+                        return WC_ERROR_NOT_CONNECTED;
+                }
+                spare = c->nslots;
+                for (i = 0; i < c->nslots; ++i) {
+                        if (c->slots[i].busy) {
+                                continue;
+                        }
+                        if (c->slots[i].conn && !c->slots[i].broken) {
+                                break;
+                        }
+                        /* A broken connection can only be reopened once
+                         * the requests still using it have finished. */
+                        if (spare == c->nslots && !c->slots[i].inflight) {
+                                spare = i;
+                        }
+                }
+                if (i == c->nslots) {
+                        i = spare;
+                }
+                if (i < c->nslots) {
+                        break;
+                }
+                wc_server_wait_locked(c);
+        }
+        slot = &c->slots[i];
+        slot->busy = 1;
+        conn = slot->conn;
+        stale = conn && !slot->broken && !slot->inflight && c->cb->ping
+             && wc_monotonic_ms() - slot->last_used >= c->ping_interval_ms;
+        if (conn && !slot->broken && !stale) {
+                pthread_mutex_unlock(&c->lock);
+                *out = i;
+                return WC_SUCCESS;
+        }
+        pthread_mutex_unlock(&c->lock);
+        /* The slot is ours, so the slow work of probing, tearing down and
+         * reopening the connection happens outside the lock. */
+        if (conn && stale && c->cb->ping(conn) == WC_SUCCESS) {
+                *out = i;
+                return WC_SUCCESS;
+        }
+        if (conn && c->cb->disconnect) {
+                c->cb->disconnect(conn);
+        }
+        conn = c->cb->connect(c->url);
+        pthread_mutex_lock(&c->lock);
+        slot->conn = conn;
+        slot->broken = 0;
+        if (!conn) {
+                wc_server_release_locked(c, i, WC_SUCCESS);
+                pthread_mutex_unlock(&c->lock);
+                return WC_ERROR_CONNECT_FAILED;
+        }
+        pthread_mutex_unlock(&c->lock);
+        *out = i;
+        return WC_SUCCESS;
+}
+
+wc_error_t wc_server_connect_pool(
+        wc_server_handle_t *server,
+        const wc_server_callbacks_t *callbacks,
+        wc_server_url_t url,
+        const wc_server_params_t *params
+) {
+        wc_server_handle_t c = NULL;
+        size_t nslots = 1;
+        /* Must have a way of returning the allocated server connection to the caller. */
+        if (!server) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        /* A server object without a server connection is pretty useless. */
+        if (!callbacks || !callbacks->connect) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        if (params && params->connections) {
+                nslots = params->connections;
+        }
+        /* Allocate the server object structure. */
+        c = malloc(sizeof(struct wc_server));
+        if (!c) {
+                return WC_ERROR_OUT_OF_MEMORY;
+        }
+        c->slots = calloc(nslots, sizeof(struct wc_server_slot));
+        if (!c->slots) {
+                free(c);
+                return WC_ERROR_OUT_OF_MEMORY;
+        }
+        /* Initialize the server object structure. */
+        c->cb = callbacks;
+        c->url = url;
+        c->ping_interval_ms = WC_SERVER_DEFAULT_PING_INTERVAL_MS;
+        if (params && params->ping_interval_ms) {
+                c->ping_interval_ms = params->ping_interval_ms;
+        }
+        c->batch_max = WC_SERVER_DEFAULT_BATCH_MAX;
+        if (params && params->batch_max) {
+                c->batch_max = params->batch_max;
+        }
+        c->batch_window_ms = params ? params->batch_window_ms : 0;
+        c->batch = NULL;
+        c->nslots = nslots;
+        c->closing = 0;
+        c->requests = NULL;
+        c->next_id = 1;
+        c->pending = 0;
+        c->waiters = 0;
+        if (pthread_mutex_init(&c->lock, NULL) != 0) {
+                free(c->slots);
+                free(c);
+                return WC_ERROR_OUT_OF_MEMORY;
+        }
+        if (pthread_cond_init(&c->done, NULL) != 0) {
+                pthread_mutex_destroy(&c->lock);
+                free(c->slots);
+                free(c);
+                return WC_ERROR_OUT_OF_MEMORY;
+        }
+        /* The first connection is opened eagerly so that an unreachable
+         * server is reported here.  The rest are opened on demand. */
+        c->slots[0].conn = callbacks->connect(url);
+        if (!c->slots[0].conn) {
+                pthread_cond_destroy(&c->done);
+                pthread_mutex_destroy(&c->lock);
+                free(c->slots);
+                free(c);
+                return WC_ERROR_CONNECT_FAILED;
+        }
+        c->slots[0].last_used = wc_monotonic_ms();
+        /* Return the server object structure. */
+        *server = c;
+        return WC_SUCCESS;
+}
+
+wc_error_t wc_server_connect(
+        wc_server_handle_t *server,
+        const wc_server_callbacks_t *callbacks,
+        wc_server_url_t url
+) {
+        return wc_server_connect_pool(server, callbacks, url, NULL);
+}
+
+wc_error_t wc_server_disconnect(wc_server_handle_t c) {
+        struct wc_request *req = NULL;
+        size_t i = 0;
+        if (!c) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        /* The server callbacks may still hold tokens for requests which
+         * have not yet completed, other threads may have connections
+         * checked out, and others may be waiting for one, so wait for all
+         * of them before tearing down.  Waiters are woken to find the
+         * server closing. */
+        pthread_mutex_lock(&c->lock);
+        c->closing = 1;
+        pthread_cond_broadcast(&c->done);
+        for (;;) {
+                for (i = 0; i < c->nslots && !c->slots[i].busy; ++i) {
+                }
+                if (!c->pending && !c->waiters && i == c->nslots) {
+                        break;
+                }
+                pthread_cond_wait(&c->done, &c->lock);
+        }
+        pthread_mutex_unlock(&c->lock);
+        while (c->requests) {
+                req = c->requests;
+                c->requests = req->next;
+                free(req);
+        }
+        for (i = 0; i < c->nslots; ++i) {
+                if (c->slots[i].conn && c->cb && c->cb->disconnect) {
+                        c->cb->disconnect(c->slots[i].conn);
+                }
+                c->slots[i].conn = NULL;
+        }
+        free(c->slots);
+        c->cb = NULL;
+        pthread_cond_destroy(&c->done);
+        pthread_mutex_destroy(&c->lock);
+        free(c);
+        return WC_SUCCESS;
+}
+
+wc_error_t wc_server_checkout(
+        wc_server_handle_t c,
+        wc_conn_handle_t *conn
+) {
+        wc_error_t e = WC_SUCCESS;
+        size_t i = 0;
+        if (!c || !conn) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        e = wc_server_acquire(c, &i);
+        if (e != WC_SUCCESS) {
+                return e;
+        }
+        pthread_mutex_lock(&c->lock);
+        *conn = c->slots[i].conn;
+        pthread_mutex_unlock(&c->lock);
+        return WC_SUCCESS;
+}
+
+wc_error_t wc_server_checkin(
+        wc_server_handle_t c,
+        wc_conn_handle_t conn,
+        wc_error_t status
+) {
+        size_t i = 0;
+        if (!c) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        pthread_mutex_lock(&c->lock);
+        for (i = 0; i < c->nslots; ++i) {
+                if (c->slots[i].busy && c->slots[i].conn == conn) {
+                        break;
+                }
+        }
+        if (!conn || i == c->nslots) {
+                pthread_mutex_unlock(&c->lock);
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        wc_server_release_locked(c, i, status);
+        pthread_mutex_unlock(&c->lock);
+        return WC_SUCCESS;
+}
+
+wc_error_t wc_server_get_terms(
+        wc_server_handle_t c,
+        bstring *terms
+) {
+        wc_error_t e = WC_SUCCESS;
+        size_t i = 0;
+        WC_STATS_DECL(t0)
+        if (!c || !terms) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        if (!c->cb || !c->cb->get_terms) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        e = wc_server_acquire(c, &i);
+        if (e != WC_SUCCESS) {
+                return e;
+        }
+        WC_STATS_START(t0);
+        e = c->cb->get_terms(c->slots[i].conn, terms);
+        WC_STATS_END(WC_STATS_SERVER, t0, 1);
+        wc_server_release(c, i, e);
+        return e;
+}
+
+/* Add count hashes to the open batch, opening one if there is none.  Sets
+ * *leader if the caller opened the batch, and *offset to the position of
+ * its hashes within it.  Must be called with the server lock held. */
+static wc_error_t wc_health_batch_join(
+        wc_server_handle_t c,
+        struct wc_health_batch **out,
+        size_t *offset,
+        int *leader,
+        const struct sha256 hashes[],
+        size_t count
+) {
+        struct wc_health_batch *b = NULL;
+        /* Wait for a full batch to be taken by its leader. */
+        while (!c->closing && c->batch && c->batch->count + count > c->batch_max) {
+                pthread_cond_wait(&c->done, &c->lock);
+        }
+        if (c->closing) {
+                return WC_ERROR_NOT_CONNECTED;
+        }
+        *leader = !c->batch;
+        if (*leader) {
+                b = calloc(1, sizeof(struct wc_health_batch));
+                if (!b) {
+                        return WC_ERROR_OUT_OF_MEMORY;
+                }
+                b->cap = c->batch_max;
+                b->hashes = malloc(b->cap * sizeof(struct sha256));
+                b->result = malloc(b->cap * sizeof(wc_health_t));
+                if (!b->hashes || !b->result) {
+                        free(b->hashes);
+                        free(b->result);
+                        free(b);
+                        return WC_ERROR_OUT_OF_MEMORY;
+                }
+                c->batch = b;
+        }
+        b = c->batch;
+        memcpy(&b->hashes[b->count], hashes, count * sizeof(struct sha256));
+        *offset = b->count;
+        b->count += count;
+        ++b->refs;
+        if (b->count >= c->batch_max) {
+                /* Wake the leader early. */
+                pthread_cond_broadcast(&c->done);
+        }
+        *out = b;
+        return WC_SUCCESS;
+}
+
+/* Send a batch as one server request.  Called by the batch leader with the
+ * server lock held, which is released while the request is made. */
+static void wc_health_batch_send(
+        wc_server_handle_t c,
+        struct wc_health_batch *b
+) {
+        struct timespec deadline;
+        wc_error_t e = WC_SUCCESS;
+        size_t i = 0;
+        WC_STATS_DECL(t0)
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += c->batch_window_ms / 1000;
+        deadline.tv_nsec += (long)(c->batch_window_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec += 1;
+                deadline.tv_nsec -= 1000000000L;
+        }
+        /* A server which starts closing cuts the window short, and the
+         * request then fails without a connection. */
+        while (!c->closing && b->count < c->batch_max) {
+                if (pthread_cond_timedwait(&c->done, &c->lock, &deadline) != 0) {
+                        break;
+                }
+        }
+        /* Close the batch to new callers, and let any waiting for room
+         * start the next one. */
+        c->batch = NULL;
+        pthread_cond_broadcast(&c->done);
+        pthread_mutex_unlock(&c->lock);
+        e = wc_server_acquire(c, &i);
+        if (e == WC_SUCCESS) {
+                WC_STATS_START(t0);
+                e = c->cb->health_check(c->slots[i].conn, b->hashes, b->count, b->result);
+                WC_STATS_END(WC_STATS_SERVER, t0, b->count);
+                wc_server_release(c, i, e);
+        }
+        pthread_mutex_lock(&c->lock);
+        b->done = 1;
+        b->error = e;
+        pthread_cond_broadcast(&c->done);
+}
+
+/* Perform a health check as part of a batch shared with concurrent
+ * callers.  Participants count as server waiters until they have collected
+ * their results, so that wc_server_disconnect frees neither the server nor
+ * the batch from under them. */
+static wc_error_t wc_health_batch_check(
+        wc_server_handle_t c,
+        wc_health_t result[],
+        const struct sha256 hashes[],
+        size_t count
+) {
+        struct wc_health_batch *b = NULL;
+        size_t offset = 0;
+        int leader = 0;
+        wc_error_t e = WC_SUCCESS;
+        pthread_mutex_lock(&c->lock);
+        ++c->waiters;
+        e = wc_health_batch_join(c, &b, &offset, &leader, hashes, count);
+        if (e == WC_SUCCESS) {
+                if (leader) {
+                        wc_health_batch_send(c, b);
+                }
+                while (!b->done) {
+                        pthread_cond_wait(&c->done, &c->lock);
+                }
+                e = b->error;
+                if (e == WC_SUCCESS) {
+                        memcpy(result, &b->result[offset], count * sizeof(wc_health_t));
+                }
+                if (--b->refs == 0) {
+                        free(b->hashes);
+                        free(b->result);
+                        free(b);
+                }
+        }
+        if (--c->waiters == 0 && c->closing) {
+                pthread_cond_broadcast(&c->done);
+        }
+        pthread_mutex_unlock(&c->lock);
+        return e;
+}
+
+wc_error_t wc_server_get_terms_if_changed(
+        wc_server_handle_t c,
+        bstring *terms,
+        int *changed,
+        const struct sha256 *etag
+) {
+        struct sha256 hash;
+        wc_error_t e = WC_SUCCESS;
+        size_t i = 0;
+        WC_STATS_DECL(t0)
+        if (!c || !terms || !changed || !etag) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        if (!c->cb || (!c->cb->get_terms_if_changed && !c->cb->get_terms)) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        *terms = NULL;
+        e = wc_server_acquire(c, &i);
+        if (e != WC_SUCCESS) {
+                return e;
+        }
+        WC_STATS_START(t0);
+        if (c->cb->get_terms_if_changed) {
+                e = c->cb->get_terms_if_changed(c->slots[i].conn, etag, terms);
+                WC_STATS_END(WC_STATS_SERVER, t0, 1);
+        } else {
+                e = c->cb->get_terms(c->slots[i].conn, terms);
+                WC_STATS_END(WC_STATS_SERVER, t0, 1);
+                if (e == WC_SUCCESS && *terms) {
+                        e = wc_terms_hash(&hash, *terms);
+                        if (e == WC_SUCCESS && !memcmp(hash.u8, etag->u8, sizeof(hash.u8))) {
+                                bdestroy(*terms);
+                                *terms = NULL;
+                        }
+                }
+        }
+        wc_server_release(c, i, e);
+        if (e != WC_SUCCESS && *terms) {
+                bdestroy(*terms);
+                *terms = NULL;
+        }
+        *changed = e == WC_SUCCESS && *terms;
+        return e;
+}
+
+wc_error_t wc_server_health_check(
+        wc_server_handle_t c,
+        wc_health_t result[],
+        const struct sha256 hashes[],
+        size_t count
+) {
+        wc_error_t e = WC_SUCCESS;
+        size_t i = 0;
+        WC_STATS_DECL(t0)
+        if (!c || (count && (!result || !hashes))) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        if (!c->cb || !c->cb->health_check) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        if (!count) {
+                return WC_SUCCESS;
+        }
+        if (c->batch_window_ms && count <= c->batch_max) {
+                return wc_health_batch_check(c, result, hashes, count);
+        }
+        e = wc_server_acquire(c, &i);
+        if (e != WC_SUCCESS) {
+                return e;
+        }
+        WC_STATS_START(t0);
+        e = c->cb->health_check(c->slots[i].conn, hashes, count, result);
+        WC_STATS_END(WC_STATS_SERVER, t0, count);
+        wc_server_release(c, i, e);
+        return e;
+}
+
+/* Completion callback handed to the asynchronous server callbacks. */
+static void wc_request_done(void *token, wc_error_t error) {
+        struct wc_request *req = (struct wc_request*)token;
+        struct wc_server *c = req->server;
+        pthread_mutex_lock(&c->lock);
+        if (!req->done) {
+                WC_STATS_END(WC_STATS_SERVER, req->started, req->items);
+                req->done = 1;
+                req->error = error;
+                --c->pending;
+                --c->slots[req->slot].inflight;
+                wc_server_settle_locked(c, req->slot, error);
+        }
+        pthread_cond_broadcast(&c->done);
+        pthread_mutex_unlock(&c->lock);
+}
+
+/* Allocate and register a new pending request, checking out a connection
+ * for it to use until it completes. */
+static wc_error_t wc_request_new(
+        struct wc_request **out,
+        wc_server_handle_t c
+) {
+        wc_error_t e = WC_SUCCESS;
+        struct wc_request *req = malloc(sizeof(struct wc_request));
+        if (!req) {
+                return WC_ERROR_OUT_OF_MEMORY;
+        }
+        e = wc_server_acquire(c, &req->slot);
+        if (e != WC_SUCCESS) {
+                free(req);
+                return e;
+        }
+        req->server = c;
+        req->done = 0;
+        req->error = WC_SUCCESS;
+#ifdef WEBCASH_STATS
+        req->items = 1;
+        WC_STATS_START(req->started);
+#endif
+        pthread_mutex_lock(&c->lock);
+        req->id = c->next_id++;
+        req->next = c->requests;
+        c->requests = req;
+        ++c->pending;
+        ++c->slots[req->slot].inflight;
+        pthread_mutex_unlock(&c->lock);
+        *out = req;
         return WC_SUCCESS;
 }
 
-wc_error_t wc_storage_have_accepted_terms(
-        wc_storage_handle_t w,
-        int *accepted
+/* Unlink and free a request.  Must be called with the server lock held. */
+static void wc_request_free(
+        wc_server_handle_t c,
+        struct wc_request *req
 ) {
-        if (!w || !accepted) {
-                return WC_ERROR_INVALID_ARGUMENT;
+        struct wc_request **p = &c->requests;
+        while (*p && *p != req) {
+                p = &(*p)->next;
         }
-        if (!w->db) {
-                return WC_ERROR_DB_CLOSED;
+        if (*p) {
+                *p = req->next;
         }
-        if (!w->cb || !w->cb->any_terms) {
-                return WC_ERROR_INVALID_ARGUMENT;
+        if (!req->done) {
+                --c->pending;
+                --c->slots[req->slot].inflight;
         }
-        return w->cb->any_terms(w->db, accepted);
+        free(req);
 }
 
-wc_error_t wc_storage_are_terms_accepted(
-        wc_storage_handle_t w,
-        int *accepted,
-        struct tm *when,
-        bstring terms
+/* Find an outstanding request.  Must be called with the server lock held. */
+static struct wc_request* wc_request_find(
+        wc_server_handle_t c,
+        wc_request_id_t id
 ) {
-        wc_error_t e = WC_SUCCESS;
-        time_t t = 0;
-        int found = 0;
-        if (!w || !terms || !(accepted || when)) {
-                return WC_ERROR_INVALID_ARGUMENT;
-        }
-        if (!w->db) {
-                return WC_ERROR_DB_CLOSED;
-        }
-        if (!w->cb || !w->cb->terms_accepted) {
-                return WC_ERROR_INVALID_ARGUMENT;
+        struct wc_request *req = c->requests;
+        while (req && req->id != id) {
+                req = req->next;
         }
-        e = w->cb->terms_accepted(w->db, terms, &t);
+        return req;
+}
+
+/* Record the result of starting a request, and hand its connection back to
+ * the pool for others to use while the reply is outstanding.  If the
+ * callback failed to start it, the completion will never be delivered, so
+ * the request is withdrawn and the error returned directly.  The request
+ * cannot have been retired yet even if it already completed, since its id
+ * has not been published. */
+static wc_error_t wc_request_started(
+        wc_server_handle_t c,
+        struct wc_request *req,
+        wc_request_id_t *id,
+        wc_error_t e
+) {
+        pthread_mutex_lock(&c->lock);
+        wc_server_release_locked(c, req->slot, e);
         if (e != WC_SUCCESS) {
-                return e;
-        }
-        found = (t != 0);
-        if (when && found) {
-                if (t + WC_TIME_EPOCH < t) {
-                        return WC_ERROR_OVERFLOW;
-                }
-                t += WC_TIME_EPOCH;
-                if (!gmtime_r(&t, when)) {
-                        return WC_ERROR_DB_CORRUPT;
-                }
-        }
-        if (accepted) {
-                *accepted = found;
+                wc_request_free(c, req);
+        } else {
+                *id = req->id;
         }
-        return WC_SUCCESS;
+        pthread_mutex_unlock(&c->lock);
+        return e;
 }
 
-wc_error_t wc_storage_accept_terms(
-        wc_storage_handle_t w,
-        bstring terms,
-        struct tm *now
+wc_error_t wc_server_get_terms_async(
+        wc_server_handle_t c,
+        wc_request_id_t *id,
+        bstring *terms
 ) {
-        time_t t = 0;
-        if (!w || !terms) {
+        struct wc_request *req = NULL;
+        wc_error_t e = WC_SUCCESS;
+        if (!c || !id || !terms) {
                 return WC_ERROR_INVALID_ARGUMENT;
         }
-        if (!w->db) {
-                return WC_ERROR_DB_CLOSED;
-        }
-        if (!w->cb || !w->cb->accept_terms) {
+        if (!c->cb || (!c->cb->get_terms_async && !c->cb->get_terms)) {
                 return WC_ERROR_INVALID_ARGUMENT;
         }
-        if (now) {
-                t = mktime(now);
-                if (t == (time_t)-1 || t < WC_TIME_EPOCH) {
-                        return WC_ERROR_INVALID_ARGUMENT;
-                }
+        e = wc_request_new(&req, c);
+        if (e != WC_SUCCESS) {
+                return e;
+        }
+        if (c->cb->get_terms_async) {
+                e = c->cb->get_terms_async(c->slots[req->slot].conn, terms, wc_request_done, req);
         } else {
-                t = time(NULL);
-                if (t == (time_t)-1 || t < WC_TIME_EPOCH) {
-                        /* The only reason time() might fail is integer overflow. */
-                        return WC_ERROR_OVERFLOW;
-                }
+                wc_request_done(req, c->cb->get_terms(c->slots[req->slot].conn, terms));
         }
-        t -= WC_TIME_EPOCH;
-        return w->cb->accept_terms(w->db, terms, t);
+        return wc_request_started(c, req, id, e);
 }
 
-struct wc_server {
-        const struct wc_server_callbacks *cb;
-        wc_conn_handle_t conn;
-};
-
-wc_error_t wc_server_connect(
-        wc_server_handle_t *server,
-        const wc_server_callbacks_t *callbacks,
-        wc_server_url_t url
+wc_error_t wc_server_health_check_async(
+        wc_server_handle_t c,
+        wc_request_id_t *id,
+        wc_health_t result[],
+        const struct sha256 hashes[],
+        size_t count
 ) {
-        wc_server_handle_t c = NULL;
-        /* Must have a way of returning the allocated server connection to the caller. */
-        if (!server) {
+        struct wc_request *req = NULL;
+        wc_error_t e = WC_SUCCESS;
+        if (!c || !id || (count && (!result || !hashes))) {
                 return WC_ERROR_INVALID_ARGUMENT;
         }
-        /* A server object without a server connection is pretty useless. */
-        if (!callbacks || !callbacks->connect) {
+        if (!c->cb || (!c->cb->health_check_async && !c->cb->health_check)) {
                 return WC_ERROR_INVALID_ARGUMENT;
         }
-        /* Allocate the server object structure. */
-        c = malloc(sizeof(struct wc_server));
-        if (!c) {
-                return WC_ERROR_OUT_OF_MEMORY;
+        e = wc_request_new(&req, c);
+        if (e != WC_SUCCESS) {
+                return e;
         }
-        /* Initialize the server object structure. */
-        c->cb = callbacks;
-        c->conn = callbacks->connect(url);
-        if (!c->conn) {
-                free(c);
-                return WC_ERROR_CONNECT_FAILED;
+#ifdef WEBCASH_STATS
+        req->items = count;
+#endif
+        if (!count) {
+                wc_request_done(req, WC_SUCCESS);
+        } else if (c->cb->health_check_async) {
+                e = c->cb->health_check_async(c->slots[req->slot].conn, hashes, count, result, wc_request_done, req);
+        } else {
+                wc_request_done(req, c->cb->health_check(c->slots[req->slot].conn, hashes, count, result));
         }
-        /* Return the server object structure. */
-        *server = c;
-        return WC_SUCCESS;
+        return wc_request_started(c, req, id, e);
 }
 
-wc_error_t wc_server_disconnect(wc_server_handle_t c) {
-        if (!c) {
+wc_error_t wc_server_poll(
+        wc_server_handle_t c,
+        wc_request_id_t id,
+        int *done
+) {
+        struct wc_request *req = NULL;
+        if (!c || !done) {
                 return WC_ERROR_INVALID_ARGUMENT;
         }
-        if (c->conn) {
-                if  (c->cb && c->cb->disconnect) {
-                        c->cb->disconnect(c->conn);
-                }
-                c->conn = NULL;
+        pthread_mutex_lock(&c->lock);
+        req = wc_request_find(c, id);
+        if (req) {
+                *done = req->done;
         }
-        c->cb = NULL;
-        free(c);
-        return WC_SUCCESS;
+        pthread_mutex_unlock(&c->lock);
+        return req ? WC_SUCCESS : WC_ERROR_INVALID_ARGUMENT;
 }
 
-wc_error_t wc_server_get_terms(
+wc_error_t wc_server_wait(
         wc_server_handle_t c,
-        bstring *terms
+        wc_request_id_t id
 ) {
-        if (!c || !terms) {
+        struct wc_request *req = NULL;
+        wc_error_t e = WC_SUCCESS;
+        if (!c) {
                 return WC_ERROR_INVALID_ARGUMENT;
         }
-        if (!c->conn) {
-                return WC_ERROR_NOT_CONNECTED;
+        pthread_mutex_lock(&c->lock);
+        /* Look the request up again after every wakeup, in case another
+         * thread waiting on the same id retired it first. */
+        while ((req = wc_request_find(c, id)) && !req->done) {
+                wc_server_wait_locked(c);
         }
-        if (!c->cb || !c->cb->get_terms) {
+        if (!req) {
+                pthread_mutex_unlock(&c->lock);
                 return WC_ERROR_INVALID_ARGUMENT;
         }
-        return c->cb->get_terms(c->conn, terms);
+        e = req->error;
+        wc_request_free(c, req);
+        pthread_mutex_unlock(&c->lock);
+        return e;
 }
 
 struct wc_ui {
@@ -1054,6 +4688,16 @@ struct wc_wallet {
         wc_storage_handle_t storage;
         wc_server_handle_t server;
         wc_ui_handle_t ui;
+        /* The storage object is not itself thread-safe, so every use of it
+         * holds storage_lock exclusively, except lookups served from the
+         * loaded output index which hold it shared. */
+        pthread_rwlock_t storage_lock;
+        /* terms_lock serializes the slow path of fetching the terms and
+         * prompting the user, the only writer of the cached terms below.
+         * cache_lock guards the cache itself, so that once the terms have
+         * been accepted readers share it without further contention. */
+        pthread_mutex_t terms_lock;
+        pthread_rwlock_t cache_lock;
         bstring terms;
         int accepted;
         struct tm terms_tm;
@@ -1066,6 +4710,7 @@ wc_error_t wc_wallet_configure(
         wc_ui_handle_t ui
 ) {
         wc_wallet_handle_t ctx = NULL;
+        wc_error_t e = WC_SUCCESS;
         /* Must have a way of returning the allocated wallet to the caller. */
         if (!wallet) {
                 return WC_ERROR_INVALID_ARGUMENT;
@@ -1082,11 +4727,35 @@ wc_error_t wc_wallet_configure(
         if (!ui) {
                 return WC_ERROR_INVALID_ARGUMENT;
         }
+        /* Load the index of wallet outputs, so that later lookups need no
+         * storage access.  Without each_secret there is none to load, and
+         * lookups fail instead. */
+        if (storage->cb && storage->cb->each_secret) {
+                e = wc_storage_index_load(storage);
+                if (e != WC_SUCCESS) {
+                        return e;
+                }
+        }
         /* Allocate the wallet object structure. */
         ctx = malloc(sizeof(struct wc_wallet));
         if (!ctx) {
                 return WC_ERROR_OUT_OF_MEMORY;
         }
+        if (pthread_rwlock_init(&ctx->storage_lock, NULL) != 0) {
+                free(ctx);
+                return WC_ERROR_OUT_OF_MEMORY;
+        }
+        if (pthread_mutex_init(&ctx->terms_lock, NULL) != 0) {
+                pthread_rwlock_destroy(&ctx->storage_lock);
+                free(ctx);
+                return WC_ERROR_OUT_OF_MEMORY;
+        }
+        if (pthread_rwlock_init(&ctx->cache_lock, NULL) != 0) {
+                pthread_mutex_destroy(&ctx->terms_lock);
+                pthread_rwlock_destroy(&ctx->storage_lock);
+                free(ctx);
+                return WC_ERROR_OUT_OF_MEMORY;
+        }
         /* Initialize the wallet object structure. */
         ctx->storage = storage;
         ctx->server = server;
@@ -1099,6 +4768,230 @@ wc_error_t wc_wallet_configure(
         return WC_SUCCESS;
 }
 
+/* Look up outputs in the loaded index.  Must be called with the storage lock
+ * held, in either mode. */
+static void wc_wallet_lookup_locked(
+        wc_wallet_handle_t wallet,
+        wc_output_info_t info[],
+        const struct sha256 hashes[],
+        size_t n
+) {
+        const struct wc_output_entry *out = NULL;
+        wc_storage_handle_t w = wallet->storage;
+        size_t i = 0;
+        for (i = 0; i < n; ++i) {
+                out = wc_output_find(&w->outputs, &hashes[i]);
+                memset(&info[i], 0, sizeof(wc_output_info_t));
+                if (out) {
+                        info[i].found = 1;
+                        info[i].spent = out->spent;
+                        info[i].amount = out->amount;
+                        info[i].derived = out->derived;
+                        info[i].chaincode = out->chaincode;
+                        info[i].depth = out->depth;
+                }
+        }
+}
+
+wc_error_t wc_wallet_lookup_outputs(
+        wc_wallet_handle_t wallet,
+        wc_output_info_t info[],
+        const struct sha256 hashes[],
+        size_t n
+) {
+        wc_error_t e = WC_SUCCESS;
+        if (!wallet || !wallet->storage || (n && (!info || !hashes))) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        pthread_rwlock_rdlock(&wallet->storage_lock);
+        if (!wallet->storage->indexed) {
+                /* Reloading the index writes to it, so upgrade to an
+                 * exclusive lock. */
+                pthread_rwlock_unlock(&wallet->storage_lock);
+                pthread_rwlock_wrlock(&wallet->storage_lock);
+                e = wc_storage_index_load(wallet->storage);
+        }
+        if (e == WC_SUCCESS) {
+                wc_wallet_lookup_locked(wallet, info, hashes, n);
+        }
+        pthread_rwlock_unlock(&wallet->storage_lock);
+        return e;
+}
+
+struct wc_recover_derive {
+        struct sha256 *out;
+        const struct sha256 *root;
+        uint64_t chaincode;
+        uint64_t start;
+        size_t count;
+};
+
+static void* wc_recover_derive_main(void *arg) {
+        struct wc_recover_derive *d = (struct wc_recover_derive*)arg;
+        wc_derive_publics(d->out, d->root, d->chaincode, d->start, d->count);
+        return NULL;
+}
+
+/* Records the outputs of one batch which the server knows and the wallet
+ * does not, in a single transaction. */
+static wc_error_t wc_recover_record(
+        wc_wallet_handle_t wallet,
+        wc_recover_result_t *result,
+        const struct sha256 *root,
+        uint64_t chaincode,
+        uint64_t start,
+        const struct sha256 hashes[],
+        const wc_health_t health[],
+        wc_output_info_t info[],
+        wc_db_secret_t secrets[],
+        struct sha256 spent[],
+        char serials[],
+        size_t count
+) {
+        wc_storage_handle_t w = wallet->storage;
+        wc_error_t e = WC_SUCCESS;
+        size_t i = 0, nsecrets = 0, nspent = 0;
+        int owned = 0;
+        pthread_rwlock_wrlock(&wallet->storage_lock);
+        e = wc_storage_index_load(w);
+        if (e != WC_SUCCESS) {
+                pthread_rwlock_unlock(&wallet->storage_lock);
+                return e;
+        }
+        wc_wallet_lookup_locked(wallet, info, hashes, count);
+        for (i = 0; i < count; ++i) {
+                if (!health[i].known || info[i].found) {
+                        continue;
+                }
+                wc_derive_serials(&serials[64 * nsecrets], root, chaincode, start + i, 1);
+                memset(&secrets[nsecrets], 0, sizeof(wc_db_secret_t));
+                secrets[nsecrets].secret.amount = health[i].spent ? 0 : health[i].amount;
+                secrets[nsecrets].secret.serial = &serials[64 * nsecrets];
+                secrets[nsecrets].secret.len = 64;
+                secrets[nsecrets].hash = hashes[i];
+                secrets[nsecrets].derived = 1;
+                secrets[nsecrets].chaincode = chaincode;
+                secrets[nsecrets].depth = start + i;
+                ++nsecrets;
+                if (health[i].spent) {
+                        spent[nspent++] = hashes[i];
+                }
+        }
+        if (nsecrets) {
+                e = wc_storage_batch_begin(w, &owned);
+                if (e == WC_SUCCESS) {
+                        e = wc_storage_add_secrets(w, secrets, nsecrets);
+                }
+                if (e == WC_SUCCESS) {
+                        e = wc_storage_spend_outputs(w, spent, nspent);
+                }
+                e = wc_storage_batch_end(w, owned, e);
+        }
+        pthread_rwlock_unlock(&wallet->storage_lock);
+        if (e == WC_SUCCESS) {
+                result->recovered += nsecrets;
+                result->unspent += nsecrets - nspent;
+                for (i = 0; i < nsecrets; ++i) {
+                        result->balance += secrets[i].secret.amount;
+                }
+        }
+        wc_memory_cleanse(serials, 64 * nsecrets);
+        return e;
+}
+
+wc_error_t wc_wallet_recover(
+        wc_wallet_handle_t wallet,
+        wc_recover_result_t *result,
+        const struct sha256 *root,
+        const wc_recover_params_t *params
+) {
+        wc_recover_result_t local;
+        struct wc_recover_derive next;
+        wc_error_t e = WC_SUCCESS;
+        struct sha256 *cur = NULL, *ahead = NULL, *tmp = NULL, *spent = NULL;
+        wc_health_t *health = NULL;
+        wc_output_info_t *info = NULL;
+        wc_db_secret_t *secrets = NULL;
+        char *serials = NULL;
+        unsigned nchaincodes = 4, c = 0;
+        size_t batch = 500, gap = 100, i = 0;
+        uint64_t depth = 0, used = 0; /* used: one past the last known depth */
+        pthread_t thread;
+        int threaded = 0;
+        if (!result) {
+                result = &local;
+        }
+        memset(result, 0, sizeof(wc_recover_result_t));
+        if (!wallet || !wallet->storage || !wallet->server || !root) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        if (params) {
+                nchaincodes = params->nchaincodes ? params->nchaincodes : nchaincodes;
+                batch = params->batch ? params->batch : batch;
+                gap = params->gap_limit ? params->gap_limit : gap;
+        }
+        if (nchaincodes > WC_RECOVER_MAX_CHAINCODES || batch > SIZE_MAX / (2 * sizeof(struct sha256) + 64)) {
+                return WC_ERROR_INVALID_ARGUMENT;
+        }
+        cur = malloc(batch * sizeof(struct sha256));
+        ahead = malloc(batch * sizeof(struct sha256));
+        spent = malloc(batch * sizeof(struct sha256));
+        health = malloc(batch * sizeof(wc_health_t));
+        info = malloc(batch * sizeof(wc_output_info_t));
+        secrets = malloc(batch * sizeof(wc_db_secret_t));
+        serials = malloc(batch * 64);
+        if (!cur || !ahead || !spent || !health || !info || !secrets || !serials) {
+                e = WC_ERROR_OUT_OF_MEMORY;
+        }
+        for (c = 0; e == WC_SUCCESS && c < nchaincodes; ++c) {
+                depth = 0;
+                used = 0;
+                wc_derive_publics(cur, root, c, depth, batch);
+                for (;;) {
+                        /* Derive the following batch while this one is being
+                         * checked, falling back on doing so afterwards. */
+                        next.out = ahead;
+                        next.root = root;
+                        next.chaincode = c;
+                        next.start = depth + batch;
+                        next.count = batch;
+                        threaded = (pthread_create(&thread, NULL, wc_recover_derive_main, &next) == 0);
+                        e = wc_server_health_check(wallet->server, health, cur, batch);
+                        if (e == WC_SUCCESS) {
+                                for (i = 0; i < batch; ++i) {
+                                        if (health[i].known) {
+                                                used = depth + i + 1;
+                                        }
+                                }
+                                e = wc_recover_record(wallet, result, root, c, depth, cur, health,
+                                                      info, secrets, spent, serials, batch);
+                        }
+                        if (threaded) {
+                                pthread_join(thread, NULL);
+                        }
+                        depth += batch;
+                        if (e != WC_SUCCESS || depth - used >= gap) {
+                                break;
+                        }
+                        if (!threaded) {
+                                wc_recover_derive_main(&next);
+                        }
+                        tmp = cur;
+                        cur = ahead;
+                        ahead = tmp;
+                }
+                result->next_depth[c] = used;
+        }
+        free(serials);
+        free(secrets);
+        free(info);
+        free(health);
+        free(spent);
+        free(ahead);
+        free(cur);
+        return e;
+}
+
 wc_error_t wc_wallet_release(wc_wallet_handle_t wallet) {
         wc_error_t e = WC_SUCCESS;
         if (!wallet) {
@@ -1120,26 +5013,76 @@ wc_error_t wc_wallet_release(wc_wallet_handle_t wallet) {
                 e = e || wc_storage_close(wallet->storage);
                 wallet->storage = NULL;
         }
+        pthread_rwlock_destroy(&wallet->cache_lock);
+        pthread_mutex_destroy(&wallet->terms_lock);
+        pthread_rwlock_destroy(&wallet->storage_lock);
         free(wallet);
         return e;
 }
 
-wc_error_t wc_wallet_terms_of_service(
+/* Copy the cached terms of service to the caller.  Must be called with the
+ * cache lock held, in either mode. */
+static wc_error_t wc_wallet_terms_copy(
         wc_wallet_handle_t wallet,
         bstring *terms,
         int *accepted,
         struct tm *when
 ) {
+        if (terms) {
+                if (*terms) {
+                        bdestroy(*terms);
+                        *terms = NULL;
+                }
+                *terms = wc_bstr_from_blk(wallet->terms->data, (size_t)wallet->terms->slen);
+                if (!*terms) {
+                        return WC_ERROR_OUT_OF_MEMORY;
+                }
+        }
+        if (accepted) {
+                *accepted = wallet->accepted;
+        }
+        if (when && wallet->accepted) {
+                memcpy(when, &wallet->terms_tm, sizeof(struct tm));
+        }
+        return WC_SUCCESS;
+}
+
+/* Fetch the terms of service and the user's acceptance of them, showing the
+ * terms to the user if need be, and update the cache.  Must be called with
+ * the terms lock held, which makes this the only writer of the cache, so
+ * the cache may be read here without the cache lock. */
+static wc_error_t wc_wallet_terms_update(wc_wallet_handle_t wallet) {
         wc_error_t e = WC_SUCCESS;
+        bstring fetched = NULL;
+        bstring known = NULL;
+        struct sha256 hash;
+        int accepted = 0, changed = 1;
+        struct tm tm;
         time_t now = 0;
-        /* Need a wallet context. */
-        if (!wallet) {
-                return WC_ERROR_INVALID_ARGUMENT;
-        }
-        /* Fetch the current terms of service from the server. */
+        /* Fetch the current terms of service from the server, unless they
+         * are the ones most recently accepted. */
         if (!wallet->terms) {
-                e = wc_server_get_terms(wallet->server, &wallet->terms);
-                if (e == WC_SUCCESS && !wallet->terms) {
+                memset(&tm, 0, sizeof(struct tm));
+                pthread_rwlock_wrlock(&wallet->storage_lock);
+                e = wc_storage_latest_terms(wallet->storage, &known, &hash, &tm);
+                pthread_rwlock_unlock(&wallet->storage_lock);
+                if (e == WC_SUCCESS && known) {
+                        e = wc_server_get_terms_if_changed(wallet->server, &fetched, &changed, &hash);
+                        if (e == WC_SUCCESS && !changed) {
+                                /* Still the accepted terms. */
+                                pthread_rwlock_wrlock(&wallet->cache_lock);
+                                wallet->terms = known;
+                                wallet->accepted = 1;
+                                memcpy(&wallet->terms_tm, &tm, sizeof(struct tm));
+                                pthread_rwlock_unlock(&wallet->cache_lock);
+                                return WC_SUCCESS;
+                        }
+                        bdestroy(known);
+                        known = NULL;
+                } else if (e == WC_SUCCESS) {
+                        e = wc_server_get_terms(wallet->server, &fetched);
+                }
+                if (e == WC_SUCCESS && !fetched) {
                         /* wc_server_get_terms should have returned an error code */
                         e = WC_ERROR_UNKNOWN;
                 }
@@ -1147,27 +5090,34 @@ wc_error_t wc_wallet_terms_of_service(
                         return e;
                 }
                 /* Clear acceptance cache. */
+                pthread_rwlock_wrlock(&wallet->cache_lock);
+                wallet->terms = fetched;
                 wallet->accepted = 0;
                 memset(&wallet->terms_tm, 0, sizeof(struct tm));
+                pthread_rwlock_unlock(&wallet->cache_lock);
         }
+        accepted = wallet->accepted;
+        memcpy(&tm, &wallet->terms_tm, sizeof(struct tm));
         /* Check if the user previously accepted these terms. */
-        if (!wallet->accepted) {
-                e = wc_storage_are_terms_accepted(wallet->storage, &wallet->accepted, &wallet->terms_tm, wallet->terms);
+        if (!accepted) {
+                pthread_rwlock_wrlock(&wallet->storage_lock);
+                e = wc_storage_are_terms_accepted(wallet->storage, &accepted, &tm, wallet->terms);
+                pthread_rwlock_unlock(&wallet->storage_lock);
                 if (e != WC_SUCCESS) {
                         return e;
                 }
         }
         /* If the terms have not been accepted, show them to the user. */
-        if (!wallet->accepted) {
+        if (!accepted) {
                 /* Show the terms of service to the user. */
-                e = wc_ui_show_terms(wallet->ui, &wallet->accepted, wallet->terms);
+                e = wc_ui_show_terms(wallet->ui, &accepted, wallet->terms);
                 if (e != WC_SUCCESS) {
                         return e;
                 }
                 /* If the user has accepted the terms, cache the acceptance. */
-                if (wallet->accepted) {
+                if (accepted) {
                         now = time(NULL);
-                        if (!gmtime_r(&now, &wallet->terms_tm)) {
+                        if (!gmtime_r(&now, &tm)) {
                                 return WC_ERROR_OVERFLOW;
                         }
                         /* If the following call fails, then the terms of
@@ -1175,27 +5125,48 @@ wc_error_t wc_wallet_terms_of_service(
                          * storage.  This is bad, but not a show stopper.
                          * The terms will just be displayed again the next
                          * time the wallet starts. */
-                        wc_storage_accept_terms(wallet->storage, wallet->terms, &wallet->terms_tm);
-                }
-        }
-        /* If the terms have already been accepted, return cached values. */
-        if (terms) {
-                if (*terms) {
-                        bdestroy(*terms);
-                        *terms = NULL;
-                }
-                *terms = bstrcpy(wallet->terms);
-                if (!*terms) {
-                        return WC_ERROR_OUT_OF_MEMORY;
+                        pthread_rwlock_wrlock(&wallet->storage_lock);
+                        wc_storage_accept_terms(wallet->storage, wallet->terms, &tm);
+                        pthread_rwlock_unlock(&wallet->storage_lock);
                 }
         }
-        if (accepted) {
-                *accepted = wallet->accepted;
+        pthread_rwlock_wrlock(&wallet->cache_lock);
+        wallet->accepted = accepted;
+        memcpy(&wallet->terms_tm, &tm, sizeof(struct tm));
+        pthread_rwlock_unlock(&wallet->cache_lock);
+        return WC_SUCCESS;
+}
+
+wc_error_t wc_wallet_terms_of_service(
+        wc_wallet_handle_t wallet,
+        bstring *terms,
+        int *accepted,
+        struct tm *when
+) {
+        wc_error_t e = WC_SUCCESS;
+        /* Need a wallet context. */
+        if (!wallet) {
+                return WC_ERROR_INVALID_ARGUMENT;
         }
-        if (when && wallet->accepted) {
-                memcpy(when, &wallet->terms_tm, sizeof(struct tm));
+        /* Once the terms have been accepted, return the cached values. */
+        pthread_rwlock_rdlock(&wallet->cache_lock);
+        if (wallet->terms && wallet->accepted) {
+                e = wc_wallet_terms_copy(wallet, terms, accepted, when);
+                pthread_rwlock_unlock(&wallet->cache_lock);
+                return e;
         }
-        return WC_SUCCESS;
+        pthread_rwlock_unlock(&wallet->cache_lock);
+        /* Otherwise consult the server, storage and user, one thread at a
+         * time.  Threads which waited here may find the work already done. */
+        pthread_mutex_lock(&wallet->terms_lock);
+        e = wc_wallet_terms_update(wallet);
+        if (e == WC_SUCCESS) {
+                pthread_rwlock_rdlock(&wallet->cache_lock);
+                e = wc_wallet_terms_copy(wallet, terms, accepted, when);
+                pthread_rwlock_unlock(&wallet->cache_lock);
+        }
+        pthread_mutex_unlock(&wallet->terms_lock);
+        return e;
 }
 
 /* End of File
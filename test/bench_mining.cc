@@ -0,0 +1,284 @@
+/* Copyright (c) 2022-2023 Mark Friedenbach
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/* Throughput benchmarks for the mining and derivation hot paths.
+ *
+ * Each result is printed as one tab-separated line:
+ *
+ *     name  backend  batch  threads  hashes  seconds  hashes_per_sec
+ *
+ * preceded by a header line starting with '#', so that the output can be
+ * consumed directly by scripts comparing runs across libsha2 versions,
+ * compiler flags, or hosts.  The minimum time spent in each benchmark can be
+ * set with --min-time=SECONDS (default 0.5).
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <new> /* for std::bad_alloc, used by webcash.h */
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <webcash.h>
+
+static double g_min_time = 0.5;
+static std::string g_backend;
+
+static void report(
+        const char *name,
+        size_t batch,
+        unsigned threads,
+        uint64_t hashes,
+        double seconds
+) {
+        printf("%s\t%s\t%zu\t%u\t%llu\t%.6f\t%.0f\n",
+               name, g_backend.c_str(), batch, threads,
+               (unsigned long long)hashes, seconds,
+               seconds > 0 ? hashes / seconds : 0.0);
+        fflush(stdout);
+}
+
+/* Repeatedly run fn, which performs hashes_per_call hashes, until at least
+ * g_min_time seconds have elapsed. */
+static void run(
+        const char *name,
+        size_t batch,
+        uint64_t hashes_per_call,
+        const std::function<void()> &fn
+) {
+        using clock = std::chrono::steady_clock;
+        uint64_t hashes = 0;
+        double seconds = 0;
+        auto start = clock::now();
+        do {
+                for (int i = 0; i < 64; ++i) {
+                        fn();
+                }
+                hashes += 64 * hashes_per_call;
+                seconds = std::chrono::duration<double>(clock::now() - start).count();
+        } while (seconds < g_min_time);
+        report(name, batch, 1, hashes, seconds);
+}
+
+static struct sha256_ctx mining_midstate() {
+        const char *prefix = /* 64 bytes, one full SHA-256 block */
+                "eyJsZWdhbGVzZSI6IHsidGVybXMiOiB0cnVlfSwgIndlYmNhc2giOiBbImUyMDAw";
+        struct sha256_ctx ctx = SHA256_INIT;
+        sha256_update(&ctx, prefix, 64);
+        return ctx;
+}
+
+static void bench_sha256() {
+        unsigned char msg[64] = {0};
+        struct sha256 hash;
+        run("sha256", 1, 1, [&]() {
+                struct sha256_ctx ctx = SHA256_INIT;
+                sha256_update(&ctx, msg, sizeof(msg));
+                sha256_done(&hash, &ctx);
+                msg[0] = hash.u8[0];
+        });
+}
+
+static void bench_mining_nway() {
+        struct sha256_ctx ctx = mining_midstate();
+        unsigned char hashes[16*32];
+        size_t j = 0;
+        run("wc_mining_4way", 4, 4, [&]() {
+                wc_mining_4way(hashes, &ctx, wc_mining_nonces, &wc_mining_nonces[4*j], wc_mining_final);
+                j = (j + 4) % 1000;
+        });
+        run("wc_mining_8way", 8, 8, [&]() {
+                wc_mining_8way(hashes, &ctx, wc_mining_nonces, &wc_mining_nonces[4*j], wc_mining_final);
+                j = (j + 8) % 1000;
+        });
+        run("wc_mining_16way", 16, 16, [&]() {
+                wc_mining_16way(hashes, &ctx, wc_mining_nonces, &wc_mining_nonces[4*j], wc_mining_final);
+                j = (j + 16) % (1000 - 16);
+        });
+}
+
+static void bench_mining_job() {
+        struct sha256_ctx ctx = mining_midstate();
+        wc_mining_job_t job;
+        wc_mining_job_init(&job, &ctx, wc_mining_nonces, wc_mining_final);
+        for (size_t batch = 4; batch <= WC_MINING_JOB_LANES; batch *= 2) {
+                size_t j = 0;
+                run("wc_mining_job_search", batch, batch, [&]() {
+                        wc_mining_job_search(&job, &wc_mining_nonces[4*j], batch, 256);
+                        j = (j + batch) % (1000 - WC_MINING_JOB_LANES);
+                });
+        }
+}
+
+static void bench_mine_threads() {
+        using clock = std::chrono::steady_clock;
+        struct sha256_ctx ctx = mining_midstate();
+        unsigned maxthreads = std::thread::hardware_concurrency();
+        if (maxthreads == 0) {
+                maxthreads = 1;
+        }
+        std::vector<unsigned> counts;
+        for (unsigned n = 1; n < maxthreads; n *= 2) {
+                counts.push_back(n);
+        }
+        counts.push_back(maxthreads);
+        for (unsigned nthreads : counts) {
+                uint64_t hashes = 0;
+                double seconds = 0;
+                auto start = clock::now();
+                do {
+                        wc_miner_handle_t miner = nullptr;
+                        /* An unreachable difficulty searches the entire
+                         * nonce space without reporting solutions. */
+                        if (wc_mine_start(&miner, &ctx, 256, nthreads, [](void *, const wc_mining_solution_t *) -> int {
+                                return 0;
+                        }, nullptr) != WC_SUCCESS) {
+                                fprintf(stderr, "wc_mine_start failed with %u threads\n", nthreads);
+                                return;
+                        }
+                        wc_mine_wait(miner);
+                        hashes += 1000 * 1000;
+                        seconds = std::chrono::duration<double>(clock::now() - start).count();
+                } while (seconds < g_min_time);
+                report("wc_mine_start", wc_mining_best_width(), nthreads, hashes, seconds);
+        }
+}
+
+static void bench_derive_serials() {
+        const struct sha256 root = {{
+                0x40, 0x7c, 0x95, 0x0b, 0x3d, 0xe6, 0x00, 0x64,
+                0xd7, 0xff, 0x74, 0x4b, 0x9b, 0x47, 0x43, 0xb8,
+                0xde, 0x58, 0xe9, 0x43, 0xe7, 0xc5, 0x37, 0xdf,
+                0x3d, 0x3a, 0x8a, 0x29, 0xa3, 0x2e, 0x1d, 0x0f
+        }};
+        const size_t batches[] = { 1, 8, 64, 1024 };
+        std::vector<char> buf(64 * 1024);
+        for (size_t batch : batches) {
+                uint64_t depth = 0;
+                run("wc_derive_serials", batch, batch, [&]() {
+                        wc_derive_serials(buf.data(), &root, 1, depth, batch);
+                        depth += batch;
+                });
+        }
+}
+
+static void bench_derive_serials_raw() {
+        const struct sha256 root = {{
+                0x40, 0x7c, 0x95, 0x0b, 0x3d, 0xe6, 0x00, 0x64,
+                0xd7, 0xff, 0x74, 0x4b, 0x9b, 0x47, 0x43, 0xb8,
+                0xde, 0x58, 0xe9, 0x43, 0xe7, 0xc5, 0x37, 0xdf,
+                0x3d, 0x3a, 0x8a, 0x29, 0xa3, 0x2e, 0x1d, 0x0f
+        }};
+        const size_t batch = 1024;
+        std::vector<struct sha256> raw(batch);
+        std::vector<char> hex(64 * batch);
+        uint64_t depth = 0;
+        run("wc_derive_serials_raw", batch, batch, [&]() {
+                wc_derive_serials_raw(raw.data(), &root, 1, depth, batch);
+                depth += batch;
+        });
+        run("wc_hex_encode", batch, batch, [&]() {
+                wc_hex_encode(hex.data(), raw[0].u8, 32 * batch);
+        });
+        run("wc_hex_decode", batch, batch, [&]() {
+                wc_hex_decode(raw[0].u8, nullptr, hex.data(), 32 * batch);
+        });
+        run("wc_derive_publics", batch, batch, [&]() {
+                wc_derive_publics(raw.data(), &root, 1, depth, batch);
+                depth += batch;
+        });
+}
+
+static void bench_public_from_secrets() {
+        const struct sha256 root = {{
+                0x40, 0x7c, 0x95, 0x0b, 0x3d, 0xe6, 0x00, 0x64,
+                0xd7, 0xff, 0x74, 0x4b, 0x9b, 0x47, 0x43, 0xb8,
+                0xde, 0x58, 0xe9, 0x43, 0xe7, 0xc5, 0x37, 0xdf,
+                0x3d, 0x3a, 0x8a, 0x29, 0xa3, 0x2e, 0x1d, 0x0f
+        }};
+        const size_t batch = 1024;
+        std::vector<char> serials(64 * batch);
+        std::vector<wc_secret_t> secrets(batch);
+        std::vector<wc_public_t> pubs(batch);
+        wc_derive_serials(serials.data(), &root, 1, 0, batch);
+        for (size_t i = 0; i < batch; ++i) {
+                secrets[i].amount = 1;
+                secrets[i].serial = blk2bstr(&serials[64 * i], 64);
+        }
+        run("wc_public_from_secret", 1, batch, [&]() {
+                for (size_t i = 0; i < batch; ++i) {
+                        pubs[i] = wc_public_from_secret(&secrets[i]);
+                }
+        });
+        run("wc_public_from_secrets", batch, batch, [&]() {
+                wc_public_from_secrets(pubs.data(), secrets.data(), batch);
+        });
+}
+
+static void bench_derive_serials_mt() {
+        using clock = std::chrono::steady_clock;
+        const struct sha256 root = {{
+                0x40, 0x7c, 0x95, 0x0b, 0x3d, 0xe6, 0x00, 0x64,
+                0xd7, 0xff, 0x74, 0x4b, 0x9b, 0x47, 0x43, 0xb8,
+                0xde, 0x58, 0xe9, 0x43, 0xe7, 0xc5, 0x37, 0xdf,
+                0x3d, 0x3a, 0x8a, 0x29, 0xa3, 0x2e, 0x1d, 0x0f
+        }};
+        const size_t batch = 64 * 1024;
+        std::vector<char> buf(64 * batch);
+        unsigned maxthreads = std::thread::hardware_concurrency();
+        if (maxthreads == 0) {
+                maxthreads = 1;
+        }
+        for (unsigned nthreads = 1; ; nthreads = nthreads * 2 < maxthreads ? nthreads * 2 : maxthreads) {
+                uint64_t hashes = 0, depth = 0;
+                double seconds = 0;
+                auto start = clock::now();
+                do {
+                        wc_derive_serials_mt(buf.data(), &root, 1, depth, batch, nthreads);
+                        depth += batch;
+                        hashes += batch;
+                        seconds = std::chrono::duration<double>(clock::now() - start).count();
+                } while (seconds < g_min_time);
+                report("wc_derive_serials_mt", batch, nthreads, hashes, seconds);
+                if (nthreads == maxthreads) {
+                        break;
+                }
+        }
+}
+
+int main(int argc, char **argv) {
+        for (int i = 1; i < argc; ++i) {
+                if (!strncmp(argv[i], "--min-time=", 11)) {
+                        g_min_time = atof(argv[i] + 11);
+                } else {
+                        fprintf(stderr, "usage: %s [--min-time=SECONDS]\n", argv[0]);
+                        return 1;
+                }
+        }
+        if (wc_init() != WC_SUCCESS) {
+                fprintf(stderr, "wc_init failed\n");
+                return 1;
+        }
+        g_backend = sha256_auto_detect();
+        printf("#name\tbackend\tbatch\tthreads\thashes\tseconds\thashes_per_sec\n");
+        bench_sha256();
+        bench_mining_nway();
+        bench_mining_job();
+        bench_mine_threads();
+        bench_derive_serials();
+        bench_derive_serials_raw();
+        bench_public_from_secrets();
+        bench_derive_serials_mt();
+        return 0;
+}
+
+/* End of File
+ */
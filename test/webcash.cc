@@ -7,6 +7,13 @@
 
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <set>
+#include <thread>
+
 #include <webcash.h>
 
 #include <bstraux.h>
@@ -83,6 +90,89 @@ TEST(gtest, wc_from_string) {
         test_cstring("\"1.0\"", WC_ERROR_INVALID_ARGUMENT);
 }
 
+TEST(gtest, wc_amount_parse) {
+        wc_amount_t amt = 0;
+        int noncanonical = -1;
+        EXPECT_EQ(wc_amount_parse(nullptr, nullptr, "1", 1), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_amount_parse(&amt, nullptr, nullptr, 1), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_amount_parse(&amt, nullptr, "1", 0), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_amount_parse(&amt, nullptr, "-", 1), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_amount_parse(&amt, nullptr, "1a", 2), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_amount_parse(&amt, nullptr, "\xd9\xa1", 2), WC_ERROR_INVALID_ARGUMENT);
+        /* The span need not be nul-terminated. */
+        ASSERT_EQ(wc_amount_parse(&amt, &noncanonical, "12.5:secret", 4), WC_SUCCESS);
+        EXPECT_EQ(amt, INT64_C(1250000000));
+        EXPECT_EQ(noncanonical, 0);
+        /* Range limits. */
+        ASSERT_EQ(wc_amount_parse(&amt, &noncanonical, "92233720368.54775807", 20), WC_SUCCESS);
+        EXPECT_EQ(amt, INT64_MAX);
+        EXPECT_EQ(wc_amount_parse(&amt, nullptr, "92233720368.54775808", 20), WC_ERROR_OVERFLOW);
+        ASSERT_EQ(wc_amount_parse(&amt, &noncanonical, "-92233720368.54775808", 21), WC_SUCCESS);
+        EXPECT_EQ(amt, INT64_MIN);
+        EXPECT_EQ(noncanonical, 0);
+        EXPECT_EQ(wc_amount_parse(&amt, nullptr, "-92233720368.54775809", 21), WC_ERROR_OVERFLOW);
+        EXPECT_EQ(wc_amount_parse(&amt, nullptr, "92233720369", 11), WC_ERROR_OVERFLOW);
+        EXPECT_EQ(wc_amount_parse(&amt, nullptr, "100000000000", 12), WC_ERROR_OVERFLOW);
+        EXPECT_EQ(wc_amount_parse(&amt, nullptr, "99999999999999999999999", 23), WC_ERROR_OVERFLOW);
+        EXPECT_EQ(wc_amount_parse(&amt, nullptr, "123456789012x", 13), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_amount_parse(&amt, nullptr, "123456789012.5x", 15), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_amount_parse(&amt, nullptr, "123456789012.5", 14), WC_ERROR_OVERFLOW);
+        /* Leading zeros are noncanonical, but do not count towards
+         * overflow. */
+        ASSERT_EQ(wc_amount_parse(&amt, &noncanonical, "0000000000000000000001", 22), WC_SUCCESS);
+        EXPECT_EQ(amt, INT64_C(100000000));
+        EXPECT_EQ(noncanonical, 1);
+        ASSERT_EQ(wc_amount_parse(&amt, &noncanonical, "-0", 2), WC_SUCCESS);
+        EXPECT_EQ(amt, 0);
+        EXPECT_EQ(noncanonical, 1);
+        /* Batch form. */
+        const char *strs[] = { "1", "bogus", "0.5" };
+        const size_t lens[] = { 1, 5, 3 };
+        wc_amount_t amts[3];
+        wc_error_t errs[3];
+        EXPECT_EQ(wc_amounts_parse(amts, errs, strs, lens, 3), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(errs[0], WC_SUCCESS);
+        EXPECT_EQ(errs[1], WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(errs[2], WC_SUCCESS);
+        EXPECT_EQ(amts[0], INT64_C(100000000));
+        EXPECT_EQ(amts[2], INT64_C(50000000));
+        EXPECT_EQ(wc_amounts_parse(amts, nullptr, strs, lens, 1), WC_SUCCESS);
+}
+
+TEST(gtest, wc_amount_format) {
+        const wc_amount_t amounts[] = {
+                0, 1, -1, 10, 12345678, 100000000, -100000000, 123456789,
+                1200000000, INT64_MAX, INT64_MIN, INT64_MIN + 1,
+        };
+        const char *expected[] = {
+                "0", "0.00000001", "-0.00000001", "0.0000001", "0.12345678",
+                "1", "-1", "1.23456789", "12", "92233720368.54775807",
+                "-92233720368.54775808", "-92233720368.54775807",
+        };
+        const size_t n = sizeof(amounts) / sizeof(amounts[0]);
+        char buf[WC_AMOUNT_MAX_LEN + 1];
+        std::vector<char> slots(n * (WC_AMOUNT_MAX_LEN + 1));
+        std::vector<size_t> lens(n);
+        wc_amounts_format(slots.data(), lens.data(), amounts, n);
+        for (size_t i = 0; i < n; ++i) {
+                wc_amount_t amt = 0;
+                int noncanonical = -1;
+                size_t len = wc_amount_format(buf, amounts[i]);
+                EXPECT_STREQ(buf, expected[i]);
+                EXPECT_EQ(len, strlen(expected[i]));
+                EXPECT_STREQ(&slots[i * (WC_AMOUNT_MAX_LEN + 1)], expected[i]);
+                EXPECT_EQ(lens[i], len);
+                bstring bstr = wc_to_bstring(amounts[i]);
+                ASSERT_NE(bstr, nullptr);
+                EXPECT_EQ(biseqcstr(bstr, expected[i]), 1);
+                bdestroy(bstr);
+                /* Formatting always produces canonical output. */
+                ASSERT_EQ(wc_amount_parse(&amt, &noncanonical, buf, len), WC_SUCCESS);
+                EXPECT_EQ(amt, amounts[i]);
+                EXPECT_EQ(noncanonical, 0);
+        }
+}
+
 TEST(gtest, wc_secret_new) {
         wc_secret_t secret;
         EXPECT_EQ(wc_secret_is_valid(&secret), WC_ERROR_INVALID_ARGUMENT);
@@ -237,6 +327,38 @@ TEST(gtest, wc_public_from_secret) {
         EXPECT_EQ(wc_secret_destroy(&secret), WC_SUCCESS);
 }
 
+TEST(gtest, wc_public_from_secrets) {
+        struct sha256 hdroot = {{
+                0x40, 0x7c, 0x95, 0x0b, 0x3d, 0xe6, 0x00, 0x64,
+                0xd7, 0xff, 0x74, 0x4b, 0x9b, 0x47, 0x43, 0xb8,
+                0xde, 0x58, 0xe9, 0x43, 0xe7, 0xc5, 0x37, 0xdf,
+                0x3d, 0x3a, 0x8a, 0x29, 0xa3, 0x2e, 0x1d, 0x0f
+        }};
+        char serial[64 + 1] = {0};
+        std::vector<wc_secret_t> secrets(30);
+        for (size_t i = 0; i < secrets.size(); ++i) {
+                if (i % 7 == 3) {
+                        /* Odd lengths, and an empty secret. */
+                        if (i != 17) {
+                                EXPECT_EQ(wc_secret_from_cstring(&secrets[i], INT64_C(1) + i, i % 2 ? "abc" : "abcd"), WC_SUCCESS);
+                        }
+                        continue;
+                }
+                wc_derive_serials(serial, &hdroot, 0, i, 1);
+                EXPECT_EQ(wc_secret_from_cstring(&secrets[i], INT64_C(1) + i, serial), WC_SUCCESS);
+        }
+        std::vector<wc_public_t> pubs(secrets.size());
+        EXPECT_EQ(wc_public_from_secrets(nullptr, secrets.data(), 1), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_public_from_secrets(pubs.data(), nullptr, 1), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_public_from_secrets(pubs.data(), nullptr, 0), WC_SUCCESS);
+        EXPECT_EQ(wc_public_from_secrets(pubs.data(), secrets.data(), secrets.size()), WC_SUCCESS);
+        for (size_t i = 0; i < secrets.size(); ++i) {
+                wc_public_t pub = wc_public_from_secret(&secrets[i]);
+                EXPECT_EQ(pubs[i].amount, pub.amount);
+                EXPECT_EQ(memcmp(pubs[i].hash.u8, pub.hash.u8, 32), 0);
+        }
+}
+
 TEST(gtest, wc_public_is_valid) {
         wc_public_t pub = WC_PUBLIC_INIT;
         EXPECT_EQ(wc_public_is_valid(nullptr), WC_ERROR_INVALID_ARGUMENT);
@@ -245,6 +367,75 @@ TEST(gtest, wc_public_is_valid) {
         EXPECT_EQ(wc_public_is_valid(&pub), WC_SUCCESS);
 }
 
+TEST(gtest, wc_secret_view) {
+        const char token[] = "e12.345678:secret:abc\nleftover";
+        wc_secret_view_t view;
+        int noncanonical = -1;
+        char buf[64];
+        size_t len = 0;
+        EXPECT_EQ(wc_secret_parse_view(nullptr, nullptr, token, 21), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_secret_parse_view(&view, nullptr, nullptr, 21), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_secret_parse_view(&view, nullptr, token, 0), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_secret_parse_view(&view, nullptr, "e1:public:abc", 13), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_secret_parse_view(&view, nullptr, "e1:secret", 9), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_secret_parse_view(&view, nullptr, "ex:secret:abc", 13), WC_ERROR_INVALID_ARGUMENT);
+        /* The input need not be nul-terminated. */
+        ASSERT_EQ(wc_secret_parse_view(&view, &noncanonical, token, 21), WC_SUCCESS);
+        EXPECT_EQ(noncanonical, 0);
+        EXPECT_EQ(view.amount, INT64_C(1234567800));
+        EXPECT_EQ(view.serial, token + 18);
+        EXPECT_EQ(view.len, 3);
+        ASSERT_EQ(wc_secret_parse_view(&view, &noncanonical, token + 1, 20), WC_SUCCESS);
+        EXPECT_EQ(noncanonical, 1);
+        /* Formatting. */
+        EXPECT_EQ(wc_secret_format(nullptr, 0, &len, &view), WC_ERROR_INSUFFICIENT_CAPACITY);
+        EXPECT_EQ(len, 21);
+        EXPECT_EQ(wc_secret_format(buf, 21, &len, &view), WC_ERROR_INSUFFICIENT_CAPACITY);
+        EXPECT_EQ(wc_secret_format(nullptr, 22, &len, &view), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_secret_format(buf, 22, &len, nullptr), WC_ERROR_INVALID_ARGUMENT);
+        ASSERT_EQ(wc_secret_format(buf, 22, &len, &view), WC_SUCCESS);
+        EXPECT_STREQ(buf, "e12.345678:secret:abc");
+        view.amount = INT64_MIN;
+        ASSERT_EQ(wc_secret_format(buf, sizeof(buf), nullptr, &view), WC_SUCCESS);
+        EXPECT_STREQ(buf, "e-92233720368.54775808:secret:abc");
+}
+
+TEST(gtest, wc_secret_compact) {
+        const char *serial = "be835897e85381905634f8bcc5db1eaa384d363c326335f4e9d89d119e78b0c5";
+        wc_secret_t secret, roundtrip;
+        wc_secret_compact_t compact;
+        ASSERT_EQ(wc_secret_from_cstring(&secret, INT64_C(5), serial), WC_SUCCESS);
+        EXPECT_EQ(wc_secret_compact_from_secret(nullptr, &secret), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_secret_compact_from_secret(&compact, nullptr), WC_ERROR_INVALID_ARGUMENT);
+        ASSERT_EQ(wc_secret_compact_from_secret(&compact, &secret), WC_SUCCESS);
+        EXPECT_EQ(compact.amount, INT64_C(5));
+        EXPECT_EQ(compact.serial.u8[0], 0xbe);
+        EXPECT_EQ(compact.serial.u8[31], 0xc5);
+        ASSERT_EQ(wc_secret_from_compact(&roundtrip, &compact), WC_SUCCESS);
+        EXPECT_EQ(roundtrip.amount, INT64_C(5));
+        EXPECT_EQ(biseqcstr(roundtrip.serial, serial), 1);
+        wc_public_t pub[2] = { WC_PUBLIC_INIT, WC_PUBLIC_INIT };
+        wc_secret_compact_t compacts[2] = { compact, compact };
+        compacts[1].amount = 7;
+        wc_public_from_compact_secrets(pub, compacts, 2);
+        wc_public_t expected = wc_public_from_secret(&secret);
+        EXPECT_EQ(pub[0].amount, INT64_C(5));
+        EXPECT_EQ(pub[1].amount, INT64_C(7));
+        EXPECT_EQ(memcmp(pub[0].hash.u8, expected.hash.u8, 32), 0);
+        EXPECT_EQ(memcmp(pub[1].hash.u8, expected.hash.u8, 32), 0);
+        /* Serials which cannot round-trip are rejected. */
+        const char *bad[] = {
+                "abc",
+                "BE835897E85381905634F8BCC5DB1EAA384D363C326335F4E9D89D119E78B0C5",
+                "be835897e85381905634f8bcc5db1eaa384d363c326335f4e9d89d119e78b0cg",
+                "be835897e85381905634f8bcc5db1eaa384d363c326335f4e9d89d119e78b0c5a",
+        };
+        for (const char *b : bad) {
+                wc_secret_view_t view = { 1, b, strlen(b) };
+                EXPECT_EQ(wc_secret_compact_from_view(&compact, &view), WC_ERROR_INVALID_ARGUMENT);
+        }
+}
+
 TEST(gtest, wc_public_string) {
         const struct sha256 zero = {0};
         const struct sha256 hash = { /* sha256(b"abc").digest() */
@@ -271,6 +462,111 @@ TEST(gtest, wc_public_string) {
         EXPECT_EQ(memcmp(&pub.hash.u8, &hash.u8, sizeof(hash.u8)), 0);
 }
 
+TEST(gtest, wc_public_view) {
+        const char token[] = "e1:public:BA7816BF8F01CFEA414140DE5DAE2223B00361A396177A9CB410FF61F20015AD";
+        const struct sha256 hash = { /* sha256(b"abc").digest() */
+                0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea,
+                0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+                0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c,
+                0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad
+        };
+        wc_public_t pub = WC_PUBLIC_INIT;
+        int noncanonical = -1;
+        char buf[WC_PUBLIC_MAX_LEN + 1];
+        size_t len = 0;
+        EXPECT_EQ(wc_public_parse_view(&pub, nullptr, token, sizeof(token) - 2), WC_ERROR_INVALID_ARGUMENT);
+        ASSERT_EQ(wc_public_parse_view(&pub, &noncanonical, token, sizeof(token) - 1), WC_SUCCESS);
+        EXPECT_EQ(noncanonical, 1);
+        EXPECT_EQ(pub.amount, INT64_C(100000000));
+        EXPECT_EQ(memcmp(&pub.hash.u8, &hash.u8, sizeof(hash.u8)), 0);
+        /* A malformed hash is reported ahead of an out-of-range amount. */
+        const char bad[] = "e100000000000:public:zz7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad";
+        EXPECT_EQ(wc_public_parse_view(&pub, nullptr, bad, sizeof(bad) - 1), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_public_parse_view(&pub, nullptr, bad, sizeof(bad) - 3), WC_ERROR_INVALID_ARGUMENT);
+        const char big[] = "e100000000000:public:ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad";
+        EXPECT_EQ(wc_public_parse_view(&pub, nullptr, big, sizeof(big) - 1), WC_ERROR_OVERFLOW);
+        EXPECT_EQ(memcmp(&pub.hash.u8, &hash.u8, sizeof(hash.u8)), 0);
+        ASSERT_EQ(wc_public_format(buf, sizeof(buf), &len, &pub), WC_SUCCESS);
+        EXPECT_EQ(len, 74);
+        EXPECT_STREQ(buf, "e1:public:ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+        EXPECT_EQ(wc_public_format(buf, len, &len, &pub), WC_ERROR_INSUFFICIENT_CAPACITY);
+        /* The longest possible encoding fits. */
+        pub.amount = INT64_MIN;
+        ASSERT_EQ(wc_public_format(buf, sizeof(buf), &len, &pub), WC_SUCCESS);
+        EXPECT_EQ(len, WC_PUBLIC_MAX_LEN);
+        /* Amounts format the same as wc_to_bstring. */
+        const wc_amount_t amounts[] = {
+                0, 1, -1, 10, 100000000, -100000000, 123456789, 1200000000,
+                INT64_MAX, INT64_MIN + 1,
+        };
+        for (wc_amount_t amount : amounts) {
+                bstring expected = wc_to_bstring(amount);
+                ASSERT_NE(expected, nullptr);
+                pub.amount = amount;
+                ASSERT_EQ(wc_public_format(buf, sizeof(buf), &len, &pub), WC_SUCCESS);
+                EXPECT_EQ(len, 1 + expected->slen + 8 + 64);
+                EXPECT_EQ(memcmp(buf + 1, expected->data, expected->slen), 0);
+                bdestroy(expected);
+        }
+}
+
+TEST(gtest, wc_tokens_parse) {
+        const std::string input =
+                "e1:secret:abc\n"
+                "\n"
+                "  e2.5:public:ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad \r\n"
+                "garbage\n"
+                "3:secret:def\r\n"
+                "e1:public:xyz\n"
+                "e4:secret:partial";
+        wc_token_t tokens[16];
+        size_t count = 0, consumed = 0;
+        EXPECT_EQ(wc_tokens_parse(nullptr, 1, &count, &consumed, input.data(), input.size(), 1), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_tokens_parse(tokens, 16, nullptr, &consumed, input.data(), input.size(), 1), WC_ERROR_INVALID_ARGUMENT);
+        ASSERT_EQ(wc_tokens_parse(tokens, 16, &count, &consumed, input.data(), input.size(), 0), WC_SUCCESS);
+        /* The unterminated last line is held back. */
+        ASSERT_EQ(count, 5);
+        EXPECT_EQ(consumed, input.rfind('\n') + 1);
+        EXPECT_EQ(tokens[0].type, WC_TOKEN_SECRET);
+        EXPECT_EQ(tokens[0].error, WC_SUCCESS);
+        EXPECT_EQ(tokens[0].noncanonical, 0);
+        EXPECT_EQ(tokens[0].secret.amount, INT64_C(100000000));
+        EXPECT_EQ(std::string(tokens[0].secret.serial, tokens[0].secret.len), "abc");
+        EXPECT_EQ(tokens[1].type, WC_TOKEN_PUBLIC);
+        EXPECT_EQ(tokens[1].error, WC_SUCCESS);
+        EXPECT_EQ(tokens[1].pub.amount, INT64_C(250000000));
+        EXPECT_EQ(tokens[1].offset, 17);
+        EXPECT_EQ(tokens[1].len, 76);
+        EXPECT_EQ(tokens[1].pub.hash.u8[0], 0xba);
+        EXPECT_EQ(tokens[2].type, WC_TOKEN_INVALID);
+        EXPECT_EQ(tokens[2].error, WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(tokens[3].type, WC_TOKEN_SECRET);
+        EXPECT_EQ(tokens[3].error, WC_SUCCESS);
+        EXPECT_EQ(tokens[3].noncanonical, 1);
+        EXPECT_EQ(std::string(tokens[3].secret.serial, tokens[3].secret.len), "def");
+        EXPECT_EQ(tokens[4].type, WC_TOKEN_PUBLIC);
+        EXPECT_EQ(tokens[4].error, WC_ERROR_INVALID_ARGUMENT);
+        /* With final set, the last line is parsed too. */
+        ASSERT_EQ(wc_tokens_parse(tokens, 16, &count, &consumed, input.data() + consumed, input.size() - consumed, 1), WC_SUCCESS);
+        ASSERT_EQ(count, 1);
+        EXPECT_EQ(tokens[0].type, WC_TOKEN_SECRET);
+        EXPECT_EQ(tokens[0].secret.amount, INT64_C(400000000));
+        /* Small batches resume where the previous one left off. */
+        size_t total = 0, pos = 0;
+        do {
+                ASSERT_EQ(wc_tokens_parse(tokens, 2, &count, &consumed, input.data() + pos, input.size() - pos, 1), WC_SUCCESS);
+                total += count;
+                pos += consumed;
+        } while (count);
+        EXPECT_EQ(total, 6);
+        EXPECT_EQ(pos, input.size());
+        /* Chunk boundaries fall at the start of lines. */
+        EXPECT_EQ(wc_tokens_boundary(input.data(), input.size(), 0), 0);
+        EXPECT_EQ(wc_tokens_boundary(input.data(), input.size(), 1), 14);
+        EXPECT_EQ(wc_tokens_boundary(input.data(), input.size(), 14), 14);
+        EXPECT_EQ(wc_tokens_boundary(input.data(), input.size(), input.size() - 1), input.size());
+}
+
 TEST(gtest, wc_mining_nonces) {
         tagbstring b64 = {0};
         bstring dec = nullptr;
@@ -326,6 +622,262 @@ TEST(gtest, wc_mining_8way) {
         EXPECT_EQ(memcmp(hashes1, hashes2, sizeof(hashes1)), 0);
 }
 
+static unsigned leading_zero_bits(const struct sha256 *hash) {
+        unsigned bits = 0;
+        for (int i = 0; i < 256 && !(hash->u8[i / 8] & (0x80 >> (i % 8))); ++i) {
+                ++bits;
+        }
+        return bits;
+}
+
+static struct sha256_ctx mining_midstate() {
+        const char *prefix = /* 64 bytes, one full SHA-256 block */
+                "eyJsZWdhbGVzZSI6IHsidGVybXMiOiB0cnVlfSwgIndlYmNhc2giOiBbImUyMDAw";
+        struct sha256_ctx ctx = SHA256_INIT;
+        sha256_update(&ctx, prefix, 64);
+        return ctx;
+}
+
+TEST(gtest, wc_mining_Nway) {
+        struct sha256_ctx ctx = SHA256_INIT;
+        struct sha256 expected[16];
+        struct sha256 hashes[16];
+        const unsigned char *nonce1 = &wc_mining_nonces[4*123];
+        const unsigned char *nonce2 = &wc_mining_nonces[4*456];
+        for (int i = 0; i < 16; ++i) {
+                struct sha256_ctx c = ctx;
+                sha256_update(&c, nonce1, 4);
+                sha256_update(&c, &nonce2[4*i], 4);
+                sha256_update(&c, wc_mining_final, 4);
+                sha256_done(&expected[i], &c);
+        }
+        memset(hashes, 0, sizeof(hashes));
+        wc_mining_4way(hashes[0].u8, &ctx, nonce1, nonce2, wc_mining_final);
+        EXPECT_EQ(memcmp(hashes, expected, 4*sizeof(struct sha256)), 0);
+        memset(hashes, 0, sizeof(hashes));
+        wc_mining_8way(hashes[0].u8, &ctx, nonce1, nonce2, wc_mining_final);
+        EXPECT_EQ(memcmp(hashes, expected, 8*sizeof(struct sha256)), 0);
+        memset(hashes, 0, sizeof(hashes));
+        wc_mining_16way(hashes[0].u8, &ctx, nonce1, nonce2, wc_mining_final);
+        EXPECT_EQ(memcmp(hashes, expected, 16*sizeof(struct sha256)), 0);
+}
+
+TEST(gtest, wc_mining_job) {
+        struct sha256_ctx ctx = SHA256_INIT;
+        struct sha256_ctx bad = SHA256_INIT;
+        wc_mining_job_t job;
+        struct sha256 expected[24];
+        struct sha256 hashes[24];
+        const unsigned char *nonce2 = &wc_mining_nonces[4*900];
+        sha256_update(&bad, "e", 1);
+        EXPECT_EQ(wc_mining_job_init(nullptr, &ctx, wc_mining_nonces, wc_mining_final), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_mining_job_init(&job, nullptr, wc_mining_nonces, wc_mining_final), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_mining_job_init(&job, &ctx, nullptr, wc_mining_final), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_mining_job_init(&job, &ctx, wc_mining_nonces, nullptr), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_mining_job_init(&job, &bad, wc_mining_nonces, wc_mining_final), WC_ERROR_INVALID_ARGUMENT);
+        ASSERT_EQ(wc_mining_job_init(&job, &ctx, &wc_mining_nonces[4*7], wc_mining_final), WC_SUCCESS);
+        // Batches larger than WC_MINING_JOB_LANES are split.
+        wc_mining_8way(expected[0].u8, &ctx, &wc_mining_nonces[4*7], nonce2, wc_mining_final);
+        wc_mining_16way(expected[8].u8, &ctx, &wc_mining_nonces[4*7], nonce2 + 4*8, wc_mining_final);
+        wc_mining_job_hash(hashes[0].u8, &job, nonce2, 24);
+        EXPECT_EQ(memcmp(hashes, expected, sizeof(hashes)), 0);
+        // Only the nonce1 bytes change.
+        wc_mining_job_set_nonce1(&job, &wc_mining_nonces[4*999]);
+        wc_mining_4way(expected[0].u8, &ctx, &wc_mining_nonces[4*999], nonce2, wc_mining_final);
+        wc_mining_job_hash(hashes[0].u8, &job, nonce2, 3);
+        EXPECT_EQ(memcmp(hashes, expected, 3*sizeof(struct sha256)), 0);
+}
+
+TEST(gtest, wc_mining_job_search) {
+        struct sha256_ctx ctx = mining_midstate();
+        wc_mining_job_t job;
+        struct sha256 hashes[WC_MINING_JOB_LANES];
+        ASSERT_EQ(wc_mining_job_init(&job, &ctx, wc_mining_nonces, wc_mining_final), WC_SUCCESS);
+        EXPECT_EQ(wc_mining_job_search(&job, wc_mining_nonces, 5, 0), 0x1f);
+        EXPECT_EQ(wc_mining_job_search(&job, wc_mining_nonces, 100, 0), 0xffff);
+        EXPECT_EQ(wc_mining_job_search(&job, wc_mining_nonces, 16, 256), 0);
+        size_t found = 0;
+        for (int i = 0; i < 1000; ++i) {
+                wc_mining_job_set_nonce1(&job, &wc_mining_nonces[4*i]);
+                for (int j = 0; j < 1000; j += 8) {
+                        unsigned d = 1 + (i + j) % 12;
+                        uint32_t mask = wc_mining_job_search(&job, &wc_mining_nonces[4*j], 8, d);
+                        wc_mining_job_hash(hashes[0].u8, &job, &wc_mining_nonces[4*j], 8);
+                        EXPECT_EQ(memcmp(job.digests, hashes, 8*sizeof(struct sha256)), 0);
+                        for (int k = 0; k < 8; ++k) {
+                                EXPECT_EQ((mask >> k) & 1, leading_zero_bits(&hashes[k]) >= d);
+                        }
+                        found += mask != 0;
+                }
+        }
+        EXPECT_GT(found, 0);
+}
+
+TEST(gtest, wc_mining_job_init_groups) {
+        struct sha256_ctx ctx = mining_midstate();
+        wc_mining_job_t job;
+        struct sha256 hashes[20], expected[20];
+        const unsigned char *nonce2 = &wc_mining_nonces[4*500];
+        unsigned char nonces[4*(WC_MINING_MAX_NONCE_GROUPS - 1)];
+        for (int g = 0; g < WC_MINING_MAX_NONCE_GROUPS - 1; ++g) {
+                memcpy(nonces + 4*g, &wc_mining_nonces[4*(100*g + 17)], 4);
+        }
+        EXPECT_EQ(wc_mining_job_init_groups(&job, &ctx, 0, nonces, wc_mining_final), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_mining_job_init_groups(&job, &ctx, WC_MINING_MAX_NONCE_GROUPS + 1, nonces, wc_mining_final), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_mining_job_init_groups(&job, &ctx, 3, nullptr, wc_mining_final), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_mining_job_init_groups(&job, &ctx, 1, nullptr, wc_mining_final), WC_SUCCESS);
+        for (unsigned ngroups = 1; ngroups <= WC_MINING_MAX_NONCE_GROUPS; ++ngroups) {
+                ASSERT_EQ(wc_mining_job_init_groups(&job, &ctx, ngroups, nonces, wc_mining_final), WC_SUCCESS);
+                for (int i = 0; i < 20; ++i) {
+                        struct sha256_ctx c = ctx;
+                        sha256_update(&c, nonces, 4*(ngroups - 1));
+                        sha256_update(&c, nonce2 + 4*i, 4);
+                        sha256_update(&c, wc_mining_final, 4);
+                        sha256_done(&expected[i], &c);
+                }
+                wc_mining_job_hash(hashes[0].u8, &job, nonce2, 20);
+                EXPECT_EQ(memcmp(hashes, expected, sizeof(hashes)), 0);
+        }
+        // Replacing the leading groups only changes those bytes.
+        ASSERT_EQ(wc_mining_job_init_groups(&job, &ctx, 3, nonces, wc_mining_final), WC_SUCCESS);
+        wc_mining_job_set_nonces(&job, nonces + 8);
+        for (int i = 0; i < 4; ++i) {
+                struct sha256_ctx c = ctx;
+                sha256_update(&c, nonces + 8, 8);
+                sha256_update(&c, nonce2 + 4*i, 4);
+                sha256_update(&c, wc_mining_final, 4);
+                sha256_done(&expected[i], &c);
+        }
+        wc_mining_job_hash(hashes[0].u8, &job, nonce2, 4);
+        EXPECT_EQ(memcmp(hashes, expected, 4*sizeof(struct sha256)), 0);
+}
+
+TEST(gtest, wc_mining_best_width) {
+        size_t width = wc_mining_best_width();
+        EXPECT_TRUE(width == 4 || width == 8 || width == 16);
+}
+
+TEST(gtest, wc_mine_start) {
+        struct sha256_ctx ctx = mining_midstate();
+        struct sha256_ctx bad = SHA256_INIT;
+        std::vector<wc_mining_solution_t> sols;
+        auto collect = [](void *arg, const wc_mining_solution_t *sol) -> int {
+                ((std::vector<wc_mining_solution_t>*)arg)->push_back(*sol);
+                return 0;
+        };
+        wc_miner_handle_t miner = nullptr;
+        EXPECT_EQ(wc_mine_start(nullptr, &ctx, 10, 4, collect, &sols), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_mine_start(&miner, nullptr, 10, 4, collect, &sols), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_mine_start(&miner, &ctx, 10, 4, nullptr, &sols), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_mine_start(&miner, &ctx, 10, 0, collect, &sols), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_mine_start(&miner, &ctx, 10, 1001, collect, &sols), WC_ERROR_INVALID_ARGUMENT);
+        sha256_update(&bad, "e", 1);
+        EXPECT_EQ(wc_mine_start(&miner, &bad, 10, 4, collect, &sols), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(miner, nullptr);
+        EXPECT_EQ(wc_mine_wait(nullptr), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_mine_stop(nullptr), WC_ERROR_INVALID_ARGUMENT);
+
+        // Exhaustive single-threaded search, for comparison.
+        size_t expected = 0;
+        struct sha256 hashes[8];
+        for (int i = 0; i < 1000; ++i) {
+                for (int j = 0; j < 1000; j += 8) {
+                        wc_mining_8way(hashes[0].u8, &ctx, &wc_mining_nonces[4*i], &wc_mining_nonces[4*j], wc_mining_final);
+                        for (int k = 0; k < 8; ++k) {
+                                expected += leading_zero_bits(&hashes[k]) >= 10;
+                        }
+                }
+        }
+        ASSERT_GT(expected, 0);
+
+        ASSERT_EQ(wc_mine_start(&miner, &ctx, 10, 4, collect, &sols), WC_SUCCESS);
+        ASSERT_NE(miner, nullptr);
+        EXPECT_EQ(wc_mine_wait(miner), WC_SUCCESS);
+        EXPECT_EQ(sols.size(), expected);
+        for (auto &sol : sols) {
+                struct sha256_ctx c = ctx;
+                struct sha256 hash;
+                EXPECT_EQ(sol.ngroups, 2);
+                sha256_update(&c, sol.nonces, 4*sol.ngroups);
+                sha256_update(&c, wc_mining_final, 4);
+                sha256_done(&hash, &c);
+                EXPECT_EQ(memcmp(hash.u8, sol.hash.u8, 32), 0);
+                EXPECT_GE(sol.difficulty, 10);
+                EXPECT_EQ(sol.difficulty, leading_zero_bits(&hash));
+        }
+}
+
+TEST(gtest, wc_mine_stop) {
+        struct sha256_ctx ctx = mining_midstate();
+        size_t count = 0;
+        wc_miner_handle_t miner = nullptr;
+        // Returning non-zero from the callback stops the search.
+        ASSERT_EQ(wc_mine_start(&miner, &ctx, 4, 8, [](void *arg, const wc_mining_solution_t *sol) -> int {
+                ++*(size_t*)arg;
+                return 1;
+        }, &count), WC_SUCCESS);
+        EXPECT_EQ(wc_mine_wait(miner), WC_SUCCESS);
+        EXPECT_EQ(count, 1);
+        // An impossible difficulty only ever ends by cancellation.
+        count = 0;
+        ASSERT_EQ(wc_mine_start(&miner, &ctx, 256, 2, [](void *arg, const wc_mining_solution_t *sol) -> int {
+                ++*(size_t*)arg;
+                return 0;
+        }, &count), WC_SUCCESS);
+        EXPECT_EQ(wc_mine_stop(miner), WC_SUCCESS);
+        EXPECT_EQ(count, 0);
+}
+
+TEST(gtest, wc_mine_start_groups) {
+        struct sha256_ctx ctx = mining_midstate();
+        std::vector<wc_mining_solution_t> sols;
+        auto collect = [](void *arg, const wc_mining_solution_t *sol) -> int {
+                ((std::vector<wc_mining_solution_t>*)arg)->push_back(*sol);
+                return 0;
+        };
+        auto collect8 = [](void *arg, const wc_mining_solution_t *sol) -> int {
+                auto v = (std::vector<wc_mining_solution_t>*)arg;
+                v->push_back(*sol);
+                return v->size() >= 8;
+        };
+        wc_miner_handle_t miner = nullptr;
+        EXPECT_EQ(wc_mine_start_groups(&miner, &ctx, 0, 4, 2, collect, &sols), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_mine_start_groups(&miner, &ctx, WC_MINING_MAX_NONCE_GROUPS + 1, 4, 2, collect, &sols), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(miner, nullptr);
+
+        // A single nonce group is a search over just 1000 payloads.
+        size_t expected = 0;
+        for (int i = 0; i < 1000; ++i) {
+                struct sha256_ctx c = ctx;
+                struct sha256 hash;
+                sha256_update(&c, &wc_mining_nonces[4*i], 4);
+                sha256_update(&c, wc_mining_final, 4);
+                sha256_done(&hash, &c);
+                expected += leading_zero_bits(&hash) >= 4;
+        }
+        ASSERT_GT(expected, 0);
+        ASSERT_EQ(wc_mine_start_groups(&miner, &ctx, 1, 4, 3, collect, &sols), WC_SUCCESS);
+        EXPECT_EQ(wc_mine_wait(miner), WC_SUCCESS);
+        EXPECT_EQ(sols.size(), expected);
+
+        // Three nonce groups: stop after a handful of solutions, each of
+        // which must hash correctly.
+        sols.clear();
+        ASSERT_EQ(wc_mine_start_groups(&miner, &ctx, 3, 12, 4, collect8, &sols), WC_SUCCESS);
+        EXPECT_EQ(wc_mine_wait(miner), WC_SUCCESS);
+        EXPECT_EQ(sols.size(), 8);
+        for (auto &sol : sols) {
+                struct sha256_ctx c = ctx;
+                struct sha256 hash;
+                EXPECT_EQ(sol.ngroups, 3);
+                sha256_update(&c, sol.nonces, 4*sol.ngroups);
+                sha256_update(&c, wc_mining_final, 4);
+                sha256_done(&hash, &c);
+                EXPECT_EQ(memcmp(hash.u8, sol.hash.u8, 32), 0);
+                EXPECT_GE(sol.difficulty, 12);
+        }
+}
+
 TEST(gtetst, wc_derive_serials) {
         char buf1[64*20 + 1] = {0};
         char buf2[64*20 + 1] = {
@@ -375,6 +927,122 @@ TEST(gtetst, wc_derive_serials) {
         }
 }
 
+TEST(gtest, wc_derive_serials_raw) {
+        struct sha256 hdroot = {{
+                0x40, 0x7c, 0x95, 0x0b, 0x3d, 0xe6, 0x00, 0x64,
+                0xd7, 0xff, 0x74, 0x4b, 0x9b, 0x47, 0x43, 0xb8,
+                0xde, 0x58, 0xe9, 0x43, 0xe7, 0xc5, 0x37, 0xdf,
+                0x3d, 0x3a, 0x8a, 0x29, 0xa3, 0x2e, 0x1d, 0x0f
+        }};
+        const size_t count = 19;
+        char expected[64*count], hex[64*count];
+        struct sha256 raw[count];
+        wc_derive_serials(expected, &hdroot, 1, 3, count);
+        wc_derive_serials_raw(raw, &hdroot, 1, 3, count);
+        wc_hex_encode(hex, raw[0].u8, sizeof(raw));
+        EXPECT_EQ(memcmp(hex, expected, sizeof(hex)), 0);
+        // In-place encoding.
+        memcpy(hex, raw, sizeof(raw));
+        wc_hex_encode(hex, (const unsigned char*)hex, sizeof(raw));
+        EXPECT_EQ(memcmp(hex, expected, sizeof(hex)), 0);
+        unsigned char all[256];
+        char allhex[512 + 1] = {0};
+        for (int i = 0; i < 256; ++i) {
+                all[i] = (unsigned char)i;
+        }
+        wc_hex_encode(allhex, all, 256);
+        for (int i = 0; i < 256; ++i) {
+                char buf[3];
+                snprintf(buf, sizeof(buf), "%02x", i);
+                EXPECT_EQ(memcmp(allhex + 2*i, buf, 2), 0);
+        }
+        // In-place encoding at every length, with the scalar tail and
+        // vector blocks meeting at every offset.
+        for (size_t n = 0; n <= 40; ++n) {
+                char inplace[80];
+                memcpy(inplace, all + 100, n);
+                wc_hex_encode(inplace, (const unsigned char*)inplace, n);
+                EXPECT_EQ(memcmp(inplace, allhex + 200, 2*n), 0) << n;
+        }
+}
+
+TEST(gtest, wc_derive_publics) {
+        struct sha256 hdroot = {{
+                0x40, 0x7c, 0x95, 0x0b, 0x3d, 0xe6, 0x00, 0x64,
+                0xd7, 0xff, 0x74, 0x4b, 0x9b, 0x47, 0x43, 0xb8,
+                0xde, 0x58, 0xe9, 0x43, 0xe7, 0xc5, 0x37, 0xdf,
+                0x3d, 0x3a, 0x8a, 0x29, 0xa3, 0x2e, 0x1d, 0x0f
+        }};
+        const size_t count = 21;
+        struct sha256 hashes[count];
+        wc_derive_publics(hashes, &hdroot, 2, 7, count);
+        for (size_t n = 0; n < count; ++n) {
+                wc_secret_t secret;
+                secret.amount = 1;
+                ASSERT_EQ(wc_derive_serial(&secret.serial, &hdroot, 2, 7 + n), WC_SUCCESS);
+                wc_public_t pub = wc_public_from_secret(&secret);
+                EXPECT_EQ(memcmp(pub.hash.u8, hashes[n].u8, 32), 0);
+        }
+}
+
+TEST(gtest, wc_hex_decode) {
+        unsigned char bytes[40], decoded[40];
+        char hex[80];
+        int noncanonical = -1;
+        for (size_t i = 0; i < sizeof(bytes); ++i) {
+                bytes[i] = (unsigned char)(37*i + 11);
+        }
+        /* Round trip at every length, covering both the vector and scalar
+         * paths. */
+        for (size_t n = 0; n <= sizeof(bytes); ++n) {
+                wc_hex_encode(hex, bytes, n);
+                memset(decoded, 0, sizeof(decoded));
+                ASSERT_EQ(wc_hex_decode(decoded, &noncanonical, hex, n), WC_SUCCESS);
+                EXPECT_EQ(noncanonical, 0);
+                EXPECT_EQ(memcmp(decoded, bytes, n), 0);
+        }
+        /* Every byte value at every position is either a hex digit, or
+         * rejected. */
+        for (size_t pos = 0; pos < 64; ++pos) {
+                for (int c = 1; c < 256; ++c) {
+                        wc_hex_encode(hex, bytes, 32);
+                        hex[pos] = (char)c;
+                        bool lower = (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f');
+                        bool upper = c >= 'A' && c <= 'F';
+                        wc_error_t err = wc_hex_decode(decoded, &noncanonical, hex, 32);
+                        ASSERT_EQ(err, lower || upper ? WC_SUCCESS : WC_ERROR_INVALID_ARGUMENT) << pos << " " << c;
+                        if (err == WC_SUCCESS) {
+                                EXPECT_EQ(noncanonical, upper ? 1 : 0);
+                                unsigned char nibble = (unsigned char)(c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10);
+                                unsigned char b = decoded[pos / 2];
+                                EXPECT_EQ(pos % 2 ? (b & 0x0f) : (b >> 4), nibble);
+                        }
+                }
+        }
+}
+
+TEST(gtest, wc_derive_serials_mt) {
+        struct sha256 hdroot = {{
+                0x40, 0x7c, 0x95, 0x0b, 0x3d, 0xe6, 0x00, 0x64,
+                0xd7, 0xff, 0x74, 0x4b, 0x9b, 0x47, 0x43, 0xb8,
+                0xde, 0x58, 0xe9, 0x43, 0xe7, 0xc5, 0x37, 0xdf,
+                0x3d, 0x3a, 0x8a, 0x29, 0xa3, 0x2e, 0x1d, 0x0f
+        }};
+        const size_t count = 1001;
+        std::vector<char> expected(64*count), buf(64*count);
+        EXPECT_EQ(wc_derive_serials_mt(buf.data(), nullptr, 1, 0, count, 4), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_derive_serials_mt(buf.data(), &hdroot, 1, 0, count, 0), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_derive_serials_mt(nullptr, &hdroot, 1, 0, 0, 4), WC_SUCCESS);
+        wc_derive_serials(expected.data(), &hdroot, 1, 5, count);
+        for (unsigned nthreads : { 1, 2, 3, 7, 64, 1000 }) {
+                for (size_t n : { (size_t)1, (size_t)9, (size_t)64, count }) {
+                        std::fill(buf.begin(), buf.end(), 0);
+                        EXPECT_EQ(wc_derive_serials_mt(buf.data(), &hdroot, 1, 5, n, nthreads), WC_SUCCESS);
+                        EXPECT_EQ(memcmp(buf.data(), expected.data(), 64*n), 0);
+                }
+        }
+}
+
 TEST(gtest, wc_storage_open_close) {
         wc_storage_callbacks_t incompletecb = {
                 .log_open = [](wc_log_url_t logurl) -> wc_log_handle_t {
@@ -542,6 +1210,466 @@ TEST(gtest, wc_storage_terms) {
         EXPECT_EQ(wc_storage_close(w), WC_SUCCESS);
 }
 
+static int collect_terms(void *arg, const struct tm *when, bstring text) {
+        auto *out = static_cast<std::vector<std::string>*>(arg);
+        EXPECT_NE(when, nullptr);
+        out->emplace_back((const char*)text->data, (size_t)text->slen);
+        return 0;
+}
+
+static int first_terms(void *arg, const struct tm *when, bstring text) {
+        collect_terms(arg, when, text);
+        return 1;
+}
+
+struct nested_terms {
+        wc_storage_handle_t w;
+        std::vector<std::string> seen;
+};
+
+/* Lists all the terms from within the visitor, both ways, which must not
+ * disturb the walk in progress. */
+static int enumerate_in_terms(void *arg, const struct tm *when, bstring text) {
+        auto *n = static_cast<nested_terms*>(arg);
+        std::vector<wc_terms_t> vec(8);
+        std::vector<std::string> inner;
+        size_t count = vec.size();
+        EXPECT_EQ(wc_storage_enumerate_terms(n->w, vec.data(), &count), WC_SUCCESS);
+        EXPECT_EQ(count, 2u);
+        EXPECT_EQ(wc_storage_foreach_terms(n->w, collect_terms, &inner), WC_SUCCESS);
+        EXPECT_EQ(inner, (std::vector<std::string>{"foo", "bar"}));
+        return collect_terms(&n->seen, when, text);
+}
+
+TEST(gtest, wc_storage_foreach_terms) {
+        // g_storage_callbacks provides neither count_terms nor each_terms,
+        // so this exercises the fallback onto all_terms.
+        wc_storage_handle_t w = nullptr;
+        ASSERT_EQ(wc_storage_open(&w, &g_storage_callbacks, nullptr, nullptr), WC_SUCCESS);
+        g_terms.clear();
+
+        size_t count = 1;
+        std::vector<std::string> seen;
+        EXPECT_EQ(wc_storage_count_terms(w, nullptr), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_storage_count_terms(w, &count), WC_SUCCESS);
+        EXPECT_EQ(count, 0);
+        EXPECT_EQ(wc_storage_foreach_terms(w, nullptr, nullptr), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_storage_foreach_terms(w, collect_terms, &seen), WC_SUCCESS);
+        EXPECT_TRUE(seen.empty());
+
+        g_terms["a"] = 1;
+        g_terms["b"] = 2;
+        g_terms["c"] = 3;
+        EXPECT_EQ(wc_storage_count_terms(w, &count), WC_SUCCESS);
+        EXPECT_EQ(count, 3);
+        EXPECT_EQ(wc_storage_foreach_terms(w, collect_terms, &seen), WC_SUCCESS);
+        EXPECT_EQ(seen, (std::vector<std::string>{"a", "b", "c"}));
+        seen.clear();
+        EXPECT_EQ(wc_storage_foreach_terms(w, first_terms, &seen), WC_SUCCESS);
+        EXPECT_EQ(seen, (std::vector<std::string>{"a"}));
+
+        g_terms.clear();
+        EXPECT_EQ(wc_storage_close(w), WC_SUCCESS);
+}
+
+TEST(gtest, wc_storage_sqlite) {
+        std::string dbpath = testing::TempDir() + "wc_storage_sqlite.db";
+        std::string logpath = testing::TempDir() + "wc_storage_sqlite.log";
+        for (const char *suffix : {"", "-wal", "-shm"}) {
+                remove((dbpath + suffix).c_str());
+        }
+        remove(logpath.c_str());
+
+        wc_log_url_t logurl = (wc_log_url_t)logpath.c_str();
+        wc_db_url_t dburl = (wc_db_url_t)dbpath.c_str();
+        wc_storage_handle_t w = nullptr;
+        EXPECT_EQ(wc_storage_open(&w, &wc_storage_sqlite_callbacks, nullptr, dburl), WC_ERROR_LOG_OPEN_FAILED);
+        EXPECT_EQ(wc_storage_open(&w, &wc_storage_sqlite_callbacks, logurl, nullptr), WC_ERROR_DB_OPEN_FAILED);
+        EXPECT_EQ(w, nullptr);
+        ASSERT_EQ(wc_storage_open(&w, &wc_storage_sqlite_callbacks, logurl, dburl), WC_SUCCESS);
+        ASSERT_NE(w, nullptr);
+
+        int accepted = -1;
+        EXPECT_EQ(wc_storage_have_accepted_terms(w, &accepted), WC_SUCCESS);
+        EXPECT_EQ(accepted, 0);
+
+        size_t count = 1;
+        EXPECT_EQ(wc_storage_enumerate_terms(w, nullptr, &count), WC_ERROR_INSUFFICIENT_CAPACITY);
+        EXPECT_EQ(count, 0);
+
+        bstring foo = cstr2bstr("foo");
+        bstring bar = cstr2bstr("bar");
+        struct tm when = {0};
+        when.tm_year = 2023 - 1900;
+        when.tm_mon = 0;
+        when.tm_mday = 2;
+        EXPECT_EQ(wc_storage_accept_terms(w, foo, &when), WC_SUCCESS);
+        EXPECT_EQ(wc_storage_accept_terms(w, bar, nullptr), WC_SUCCESS);
+        EXPECT_EQ(wc_storage_close(w), WC_SUCCESS);
+
+        /* Everything must persist across a close and reopen. */
+        w = nullptr;
+        ASSERT_EQ(wc_storage_open(&w, &wc_storage_sqlite_callbacks, logurl, dburl), WC_SUCCESS);
+        accepted = -1;
+        EXPECT_EQ(wc_storage_have_accepted_terms(w, &accepted), WC_SUCCESS);
+        EXPECT_EQ(accepted, 1);
+
+        struct tm got = {0};
+        accepted = -1;
+        EXPECT_EQ(wc_storage_are_terms_accepted(w, &accepted, &got, foo), WC_SUCCESS);
+        EXPECT_EQ(accepted, 1);
+        EXPECT_EQ(got.tm_year, 2023 - 1900);
+        EXPECT_EQ(got.tm_mon, 0);
+        EXPECT_EQ(got.tm_mday, 2);
+
+        std::vector<wc_terms_t> vec(1);
+        count = vec.size();
+        EXPECT_EQ(wc_storage_enumerate_terms(w, vec.data(), &count), WC_ERROR_INSUFFICIENT_CAPACITY);
+        EXPECT_EQ(count, 2);
+        vec.resize(count);
+        EXPECT_EQ(wc_storage_enumerate_terms(w, vec.data(), &count), WC_SUCCESS);
+        ASSERT_EQ(count, 2);
+        EXPECT_EQ(biseq(vec[0].text, foo), 1);
+        EXPECT_EQ(biseq(vec[1].text, bar), 1);
+
+        count = 0;
+        EXPECT_EQ(wc_storage_count_terms(w, &count), WC_SUCCESS);
+        EXPECT_EQ(count, 2);
+        std::vector<std::string> seen;
+        EXPECT_EQ(wc_storage_foreach_terms(w, collect_terms, &seen), WC_SUCCESS);
+        EXPECT_EQ(seen, (std::vector<std::string>{"foo", "bar"}));
+        seen.clear();
+        EXPECT_EQ(wc_storage_foreach_terms(w, first_terms, &seen), WC_SUCCESS);
+        EXPECT_EQ(seen, (std::vector<std::string>{"foo"}));
+        nested_terms nested = {w, {}};
+        EXPECT_EQ(wc_storage_foreach_terms(w, enumerate_in_terms, &nested), WC_SUCCESS);
+        EXPECT_EQ(nested.seen, (std::vector<std::string>{"foo", "bar"}));
+
+        bstring baz = cstr2bstr("baz");
+        accepted = -1;
+        EXPECT_EQ(wc_storage_are_terms_accepted(w, &accepted, nullptr, baz), WC_SUCCESS);
+        EXPECT_EQ(accepted, 0);
+
+        bdestroy(baz);
+        bdestroy(bar);
+        bdestroy(foo);
+        EXPECT_EQ(wc_storage_close(w), WC_SUCCESS);
+}
+
+static wc_db_secret_t make_db_secret(const std::string &serial, wc_amount_t amount, uint64_t depth) {
+        wc_db_secret_t s = {};
+        s.secret.amount = amount;
+        s.secret.serial = serial.data();
+        s.secret.len = serial.size();
+        struct sha256_ctx ctx = SHA256_INIT;
+        sha256_update(&ctx, serial.data(), serial.size());
+        sha256_done(&s.hash, &ctx);
+        s.derived = 1;
+        s.chaincode = 0;
+        s.depth = depth;
+        return s;
+}
+
+TEST(gtest, wc_storage_transactions) {
+        std::string dbpath = testing::TempDir() + "wc_storage_txn.db";
+        std::string logpath = testing::TempDir() + "wc_storage_txn.log";
+        for (const char *suffix : {"", "-wal", "-shm"}) {
+                remove((dbpath + suffix).c_str());
+        }
+        remove(logpath.c_str());
+
+        wc_storage_handle_t w = nullptr;
+        ASSERT_EQ(wc_storage_open(&w, &wc_storage_sqlite_callbacks, (wc_log_url_t)logpath.c_str(), (wc_db_url_t)dbpath.c_str()), WC_SUCCESS);
+
+        EXPECT_EQ(wc_storage_begin(nullptr), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_storage_commit(w), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_storage_rollback(w), WC_ERROR_INVALID_ARGUMENT);
+
+        std::vector<std::string> serials;
+        for (int i = 0; i < 4; ++i) {
+                serials.push_back(std::string(63, 'a') + (char)('0' + i));
+        }
+        std::vector<wc_db_secret_t> secrets;
+        for (size_t i = 0; i < serials.size(); ++i) {
+                secrets.push_back(make_db_secret(serials[i], 100 + i, i));
+        }
+
+        /* Rolled-back writes leave no trace, so the same secrets can be
+         * added again. */
+        EXPECT_EQ(wc_storage_begin(w), WC_SUCCESS);
+        EXPECT_EQ(wc_storage_begin(w), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_storage_add_secrets(w, secrets.data(), 2), WC_SUCCESS);
+        EXPECT_EQ(wc_storage_rollback(w), WC_SUCCESS);
+        EXPECT_EQ(wc_storage_add_secrets(w, secrets.data(), 2), WC_SUCCESS);
+
+        /* Duplicate public hashes are rejected, and a failing batch is
+         * written not at all. */
+        EXPECT_EQ(wc_storage_add_secrets(w, &secrets[1], 2), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_storage_add_secrets(w, &secrets[2], 1), WC_SUCCESS);
+
+        /* A replace spends its inputs and creates its outputs atomically. */
+        struct sha256 inputs[2] = { secrets[0].hash, secrets[1].hash };
+        EXPECT_EQ(wc_storage_replace(w, inputs, 2, &secrets[2], 1), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_storage_replace(w, inputs, 2, &secrets[3], 1), WC_SUCCESS);
+        EXPECT_EQ(wc_storage_add_secrets(w, &secrets[3], 1), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_storage_spend_outputs(w, inputs, 2), WC_SUCCESS);
+        EXPECT_EQ(wc_storage_replace(w, nullptr, 0, nullptr, 0), WC_SUCCESS);
+
+        /* Closing with an open transaction discards it. */
+        EXPECT_EQ(wc_storage_begin(w), WC_SUCCESS);
+        const std::string extra_serial(64, 'b');
+        wc_db_secret_t extra = make_db_secret(extra_serial, 1, 9);
+        EXPECT_EQ(wc_storage_add_secrets(w, &extra, 1), WC_SUCCESS);
+        EXPECT_EQ(wc_storage_close(w), WC_SUCCESS);
+        w = nullptr;
+        ASSERT_EQ(wc_storage_open(&w, &wc_storage_sqlite_callbacks, (wc_log_url_t)logpath.c_str(), (wc_db_url_t)dbpath.c_str()), WC_SUCCESS);
+        EXPECT_EQ(wc_storage_add_secrets(w, &extra, 1), WC_SUCCESS);
+        EXPECT_EQ(wc_storage_add_secrets(w, &secrets[0], 1), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_storage_close(w), WC_SUCCESS);
+
+        /* Backends without transaction support still pair calls. */
+        ASSERT_EQ(wc_storage_open(&w, &g_storage_callbacks, nullptr, nullptr), WC_SUCCESS);
+        EXPECT_EQ(wc_storage_begin(w), WC_SUCCESS);
+        EXPECT_EQ(wc_storage_add_secrets(w, secrets.data(), 1), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_storage_commit(w), WC_SUCCESS);
+        EXPECT_EQ(wc_storage_commit(w), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_storage_close(w), WC_SUCCESS);
+}
+
+struct test_log {
+        std::mutex lock;
+        std::string data;
+        int writes = 0;
+        int syncs = 0;
+        bool fail = false;
+};
+
+static wc_storage_callbacks_t test_log_callbacks() {
+        wc_storage_callbacks_t cb = g_storage_callbacks;
+        cb.log_open = [](wc_log_url_t logurl) -> wc_log_handle_t {
+                return (wc_log_handle_t)logurl;
+        };
+        cb.log_write = [](wc_log_handle_t log, const void *data, size_t len) -> wc_error_t {
+                test_log *t = (test_log*)log;
+                std::lock_guard<std::mutex> guard(t->lock);
+                if (t->fail) {
+                        return WC_ERROR_UNKNOWN;
+                }
+                t->data.append((const char*)data, len);
+                ++t->writes;
+                return WC_SUCCESS;
+        };
+        cb.log_sync = [](wc_log_handle_t log) -> wc_error_t {
+                test_log *t = (test_log*)log;
+                std::lock_guard<std::mutex> guard(t->lock);
+                /* Slow enough that concurrent appenders pile up. */
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                ++t->syncs;
+                return WC_SUCCESS;
+        };
+        return cb;
+}
+
+static std::vector<std::string> read_log(wc_log_reader_handle_t r) {
+        std::vector<std::string> records;
+        uint64_t count = 0;
+        EXPECT_EQ(wc_log_reader_count(r, &count), WC_SUCCESS);
+        for (uint64_t i = 0; i < count; ++i) {
+                const void *rec = nullptr;
+                size_t len = 0;
+                EXPECT_EQ(wc_log_reader_get(r, i, &rec, &len), WC_SUCCESS);
+                records.emplace_back((const char*)rec, len);
+        }
+        return records;
+}
+
+static std::vector<std::string> read_log(const std::string &data) {
+        wc_log_reader_handle_t r = nullptr;
+        EXPECT_EQ(wc_log_reader_open_memory(&r, data.data(), data.size()), WC_SUCCESS);
+        if (!r) {
+                return {};
+        }
+        std::vector<std::string> records = read_log(r);
+        EXPECT_EQ(wc_log_reader_close(r), WC_SUCCESS);
+        return records;
+}
+
+TEST(gtest, wc_storage_log_append) {
+        wc_storage_callbacks_t cb = test_log_callbacks();
+        test_log log;
+        wc_storage_handle_t w = nullptr;
+        ASSERT_EQ(wc_storage_open(&w, &cb, (wc_log_url_t)&log, nullptr), WC_SUCCESS);
+
+        EXPECT_EQ(wc_storage_log_append(nullptr, "a", 1), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_storage_log_append(w, nullptr, 1), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_storage_log_configure(w, WC_LOG_SYNC_INTERVAL, 0), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_storage_log_configure(w, (wc_log_sync_t)42, 0), WC_ERROR_INVALID_ARGUMENT);
+
+        /* Per-record: durable on return. */
+        EXPECT_EQ(wc_storage_log_append(w, "one\n", 4), WC_SUCCESS);
+        EXPECT_EQ(read_log(log.data), std::vector<std::string>{"one\n"});
+        EXPECT_EQ(log.syncs, 1);
+
+        /* Concurrent appenders share writes and syncs, and records are never
+         * interleaved. */
+        const int nthreads = 8, nrecords = 50;
+        std::vector<std::thread> threads;
+        for (int i = 0; i < nthreads; ++i) {
+                threads.emplace_back([w, i]() {
+                        std::string rec = std::string(15, (char)('a' + i)) + "\n";
+                        for (int j = 0; j < nrecords; ++j) {
+                                EXPECT_EQ(wc_storage_log_append(w, rec.data(), rec.size()), WC_SUCCESS);
+                        }
+                });
+        }
+        for (auto &t : threads) {
+                t.join();
+        }
+        std::vector<std::string> records = read_log(log.data);
+        EXPECT_EQ(records.size(), 1 + nthreads * nrecords);
+        std::map<char, int> seen;
+        for (size_t i = 1; i < records.size(); ++i) {
+                EXPECT_EQ(records[i], std::string(15, records[i][0]) + "\n");
+                ++seen[records[i][0]];
+        }
+        for (int i = 0; i < nthreads; ++i) {
+                EXPECT_EQ(seen[(char)('a' + i)], nrecords);
+        }
+        EXPECT_LT(log.syncs, 1 + nthreads * nrecords);
+        EXPECT_EQ(wc_storage_log_append(w, std::string(WC_LOG_RECORD_MAX + 1, 'x').data(), WC_LOG_RECORD_MAX + 1), WC_ERROR_OVERFLOW);
+
+        /* Per-batch: nothing is written until flushed. */
+        EXPECT_EQ(wc_storage_log_configure(w, WC_LOG_SYNC_BATCH, 0), WC_SUCCESS);
+        int syncs = log.syncs;
+        size_t size = log.data.size();
+        size_t nrecs = read_log(log.data).size();
+        for (int j = 0; j < 10; ++j) {
+                EXPECT_EQ(wc_storage_log_append(w, "batch\n", 6), WC_SUCCESS);
+        }
+        EXPECT_EQ(log.data.size(), size);
+        EXPECT_EQ(wc_storage_log_flush(w), WC_SUCCESS);
+        EXPECT_EQ(read_log(log.data).size(), nrecs + 10);
+        EXPECT_EQ(log.syncs, syncs + 1);
+
+        /* Per-interval: written in the background. */
+        size = log.data.size();
+        EXPECT_EQ(wc_storage_log_configure(w, WC_LOG_SYNC_INTERVAL, 5), WC_SUCCESS);
+        EXPECT_EQ(wc_storage_log_append(w, "later\n", 6), WC_SUCCESS);
+        for (int j = 0; j < 1000; ++j) {
+                {
+                        std::lock_guard<std::mutex> guard(log.lock);
+                        if (log.data.size() > size) {
+                                break;
+                        }
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        {
+                std::lock_guard<std::mutex> guard(log.lock);
+                EXPECT_EQ(read_log(log.data).size(), nrecs + 11);
+        }
+
+        /* Failures are sticky. */
+        EXPECT_EQ(wc_storage_log_configure(w, WC_LOG_SYNC_RECORD, 0), WC_SUCCESS);
+        log.fail = true;
+        EXPECT_EQ(wc_storage_log_append(w, "x", 1), WC_ERROR_UNKNOWN);
+        log.fail = false;
+        EXPECT_EQ(wc_storage_log_append(w, "y", 1), WC_ERROR_UNKNOWN);
+        EXPECT_EQ(wc_storage_log_flush(w), WC_ERROR_UNKNOWN);
+        EXPECT_EQ(wc_storage_close(w), WC_SUCCESS);
+}
+
+TEST(gtest, wc_storage_sqlite_log) {
+        std::string dbpath = testing::TempDir() + "wc_storage_log.db";
+        std::string logpath = testing::TempDir() + "wc_storage_log.log";
+        for (const char *suffix : {"", "-wal", "-shm"}) {
+                remove((dbpath + suffix).c_str());
+        }
+        remove(logpath.c_str());
+
+        wc_storage_handle_t w = nullptr;
+        ASSERT_EQ(wc_storage_open(&w, &wc_storage_sqlite_callbacks, (wc_log_url_t)logpath.c_str(), (wc_db_url_t)dbpath.c_str()), WC_SUCCESS);
+        EXPECT_EQ(wc_storage_log_append(w, "first\n", 6), WC_SUCCESS);
+        EXPECT_EQ(wc_storage_log_configure(w, WC_LOG_SYNC_BATCH, 0), WC_SUCCESS);
+        EXPECT_EQ(wc_storage_log_append(w, "second\n", 7), WC_SUCCESS);
+        /* Closing flushes whatever is still buffered. */
+        EXPECT_EQ(wc_storage_close(w), WC_SUCCESS);
+
+        wc_log_reader_handle_t r = nullptr;
+        ASSERT_EQ(wc_log_reader_open(&r, logpath.c_str()), WC_SUCCESS);
+        EXPECT_EQ(read_log(r), (std::vector<std::string>{"first\n", "second\n"}));
+        EXPECT_EQ(wc_log_reader_close(r), WC_SUCCESS);
+}
+
+TEST(gtest, wc_log_reader) {
+        std::string logpath = testing::TempDir() + "wc_log_reader.log";
+        std::string dbpath = testing::TempDir() + "wc_log_reader.db";
+        for (const char *suffix : {"", "-wal", "-shm"}) {
+                remove((dbpath + suffix).c_str());
+        }
+        remove(logpath.c_str());
+        wc_log_reader_handle_t r = nullptr;
+        EXPECT_EQ(wc_log_reader_open(&r, nullptr), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_log_reader_open(&r, logpath.c_str()), WC_ERROR_LOG_OPEN_FAILED);
+
+        /* Three sessions, each closed cleanly, so the reader can follow the
+         * chain of footers. */
+        std::vector<std::string> expected;
+        for (int session = 0; session < 3; ++session) {
+                wc_storage_handle_t w = nullptr;
+                ASSERT_EQ(wc_storage_open(&w, &wc_storage_sqlite_callbacks, (wc_log_url_t)logpath.c_str(), (wc_db_url_t)dbpath.c_str()), WC_SUCCESS);
+                EXPECT_EQ(wc_storage_log_configure(w, WC_LOG_SYNC_BATCH, 0), WC_SUCCESS);
+                for (int block = 0; block < 3; ++block) {
+                        for (int i = 0; i <= block; ++i) {
+                                std::string rec = std::to_string(session) + ":" + std::to_string(block) + ":" + std::to_string(i);
+                                EXPECT_EQ(wc_storage_log_append(w, rec.data(), rec.size()), WC_SUCCESS);
+                                expected.push_back(rec);
+                        }
+                        EXPECT_EQ(wc_storage_log_flush(w), WC_SUCCESS);
+                }
+                EXPECT_EQ(wc_storage_close(w), WC_SUCCESS);
+        }
+        ASSERT_EQ(wc_log_reader_open(&r, logpath.c_str()), WC_SUCCESS);
+        EXPECT_EQ(read_log(r), expected);
+        const void *rec = nullptr;
+        size_t len = 0;
+        EXPECT_EQ(wc_log_reader_get(r, expected.size(), &rec, &len), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_log_reader_close(r), WC_SUCCESS);
+
+        /* The same log with a torn block at the end, as after a crash, and
+         * with a record corrupted. */
+        std::string data;
+        {
+                FILE *f = fopen(logpath.c_str(), "rb");
+                ASSERT_NE(f, nullptr);
+                char buf[4096];
+                size_t n = 0;
+                while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+                        data.append(buf, n);
+                }
+                fclose(f);
+        }
+        std::string torn = data;
+        torn.append("WCLB\x05\x00\x00\x00", 8);
+        torn.append(100, '\0');
+        EXPECT_EQ(read_log(torn), expected);
+
+        std::string corrupt = data;
+        size_t at = corrupt.find("0:0:0");
+        ASSERT_NE(at, std::string::npos);
+        corrupt[at] = '9';
+        ASSERT_EQ(wc_log_reader_open_memory(&r, corrupt.data(), corrupt.size()), WC_SUCCESS);
+        uint64_t count = 0;
+        EXPECT_EQ(wc_log_reader_count(r, &count), WC_SUCCESS);
+        EXPECT_EQ(count, expected.size());
+        EXPECT_EQ(wc_log_reader_get(r, 0, &rec, &len), WC_ERROR_DB_CORRUPT);
+        EXPECT_EQ(wc_log_reader_get(r, 1, &rec, &len), WC_SUCCESS);
+        EXPECT_EQ(std::string((const char*)rec, len), expected[1]);
+        EXPECT_EQ(wc_log_reader_close(r), WC_SUCCESS);
+}
+
+extern wc_server_callbacks_t g_server_callbacks;
+
 TEST(gtest, wc_server_connect) {
         wc_server_callbacks_t incompletecb = {};
         wc_server_callbacks_t cb = {
@@ -567,6 +1695,11 @@ TEST(gtest, wc_server_connect) {
         ASSERT_NE(c, nullptr);
         EXPECT_EQ(wc_server_disconnect(nullptr), WC_ERROR_INVALID_ARGUMENT);
         EXPECT_EQ(wc_server_disconnect(c), WC_SUCCESS);
+
+        /* The original members keep their positions. */
+        wc_server_callbacks_t positional = { cb.connect, nullptr, g_server_callbacks.get_terms };
+        EXPECT_EQ(positional.get_terms, g_server_callbacks.get_terms);
+        EXPECT_EQ(positional.ping, nullptr);
 }
 
 std::string g_terms_of_service = "Terms of Service";
@@ -694,6 +1827,10 @@ TEST(gtest, wc_wallet_configure) {
         EXPECT_EQ(wc_wallet_configure(&wallet, storage, server, ui), WC_SUCCESS);
         ASSERT_NE(wallet, nullptr);
         EXPECT_EQ(g_terms.size(), 0);
+        // Storage which cannot enumerate its secrets has no output index.
+        struct sha256 hash = {};
+        wc_output_info_t info;
+        EXPECT_EQ(wc_wallet_lookup_outputs(wallet, &info, &hash, 1), WC_ERROR_INVALID_ARGUMENT);
         EXPECT_EQ(wc_wallet_release(nullptr), WC_ERROR_INVALID_ARGUMENT);
         EXPECT_EQ(wc_wallet_release(wallet), WC_SUCCESS);
 
@@ -771,6 +1908,964 @@ TEST(gtest, wc_wallet_terms_of_service) {
         EXPECT_EQ(wc_wallet_release(wallet), WC_SUCCESS);
 }
 
+TEST(gtest, wc_wallet_lookup_outputs) {
+        std::string dbpath = testing::TempDir() + "wc_wallet_lookup.db";
+        std::string logpath = testing::TempDir() + "wc_wallet_lookup.log";
+        for (const char *suffix : {"", "-wal", "-shm"}) {
+                remove((dbpath + suffix).c_str());
+        }
+        remove(logpath.c_str());
+        wc_log_url_t logurl = (wc_log_url_t)logpath.c_str();
+        wc_db_url_t dburl = (wc_db_url_t)dbpath.c_str();
+
+        /* Enough secrets to force the table to grow several times. */
+        const size_t n = 1000;
+        std::vector<std::string> serials;
+        std::vector<wc_db_secret_t> secrets;
+        for (size_t i = 0; i < n + 1; ++i) {
+                serials.push_back(std::to_string(i) + std::string(60, 'c'));
+        }
+        for (size_t i = 0; i < n + 1; ++i) {
+                secrets.push_back(make_db_secret(serials[i], 1 + i, i));
+        }
+        secrets[7].derived = 0;
+
+        wc_storage_handle_t storage = nullptr;
+        ASSERT_EQ(wc_storage_open(&storage, &wc_storage_sqlite_callbacks, logurl, dburl), WC_SUCCESS);
+        EXPECT_EQ(wc_storage_add_secrets(storage, secrets.data(), n), WC_SUCCESS);
+        EXPECT_EQ(wc_storage_spend_outputs(storage, &secrets[3].hash, 1), WC_SUCCESS);
+        EXPECT_EQ(wc_storage_close(storage), WC_SUCCESS);
+
+        /* The index is loaded from the database at configure time. */
+        wc_server_handle_t server = nullptr;
+        wc_ui_handle_t ui = nullptr;
+        wc_wallet_handle_t wallet = nullptr;
+        ASSERT_EQ(wc_storage_open(&storage, &wc_storage_sqlite_callbacks, logurl, dburl), WC_SUCCESS);
+        ASSERT_EQ(wc_server_connect(&server, &g_server_callbacks, nullptr), WC_SUCCESS);
+        ASSERT_EQ(wc_ui_startup(&ui, &g_ui_callbacks, nullptr), WC_SUCCESS);
+        ASSERT_EQ(wc_wallet_configure(&wallet, storage, server, ui), WC_SUCCESS);
+
+        std::vector<struct sha256> hashes;
+        for (const auto &s : secrets) {
+                hashes.push_back(s.hash);
+        }
+        std::vector<wc_output_info_t> info(hashes.size());
+        EXPECT_EQ(wc_wallet_lookup_outputs(nullptr, info.data(), hashes.data(), n), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_wallet_lookup_outputs(wallet, nullptr, hashes.data(), n), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_wallet_lookup_outputs(wallet, nullptr, nullptr, 0), WC_SUCCESS);
+        EXPECT_EQ(wc_wallet_lookup_outputs(wallet, info.data(), hashes.data(), hashes.size()), WC_SUCCESS);
+        for (size_t i = 0; i < n; ++i) {
+                EXPECT_EQ(info[i].found, 1);
+                EXPECT_EQ(info[i].amount, (wc_amount_t)(1 + i));
+                EXPECT_EQ(info[i].spent, i == 3);
+                EXPECT_EQ(info[i].derived, i != 7);
+                EXPECT_EQ(info[i].depth, i != 7 ? i : 0);
+        }
+        EXPECT_EQ(info[n].found, 0);
+
+        /* Writes through storage are reflected immediately, and rolled-back
+         * writes are forgotten. */
+        EXPECT_EQ(wc_storage_replace(storage, &secrets[0].hash, 1, &secrets[n], 1), WC_SUCCESS);
+        EXPECT_EQ(wc_wallet_lookup_outputs(wallet, info.data(), hashes.data(), hashes.size()), WC_SUCCESS);
+        EXPECT_EQ(info[0].spent, 1);
+        EXPECT_EQ(info[n].found, 1);
+        EXPECT_EQ(info[n].spent, 0);
+
+        const std::string extra_serial(64, 'd');
+        wc_db_secret_t extra = make_db_secret(extra_serial, 5, n + 5);
+        EXPECT_EQ(wc_storage_begin(storage), WC_SUCCESS);
+        EXPECT_EQ(wc_storage_add_secrets(storage, &extra, 1), WC_SUCCESS);
+        EXPECT_EQ(wc_wallet_lookup_outputs(wallet, info.data(), &extra.hash, 1), WC_SUCCESS);
+        EXPECT_EQ(info[0].found, 1);
+        EXPECT_EQ(wc_storage_rollback(storage), WC_SUCCESS);
+        EXPECT_EQ(wc_wallet_lookup_outputs(wallet, info.data(), &extra.hash, 1), WC_SUCCESS);
+        EXPECT_EQ(info[0].found, 0);
+        EXPECT_EQ(wc_wallet_lookup_outputs(wallet, info.data(), &hashes[n], 1), WC_SUCCESS);
+        EXPECT_EQ(info[0].found, 1);
+
+        EXPECT_EQ(wc_wallet_release(wallet), WC_SUCCESS);
+}
+
+static std::map<std::string, wc_health_t> g_server_outputs;
+static int g_health_checks = 0;
+
+TEST(gtest, wc_wallet_recover) {
+        std::string dbpath = testing::TempDir() + "wc_wallet_recover.db";
+        std::string logpath = testing::TempDir() + "wc_wallet_recover.log";
+        for (const char *suffix : {"", "-wal", "-shm"}) {
+                remove((dbpath + suffix).c_str());
+        }
+        remove(logpath.c_str());
+
+        const struct sha256 root = {{
+                0x40, 0x7c, 0x95, 0x0b, 0x3d, 0xe6, 0x00, 0x64,
+                0xd7, 0xff, 0x74, 0x4b, 0x9b, 0x47, 0x43, 0xb8,
+                0xde, 0x58, 0xe9, 0x43, 0xe7, 0xc5, 0x37, 0xdf,
+                0x3d, 0x3a, 0x8a, 0x29, 0xa3, 0x2e, 0x1d, 0x0f
+        }};
+        struct known { uint64_t chaincode, depth; int spent; wc_amount_t amount; };
+        const known outputs[] = {
+                {0, 0, 0, 100}, {0, 5, 1, 0}, {0, 130, 0, 250}, {2, 3, 0, 7},
+        };
+        g_server_outputs.clear();
+        for (const auto &o : outputs) {
+                struct sha256 hash;
+                wc_derive_publics(&hash, &root, o.chaincode, o.depth, 1);
+                wc_health_t h = {1, o.spent, o.amount};
+                g_server_outputs[std::string((const char*)hash.u8, 32)] = h;
+        }
+
+        wc_server_callbacks_t server_cb = g_server_callbacks;
+        server_cb.health_check = [](wc_conn_handle_t conn, const struct sha256 *hashes, size_t count, wc_health_t *result) -> wc_error_t {
+                ++g_health_checks;
+                for (size_t i = 0; i < count; ++i) {
+                        auto it = g_server_outputs.find(std::string((const char*)hashes[i].u8, 32));
+                        result[i] = it != g_server_outputs.end() ? it->second : wc_health_t{0, 0, 0};
+                }
+                return WC_SUCCESS;
+        };
+
+        wc_storage_handle_t storage = nullptr;
+        wc_server_handle_t server = nullptr;
+        wc_ui_handle_t ui = nullptr;
+        wc_wallet_handle_t wallet = nullptr;
+        ASSERT_EQ(wc_storage_open(&storage, &wc_storage_sqlite_callbacks, (wc_log_url_t)logpath.c_str(), (wc_db_url_t)dbpath.c_str()), WC_SUCCESS);
+        ASSERT_EQ(wc_server_connect(&server, &server_cb, nullptr), WC_SUCCESS);
+        ASSERT_EQ(wc_ui_startup(&ui, &g_ui_callbacks, nullptr), WC_SUCCESS);
+        ASSERT_EQ(wc_wallet_configure(&wallet, storage, server, ui), WC_SUCCESS);
+
+        wc_recover_params_t params = {};
+        params.batch = 50;
+        params.gap_limit = 100;
+        wc_recover_result_t result;
+        EXPECT_EQ(wc_wallet_recover(nullptr, &result, &root, &params), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_wallet_recover(wallet, &result, nullptr, &params), WC_ERROR_INVALID_ARGUMENT);
+        params.nchaincodes = WC_RECOVER_MAX_CHAINCODES + 1;
+        EXPECT_EQ(wc_wallet_recover(wallet, &result, &root, &params), WC_ERROR_INVALID_ARGUMENT);
+        params.nchaincodes = 0;
+
+        g_health_checks = 0;
+        EXPECT_EQ(wc_wallet_recover(wallet, &result, &root, &params), WC_SUCCESS);
+        EXPECT_EQ(result.recovered, 4);
+        EXPECT_EQ(result.unspent, 3);
+        EXPECT_EQ(result.balance, 357);
+        EXPECT_EQ(result.next_depth[0], 131);
+        EXPECT_EQ(result.next_depth[1], 0);
+        EXPECT_EQ(result.next_depth[2], 4);
+        EXPECT_EQ(result.next_depth[3], 0);
+        /* Chaincode 0 scans depths 0..249 in five batches, chaincode 2
+         * depths 0..149 in three, and the unused ones 0..99 in two. */
+        EXPECT_EQ(g_health_checks, 5 + 2 + 3 + 2);
+
+        struct sha256 hashes[2];
+        wc_derive_publics(&hashes[0], &root, 0, 5, 1);
+        wc_derive_publics(&hashes[1], &root, 0, 130, 1);
+        wc_output_info_t info[2];
+        EXPECT_EQ(wc_wallet_lookup_outputs(wallet, info, hashes, 2), WC_SUCCESS);
+        EXPECT_EQ(info[0].found, 1);
+        EXPECT_EQ(info[0].spent, 1);
+        EXPECT_EQ(info[1].found, 1);
+        EXPECT_EQ(info[1].spent, 0);
+        EXPECT_EQ(info[1].amount, 250);
+        EXPECT_EQ(info[1].depth, 130);
+
+        /* Running again finds nothing new. */
+        EXPECT_EQ(wc_wallet_recover(wallet, &result, &root, &params), WC_SUCCESS);
+        EXPECT_EQ(result.recovered, 0);
+        EXPECT_EQ(result.next_depth[0], 131);
+
+        EXPECT_EQ(wc_wallet_release(wallet), WC_SUCCESS);
+        g_server_outputs.clear();
+}
+
+struct pending_request {
+        bstring *terms;
+        wc_server_done_t done;
+        void *token;
+};
+static std::vector<pending_request> g_pending_requests;
+
+TEST(gtest, wc_server_async) {
+        wc_request_id_t id = 0;
+        int done = 0;
+        bstring terms = nullptr;
+
+        /* Without asynchronous callbacks, requests complete immediately. */
+        wc_server_handle_t c = nullptr;
+        ASSERT_EQ(wc_server_connect(&c, &g_server_callbacks, nullptr), WC_SUCCESS);
+        EXPECT_EQ(wc_server_get_terms_async(nullptr, &id, &terms), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_server_get_terms_async(c, nullptr, &terms), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_server_get_terms_async(c, &id, nullptr), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_server_health_check_async(c, &id, nullptr, nullptr, 0), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_server_get_terms_async(c, &id, &terms), WC_SUCCESS);
+        EXPECT_NE(id, 0);
+        EXPECT_EQ(wc_server_poll(c, id, &done), WC_SUCCESS);
+        EXPECT_EQ(done, 1);
+        EXPECT_EQ(wc_server_wait(c, id), WC_SUCCESS);
+        ASSERT_NE(terms, nullptr);
+        EXPECT_EQ(std::string((const char*)terms->data, terms->slen), g_terms_of_service);
+        bdestroy(terms);
+        terms = nullptr;
+        /* Once retired, the id is no longer recognized. */
+        EXPECT_EQ(wc_server_poll(c, id, &done), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_server_wait(c, id), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_server_disconnect(c), WC_SUCCESS);
+
+        /* With asynchronous callbacks, many requests can be in flight at
+         * once and complete in any order, from any thread. */
+        wc_server_callbacks_t cb = g_server_callbacks;
+        cb.get_terms_async = [](wc_conn_handle_t conn, bstring *terms, wc_server_done_t done, void *token) -> wc_error_t {
+                if (g_pending_requests.size() >= 8) {
+                        return WC_ERROR_OUT_OF_MEMORY;
+                }
+                g_pending_requests.push_back({terms, done, token});
+                return WC_SUCCESS;
+        };
+        g_pending_requests.clear();
+        ASSERT_EQ(wc_server_connect(&c, &cb, nullptr), WC_SUCCESS);
+        std::vector<bstring> results(8, nullptr);
+        std::vector<wc_request_id_t> ids(8, 0);
+        for (size_t i = 0; i < ids.size(); ++i) {
+                EXPECT_EQ(wc_server_get_terms_async(c, &ids[i], &results[i]), WC_SUCCESS);
+                for (size_t j = 0; j < i; ++j) {
+                        EXPECT_NE(ids[i], ids[j]);
+                }
+        }
+        /* A request the backend refuses to start is never issued an id. */
+        id = 0;
+        EXPECT_EQ(wc_server_get_terms_async(c, &id, &terms), WC_ERROR_OUT_OF_MEMORY);
+        EXPECT_EQ(id, 0);
+        for (size_t i = 0; i < ids.size(); ++i) {
+                EXPECT_EQ(wc_server_poll(c, ids[i], &done), WC_SUCCESS);
+                EXPECT_EQ(done, 0);
+        }
+        std::thread worker([]() {
+                for (size_t i = g_pending_requests.size(); i-- > 0; ) {
+                        const pending_request &p = g_pending_requests[i];
+                        wc_error_t e = WC_ERROR_UNKNOWN;
+                        if (i % 2 == 0) {
+                                *p.terms = bfromcstr(std::to_string(i).c_str());
+                                e = WC_SUCCESS;
+                        }
+                        p.done(p.token, e);
+                }
+        });
+        for (size_t i = 0; i < ids.size(); ++i) {
+                EXPECT_EQ(wc_server_wait(c, ids[i]), i % 2 == 0 ? WC_SUCCESS : WC_ERROR_UNKNOWN);
+                if (i % 2 == 0) {
+                        ASSERT_NE(results[i], nullptr);
+                        EXPECT_EQ(std::string((const char*)results[i]->data, results[i]->slen), std::to_string(i));
+                        bdestroy(results[i]);
+                } else {
+                        EXPECT_EQ(results[i], nullptr);
+                }
+        }
+        worker.join();
+
+        /* Disconnecting waits for requests still in flight, even if they
+         * were never waited upon. */
+        g_pending_requests.clear();
+        EXPECT_EQ(wc_server_get_terms_async(c, &id, &terms), WC_SUCCESS);
+        std::thread late([]() {
+                std::this_thread::sleep_for(std::chrono::milliseconds(20));
+                g_pending_requests[0].done(g_pending_requests[0].token, WC_ERROR_UNKNOWN);
+        });
+        EXPECT_EQ(wc_server_disconnect(c), WC_SUCCESS);
+        late.join();
+
+        /* A thread already waiting on a request when the disconnect starts
+         * gets its result, and the disconnect waits for it to leave. */
+        g_pending_requests.clear();
+        ASSERT_EQ(wc_server_connect(&c, &cb, nullptr), WC_SUCCESS);
+        EXPECT_EQ(wc_server_get_terms_async(c, &id, &terms), WC_SUCCESS);
+        std::atomic<int> waited{-1};
+        std::atomic<bool> disconnected{false};
+        std::thread waiter([&]() {
+                waited = wc_server_wait(c, id);
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        std::thread closer([&]() {
+                EXPECT_EQ(wc_server_disconnect(c), WC_SUCCESS);
+                disconnected = true;
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        EXPECT_EQ(waited, -1);
+        EXPECT_FALSE(disconnected);
+        g_pending_requests[0].done(g_pending_requests[0].token, WC_ERROR_UNKNOWN);
+        waiter.join();
+        closer.join();
+        EXPECT_EQ(waited, WC_ERROR_UNKNOWN);
+        EXPECT_TRUE(disconnected);
+        g_pending_requests.clear();
+}
+
+static std::mutex g_pool_mutex;
+static size_t g_pool_connects = 0;
+static size_t g_pool_disconnects = 0;
+static size_t g_pool_pings = 0;
+static wc_error_t g_pool_ping_result = WC_SUCCESS;
+static std::set<uintptr_t> g_pool_active;
+static int g_pool_overlap = 0;
+
+TEST(gtest, wc_server_connect_pool) {
+        wc_server_callbacks_t cb = g_server_callbacks;
+        cb.connect = [](wc_server_url_t url) -> wc_conn_handle_t {
+                std::lock_guard<std::mutex> guard(g_pool_mutex);
+                return (wc_conn_handle_t)(uintptr_t)++g_pool_connects;
+        };
+        cb.disconnect = [](wc_conn_handle_t conn) {
+                std::lock_guard<std::mutex> guard(g_pool_mutex);
+                ++g_pool_disconnects;
+        };
+        cb.ping = [](wc_conn_handle_t conn) -> wc_error_t {
+                std::lock_guard<std::mutex> guard(g_pool_mutex);
+                ++g_pool_pings;
+                return g_pool_ping_result;
+        };
+        /* Detects two threads being handed the same connection. */
+        cb.get_terms = [](wc_conn_handle_t conn, bstring *terms) -> wc_error_t {
+                {
+                        std::lock_guard<std::mutex> guard(g_pool_mutex);
+                        if (!g_pool_active.insert((uintptr_t)conn).second) {
+                                ++g_pool_overlap;
+                        }
+                }
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+                {
+                        std::lock_guard<std::mutex> guard(g_pool_mutex);
+                        g_pool_active.erase((uintptr_t)conn);
+                }
+                *terms = bfromcstr("Terms of Service");
+                return WC_SUCCESS;
+        };
+        g_pool_connects = g_pool_disconnects = g_pool_pings = 0;
+        g_pool_ping_result = WC_SUCCESS;
+        g_pool_overlap = 0;
+
+        wc_server_params_t params = {};
+        params.connections = 3;
+        params.ping_interval_ms = 20;
+        wc_server_handle_t c = nullptr;
+        EXPECT_EQ(wc_server_connect_pool(nullptr, &cb, nullptr, &params), WC_ERROR_INVALID_ARGUMENT);
+        ASSERT_EQ(wc_server_connect_pool(&c, &cb, nullptr, &params), WC_SUCCESS);
+        EXPECT_EQ(g_pool_connects, 1);
+
+        /* Connections are opened on demand, up to the pool size. */
+        wc_conn_handle_t conns[3] = {};
+        EXPECT_EQ(wc_server_checkout(c, nullptr), WC_ERROR_INVALID_ARGUMENT);
+        for (auto &conn : conns) {
+                EXPECT_EQ(wc_server_checkout(c, &conn), WC_SUCCESS);
+        }
+        EXPECT_EQ(g_pool_connects, 3);
+        EXPECT_NE(conns[0], conns[1]);
+        EXPECT_NE(conns[1], conns[2]);
+        EXPECT_NE(conns[0], conns[2]);
+        EXPECT_EQ(wc_server_checkin(c, (wc_conn_handle_t)(uintptr_t)99, WC_SUCCESS), WC_ERROR_INVALID_ARGUMENT);
+        for (auto &conn : conns) {
+                EXPECT_EQ(wc_server_checkin(c, conn, WC_SUCCESS), WC_SUCCESS);
+        }
+        EXPECT_EQ(wc_server_checkin(c, conns[0], WC_SUCCESS), WC_ERROR_INVALID_ARGUMENT);
+
+        /* Warm connections are reused, and broken ones reopened. */
+        wc_conn_handle_t conn = nullptr;
+        EXPECT_EQ(wc_server_checkout(c, &conn), WC_SUCCESS);
+        EXPECT_EQ(g_pool_connects, 3);
+        EXPECT_EQ(wc_server_checkin(c, conn, WC_ERROR_NOT_CONNECTED), WC_SUCCESS);
+        for (auto &conn : conns) {
+                EXPECT_EQ(wc_server_checkout(c, &conn), WC_SUCCESS);
+        }
+        EXPECT_EQ(g_pool_connects, 4);
+        EXPECT_EQ(g_pool_disconnects, 1);
+        for (auto &conn : conns) {
+                EXPECT_EQ(wc_server_checkin(c, conn, WC_SUCCESS), WC_SUCCESS);
+        }
+
+        /* Idle connections are probed before reuse. */
+        EXPECT_EQ(g_pool_pings, 0);
+        std::this_thread::sleep_for(std::chrono::milliseconds(40));
+        EXPECT_EQ(wc_server_checkout(c, &conn), WC_SUCCESS);
+        EXPECT_EQ(g_pool_pings, 1);
+        EXPECT_EQ(g_pool_connects, 4);
+        EXPECT_EQ(wc_server_checkin(c, conn, WC_SUCCESS), WC_SUCCESS);
+        g_pool_ping_result = WC_ERROR_NOT_CONNECTED;
+        std::this_thread::sleep_for(std::chrono::milliseconds(40));
+        EXPECT_EQ(wc_server_checkout(c, &conn), WC_SUCCESS);
+        EXPECT_EQ(g_pool_pings, 2);
+        EXPECT_EQ(g_pool_connects, 5);
+        EXPECT_EQ(g_pool_disconnects, 2);
+        EXPECT_EQ(wc_server_checkin(c, conn, WC_SUCCESS), WC_SUCCESS);
+        g_pool_ping_result = WC_SUCCESS;
+
+        /* Concurrent requests share the pool without ever sharing a
+         * connection. */
+        std::vector<std::thread> workers;
+        std::vector<int> failures(8, 0);
+        for (size_t i = 0; i < failures.size(); ++i) {
+                workers.emplace_back([c, &failures, i]() {
+                        for (int j = 0; j < 50; ++j) {
+                                bstring terms = nullptr;
+                                if (wc_server_get_terms(c, &terms) != WC_SUCCESS) {
+                                        ++failures[i];
+                                }
+                                bdestroy(terms);
+                        }
+                });
+        }
+        for (auto &t : workers) {
+                t.join();
+        }
+        for (int f : failures) {
+                EXPECT_EQ(f, 0);
+        }
+        EXPECT_EQ(g_pool_overlap, 0);
+        EXPECT_EQ(g_pool_connects, 5);
+
+        EXPECT_EQ(wc_server_disconnect(c), WC_SUCCESS);
+        EXPECT_EQ(g_pool_disconnects, g_pool_connects);
+}
+
+TEST(gtest, wc_server_disconnect_waiting) {
+        wc_server_callbacks_t cb = g_server_callbacks;
+        wc_server_handle_t c = nullptr;
+        ASSERT_EQ(wc_server_connect(&c, &cb, nullptr), WC_SUCCESS);
+        wc_conn_handle_t conn = nullptr;
+        ASSERT_EQ(wc_server_checkout(c, &conn), WC_SUCCESS);
+
+        /* A checkout blocked on the only connection fails once the server
+         * starts closing, and the disconnect itself waits for the
+         * connection still checked out. */
+        std::atomic<int> blocked_result{-1};
+        std::atomic<bool> disconnected{false};
+        std::thread blocked([&]() {
+                wc_conn_handle_t other = nullptr;
+                blocked_result = wc_server_checkout(c, &other);
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        EXPECT_EQ(blocked_result, -1);
+        std::thread closer([&]() {
+                EXPECT_EQ(wc_server_disconnect(c), WC_SUCCESS);
+                disconnected = true;
+        });
+        blocked.join();
+        EXPECT_EQ(blocked_result, WC_ERROR_NOT_CONNECTED);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        EXPECT_FALSE(disconnected);
+        EXPECT_EQ(wc_server_checkin(c, conn, WC_SUCCESS), WC_SUCCESS);
+        closer.join();
+        EXPECT_TRUE(disconnected);
+}
+
+static size_t g_batch_requests = 0;
+static size_t g_batch_largest = 0;
+
+TEST(gtest, wc_server_health_check_batch) {
+        wc_server_callbacks_t cb = g_server_callbacks;
+        cb.health_check = [](wc_conn_handle_t conn, const struct sha256 *hashes, size_t count, wc_health_t *result) -> wc_error_t {
+                ++g_batch_requests;
+                g_batch_largest = std::max(g_batch_largest, count);
+                for (size_t i = 0; i < count; ++i) {
+                        result[i] = wc_health_t{hashes[i].u8[0] % 2 == 0, 0, hashes[i].u8[0]};
+                }
+                return WC_SUCCESS;
+        };
+        auto run = [](wc_server_handle_t c, size_t nthreads) -> int {
+                std::vector<std::thread> workers;
+                std::vector<int> failures(nthreads, 0);
+                for (size_t i = 0; i < nthreads; ++i) {
+                        workers.emplace_back([c, &failures, i]() {
+                                struct sha256 hashes[2] = {};
+                                wc_health_t result[2] = {};
+                                hashes[0].u8[0] = (unsigned char)(2 * i);
+                                hashes[1].u8[0] = (unsigned char)(2 * i + 1);
+                                if (wc_server_health_check(c, result, hashes, 2) != WC_SUCCESS
+                                 || result[0].known != 1 || result[0].amount != (wc_amount_t)(2 * i)
+                                 || result[1].known != 0 || result[1].amount != (wc_amount_t)(2 * i + 1)) {
+                                        ++failures[i];
+                                }
+                        });
+                }
+                int total = 0;
+                for (size_t i = 0; i < nthreads; ++i) {
+                        workers[i].join();
+                        total += failures[i];
+                }
+                return total;
+        };
+
+        /* Within the window, concurrent checks share one request. */
+        wc_server_params_t params = {};
+        params.batch_window_ms = 200;
+        wc_server_handle_t c = nullptr;
+        ASSERT_EQ(wc_server_connect_pool(&c, &cb, nullptr, &params), WC_SUCCESS);
+        g_batch_requests = g_batch_largest = 0;
+        EXPECT_EQ(run(c, 8), 0);
+        EXPECT_LT(g_batch_requests, 8);
+        EXPECT_EQ(g_batch_largest, 16);
+        EXPECT_EQ(wc_server_disconnect(c), WC_SUCCESS);
+
+        /* A full batch is sent without waiting out the window, and checks
+         * too large for a batch are sent on their own. */
+        params.batch_window_ms = 60000;
+        params.batch_max = 4;
+        ASSERT_EQ(wc_server_connect_pool(&c, &cb, nullptr, &params), WC_SUCCESS);
+        g_batch_requests = g_batch_largest = 0;
+        auto start = std::chrono::steady_clock::now();
+        EXPECT_EQ(run(c, 8), 0);
+        EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(30));
+        EXPECT_EQ(g_batch_requests, 4);
+        EXPECT_EQ(g_batch_largest, 4);
+        struct sha256 hashes[5] = {};
+        wc_health_t result[5];
+        g_batch_requests = 0;
+        EXPECT_EQ(wc_server_health_check(c, result, hashes, 5), WC_SUCCESS);
+        EXPECT_EQ(g_batch_requests, 1);
+
+        /* Disconnecting fails a batch still collecting, and waits for its
+         * callers to leave rather than freeing it from under them. */
+        g_batch_requests = 0;
+        std::vector<std::thread> callers;
+        std::atomic<int> failed{0};
+        for (int i = 0; i < 2; ++i) {
+                callers.emplace_back([c, &failed]() {
+                        struct sha256 hash = {};
+                        wc_health_t health;
+                        if (wc_server_health_check(c, &health, &hash, 1) == WC_ERROR_NOT_CONNECTED) {
+                                ++failed;
+                        }
+                });
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        start = std::chrono::steady_clock::now();
+        EXPECT_EQ(wc_server_disconnect(c), WC_SUCCESS);
+        EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(30));
+        for (auto &t : callers) {
+                t.join();
+        }
+        EXPECT_EQ(failed, 2);
+        EXPECT_EQ(g_batch_requests, 0);
+}
+
+static int g_terms_prompts = 0;
+
+TEST(gtest, wc_wallet_threads) {
+        wc_ui_callbacks_t ui_cb = g_ui_callbacks;
+        ui_cb.show_terms = [](wc_window_handle_t window, int *accepted, bstring terms) -> wc_error_t {
+                ++g_terms_prompts;
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                *accepted = 1;
+                return WC_SUCCESS;
+        };
+        wc_storage_handle_t storage = nullptr;
+        wc_server_handle_t server = nullptr;
+        wc_ui_handle_t ui = nullptr;
+        wc_wallet_handle_t wallet = nullptr;
+        /* The wallet holds no secrets, but must say so to be indexed. */
+        wc_storage_callbacks_t storage_cb = g_storage_callbacks;
+        storage_cb.each_secret = [](wc_db_handle_t db, wc_db_secrets_visitor_t visit, void *arg) -> wc_error_t {
+                return WC_SUCCESS;
+        };
+        ASSERT_EQ(wc_storage_open(&storage, &storage_cb, nullptr, nullptr), WC_SUCCESS);
+        ASSERT_EQ(wc_server_connect(&server, &g_server_callbacks, nullptr), WC_SUCCESS);
+        ASSERT_EQ(wc_ui_startup(&ui, &ui_cb, nullptr), WC_SUCCESS);
+        g_terms.clear();
+        g_terms_prompts = 0;
+        ASSERT_EQ(wc_wallet_configure(&wallet, storage, server, ui), WC_SUCCESS);
+
+        /* Concurrent callers share a single prompt, and see the same
+         * acceptance, while lookups proceed alongside. */
+        std::vector<std::thread> workers;
+        std::vector<int> failures(8, 0);
+        for (size_t i = 0; i < failures.size(); ++i) {
+                workers.emplace_back([wallet, &failures, i]() {
+                        for (int j = 0; j < 100; ++j) {
+                                if (i % 2) {
+                                        struct sha256 hash = {};
+                                        wc_output_info_t info;
+                                        hash.u8[0] = (unsigned char)j;
+                                        if (wc_wallet_lookup_outputs(wallet, &info, &hash, 1) != WC_SUCCESS || info.found) {
+                                                ++failures[i];
+                                        }
+                                        continue;
+                                }
+                                bstring terms = nullptr;
+                                int accepted = 0;
+                                struct tm when;
+                                if (wc_wallet_terms_of_service(wallet, &terms, &accepted, &when) != WC_SUCCESS
+                                 || !accepted || !terms || !biseqcstr(terms, g_terms_of_service.c_str())) {
+                                        ++failures[i];
+                                }
+                                bdestroy(terms);
+                        }
+                });
+        }
+        for (auto &t : workers) {
+                t.join();
+        }
+        for (int f : failures) {
+                EXPECT_EQ(f, 0);
+        }
+        EXPECT_EQ(g_terms_prompts, 1);
+        EXPECT_EQ(g_terms.size(), 1);
+        EXPECT_EQ(wc_wallet_release(wallet), WC_SUCCESS);
+}
+
+static int g_full_fetches = 0;
+static int g_conditional_fetches = 0;
+
+TEST(gtest, wc_wallet_terms_cache) {
+        std::string dbpath = testing::TempDir() + "wc_wallet_terms_cache.db";
+        std::string logpath = testing::TempDir() + "wc_wallet_terms_cache.log";
+        for (const char *suffix : {"", "-wal", "-shm"}) {
+                remove((dbpath + suffix).c_str());
+        }
+        remove(logpath.c_str());
+        const std::string original = g_terms_of_service;
+
+        /* Without the conditional callback, hashes are compared locally. */
+        struct sha256 etag;
+        bstring bstr = bfromcstr(g_terms_of_service.c_str());
+        EXPECT_EQ(wc_terms_hash(nullptr, bstr), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_terms_hash(&etag, bstr), WC_SUCCESS);
+        bdestroy(bstr);
+        wc_server_handle_t c = nullptr;
+        bstring terms = nullptr;
+        int changed = -1;
+        ASSERT_EQ(wc_server_connect(&c, &g_server_callbacks, nullptr), WC_SUCCESS);
+        EXPECT_EQ(wc_server_get_terms_if_changed(c, &terms, &changed, nullptr), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_server_get_terms_if_changed(c, &terms, &changed, &etag), WC_SUCCESS);
+        EXPECT_EQ(changed, 0);
+        EXPECT_EQ(terms, nullptr);
+        struct sha256 other = etag;
+        other.u8[0] ^= 1;
+        EXPECT_EQ(wc_server_get_terms_if_changed(c, &terms, &changed, &other), WC_SUCCESS);
+        EXPECT_EQ(changed, 1);
+        ASSERT_NE(terms, nullptr);
+        EXPECT_EQ(biseqcstr(terms, g_terms_of_service.c_str()), 1);
+        bdestroy(terms);
+        terms = nullptr;
+        EXPECT_EQ(wc_server_disconnect(c), WC_SUCCESS);
+
+        wc_server_callbacks_t server_cb = g_server_callbacks;
+        server_cb.get_terms = [](wc_conn_handle_t conn, bstring *terms) -> wc_error_t {
+                ++g_full_fetches;
+                *terms = bfromcstr(g_terms_of_service.c_str());
+                return WC_SUCCESS;
+        };
+        server_cb.get_terms_if_changed = [](wc_conn_handle_t conn, const struct sha256 *etag, bstring *terms) -> wc_error_t {
+                ++g_conditional_fetches;
+                bstring current = bfromcstr(g_terms_of_service.c_str());
+                struct sha256 hash;
+                wc_terms_hash(&hash, current);
+                if (!memcmp(hash.u8, etag->u8, sizeof(hash.u8))) {
+                        bdestroy(current);
+                        current = nullptr;
+                }
+                *terms = current;
+                return WC_SUCCESS;
+        };
+        wc_ui_callbacks_t ui_cb = g_ui_callbacks;
+        ui_cb.show_terms = [](wc_window_handle_t window, int *accepted, bstring terms) -> wc_error_t {
+                ++g_terms_prompts;
+                *accepted = 1;
+                return WC_SUCCESS;
+        };
+        auto open_and_check = [&](int *accepted, struct tm *when) {
+                wc_storage_handle_t storage = nullptr;
+                wc_server_handle_t server = nullptr;
+                wc_ui_handle_t ui = nullptr;
+                wc_wallet_handle_t wallet = nullptr;
+                ASSERT_EQ(wc_storage_open(&storage, &wc_storage_sqlite_callbacks, (wc_log_url_t)logpath.c_str(), (wc_db_url_t)dbpath.c_str()), WC_SUCCESS);
+                ASSERT_EQ(wc_server_connect(&server, &server_cb, nullptr), WC_SUCCESS);
+                ASSERT_EQ(wc_ui_startup(&ui, &ui_cb, nullptr), WC_SUCCESS);
+                ASSERT_EQ(wc_wallet_configure(&wallet, storage, server, ui), WC_SUCCESS);
+                bstring terms = nullptr;
+                EXPECT_EQ(wc_wallet_terms_of_service(wallet, &terms, accepted, when), WC_SUCCESS);
+                ASSERT_NE(terms, nullptr);
+                EXPECT_EQ(biseqcstr(terms, g_terms_of_service.c_str()), 1);
+                bdestroy(terms);
+                EXPECT_EQ(wc_wallet_release(wallet), WC_SUCCESS);
+        };
+        int accepted = 0;
+        struct tm first, when;
+
+        /* A new wallet fetches the terms in full and prompts the user. */
+        g_full_fetches = g_conditional_fetches = g_terms_prompts = 0;
+        open_and_check(&accepted, &first);
+        EXPECT_EQ(accepted, 1);
+        EXPECT_EQ(g_full_fetches, 1);
+        EXPECT_EQ(g_conditional_fetches, 0);
+        EXPECT_EQ(g_terms_prompts, 1);
+
+        /* Reopening only asks whether the accepted terms are current. */
+        g_full_fetches = g_conditional_fetches = g_terms_prompts = 0;
+        open_and_check(&accepted, &when);
+        EXPECT_EQ(accepted, 1);
+        EXPECT_EQ(g_full_fetches, 0);
+        EXPECT_EQ(g_conditional_fetches, 1);
+        EXPECT_EQ(g_terms_prompts, 0);
+        EXPECT_EQ(mktime(&when), mktime(&first));
+
+        /* New terms are sent in the conditional reply, and shown. */
+        g_terms_of_service = original + " (revised)";
+        g_full_fetches = g_conditional_fetches = g_terms_prompts = 0;
+        open_and_check(&accepted, &when);
+        EXPECT_EQ(accepted, 1);
+        EXPECT_EQ(g_full_fetches, 0);
+        EXPECT_EQ(g_conditional_fetches, 1);
+        EXPECT_EQ(g_terms_prompts, 1);
+        g_terms_of_service = original;
+
+        /* The latest acceptance wins. */
+        wc_storage_handle_t storage = nullptr;
+        ASSERT_EQ(wc_storage_open(&storage, &wc_storage_sqlite_callbacks, (wc_log_url_t)logpath.c_str(), (wc_db_url_t)dbpath.c_str()), WC_SUCCESS);
+        struct sha256 hash;
+        EXPECT_EQ(wc_storage_latest_terms(storage, nullptr, &hash, nullptr), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_storage_latest_terms(storage, &terms, &hash, nullptr), WC_SUCCESS);
+        ASSERT_NE(terms, nullptr);
+        EXPECT_EQ(biseqcstr(terms, (original + " (revised)").c_str()), 1);
+        EXPECT_EQ(wc_terms_hash(&etag, terms), WC_SUCCESS);
+        EXPECT_EQ(memcmp(hash.u8, etag.u8, sizeof(hash.u8)), 0);
+        bdestroy(terms);
+        EXPECT_EQ(wc_storage_close(storage), WC_SUCCESS);
+
+        /* Storage without latest_terms reports none. */
+        ASSERT_EQ(wc_storage_open(&storage, &g_storage_callbacks, nullptr, nullptr), WC_SUCCESS);
+        terms = nullptr;
+        EXPECT_EQ(wc_storage_latest_terms(storage, &terms, &hash, nullptr), WC_SUCCESS);
+        EXPECT_EQ(terms, nullptr);
+        EXPECT_EQ(wc_storage_close(storage), WC_SUCCESS);
+}
+
+TEST(gtest, wc_arena) {
+        wc_arena_handle_t arena = nullptr;
+        EXPECT_EQ(wc_arena_create(nullptr, 0), WC_ERROR_INVALID_ARGUMENT);
+        ASSERT_EQ(wc_arena_create(&arena, 256), WC_SUCCESS);
+        EXPECT_EQ(wc_arena_alloc(nullptr, 1), nullptr);
+
+        /* Allocations are aligned and do not overlap, and spill over into
+         * new chunks, including ones larger than the chunk size. */
+        std::vector<unsigned char*> blocks;
+        for (size_t i = 0; i < 40; ++i) {
+                unsigned char *p = (unsigned char*)wc_arena_alloc(arena, i * 7 % 50 + 1);
+                ASSERT_NE(p, nullptr);
+                EXPECT_EQ((uintptr_t)p % 16, 0);
+                memset(p, (int)i, i * 7 % 50 + 1);
+                blocks.push_back(p);
+        }
+        unsigned char *big = (unsigned char*)wc_arena_alloc(arena, 4096);
+        ASSERT_NE(big, nullptr);
+        memset(big, 0xff, 4096);
+        for (size_t i = 0; i < blocks.size(); ++i) {
+                for (size_t j = 0; j < i * 7 % 50 + 1; ++j) {
+                        ASSERT_EQ(blocks[i][j], (unsigned char)i);
+                }
+        }
+
+        /* Library strings come from the arena while it is in use. */
+        const struct sha256 root = {{
+                0x40, 0x7c, 0x95, 0x0b, 0x3d, 0xe6, 0x00, 0x64,
+                0xd7, 0xff, 0x74, 0x4b, 0x9b, 0x47, 0x43, 0xb8,
+                0xde, 0x58, 0xe9, 0x43, 0xe7, 0xc5, 0x37, 0xdf,
+                0x3d, 0x3a, 0x8a, 0x29, 0xa3, 0x2e, 0x1d, 0x0f
+        }};
+        EXPECT_EQ(wc_arena_reset(arena), WC_SUCCESS);
+        EXPECT_EQ(wc_arena_destroy(arena), WC_SUCCESS);
+        /* One chunk holds everything below, so it is still readable after
+         * being reset. */
+        ASSERT_EQ(wc_arena_create(&arena, 0), WC_SUCCESS);
+        wc_arena_handle_t previous = (wc_arena_handle_t)1;
+        EXPECT_EQ(wc_arena_use(arena, &previous), WC_SUCCESS);
+        EXPECT_EQ(previous, nullptr);
+        bstring amount = wc_to_bstring(150000000);
+        ASSERT_NE(amount, nullptr);
+        EXPECT_EQ(biseqcstr(amount, "1.5"), 1);
+        EXPECT_LE(amount->mlen, 0);
+        EXPECT_NE(bdestroy(amount), BSTR_OK); /* harmless */
+        bstring serial = nullptr;
+        EXPECT_EQ(wc_derive_serial(&serial, &root, 0, 0), WC_SUCCESS);
+        ASSERT_NE(serial, nullptr);
+        EXPECT_EQ(serial->slen, 64);
+        EXPECT_LE(serial->mlen, 0);
+        unsigned char *serial_data = serial->data;
+        std::string expected((const char*)serial->data, 64);
+        wc_secret_t secret;
+        EXPECT_EQ(wc_secret_from_bstring_copy(&secret, 1, serial), WC_SUCCESS);
+        bstring code = nullptr;
+        EXPECT_EQ(wc_secret_to_string(&code, &secret), WC_SUCCESS);
+        ASSERT_NE(code, nullptr);
+        EXPECT_EQ(std::string((const char*)code->data, code->slen), "e0.00000001:secret:" + expected);
+        EXPECT_LE(secret.serial->mlen, 0);
+        EXPECT_EQ(wc_secret_destroy(&secret), WC_SUCCESS);
+        EXPECT_EQ(secret.serial, nullptr);
+        EXPECT_EQ(wc_arena_use(nullptr, &previous), WC_SUCCESS);
+        EXPECT_EQ(previous, arena);
+
+        /* Back on the heap. */
+        bstring heap = wc_to_bstring(1);
+        ASSERT_NE(heap, nullptr);
+        EXPECT_GT(heap->mlen, 0);
+        EXPECT_EQ(bdestroy(heap), BSTR_OK);
+
+        /* Releasing the arena cleanses the secrets it held. */
+        EXPECT_EQ(wc_arena_reset(arena), WC_SUCCESS);
+        EXPECT_EQ(std::string((const char*)serial_data, 64), std::string(64, '\0'));
+        EXPECT_EQ(wc_arena_reset(nullptr), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_arena_destroy(nullptr), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_arena_destroy(arena), WC_SUCCESS);
+}
+
+TEST(gtest, wc_stats) {
+        const struct sha256 root = {{
+                0x40, 0x7c, 0x95, 0x0b, 0x3d, 0xe6, 0x00, 0x64,
+                0xd7, 0xff, 0x74, 0x4b, 0x9b, 0x47, 0x43, 0xb8,
+                0xde, 0x58, 0xe9, 0x43, 0xe7, 0xc5, 0x37, 0xdf,
+                0x3d, 0x3a, 0x8a, 0x29, 0xa3, 0x2e, 0x1d, 0x0f
+        }};
+        struct sha256_ctx ctx = SHA256_INIT;
+        char serials[64 * 10];
+        wc_stats_t stats;
+        EXPECT_EQ(wc_stats_snapshot(nullptr), WC_ERROR_INVALID_ARGUMENT);
+        EXPECT_EQ(wc_stats_reset(), WC_SUCCESS);
+        /* Mining is timed per search, not per batch of hashes. */
+        EXPECT_EQ(wc_backend_cpu_callbacks.mine(nullptr, &ctx, 2, 0, 2, 256, [](void *, const wc_mining_solution_t *) -> int { return 0; }, nullptr), WC_SUCCESS);
+        wc_derive_serials(serials, &root, 0, 0, 10);
+        /* Counters of threads which have exited are retained. */
+        std::thread([&]() {
+                wc_derive_serials(serials, &root, 0, 10, 5);
+        }).join();
+        ASSERT_EQ(wc_stats_snapshot(&stats), WC_SUCCESS);
+        if (!stats.enabled) {
+                for (size_t op = 0; op < WC_STATS_NUM_OPS; ++op) {
+                        EXPECT_EQ(stats.ops[op].calls, 0u);
+                }
+                return;
+        }
+        EXPECT_EQ(stats.ops[WC_STATS_MINING].calls, 1u);
+        EXPECT_EQ(stats.ops[WC_STATS_MINING].items, 2000u);
+        EXPECT_EQ(stats.ops[WC_STATS_DERIVE].calls, 2u);
+        EXPECT_EQ(stats.ops[WC_STATS_DERIVE].items, 15u);
+        for (size_t op = 0; op < WC_STATS_NUM_OPS; ++op) {
+                uint64_t n = 0;
+                for (size_t b = 0; b < WC_STATS_BUCKETS; ++b) {
+                        n += stats.ops[op].buckets[b];
+                }
+                EXPECT_EQ(n, stats.ops[op].calls);
+                EXPECT_LE(stats.ops[op].max_ns, stats.ops[op].total_ns);
+        }
+        EXPECT_EQ(wc_stats_reset(), WC_SUCCESS);
+        ASSERT_EQ(wc_stats_snapshot(&stats), WC_SUCCESS);
+        EXPECT_EQ(stats.ops[WC_STATS_MINING].calls, 0u);
+        EXPECT_EQ(stats.ops[WC_STATS_DERIVE].calls, 0u);
+        /* Counters left from before a reset are discarded on next use. */
+        wc_derive_serials(serials, &root, 0, 0, 3);
+        ASSERT_EQ(wc_stats_snapshot(&stats), WC_SUCCESS);
+        EXPECT_EQ(stats.ops[WC_STATS_DERIVE].calls, 1u);
+        EXPECT_EQ(stats.ops[WC_STATS_DERIVE].items, 3u);
+}
+
+static std::atomic<size_t> g_backend_mines{0};
+static std::atomic<size_t> g_backend_derives{0};
+
+TEST(gtest, wc_backend) {
+        /* A backend which counts its calls, and delegates to the CPU. */
+        static const wc_backend_callbacks_t counting = {
+                [](wc_device_handle_t dev, const struct sha256_ctx *ctx, unsigned ngroups, uint64_t first, uint64_t count, unsigned difficulty, wc_mining_callback_t found, void *arg) -> wc_error_t {
+                        ++g_backend_mines;
+                        EXPECT_LE(count, 3u);
+                        return wc_backend_cpu_callbacks.mine(dev, ctx, ngroups, first, count, difficulty, found, arg);
+                },
+                [](wc_device_handle_t dev, struct sha256 *out, const struct sha256 *root, uint64_t chaincode, uint64_t start, size_t count) -> wc_error_t {
+                        ++g_backend_derives;
+                        return wc_backend_cpu_callbacks.derive_serials(dev, out, root, chaincode, start, count);
+                },
+                [](wc_device_handle_t dev, struct sha256 *out, const struct sha256 *root, uint64_t chaincode, uint64_t start, size_t count) -> wc_error_t {
+                        ++g_backend_derives;
+                        return wc_backend_cpu_callbacks.derive_publics(dev, out, root, chaincode, start, count);
+                },
+        };
+        /* A device which always fails, leaving everything to the CPU. */
+        static const wc_backend_callbacks_t failing = {
+                [](wc_device_handle_t, const struct sha256_ctx *, unsigned, uint64_t, uint64_t, unsigned, wc_mining_callback_t, void *) -> wc_error_t {
+                        return WC_ERROR_OUT_OF_MEMORY;
+                },
+                nullptr,
+                [](wc_device_handle_t, struct sha256 *, const struct sha256 *, uint64_t, uint64_t, size_t) -> wc_error_t {
+                        return WC_ERROR_OUT_OF_MEMORY;
+                },
+        };
+        /* A device which fails after reporting what it found. */
+        static const wc_backend_callbacks_t flaky = {
+                [](wc_device_handle_t dev, const struct sha256_ctx *ctx, unsigned ngroups, uint64_t first, uint64_t count, unsigned difficulty, wc_mining_callback_t found, void *arg) -> wc_error_t {
+                        wc_backend_cpu_callbacks.mine(dev, ctx, ngroups, first, count, difficulty, found, arg);
+                        return WC_ERROR_UNKNOWN;
+                },
+                nullptr,
+                nullptr,
+        };
+        const struct sha256 root = {{
+                0x40, 0x7c, 0x95, 0x0b, 0x3d, 0xe6, 0x00, 0x64,
+                0xd7, 0xff, 0x74, 0x4b, 0x9b, 0x47, 0x43, 0xb8,
+                0xde, 0x58, 0xe9, 0x43, 0xe7, 0xc5, 0x37, 0xdf,
+                0x3d, 0x3a, 0x8a, 0x29, 0xa3, 0x2e, 0x1d, 0x0f
+        }};
+        struct sha256_ctx ctx = mining_midstate();
+        auto collect = [](void *arg, const wc_mining_solution_t *sol) -> int {
+                ((std::vector<std::string>*)arg)->push_back(std::string((const char*)sol->nonces, 4*sol->ngroups));
+                return 0;
+        };
+        auto mine = [&]() {
+                std::vector<std::string> sols;
+                wc_miner_handle_t miner = nullptr;
+                EXPECT_EQ(wc_mine_start(&miner, &ctx, 8, 3, collect, &sols), WC_SUCCESS);
+                EXPECT_EQ(wc_mine_wait(miner), WC_SUCCESS);
+                std::sort(sols.begin(), sols.end());
+                return sols;
+        };
+        auto derive = [&]() {
+                std::vector<char> serials(64 * 100);
+                std::vector<struct sha256> publics(100);
+                wc_derive_serials(serials.data(), &root, 1, 5, 100);
+                EXPECT_EQ(wc_derive_serials_mt(serials.data() + 64 * 50, &root, 1, 55, 50, 4), WC_SUCCESS);
+                wc_derive_publics(publics.data(), &root, 1, 5, 100);
+                return std::make_pair(std::string(serials.begin(), serials.end()),
+                                      std::string((const char*)publics[0].u8, 32 * publics.size()));
+        };
+        const auto cpu_sols = mine();
+        const auto cpu_derived = derive();
+        ASSERT_FALSE(cpu_sols.empty());
+
+        /* Offloading gives identical results, in ranges of mining_rows. */
+        wc_backend_params_t params = {};
+        params.mining_rows = 3;
+        params.min_derive = 50;
+        EXPECT_EQ(wc_backend_use(&counting, nullptr, &params), WC_SUCCESS);
+        EXPECT_EQ(mine(), cpu_sols);
+        EXPECT_EQ(g_backend_mines, (1000u + 2) / 3);
+        EXPECT_EQ(derive(), cpu_derived);
+        EXPECT_EQ(g_backend_derives, 3u);
+        /* Small derivations stay on the CPU. */
+        std::vector<char> one(64);
+        wc_derive_serials(one.data(), &root, 1, 5, 1);
+        EXPECT_EQ(std::string(one.begin(), one.end()), cpu_derived.first.substr(0, 64));
+        EXPECT_EQ(g_backend_derives, 3u);
+        /* Hex buffers need no particular alignment. */
+        std::vector<char> odd(1 + 64 * 100);
+        wc_derive_serials(odd.data() + 1, &root, 1, 5, 100);
+        EXPECT_EQ(std::string(odd.begin() + 1, odd.end()), cpu_derived.first);
+        EXPECT_EQ(g_backend_derives, 4u);
+
+        /* A failing device falls back to the CPU. */
+        EXPECT_EQ(wc_backend_use(&failing, nullptr, &params), WC_SUCCESS);
+        EXPECT_EQ(mine(), cpu_sols);
+        EXPECT_EQ(derive(), cpu_derived);
+        /* What a failed call reported is not passed on twice. */
+        EXPECT_EQ(wc_backend_use(&flaky, nullptr, &params), WC_SUCCESS);
+        EXPECT_EQ(mine(), cpu_sols);
+
+        EXPECT_EQ(wc_backend_use(nullptr, nullptr, nullptr), WC_SUCCESS);
+        EXPECT_EQ(mine(), cpu_sols);
+}
+
 int main(int argc, char **argv) {
         ::testing::InitGoogleTest(&argc, argv);
         assert(wc_init() == WC_SUCCESS);